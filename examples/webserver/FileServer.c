@@ -46,10 +46,12 @@ struct FileInfo
 {
     const char *Filename;   // With Path
     bool Dynamic;
+    bool Offload;           // CPU heavy, run it on a worker thread
     const char **Cookies;
     const char **Gets;
     const char **Posts;
     void (*WriteFile)(struct WebServer *Web);
+    const char *Upstream;   // Pass requests for this path (and everything under it) on to this server (NULL=use 'WriteFile')
 };
 
 /*** FUNCTION PROTOTYPES      ***/
@@ -58,8 +60,10 @@ void File_Root(struct WebServer *Web);
 /*** VARIABLE DEFINITIONS     ***/
 struct FileInfo m_Files[]=
 {
-    /* Filename, Dynamic, Cookies, Gets, Posts, Callback */
-    {"/",false,NULL,NULL,NULL,File_Root},
+    /* Filename, Dynamic, Offload, Cookies, Gets, Posts, Callback, Upstream */
+    {"/",false,false,NULL,NULL,NULL,File_Root,NULL},
+//    {"/api/",true,false,NULL,NULL,NULL,NULL,"unix:/run/helper.sock"},
+//    {"/status/",true,false,NULL,NULL,NULL,NULL,"127.0.0.1:8081"},
 };
 
 /*******************************************************************************
@@ -81,12 +85,29 @@ struct FileInfo m_Files[]=
  *                                     ETAG to 'DOCVER' where it will not
  *                                     resent to the browser until 'DOCVER'
  *                                     changes.
+ *                      Offload -- If this is true FS_SendFile() will be
+ *                                 called from a worker thread so it doesn't
+ *                                 hold up the other connections.  Use this
+ *                                 for pages that take a lot of CPU to make.
+ *                                 The page must send its whole reply (no
+ *                                 generators, deferred replies, WebSockets
+ *                                 or events) and it is limited to
+ *                                 WS_OPT_OFFLOAD_OUTPUT_MAX bytes.
+ *                      Route -- The name this page is counted under in the
+ *                               metrics page.  This must stay around (it
+ *                               can't point into 'Filename').  NULL counts
+ *                               it as "other".
  *                      Cookies -- A pointer to the list of cookies that this
  *                                 page accepts.
  *                      Gets -- A pointer to the list of GET vars that this
  *                              page accepts.
  *                      Posts -- A pointer to the list of POST vars that this
  *                               page accepts.
+ *                      Upstream -- If this isn't NULL the request is passed
+ *                                  on to this server instead of calling
+ *                                  FS_SendFile().  "host:port" or
+ *                                  "unix:/path/to/socket".  This must stay
+ *                                  around.
  *
  * FUNCTION:
  *    This function is called when a new request comes in for a file.  This
@@ -109,13 +130,20 @@ bool FS_GetFileProperties(const char *Filename,struct WSPageProp *PageProp)
 
     for(r=0;r<sizeof(m_Files)/sizeof(struct FileInfo);r++)
     {
-        if(strcmp(Filename,m_Files[r].Filename)==0)
+        /* Pages passed on to an upstream server cover everything under
+           their path */
+        if(strcmp(Filename,m_Files[r].Filename)==0 ||
+                (m_Files[r].Upstream!=NULL && strncmp(Filename,
+                m_Files[r].Filename,strlen(m_Files[r].Filename))==0))
         {
             PageProp->FileID=(uintptr_t)&m_Files[r];
             PageProp->DynamicFile=m_Files[r].Dynamic;
+            PageProp->Offload=m_Files[r].Offload;
+            PageProp->Route=m_Files[r].Filename;
             PageProp->Cookies=m_Files[r].Cookies;
             PageProp->Gets=m_Files[r].Gets;
             PageProp->Posts=m_Files[r].Posts;
+            PageProp->Upstream=m_Files[r].Upstream;
             return true;
         }
     }
@@ -187,11 +215,11 @@ char* load_file(char const* path)
       buffer = (char*)malloc ((length+1)*sizeof(char));
       if (buffer)
       {
-        fread (buffer, sizeof(char), length, f);
+        length = fread (buffer, sizeof(char), length, f);
+        buffer[length] = '\0';
       }
       fclose (f);
     }
-    buffer[length] = '\0';
     // for (int i = 0; i < length; i++) {
     //     printf("buffer[%d] == %c\n", i, buffer[i]);
     // }
@@ -203,5 +231,11 @@ char* load_file(char const* path)
 void File_Root(struct WebServer *Web)
 {
     char* index = load_file("index.html");
+    if (index == NULL)
+    {
+        WS_WriteWholeStr(Web,HelloWorldHTML);
+        return;
+    }
     WS_WriteWhole(Web,index,strlen(index)-1);
+    free(index);
 }
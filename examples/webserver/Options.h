@@ -40,7 +40,64 @@
 
 #define WS_OPT_MAX_CONNECTIONS              16      // The max number of connections we can handle at the same time (this will include buffers needed for each connection)
 #define WS_OPT_ARG_MEMORY_SIZE              100     // The memory block to use to store the cookies, get args, and post args
+#define WS_OPT_MAX_ARGS                     16      // The size of the arg index table.  A page can list more GET + COOKIE + POST args than this but they are then looked up with a linear search and a request can only send this many of them (more sends a 507)
+#define WS_OPT_LAZY_ARGS                    1       // Keep the raw query string and cookies and only parse them when the page asks for an arg (0=parse as they come in)
+#define WS_OPT_LAZY_ARGS_SIZE               256     // The memory block the raw query string and cookies are kept in until they are parsed (this is allocated for every connection, args that don't fit are parsed as they come in)
+#define WS_OPT_GET_PLUS_IS_SPACE            0       // Decode a '+' in GET args as a space (form data sent with method="get")
+#define WS_OPT_POST_PLUS_IS_SPACE           1       // Decode a '+' in POST args as a space (form data)
+#define WS_OPT_CHUNK_BUFFER_SIZE            1024    // WS_WriteChunk() data is collected into chunks of up to this size before being sent (this is allocated for every connection)
+#define WS_OPT_GENERATOR_BUDGET             4096    // The number of bytes a generator (WS_StartGenerator()) is asked for each time the connection can take more
+#define WS_OPT_GENERATOR_CALLS              8       // The max number of times a connection's generator is called in one WS_Tick() (while the connection can take more)
+#define WS_OPT_DEFERRED_QUEUE_SIZE          16      // The max number of WS_CompleteDeferred() calls that can be waiting for WS_Tick() to run them (must be a power of 2)
+#define WS_OPT_DEFERRED_TIMEOUT             30      // How many seconds a deferred reply (WS_DeferReply()) can wait to be completed before we send a 504
+#define WS_OPT_OFFLOAD_THREADS              2       // The number of worker threads that run pages marked Offload (0=run them on the web server thread)
+#define WS_OPT_OFFLOAD_QUEUE_SIZE           16      // The max number of offloaded pages waiting for a worker thread (must be a power of 2)
+#define WS_OPT_OFFLOAD_OUTPUT_MAX           262144  // The max number of bytes an offloaded page can send (it's held in memory until the page is done, more than this sends a 500)
+#define WS_OPT_METRICS                      1       // Keep counters and latency histograms and serve them in the Prometheus text format (0=compile them out)
+#define WS_OPT_METRICS_PATH                 "/metrics" // The page the metrics are served on (checked before the FileServer.c pages)
+#define WS_OPT_METRICS_MAX_ROUTES           16      // The max number of different pages counted by name in the metrics (the rest are counted as "other")
+#define WS_OPT_TRACE                        1       // Record timestamped events (accept, first byte, handler, writes, close) in per thread ring buffers (0=compile them out)
+#define WS_OPT_TRACE_EVENTS                 1024    // The number of events kept for each thread (must be a power of 2)
+#define WS_OPT_TRACE_PATH                   "/trace" // The page the trace is served on as a Chrome trace (checked before the FileServer.c pages)
+#define WS_OPT_TRACE_FILE                   "/tmp/bittyhttp-trace.json" // Where WSTrace_RequestDump() writes the trace
+#define WS_OPT_SHED_LOAD                    1       // Accept connections we don't have room for and send them a 503 instead of leaving them in the listen backlog (0=leave them waiting)
+#define WS_OPT_ADMIT_LIMIT                  WS_OPT_MAX_CONNECTIONS // The number of connections in use before new ones are turned away (can't be more than WS_OPT_MAX_CONNECTIONS)
+#define WS_OPT_RETRY_AFTER                  1       // The seconds we tell turned away clients to wait before trying again (Retry-After: header of the 503)
+#define WS_OPT_HANDOFF_PATH                 "/tmp/bittyhttp-handoff.sock" // The unix socket a new copy of the server connects to to take over the listening socket (see main.c)
+#define WS_OPT_HANDOFF_IDLE                 1       // Hand idle keep-alive connections to the new copy of the server too (0=keep them until they time out)
+#define WS_OPT_DRAIN_TIMEOUT                10      // How many seconds we keep running the requests we have after handing off to a new copy of the server
+#define WS_OPT_LISTEN_BACKLOG               WS_OPT_MAX_CONNECTIONS // How many connections the kernel queues up for us to accept (WS_Start())
+#define WS_OPT_LISTEN_NODELAY               1       // Send replies right away instead of holding small writes for the client's ACK (TCP_NODELAY, 0=leave Nagle on)
+#define WS_OPT_LISTEN_DEFER_ACCEPT          0       // Only accept a connection once the request has arrived, waiting up to this many seconds (TCP_DEFER_ACCEPT, 0=off)
+#define WS_OPT_LISTEN_FASTOPEN              0       // The max number of TCP fast open connections waiting for the handshake (TCP_FASTOPEN, 0=off, the kernel needs net.ipv4.tcp_fastopen=3)
+#define WS_OPT_LISTEN_BUSY_POLL             0       // How many microseconds to busy poll the network device for reads (SO_BUSY_POLL, 0=off)
+#define WS_OPT_LISTEN_RCVBUF                0       // The socket receive buffer size (SO_RCVBUF, 0=system default)
+#define WS_OPT_LISTEN_SNDBUF                0       // The socket send buffer size (SO_SNDBUF, 0=system default)
+#define WS_OPT_CLIENT_CONNECTIONS           4       // The max number of outbound connections WSClient.c keeps open (to all servers)
+#define WS_OPT_CLIENT_PER_HOST              2       // The max number of outbound connections to one server (host + port)
+#define WS_OPT_CLIENT_PIPELINE              4       // The max number of requests sent on a connection before the first is answered (1=no pipelining)
+#define WS_OPT_CLIENT_REQUESTS              16      // The max number of outbound requests waiting or in flight
+#define WS_OPT_CLIENT_REQUEST_SIZE          512     // The biggest outbound request (headers + body) WSClient_Request() can take (this is allocated for every request)
+#define WS_OPT_CLIENT_TIMEOUT               30      // How many seconds to wait for a connection or a response before failing an outbound request
+#define WS_OPT_CLIENT_IDLE_TIMEOUT          5       // How many seconds to keep an unused outbound connection open (keep this under the server's keep-alive timeout)
+#define WS_OPT_PROXY_CONNECTIONS            WS_OPT_MAX_CONNECTIONS // The max number of connections to the upstream servers FileServer.c routes pass requests on to (in use + kept open for reuse)
+#define WS_OPT_PROXY_HEAD_SIZE              1024    // The biggest request or response head (request/status line + headers) we can pass on (this is allocated for every upstream connection)
+#define WS_OPT_PROXY_TIMEOUT                30      // How many seconds an upstream server can go without taking or sending anything before we give up on it (504)
+#define WS_OPT_PROXY_IDLE_TIMEOUT           5       // How many seconds to keep an unused upstream connection open (keep this under the upstream's keep-alive timeout)
+#define WS_OPT_WEBSOCKET_CONNECTIONS        WS_OPT_MAX_CONNECTIONS // The max number of connections that can be WebSockets at the same time
+#define WS_OPT_WEBSOCKET_MESSAGE_SIZE       512     // The biggest message we take from a WebSocket client (this is allocated for every WebSocket)
+#define WS_OPT_WEBSOCKET_QUEUE              16      // The max number of frames waiting to go out on a WebSocket before we hang up on it (a client that can't keep up)
+#define WS_OPT_WEBSOCKET_PING               30      // How many seconds a WebSocket can be quiet before we ping it (it's hung up on if it stays quiet for twice this)
+#define WS_OPT_EVENTS_SUBSCRIBERS           WS_OPT_MAX_CONNECTIONS // The max number of connections that can be subscribed to server-sent event channels at the same time
+#define WS_OPT_EVENTS_CHANNELS              4       // The max number of server-sent event channels (they are made the first time they are used)
+#define WS_OPT_EVENTS_NAME_SIZE             32      // The longest channel name (including the \0)
+#define WS_OPT_EVENTS_RING_SIZE             8192    // The bytes of recent events each channel keeps for subscribers that are behind or resuming (must be a power of 2)
+#define WS_OPT_EVENTS_RING_EVENTS           64      // The max number of recent events each channel keeps (for Last-Event-ID)
+#define WS_OPT_EVENTS_KEEPALIVE             15      // How many seconds an event stream can go without sending before we send a comment (so proxies don't hang up on it)
 #define WS_SECONDS_UNTIL_CONNECTION_RELEASE 10      // How many seconds to wait after a connection stops sending to us before we hang up
+#define WS_OPT_HEADER_TIMEOUT               10      // How many seconds a client has to send the request line + headers once it starts sending them
+#define WS_OPT_BODY_TIMEOUT                 30      // How many seconds a client has to send the body once the headers are in
+#define WS_OPT_MIN_BYTES_PER_SEC            50      // The slowest (after the first second) the headers and body can come in before we hang up (0=no min)
 #define WS_LINE_BUFFER_SIZE                 256     // The max number of bytes we can handle a single header line can be (including the GET line).  This is normally in the order of 16K - 128K (we default to a lot less)
 
 /***  MACROS                           ***/
@@ -7,6 +7,7 @@
  * FILE DESCRIPTION:
  *    This version is a basic version of the sockets connection system.  It
  *    takes out all of the SSL stuff so we don't have to link in a much stuff.
+ *    TLS (with OpenSSL) can be built back in with SOCKETSCON_TLS.
  *
  * COPYRIGHT:
  *    Copyright (c) 2019 Paul Hutchinson
@@ -32,6 +33,9 @@
  ******************************************************************************/
 
 /*** HEADER FILES TO INCLUDE  ***/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // splice() and pipe2()
+#endif
 #include "SocketsCon.h"
 #include <unistd.h>
 #include <stdlib.h>
@@ -40,6 +44,7 @@
 #include <sys/types.h> 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <errno.h>
 #include <stdbool.h>
@@ -49,20 +54,41 @@
 #include <sys/sysinfo.h>
 #include <sys/time.h>
 #include <signal.h>
+#include <sys/un.h>
+#if SOCKETSCON_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
 
 /*** DEFINES                  ***/
 #define CONNECT_TIMEOUT 10000   // How long do we wait before giving up on a connect() (ms)
+#define RELAY_COPY_SIZE 4096    // The buffer SocketsCon_Relay() uses when the data has to pass through us
 
 /*** MACROS                   ***/
 
 /*** TYPE DEFINITIONS         ***/
 
 /*** FUNCTION PROTOTYPES      ***/
+static void PRIV_SocketsCon_FreeTLS(struct SocketCon *Con);
+#if SOCKETSCON_TLS
+static int PRIV_SocketsCon_ReadTLS(struct SocketCon *Con,void *buf,int num);
+static bool PRIV_SocketsCon_WriteTLS(struct SocketCon *Con,const void *buf,
+        int num);
+static int PRIV_SocketsCon_WriteSomeTLS(struct SocketCon *Con,
+        const void *buf,int num);
+#endif
 static void PRIV_SocketsCon_Error(struct SocketCon *Con,
         e_ConnectErrorType ErrorCode);
+static bool PRIV_SocketsCon_Resolve(struct SocketCon *Con);
+static int PRIV_SocketsCon_RelayCopy(struct SocketCon *From,
+        struct SocketCon *To,int MaxLen);
 static uint32_t SocketsCon_Get1mSecCounter(void);
 
 /*** VARIABLE DEFINITIONS     ***/
+#if SOCKETSCON_TLS
+/* Shared by all the TLS connections (the cert, key, and session cache) */
+static SSL_CTX *m_TLSContext;
+#endif
 
 /*******************************************************************************
  * NAME:
@@ -103,7 +129,8 @@ static uint32_t SocketsCon_Get1mSecCounter(void)
  *    NONE
  *
  * FUNCTION:
- *    This function init's my socket connection wrapper system.
+ *    This function init's my socket connection wrapper system.  This also
+ *    starts the name lookup system (SocketsDNS_Init()).
  *
  * RETURNS:
  *    true -- Things worked out
@@ -118,6 +145,9 @@ bool SocketsCon_InitSocketConSystem(void)
        error code instead) */
     signal(SIGPIPE, SIG_IGN);
 
+    /* If this fails names can't be looked up but numbers still work */
+    SocketsDNS_Init();
+
     return true;
 }
 
@@ -142,6 +172,13 @@ bool SocketsCon_InitSocketConSystem(void)
  ******************************************************************************/
 void SocketsCon_ShutdownSocketConSystem(void)
 {
+    SocketsDNS_Shutdown();
+
+#if SOCKETSCON_TLS
+    if(m_TLSContext!=NULL)
+        SSL_CTX_free(m_TLSContext);
+    m_TLSContext=NULL;
+#endif
 }
 
 /*******************************************************************************
@@ -171,6 +208,8 @@ bool SocketsCon_InitSockCon(struct SocketCon *Con)
     Con->State=e_ConnectState_Idle;
     Con->SocketFD=-1;
     Con->ReadInProgress=false;
+    Con->TLS=NULL;
+    Con->UseTLS=false;
 
     return true;
 }
@@ -191,9 +230,16 @@ bool SocketsCon_InitSockCon(struct SocketCon *Con)
  * FUNCTION:
  *    This function starts a nonblocking connection to a server.
  *
+ *    The server name is looked up with SocketsDNS_Lookup() so this doesn't
+ *    wait on a nameserver.  Addresses and names already in the cache start
+ *    connecting right away, otherwise the connection waits in
+ *    e_ConnectState_Resolving and SocketsCon_Tick() carries on once the
+ *    answer comes in.  IPv6 addresses work too.
+ *
  * RETURNS:
  *    true -- Things have been started
- *    false -- There was an error
+ *    false -- There was an error (the name is known not to exist or the
+ *             connect() failed)
  *
  * SEE ALSO:
  *    SocketsCon_InitSockCon(), SocketsCon_Write(), SocketsCon_Read(),
@@ -202,21 +248,70 @@ bool SocketsCon_InitSockCon(struct SocketCon *Con)
 bool SocketsCon_Connect(struct SocketCon *Con,const char *ServerName,
         int portNo)
 {
-    struct hostent *host;
-    struct sockaddr_in serv_addr;
-    int flags;
-    int ConnectRet;
-
-    Con->SocketFD=0;
+    Con->SocketFD=-1;
 
-    host=gethostbyname(ServerName);
-    if(host==NULL)
+    if(strlen(ServerName)>=sizeof(Con->ServerName))
     {
         PRIV_SocketsCon_Error(Con,e_ConnectError_gethostbynameFailed);
         return false;
     }
+    strcpy(Con->ServerName,ServerName);
+    Con->ServerPort=portNo;
+
+    Con->State=e_ConnectState_Resolving;
+    Con->TimeoutTS=SocketsCon_Get1mSecCounter();
+
+    return PRIV_SocketsCon_Resolve(Con);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsCon_Resolve
+ *
+ * SYNOPSIS:
+ *    static bool PRIV_SocketsCon_Resolve(struct SocketCon *Con);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection to work on (in e_ConnectState_Resolving)
+ *
+ * FUNCTION:
+ *    This function checks if the server's name has been looked up yet, and
+ *    if it has starts the connect().
+ *
+ * RETURNS:
+ *    true -- Still looking it up, or the connect() was started
+ *    false -- There was an error (the connection is in the error state)
+ *
+ * SEE ALSO:
+ *    SocketsCon_Connect(), SocketsCon_Tick()
+ ******************************************************************************/
+static bool PRIV_SocketsCon_Resolve(struct SocketCon *Con)
+{
+    struct sockaddr_storage serv_addr;
+    socklen_t AddrLen;
+    int flags;
+    int ConnectRet;
+
+    switch(SocketsDNS_Lookup(Con->ServerName,&serv_addr,&AddrLen))
+    {
+        case e_SocketsDNS_Found:
+        break;
+        case e_SocketsDNS_Pending:
+            return true;
+        case e_SocketsDNS_NotFound:
+        case e_SocketsDNS_Failed:
+        case e_SocketsDNSMAX:
+        default:
+            PRIV_SocketsCon_Error(Con,e_ConnectError_gethostbynameFailed);
+            return false;
+    }
 
-    if((Con->SocketFD=socket(AF_INET,SOCK_STREAM,0))<0)
+    if(serv_addr.ss_family==AF_INET6)
+        ((struct sockaddr_in6 *)&serv_addr)->sin6_port=htons(Con->ServerPort);
+    else
+        ((struct sockaddr_in *)&serv_addr)->sin_port=htons(Con->ServerPort);
+
+    if((Con->SocketFD=socket(serv_addr.ss_family,SOCK_STREAM,0))<0)
     {
         PRIV_SocketsCon_Error(Con,e_ConnectError_Failed2GetSocket);
         return false;
@@ -229,14 +324,7 @@ bool SocketsCon_Connect(struct SocketCon *Con,const char *ServerName,
     flags|=O_NONBLOCK;
     fcntl(Con->SocketFD, F_SETFL, flags);
 
-    memset(&serv_addr,'0',sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(portNo); 
-    serv_addr.sin_addr.s_addr = *(long*)(host->h_addr);
-    memset(&(serv_addr.sin_zero), 0, 8);
-
-    ConnectRet=connect(Con->SocketFD,(struct sockaddr *)&serv_addr,
-            sizeof(serv_addr));
+    ConnectRet=connect(Con->SocketFD,(struct sockaddr *)&serv_addr,AddrLen);
     Con->Last_errno=errno;
     if(ConnectRet<0 && errno!=EINPROGRESS)
     {
@@ -327,6 +415,9 @@ void SocketsCon_Tick(struct SocketCon *Con)
     {
         case e_ConnectState_Idle:
         break;
+        case e_ConnectState_Resolving:
+            PRIV_SocketsCon_Resolve(Con);
+        break;
         case e_ConnectState_Connecting:
             FD_ZERO(&rset);
             FD_SET(Con->SocketFD, &rset);
@@ -355,6 +446,7 @@ void SocketsCon_Tick(struct SocketCon *Con)
                 }
                 if(error)
                 {
+                    Con->Last_errno=error;
                     PRIV_SocketsCon_Error(Con,e_ConnectError_Failed2Getsockopt);
                     return;
                 }
@@ -421,6 +513,8 @@ static void PRIV_SocketsCon_Error(struct SocketCon *Con,
 {
     Con->State=e_ConnectState_Error;
 
+    PRIV_SocketsCon_FreeTLS(Con);
+
     if(Con->SocketFD>=0)
         close(Con->SocketFD);
 
@@ -444,6 +538,9 @@ static void PRIV_SocketsCon_Error(struct SocketCon *Con,
  * FUNCTION:
  *    This function sends data out a socket.
  *
+ *    On a TLS connection the data is encrypted first.  Nothing can be sent
+ *    until the client has finished the TLS handshake (this returns false).
+ *
  * RETURNS:
  *    true -- Things worked out
  *    false -- There was an error
@@ -460,6 +557,11 @@ bool SocketsCon_Write(struct SocketCon *Con,const void *buf,int num)
     if(Con->State!=e_ConnectState_Connected)
         return false;
 
+#if SOCKETSCON_TLS
+    if(Con->TLS!=NULL)
+        return PRIV_SocketsCon_WriteTLS(Con,buf,num);
+#endif
+
     BytesSent=0;
     OutputPos=buf;
     while(BytesSent<num)
@@ -482,6 +584,59 @@ bool SocketsCon_Write(struct SocketCon *Con,const void *buf,int num)
     return true;
 }
 
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_WriteSome
+ *
+ * SYNOPSIS:
+ *    int SocketsCon_WriteSome(struct SocketCon *Con,const void *buf,int num);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection to work on
+ *    buf [I] -- The data to send
+ *    num [I] -- The number of bytes in 'buf'
+ *
+ * FUNCTION:
+ *    This function sends as much of 'buf' as the connection will take
+ *    right now.  Unlike SocketsCon_Write() it doesn't wait for the rest,
+ *    call it again later with what is left.
+ *
+ *    For TLS connections this is one SSL_write().  If it comes back with
+ *    0 the next call must start with the same bytes (OpenSSL is part way
+ *    through a record), it can have more after them.
+ *
+ * RETURNS:
+ *    The number of bytes sent (0 if the connection can't take any right
+ *    now) or <0 if there was an error.
+ *
+ * SEE ALSO:
+ *    SocketsCon_Write(), SocketsCon_CanWrite()
+ ******************************************************************************/
+int SocketsCon_WriteSome(struct SocketCon *Con,const void *buf,int num)
+{
+    int retVal;
+
+    if(Con->State!=e_ConnectState_Connected)
+        return -1;
+
+#if SOCKETSCON_TLS
+    if(Con->TLS!=NULL)
+        return PRIV_SocketsCon_WriteSomeTLS(Con,buf,num);
+#endif
+
+    retVal=send(Con->SocketFD,buf,num,MSG_DONTWAIT);
+    Con->Last_errno=errno;
+    if(retVal<0)
+    {
+        if(Con->Last_errno==EAGAIN || Con->Last_errno==EWOULDBLOCK)
+            return 0;
+
+        PRIV_SocketsCon_Error(Con,e_ConnectError_WriteTX_SOCKET_ERROR);
+        return -1;
+    }
+    return retVal;
+}
+
 /*******************************************************************************
  * NAME:
  *    SocketsCon_Read
@@ -516,6 +671,11 @@ int SocketsCon_Read(struct SocketCon *Con,void *buf,int num)
     if(Con->State!=e_ConnectState_Connected)
         return 0;
 
+#if SOCKETSCON_TLS
+    if(Con->TLS!=NULL)
+        return PRIV_SocketsCon_ReadTLS(Con,buf,num);
+#endif
+
     retVal=0;
 
     FD_ZERO(&fds);
@@ -543,6 +703,47 @@ int SocketsCon_Read(struct SocketCon *Con,void *buf,int num)
     return retVal;
 }
 
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_CanWrite
+ *
+ * SYNOPSIS:
+ *    bool SocketsCon_CanWrite(struct SocketCon *Con);
+ *
+ * PARAMETERS:
+ *    Con [I] -- The connection to work on
+ *
+ * FUNCTION:
+ *    This function checks if the OS has room to take more data for this
+ *    connection (so a SocketsCon_Write() will not have to wait).  It will
+ *    return immediately.
+ *
+ * RETURNS:
+ *    true -- There is room to write
+ *    false -- The send buffer is full (or the connection isn't connected)
+ *
+ * SEE ALSO:
+ *    SocketsCon_Write(), SocketsCon_Read()
+ ******************************************************************************/
+bool SocketsCon_CanWrite(struct SocketCon *Con)
+{
+    struct timeval tv;
+    fd_set fds;
+
+    if(Con->State!=e_ConnectState_Connected)
+        return false;
+
+    FD_ZERO(&fds);
+    FD_SET(Con->SocketFD,&fds);
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+
+    if(select(Con->SocketFD+1,NULL,&fds,NULL,&tv)<=0)
+        return false;
+
+    return FD_ISSET(Con->SocketFD,&fds);
+}
+
 /*******************************************************************************
  * NAME:
  *    SocketsCon_Close
@@ -565,6 +766,9 @@ int SocketsCon_Read(struct SocketCon *Con,void *buf,int num)
 void SocketsCon_Close(struct SocketCon *Con)
 {
     Con->State=e_ConnectState_Idle;
+    Con->UseTLS=false;
+
+    PRIV_SocketsCon_FreeTLS(Con);
 
     if(Con->SocketFD>=0)
         close(Con->SocketFD);
@@ -588,16 +792,95 @@ void SocketsCon_Close(struct SocketCon *Con)
  * FUNCTION:
  *    This function opens a socket, binds to it, and starts listening.
  *
+ *    This uses the default options (SocketsCon_InitListenOptions()).
+ *
  * RETURNS:
  *    true -- things worked out
  *    false -- There was an error
  *
  * SEE ALSO:
- *    
+ *    SocketsCon_ListenWithOptions()
  ******************************************************************************/
 bool SocketsCon_Listen(struct SocketCon *Con,const char *bindadd,int PortNo)
+{
+    struct SocketConListenOptions Options;
+
+    SocketsCon_InitListenOptions(&Options);
+    return SocketsCon_ListenWithOptions(Con,bindadd,PortNo,&Options);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_InitListenOptions
+ *
+ * SYNOPSIS:
+ *    void SocketsCon_InitListenOptions(struct SocketConListenOptions *Options);
+ *
+ * PARAMETERS:
+ *    Options [O] -- The options to fill in
+ *
+ * FUNCTION:
+ *    This function fills in the listening socket options with the defaults
+ *    (a backlog of 5 and everything else left to the system).  Change the
+ *    ones you want and pass them to SocketsCon_ListenWithOptions().
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    SocketsCon_ListenWithOptions()
+ ******************************************************************************/
+void SocketsCon_InitListenOptions(struct SocketConListenOptions *Options)
+{
+    Options->Backlog=5;
+    Options->NoDelay=false;
+    Options->DeferAccept=0;
+    Options->FastOpen=0;
+    Options->BusyPoll=0;
+    Options->RecvBufferSize=0;
+    Options->SendBufferSize=0;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_ListenWithOptions
+ *
+ * SYNOPSIS:
+ *    bool SocketsCon_ListenWithOptions(struct SocketCon *Con,
+ *          const char *bindadd,int PortNo,
+ *          const struct SocketConListenOptions *Options);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection to work on
+ *    bindadd [I] -- The address to bind to (pass NULL for INADDR_ANY)
+ *    PortNo [I] -- The port number to bind to
+ *    Options [I] -- How to set up the socket (see
+ *                   SocketsCon_InitListenOptions())
+ *
+ * FUNCTION:
+ *    This function opens a socket, sets the options on it, binds to it, and
+ *    starts listening.
+ *
+ *    The options are set on the listening socket and the connections we
+ *    accept get them from it.  The buffer sizes are set before listening so
+ *    the TCP window scale is picked to match.
+ *
+ *    Errors setting DeferAccept, FastOpen, and BusyPoll are ignored (not
+ *    every kernel has them, and SO_BUSY_POLL needs CAP_NET_ADMIN to go
+ *    above the system setting), the server just runs without them.
+ *
+ * RETURNS:
+ *    true -- things worked out
+ *    false -- There was an error
+ *
+ * SEE ALSO:
+ *    SocketsCon_Listen(), SocketsCon_InitListenOptions()
+ ******************************************************************************/
+bool SocketsCon_ListenWithOptions(struct SocketCon *Con,const char *bindadd,
+        int PortNo,const struct SocketConListenOptions *Options)
 {
     struct sockaddr_in serv_addr;
+    int Value;
 
     Con->SocketFD=socket(AF_INET,SOCK_STREAM,0);
     if(Con->SocketFD<0)
@@ -615,6 +898,62 @@ bool SocketsCon_Listen(struct SocketCon *Con,const char *bindadd,int PortNo)
         setsockopt(Con->SocketFD,SOL_SOCKET,SO_REUSEADDR,&enable,sizeof(int));
     }
 
+    if(Options->RecvBufferSize>0)
+    {
+        Value=Options->RecvBufferSize;
+        if(setsockopt(Con->SocketFD,SOL_SOCKET,SO_RCVBUF,&Value,
+                sizeof(Value))<0)
+        {
+            Con->Last_errno=errno;
+            PRIV_SocketsCon_Error(Con,e_ConnectError_Failed2Setsockopt);
+            return false;
+        }
+    }
+    if(Options->SendBufferSize>0)
+    {
+        Value=Options->SendBufferSize;
+        if(setsockopt(Con->SocketFD,SOL_SOCKET,SO_SNDBUF,&Value,
+                sizeof(Value))<0)
+        {
+            Con->Last_errno=errno;
+            PRIV_SocketsCon_Error(Con,e_ConnectError_Failed2Setsockopt);
+            return false;
+        }
+    }
+    if(Options->NoDelay)
+    {
+        /* Send replies right away instead of waiting for the ACK of the
+           last write (Nagle) */
+        Value=1;
+        if(setsockopt(Con->SocketFD,IPPROTO_TCP,TCP_NODELAY,&Value,
+                sizeof(Value))<0)
+        {
+            Con->Last_errno=errno;
+            PRIV_SocketsCon_Error(Con,e_ConnectError_Failed2Setsockopt);
+            return false;
+        }
+    }
+
+    /* We ignore errors from these */
+    if(Options->DeferAccept>0)
+    {
+        Value=Options->DeferAccept;
+        setsockopt(Con->SocketFD,IPPROTO_TCP,TCP_DEFER_ACCEPT,&Value,
+                sizeof(Value));
+    }
+    if(Options->FastOpen>0)
+    {
+        Value=Options->FastOpen;
+        setsockopt(Con->SocketFD,IPPROTO_TCP,TCP_FASTOPEN,&Value,
+                sizeof(Value));
+    }
+    if(Options->BusyPoll>0)
+    {
+        Value=Options->BusyPoll;
+        setsockopt(Con->SocketFD,SOL_SOCKET,SO_BUSY_POLL,&Value,
+                sizeof(Value));
+    }
+
     /* Initialize socket structure */
     bzero((char *)&serv_addr,sizeof(serv_addr));
     serv_addr.sin_family=AF_INET;
@@ -630,7 +969,7 @@ bool SocketsCon_Listen(struct SocketCon *Con,const char *bindadd,int PortNo)
         return false;
     }
 
-    listen(Con->SocketFD,5);
+    listen(Con->SocketFD,Options->Backlog);
 
     Con->State=e_ConnectState_Listening;
 
@@ -652,14 +991,16 @@ bool SocketsCon_Listen(struct SocketCon *Con,const char *bindadd,int PortNo)
  *                  function.
  *
  * FUNCTION:
- *    This function accepts a new connection on a listening socket.
+ *    This function accepts a new connection on a listening socket.  This
+ *    works the same for TCP (SocketsCon_Listen()) and unix domain
+ *    (SocketsCon_ListenUnix()) sockets.
  *
  * RETURNS:
  *    true -- We got a new connection
  *    false -- No new connection or error
  *
  * SEE ALSO:
- *    SocketsCon_Listen()
+ *    SocketsCon_Listen(), SocketsCon_ListenUnix()
  ******************************************************************************/
 bool SocketsCon_Accept(struct SocketCon *Con,struct SocketCon *NewCon)
 {
@@ -667,9 +1008,12 @@ bool SocketsCon_Accept(struct SocketCon *Con,struct SocketCon *NewCon)
     fd_set fds;
     int newsockfd;
     socklen_t clilen;
-    struct sockaddr_in cli_addr;
+    struct sockaddr_storage cli_addr;
     int flags;
 
+    if(Con->State!=e_ConnectState_Listening)
+        return false;
+
     clilen=sizeof(cli_addr);
 
     FD_ZERO(&fds);
@@ -698,6 +1042,13 @@ bool SocketsCon_Accept(struct SocketCon *Con,struct SocketCon *NewCon)
             fcntl(NewCon->SocketFD, F_SETFL, flags);
 
             NewCon->State=e_ConnectState_Connected;
+
+            /* Connections from a TLS listener start the handshake */
+            if(Con->UseTLS && !SocketsCon_EnableTLS(NewCon))
+            {
+                SocketsCon_Close(NewCon);
+                return false;
+            }
             return true;
         }
     }
@@ -804,7 +1155,8 @@ int SocketsCon_GetLastErrNo(struct SocketCon *Con)
  *    e_ConnectError_AllOk -- We didn't have an error (it means we have an
  *                            unhandled error, or your calling this even though
  *                            nothing failed)
- *    e_ConnectError_gethostbynameFailed -- The call to gethostbyname() failed
+ *    e_ConnectError_gethostbynameFailed -- The server name couldn't be looked
+ *                                          up (SocketsDNS_Lookup())
  *    e_ConnectError_Failed2GetSocket --
  *    e_ConnectError_ConnectFailed --
  *    e_ConnectError_Failed2Connect --
@@ -826,6 +1178,7 @@ int SocketsCon_GetLastErrNo(struct SocketCon *Con)
  *    e_ConnectError_Failed2Bind --
  *    e_ConnectError_AcceptError --
  *    e_ConnectError_AcceptTX_SOCKET_ERROR --
+ *    e_ConnectError_Failed2Setsockopt --
  *    e_ConnectErrorMAX
  *
  * SEE ALSO:
@@ -870,3 +1223,1158 @@ bool SocketsCon_GetSocketHandle(struct SocketCon *Con,
 
     return true;
 }
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_ListenUnix
+ *
+ * SYNOPSIS:
+ *    bool SocketsCon_ListenUnix(struct SocketCon *Con,const char *Path);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection to work on
+ *    Path [I] -- The file name of the unix domain socket to listen on
+ *
+ * FUNCTION:
+ *    This function opens a unix domain socket, binds it to 'Path', and starts
+ *    listening.  Anything already at 'Path' is removed first (a socket left
+ *    over from a server that didn't clean up).
+ *
+ *    Connections are taken with SocketsCon_Accept() the same as a TCP
+ *    listening socket.
+ *
+ * RETURNS:
+ *    true -- things worked out
+ *    false -- There was an error
+ *
+ * SEE ALSO:
+ *    SocketsCon_Listen(), SocketsCon_ConnectUnix()
+ ******************************************************************************/
+bool SocketsCon_ListenUnix(struct SocketCon *Con,const char *Path)
+{
+    struct sockaddr_un serv_addr;
+
+    if(strlen(Path)>=sizeof(serv_addr.sun_path))
+    {
+        PRIV_SocketsCon_Error(Con,e_ConnectError_Failed2Bind);
+        return false;
+    }
+
+    Con->SocketFD=socket(AF_UNIX,SOCK_STREAM,0);
+    if(Con->SocketFD<0)
+    {
+        PRIV_SocketsCon_Error(Con,e_ConnectError_Failed2GetSocket);
+        return false;
+    }
+
+    memset(&serv_addr,0x00,sizeof(serv_addr));
+    serv_addr.sun_family=AF_UNIX;
+    strcpy(serv_addr.sun_path,Path);
+
+    unlink(Path);
+    if(bind(Con->SocketFD,(struct sockaddr *)&serv_addr,sizeof(serv_addr))<0)
+    {
+        Con->Last_errno=errno;
+        PRIV_SocketsCon_Error(Con,e_ConnectError_Failed2Bind);
+        return false;
+    }
+
+    listen(Con->SocketFD,5);
+
+    Con->State=e_ConnectState_Listening;
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_ConnectUnix
+ *
+ * SYNOPSIS:
+ *    bool SocketsCon_ConnectUnix(struct SocketCon *Con,const char *Path);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection to work on
+ *    Path [I] -- The file name of the unix domain socket to connect to
+ *
+ * FUNCTION:
+ *    This function connects to a unix domain socket on this machine.  Unlike
+ *    SocketsCon_Connect() this is done right away (there is nothing to wait
+ *    for) so the connection is ready to use when this returns true.
+ *
+ * RETURNS:
+ *    true -- We are connected
+ *    false -- There was an error (no one is listening on 'Path')
+ *
+ * SEE ALSO:
+ *    SocketsCon_ListenUnix(), SocketsCon_ReadHandles()
+ ******************************************************************************/
+bool SocketsCon_ConnectUnix(struct SocketCon *Con,const char *Path)
+{
+    struct sockaddr_un serv_addr;
+    int flags;
+
+    if(strlen(Path)>=sizeof(serv_addr.sun_path))
+    {
+        PRIV_SocketsCon_Error(Con,e_ConnectError_ConnectFailed);
+        return false;
+    }
+
+    Con->SocketFD=socket(AF_UNIX,SOCK_STREAM,0);
+    if(Con->SocketFD<0)
+    {
+        PRIV_SocketsCon_Error(Con,e_ConnectError_Failed2GetSocket);
+        return false;
+    }
+
+    memset(&serv_addr,0x00,sizeof(serv_addr));
+    serv_addr.sun_family=AF_UNIX;
+    strcpy(serv_addr.sun_path,Path);
+
+    if(connect(Con->SocketFD,(struct sockaddr *)&serv_addr,
+            sizeof(serv_addr))<0)
+    {
+        Con->Last_errno=errno;
+        PRIV_SocketsCon_Error(Con,e_ConnectError_ConnectFailed);
+        return false;
+    }
+
+    /* Switch to nonblocking */
+    flags=fcntl(Con->SocketFD, F_GETFL, 0);
+    if(flags<0)
+        flags=0;
+    flags|=O_NONBLOCK;
+    fcntl(Con->SocketFD, F_SETFL, flags);
+
+    Con->ReadInProgress=false;
+    Con->State=e_ConnectState_Connected;
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_UseHandle
+ *
+ * SYNOPSIS:
+ *    bool SocketsCon_UseHandle(struct SocketCon *Con,
+ *          t_ConSocketHandle Handle);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection to work on.  This must have
+ *                 SocketsCon_InitSockCon() called on it first.
+ *    Handle [I] -- An open socket to use for this connection
+ *
+ * FUNCTION:
+ *    This function makes a connection out of a socket that was opened
+ *    somewhere else (passed in from another process with
+ *    SocketsCon_ReadHandles(), for example).  If the socket is listening the
+ *    connection is a listening socket (use SocketsCon_Accept() on it),
+ *    otherwise it's a connected socket.
+ *
+ *    The connection owns the handle after this (it's closed by
+ *    SocketsCon_Close(), or right away if there is an error).
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- 'Handle' isn't a socket
+ *
+ * SEE ALSO:
+ *    SocketsCon_GetSocketHandle(), SocketsCon_ReadHandles()
+ ******************************************************************************/
+bool SocketsCon_UseHandle(struct SocketCon *Con,t_ConSocketHandle Handle)
+{
+    int Listening;
+    socklen_t len;
+    int flags;
+
+    Con->SocketFD=Handle;
+
+    len=sizeof(Listening);
+    if(getsockopt(Con->SocketFD,SOL_SOCKET,SO_ACCEPTCONN,&Listening,&len)<0)
+    {
+        Con->Last_errno=errno;
+        PRIV_SocketsCon_Error(Con,e_ConnectError_Failed2Getsockopt);
+        return false;
+    }
+
+    Con->ReadInProgress=false;
+    if(Listening)
+    {
+        Con->State=e_ConnectState_Listening;
+        return true;
+    }
+
+    /* Switch to nonblocking */
+    flags=fcntl(Con->SocketFD, F_GETFL, 0);
+    if(flags<0)
+        flags=0;
+    flags|=O_NONBLOCK;
+    fcntl(Con->SocketFD, F_SETFL, flags);
+
+    Con->State=e_ConnectState_Connected;
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_SendHandles
+ *
+ * SYNOPSIS:
+ *    bool SocketsCon_SendHandles(struct SocketCon *Con,
+ *          const t_ConSocketHandle *Handles,int Count);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection to send on.  This must be a unix domain
+ *                 socket (SocketsCon_ConnectUnix() or accepted from
+ *                 SocketsCon_ListenUnix()).
+ *    Handles [I] -- The sockets to send
+ *    Count [I] -- The number of handles in 'Handles' (1 to
+ *                 SOCKETSCON_MAX_HANDLES)
+ *
+ * FUNCTION:
+ *    This function sends open sockets to the process on the other end of
+ *    'Con' (SCM_RIGHTS).  The other process gets its own copy of each
+ *    socket, so we can close ours after this and the socket stays open.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- There was an error
+ *
+ * SEE ALSO:
+ *    SocketsCon_ReadHandles(), SocketsCon_GetSocketHandle()
+ ******************************************************************************/
+bool SocketsCon_SendHandles(struct SocketCon *Con,
+        const t_ConSocketHandle *Handles,int Count)
+{
+    union
+    {
+        struct cmsghdr Align;
+        char Buff[CMSG_SPACE(sizeof(int)*SOCKETSCON_MAX_HANDLES)];
+    } Control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char Byte;
+    int retVal;
+
+    if(Con->State!=e_ConnectState_Connected || Count<1 ||
+            Count>SOCKETSCON_MAX_HANDLES)
+    {
+        return false;
+    }
+
+    /* We have to send at least 1 byte with the handles */
+    Byte=0;
+    iov.iov_base=&Byte;
+    iov.iov_len=1;
+
+    memset(&msg,0x00,sizeof(msg));
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    msg.msg_control=Control.Buff;
+    msg.msg_controllen=CMSG_SPACE(sizeof(int)*Count);
+
+    cmsg=CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level=SOL_SOCKET;
+    cmsg->cmsg_type=SCM_RIGHTS;
+    cmsg->cmsg_len=CMSG_LEN(sizeof(int)*Count);
+    memcpy(CMSG_DATA(cmsg),Handles,sizeof(int)*Count);
+
+    do
+    {
+        retVal=sendmsg(Con->SocketFD,&msg,0);
+        Con->Last_errno=errno;
+    } while(retVal<0 && (Con->Last_errno==EAGAIN || Con->Last_errno==EINTR));
+
+    if(retVal!=1)
+    {
+        PRIV_SocketsCon_Error(Con,e_ConnectError_WriteTX_SOCKET_ERROR);
+        return false;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_ReadHandles
+ *
+ * SYNOPSIS:
+ *    int SocketsCon_ReadHandles(struct SocketCon *Con,
+ *          t_ConSocketHandle *Handles,int MaxCount);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection to read from
+ *    Handles [O] -- The sockets we got
+ *    MaxCount [I] -- The number of handles 'Handles' has room for
+ *
+ * FUNCTION:
+ *    This function reads sockets sent with SocketsCon_SendHandles().  It
+ *    will return immediately if nothing has been sent yet.
+ *
+ *    The handles are ours to close (pass them to SocketsCon_UseHandle()).
+ *    Any more than 'MaxCount' are closed.
+ *
+ * RETURNS:
+ *    The number of handles read, 0 if nothing has been sent yet, or <0 if
+ *    there was an error (or the other end hung up).
+ *
+ * SEE ALSO:
+ *    SocketsCon_SendHandles(), SocketsCon_UseHandle()
+ ******************************************************************************/
+int SocketsCon_ReadHandles(struct SocketCon *Con,t_ConSocketHandle *Handles,
+        int MaxCount)
+{
+    union
+    {
+        struct cmsghdr Align;
+        char Buff[CMSG_SPACE(sizeof(int)*SOCKETSCON_MAX_HANDLES)];
+    } Control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char Byte;
+    int retVal;
+    int Count;
+    int Got;
+    int fd;
+    int r;
+
+    if(Con->State!=e_ConnectState_Connected)
+        return -1;
+
+    iov.iov_base=&Byte;
+    iov.iov_len=1;
+
+    memset(&msg,0x00,sizeof(msg));
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    msg.msg_control=Control.Buff;
+    msg.msg_controllen=sizeof(Control.Buff);
+
+    retVal=recvmsg(Con->SocketFD,&msg,MSG_CMSG_CLOEXEC);
+    Con->Last_errno=errno;
+    if(retVal<0)
+    {
+        if(Con->Last_errno==EAGAIN || Con->Last_errno==EINTR)
+            return 0;
+        PRIV_SocketsCon_Error(Con,e_ConnectError_ReadSocketError);
+        return -1;
+    }
+    if(retVal==0)
+    {
+        /* The other end hung up */
+        Con->State=e_ConnectState_Idle;
+        return -1;
+    }
+
+    Count=0;
+    for(cmsg=CMSG_FIRSTHDR(&msg);cmsg!=NULL;cmsg=CMSG_NXTHDR(&msg,cmsg))
+    {
+        if(cmsg->cmsg_level!=SOL_SOCKET || cmsg->cmsg_type!=SCM_RIGHTS)
+            continue;
+
+        Got=(cmsg->cmsg_len-CMSG_LEN(0))/sizeof(int);
+        for(r=0;r<Got;r++)
+        {
+            memcpy(&fd,CMSG_DATA(cmsg)+r*sizeof(int),sizeof(int));
+            if(Count<MaxCount)
+                Handles[Count++]=fd;
+            else
+                close(fd);
+        }
+    }
+
+    return Count;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_InheritedHandles
+ *
+ * SYNOPSIS:
+ *    int SocketsCon_InheritedHandles(t_ConSocketHandle *Handles,int MaxCount);
+ *
+ * PARAMETERS:
+ *    Handles [O] -- The sockets we where started with
+ *    MaxCount [I] -- The number of handles 'Handles' has room for
+ *
+ * FUNCTION:
+ *    This function gets the sockets our supervisor opened for us before
+ *    starting us (socket activation).  This uses the LISTEN_FDS protocol
+ *    (systemd and friends): LISTEN_PID is our pid and LISTEN_FDS is the
+ *    number of sockets, starting at handle 3.
+ *
+ *    The environment vars are removed so any programs we start don't think
+ *    the sockets are for them.  The handles are ours to close (pass them to
+ *    SocketsCon_UseHandle()).  Any more than 'MaxCount' are left alone.
+ *
+ * RETURNS:
+ *    The number of handles, 0 if we weren't started with any.
+ *
+ * SEE ALSO:
+ *    SocketsCon_UseHandle()
+ ******************************************************************************/
+int SocketsCon_InheritedHandles(t_ConSocketHandle *Handles,int MaxCount)
+{
+    const char *Pid;
+    const char *Fds;
+    char *End;
+    long Count;
+    int r;
+
+    Pid=getenv("LISTEN_PID");
+    Fds=getenv("LISTEN_FDS");
+    if(Pid==NULL || Fds==NULL)
+        return 0;
+
+    /* Make sure they are for us and not our parent */
+    if(strtol(Pid,&End,10)!=(long)getpid() || *End!=0)
+        return 0;
+
+    Count=strtol(Fds,&End,10);
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    if(*End!=0 || Count<=0)
+        return 0;
+
+    if(Count>MaxCount)
+        Count=MaxCount;
+
+    for(r=0;r<Count;r++)
+    {
+        Handles[r]=SOCKETSCON_FIRST_INHERITED_HANDLE+r;
+        fcntl(Handles[r],F_SETFD,FD_CLOEXEC);
+    }
+
+    return Count;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_GetLocalPort
+ *
+ * SYNOPSIS:
+ *    bool SocketsCon_GetLocalPort(struct SocketCon *Con,int *RetPort);
+ *
+ * PARAMETERS:
+ *    Con [I] -- The connection to work on
+ *    RetPort [O] -- The port this socket is bound to
+ *
+ * FUNCTION:
+ *    This function gets the local port of a TCP socket.  This is used to
+ *    find which socket is which when they where opened by someone else
+ *    (SocketsCon_UseHandle()).
+ *
+ * RETURNS:
+ *    true -- 'RetPort' has been filled in
+ *    false -- This isn't a TCP socket (or there was an error)
+ *
+ * SEE ALSO:
+ *    SocketsCon_UseHandle()
+ ******************************************************************************/
+bool SocketsCon_GetLocalPort(struct SocketCon *Con,int *RetPort)
+{
+    struct sockaddr_storage Addr;
+    socklen_t len;
+
+    if(Con->SocketFD<0)
+        return false;
+
+    len=sizeof(Addr);
+    if(getsockname(Con->SocketFD,(struct sockaddr *)&Addr,&len)<0)
+        return false;
+
+    switch(Addr.ss_family)
+    {
+        case AF_INET:
+            *RetPort=ntohs(((struct sockaddr_in *)&Addr)->sin_port);
+        return true;
+        case AF_INET6:
+            *RetPort=ntohs(((struct sockaddr_in6 *)&Addr)->sin6_port);
+        return true;
+        default:
+        break;
+    }
+    return false;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_InitTLS
+ *
+ * SYNOPSIS:
+ *    bool SocketsCon_InitTLS(const char *CertFile,const char *KeyFile);
+ *
+ * PARAMETERS:
+ *    CertFile [I] -- The PEM file with our certificate (and the chain)
+ *    KeyFile [I] -- The PEM file with the private key for 'CertFile'
+ *
+ * FUNCTION:
+ *    This function sets up TLS for the server side of connections
+ *    (SocketsCon_EnableTLS()).  This needs to be built with SOCKETSCON_TLS
+ *    set to 1 (and linked with OpenSSL).
+ *
+ *    Clients that reconnect can resume their last session (from the
+ *    session cache for TLS 1.2 or with a session ticket for TLS 1.3) which
+ *    skips the public key part of the handshake.  The sessions only live as
+ *    long as this process.
+ *
+ *    Kernel TLS is turned on if OpenSSL and the kernel have it ("tls" in
+ *    /proc/sys/net/ipv4/tcp_available_ulp) so the kernel does the
+ *    encryption and SocketsCon_Relay() can still splice() to the connection.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- There was an error (or we were built without TLS)
+ *
+ * SEE ALSO:
+ *    SocketsCon_EnableTLS()
+ ******************************************************************************/
+bool SocketsCon_InitTLS(const char *CertFile,const char *KeyFile)
+{
+#if SOCKETSCON_TLS
+    static const unsigned char SessionContext[]="BittyHTTP";
+    SSL_CTX *Context;
+
+    Context=SSL_CTX_new(TLS_server_method());
+    if(Context==NULL)
+        return false;
+
+    SSL_CTX_set_min_proto_version(Context,TLS1_2_VERSION);
+
+    /* Renegotiation would need reads in the middle of a write */
+    SSL_CTX_set_options(Context,SSL_OP_NO_RENEGOTIATION|SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_mode(Context,SSL_MODE_ENABLE_PARTIAL_WRITE|
+            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER|SSL_MODE_RELEASE_BUFFERS);
+
+    /* Session resumption */
+    SSL_CTX_set_session_id_context(Context,SessionContext,
+            sizeof(SessionContext)-1);
+    SSL_CTX_set_session_cache_mode(Context,SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(Context,SOCKETSCON_TLS_SESSION_CACHE);
+    SSL_CTX_set_num_tickets(Context,SOCKETSCON_TLS_TICKETS);
+
+    if(SSL_CTX_use_certificate_chain_file(Context,CertFile)!=1 ||
+            SSL_CTX_use_PrivateKey_file(Context,KeyFile,SSL_FILETYPE_PEM)!=1 ||
+            SSL_CTX_check_private_key(Context)!=1)
+    {
+        SSL_CTX_free(Context);
+        return false;
+    }
+
+    if(m_TLSContext!=NULL)
+        SSL_CTX_free(m_TLSContext);
+    m_TLSContext=Context;
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_EnableTLS
+ *
+ * SYNOPSIS:
+ *    bool SocketsCon_EnableTLS(struct SocketCon *Con);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection to work on
+ *
+ * FUNCTION:
+ *    This function turns on TLS (as the server) for a connection.
+ *    SocketsCon_InitTLS() must be called first.
+ *
+ *    If 'Con' is a listening socket all the connections accepted from it
+ *    will use TLS.  If it's connected the handshake is started.
+ *
+ *    The handshake is run as SocketsCon_Read() is called (it returns 0 until
+ *    the handshake is done and the client sends something).
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- There was an error (or we were built without TLS)
+ *
+ * SEE ALSO:
+ *    SocketsCon_InitTLS(), SocketsCon_IsTLS()
+ ******************************************************************************/
+bool SocketsCon_EnableTLS(struct SocketCon *Con)
+{
+#if SOCKETSCON_TLS
+    SSL *ssl;
+
+    if(m_TLSContext==NULL)
+        return false;
+
+    if(Con->State==e_ConnectState_Listening)
+    {
+        Con->UseTLS=true;
+        return true;
+    }
+
+    if(Con->State!=e_ConnectState_Connected || Con->TLS!=NULL)
+        return false;
+
+    ssl=SSL_new(m_TLSContext);
+    if(ssl==NULL)
+    {
+        PRIV_SocketsCon_Error(Con,e_ConnectError_Failed2AllocSSL);
+        return false;
+    }
+    if(SSL_set_fd(ssl,Con->SocketFD)!=1)
+    {
+        SSL_free(ssl);
+        PRIV_SocketsCon_Error(Con,e_ConnectError_Failed2SetSSLFD);
+        return false;
+    }
+    SSL_set_accept_state(ssl);
+
+    Con->TLS=ssl;
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_IsTLS
+ *
+ * SYNOPSIS:
+ *    bool SocketsCon_IsTLS(struct SocketCon *Con);
+ *
+ * PARAMETERS:
+ *    Con [I] -- The connection to work on
+ *
+ * FUNCTION:
+ *    This function checks if a connection is using TLS (or if a listening
+ *    socket hands out TLS connections).
+ *
+ * RETURNS:
+ *    true -- It uses TLS
+ *    false -- It's plain
+ *
+ * SEE ALSO:
+ *    SocketsCon_EnableTLS()
+ ******************************************************************************/
+bool SocketsCon_IsTLS(struct SocketCon *Con)
+{
+    return Con->TLS!=NULL || Con->UseTLS;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_IsKernelTLS
+ *
+ * SYNOPSIS:
+ *    bool SocketsCon_IsKernelTLS(struct SocketCon *Con);
+ *
+ * PARAMETERS:
+ *    Con [I] -- The connection to work on
+ *
+ * FUNCTION:
+ *    This function checks if the kernel is doing the TLS encryption for the
+ *    data we send on this connection (kTLS).  This only happens after the
+ *    handshake, and only if OpenSSL and the kernel support it.
+ *
+ * RETURNS:
+ *    true -- The kernel encrypts what we send
+ *    false -- OpenSSL does it (or it's not a TLS connection)
+ *
+ * SEE ALSO:
+ *    SocketsCon_Relay()
+ ******************************************************************************/
+bool SocketsCon_IsKernelTLS(struct SocketCon *Con)
+{
+#if SOCKETSCON_TLS
+    if(Con->TLS==NULL)
+        return false;
+    return BIO_get_ktls_send(SSL_get_wbio((SSL *)Con->TLS))!=0;
+#else
+    return false;
+#endif
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_Peek
+ *
+ * SYNOPSIS:
+ *    int SocketsCon_Peek(struct SocketCon *Con,void *buf,int num);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection to work on
+ *    buf [I] -- The buffer to copy into
+ *    num [I] -- The max number of bytes that can be copied into 'buf'
+ *
+ * FUNCTION:
+ *    This function copies out what is waiting to be read on a connection
+ *    without taking it off the connection (the next SocketsCon_Read() or
+ *    SocketsCon_Relay() still gets it).  It will return immediately if
+ *    there is no data.
+ *
+ *    This only works on plain connections.
+ *
+ * RETURNS:
+ *    The number of bytes copied into 'buf', 0 if there is nothing waiting,
+ *    -55 if the other end hung up, or <0 if there was an error.
+ *
+ * SEE ALSO:
+ *    SocketsCon_Read(), SocketsCon_Relay()
+ ******************************************************************************/
+int SocketsCon_Peek(struct SocketCon *Con,void *buf,int num)
+{
+    int retVal;
+
+    if(Con->State==e_ConnectState_Error)
+        return -100;
+
+    if(Con->State!=e_ConnectState_Connected)
+        return 0;
+
+    /* OpenSSL has already taken the bytes off the socket */
+    if(Con->TLS!=NULL)
+        return -1;
+
+    retVal=recv(Con->SocketFD,buf,num,MSG_PEEK|MSG_DONTWAIT);
+    Con->Last_errno=errno;
+    if(retVal==0)
+    {
+        /* Connection closed */
+        Con->State=e_ConnectState_Idle;
+        return -55;
+    }
+    if(retVal<0)
+    {
+        if(Con->Last_errno==EAGAIN || Con->Last_errno==EWOULDBLOCK)
+            return 0;
+
+        PRIV_SocketsCon_Error(Con,e_ConnectError_ReadSocketError);
+        return -1;
+    }
+    return retVal;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_InitRelay
+ *
+ * SYNOPSIS:
+ *    void SocketsCon_InitRelay(struct SocketConRelay *Relay);
+ *
+ * PARAMETERS:
+ *    Relay [O] -- The relay to set up
+ *
+ * FUNCTION:
+ *    This function sets up a relay for SocketsCon_Relay().  The pipe isn't
+ *    made until the relay is first used.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    SocketsCon_Relay(), SocketsCon_FreeRelay()
+ ******************************************************************************/
+void SocketsCon_InitRelay(struct SocketConRelay *Relay)
+{
+    Relay->Pipe[0]=-1;
+    Relay->Pipe[1]=-1;
+    Relay->InPipe=0;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_FreeRelay
+ *
+ * SYNOPSIS:
+ *    void SocketsCon_FreeRelay(struct SocketConRelay *Relay);
+ *
+ * PARAMETERS:
+ *    Relay [I/O] -- The relay to free
+ *
+ * FUNCTION:
+ *    This function closes the relay's pipe.  Anything still in the pipe is
+ *    lost.  The relay can be used again after this (a new pipe is made).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    SocketsCon_InitRelay()
+ ******************************************************************************/
+void SocketsCon_FreeRelay(struct SocketConRelay *Relay)
+{
+    if(Relay->Pipe[0]>=0)
+        close(Relay->Pipe[0]);
+    if(Relay->Pipe[1]>=0)
+        close(Relay->Pipe[1]);
+    SocketsCon_InitRelay(Relay);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsCon_Relay
+ *
+ * SYNOPSIS:
+ *    int SocketsCon_Relay(struct SocketCon *From,struct SocketCon *To,
+ *          struct SocketConRelay *Relay,int MaxLen);
+ *
+ * PARAMETERS:
+ *    From [I/O] -- The connection to read from
+ *    To [I/O] -- The connection to send what was read to
+ *    Relay [I/O] -- The pipe the bytes go though (see SocketsCon_InitRelay())
+ *    MaxLen [I] -- The max number of bytes to take from 'From'.  Pass 0 to
+ *                  just send on what is still in the pipe.
+ *
+ * FUNCTION:
+ *    This function moves bytes from one connection to another.  On plain
+ *    connections (or when 'To' is using kernel TLS) this is done with
+ *    splice() though a pipe so the data never has to be copied into our
+ *    memory.  It will return immediately if there is nothing to read or
+ *    'To' can't take any more.
+ *
+ *    Bytes that were read but that 'To' couldn't take yet stay in the pipe
+ *    ('Relay->InPipe') and are sent on the next call.  The relay isn't done
+ *    until 'Relay->InPipe' is 0.
+ *
+ *    If either end is using TLS (without kernel TLS for sending) the bytes
+ *    are read and written in blocks instead, and this waits until they have
+ *    all been sent like SocketsCon_Write() does.
+ *
+ * RETURNS:
+ *    The number of bytes taken from 'From', -55 if 'From' hung up, or <0 if
+ *    there was an error on either connection.
+ *
+ * SEE ALSO:
+ *    SocketsCon_InitRelay()
+ ******************************************************************************/
+int SocketsCon_Relay(struct SocketCon *From,struct SocketCon *To,
+        struct SocketConRelay *Relay,int MaxLen)
+{
+    ssize_t retVal;
+    int Moved;
+
+    if(To->State!=e_ConnectState_Connected)
+        return -1;
+
+    if(From->TLS!=NULL || (To->TLS!=NULL && !SocketsCon_IsKernelTLS(To)))
+        return PRIV_SocketsCon_RelayCopy(From,To,MaxLen);
+
+    if(Relay->Pipe[0]<0 && pipe2(Relay->Pipe,O_NONBLOCK|O_CLOEXEC)<0)
+    {
+        /* No pipe, we can still copy it */
+        SocketsCon_InitRelay(Relay);
+        return PRIV_SocketsCon_RelayCopy(From,To,MaxLen);
+    }
+
+    /* Fill the pipe */
+    Moved=0;
+    if(MaxLen>0 && From->State==e_ConnectState_Connected)
+    {
+        retVal=splice(From->SocketFD,NULL,Relay->Pipe[1],NULL,MaxLen,
+                SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        From->Last_errno=errno;
+        if(retVal==0)
+        {
+            /* Connection closed (what's in the pipe still goes out) */
+            From->State=e_ConnectState_Idle;
+            Moved=-55;
+        }
+        else if(retVal<0)
+        {
+            /* EAGAIN is nothing to read or the pipe is full */
+            if(From->Last_errno!=EAGAIN && From->Last_errno!=EWOULDBLOCK)
+            {
+                PRIV_SocketsCon_Error(From,e_ConnectError_ReadSocketError);
+                return -1;
+            }
+        }
+        else
+        {
+            Relay->InPipe+=retVal;
+            Moved=retVal;
+        }
+    }
+
+    /* Empty it into 'To' */
+    while(Relay->InPipe>0)
+    {
+        retVal=splice(Relay->Pipe[0],NULL,To->SocketFD,NULL,Relay->InPipe,
+                SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        To->Last_errno=errno;
+        if(retVal<0)
+        {
+            /* If it's full we try again next time */
+            if(To->Last_errno==EAGAIN || To->Last_errno==EWOULDBLOCK)
+                break;
+
+            PRIV_SocketsCon_Error(To,e_ConnectError_WriteTX_SOCKET_ERROR);
+            return -1;
+        }
+        if(retVal==0)
+            break;
+        Relay->InPipe-=retVal;
+    }
+
+    return Moved;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsCon_RelayCopy
+ *
+ * SYNOPSIS:
+ *    static int PRIV_SocketsCon_RelayCopy(struct SocketCon *From,
+ *          struct SocketCon *To,int MaxLen);
+ *
+ * PARAMETERS:
+ *    From [I/O] -- The connection to read from
+ *    To [I/O] -- The connection to send what was read to
+ *    MaxLen [I] -- The max number of bytes to take from 'From'
+ *
+ * FUNCTION:
+ *    This function is SocketsCon_Relay() for when we can't use splice().
+ *    It reads a block and sends it.
+ *
+ * RETURNS:
+ *    The number of bytes moved, -55 if 'From' hung up, or <0 if there was
+ *    an error.
+ *
+ * SEE ALSO:
+ *    SocketsCon_Relay()
+ ******************************************************************************/
+static int PRIV_SocketsCon_RelayCopy(struct SocketCon *From,
+        struct SocketCon *To,int MaxLen)
+{
+    char Buffer[RELAY_COPY_SIZE];
+    int retVal;
+
+    if(MaxLen>(int)sizeof(Buffer))
+        MaxLen=sizeof(Buffer);
+    if(MaxLen<=0)
+        return 0;
+
+    retVal=SocketsCon_Read(From,Buffer,MaxLen);
+    if(retVal<=0)
+        return retVal;
+
+    if(!SocketsCon_Write(To,Buffer,retVal))
+        return -1;
+
+    return retVal;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsCon_FreeTLS
+ *
+ * SYNOPSIS:
+ *    static void PRIV_SocketsCon_FreeTLS(struct SocketCon *Con);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection to work on
+ *
+ * FUNCTION:
+ *    This function frees the TLS session on a connection (if it has one).
+ *    If the socket is still open the client is told we are closing.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    SocketsCon_Close()
+ ******************************************************************************/
+static void PRIV_SocketsCon_FreeTLS(struct SocketCon *Con)
+{
+#if SOCKETSCON_TLS
+    if(Con->TLS==NULL)
+        return;
+
+    /* We don't wait for the client's close_notify */
+    if(Con->SocketFD>=0 && SSL_is_init_finished((SSL *)Con->TLS))
+        SSL_shutdown((SSL *)Con->TLS);
+
+    SSL_free((SSL *)Con->TLS);
+    ERR_clear_error();
+#endif
+    Con->TLS=NULL;
+}
+
+#if SOCKETSCON_TLS
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsCon_ReadTLS
+ *
+ * SYNOPSIS:
+ *    static int PRIV_SocketsCon_ReadTLS(struct SocketCon *Con,void *buf,
+ *          int num);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection to work on
+ *    buf [I] -- The buffer to read into
+ *    num [I] -- The max number of bytes that can be read into 'buf'
+ *
+ * FUNCTION:
+ *    This function is SocketsCon_Read() for TLS connections.  It also runs
+ *    the handshake.
+ *
+ * RETURNS:
+ *    The number of bytes read, 0 if there is nothing to read yet, or <0 if
+ *    there was an error (or the other end hung up).
+ *
+ * SEE ALSO:
+ *    SocketsCon_Read()
+ ******************************************************************************/
+static int PRIV_SocketsCon_ReadTLS(struct SocketCon *Con,void *buf,int num)
+{
+    int retVal;
+
+    errno=0;
+    retVal=SSL_read((SSL *)Con->TLS,buf,num);
+    Con->Last_errno=errno;
+    if(retVal>0)
+        return retVal;
+
+    switch(SSL_get_error((SSL *)Con->TLS,retVal))
+    {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            /* Nothing yet (or the handshake is still going) */
+            ERR_clear_error();
+        return 0;
+        case SSL_ERROR_ZERO_RETURN:
+            /* The client closed the TLS session */
+            Con->State=e_ConnectState_Idle;
+        return -55;
+        case SSL_ERROR_SYSCALL:
+            if(Con->Last_errno==0)
+            {
+                /* The client hung up without closing the session */
+                Con->State=e_ConnectState_Idle;
+                return -55;
+            }
+            PRIV_SocketsCon_Error(Con,e_ConnectError_ReadSocketError);
+        return -1;
+        default:
+            /* A bad handshake or record */
+            PRIV_SocketsCon_Error(Con,e_ConnectError_SSLConnectFailed);
+        return -1;
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsCon_WriteTLS
+ *
+ * SYNOPSIS:
+ *    static bool PRIV_SocketsCon_WriteTLS(struct SocketCon *Con,
+ *          const void *buf,int num);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection to work on
+ *    buf [I] -- The buffer to send
+ *    num [I] -- The number of bytes to send
+ *
+ * FUNCTION:
+ *    This function is SocketsCon_Write() for TLS connections.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- There was an error (or the handshake isn't done)
+ *
+ * SEE ALSO:
+ *    SocketsCon_Write()
+ ******************************************************************************/
+static bool PRIV_SocketsCon_WriteTLS(struct SocketCon *Con,const void *buf,
+        int num)
+{
+    int retVal;
+    int BytesSent;
+    const uint8_t *OutputPos;
+
+    /* We can't wait for the client to finish the handshake here */
+    if(!SSL_is_init_finished((SSL *)Con->TLS))
+        return false;
+
+    BytesSent=0;
+    OutputPos=buf;
+    while(BytesSent<num)
+    {
+        retVal=SSL_write((SSL *)Con->TLS,OutputPos,num-BytesSent);
+        if(retVal<=0)
+        {
+            /* If it was busy, try again */
+            if(SSL_get_error((SSL *)Con->TLS,retVal)==SSL_ERROR_WANT_WRITE)
+                continue;
+
+            /* Real error */
+            PRIV_SocketsCon_Error(Con,e_ConnectError_WriteTX_SOCKET_ERROR);
+            return false;
+        }
+        BytesSent+=retVal;
+        OutputPos+=retVal;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsCon_WriteSomeTLS
+ *
+ * SYNOPSIS:
+ *    static int PRIV_SocketsCon_WriteSomeTLS(struct SocketCon *Con,
+ *          const void *buf,int num);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection to work on
+ *    buf [I] -- The buffer to send
+ *    num [I] -- The number of bytes in 'buf'
+ *
+ * FUNCTION:
+ *    This function is SocketsCon_WriteSome() for TLS connections.  It does
+ *    one SSL_write() and doesn't wait if the socket is full
+ *    (SSL_MODE_ENABLE_PARTIAL_WRITE and SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+ *    are set on the context, so a short write is fine and the retry can
+ *    come from a buffer that has moved).
+ *
+ * RETURNS:
+ *    The number of bytes sent (0 if the socket can't take any right now)
+ *    or <0 if there was an error (or the handshake isn't done).
+ *
+ * SEE ALSO:
+ *    SocketsCon_WriteSome(), PRIV_SocketsCon_WriteTLS()
+ ******************************************************************************/
+static int PRIV_SocketsCon_WriteSomeTLS(struct SocketCon *Con,
+        const void *buf,int num)
+{
+    int retVal;
+
+    /* We can't wait for the client to finish the handshake here */
+    if(!SSL_is_init_finished((SSL *)Con->TLS))
+        return -1;
+
+    if(num<=0)
+        return 0;
+
+    retVal=SSL_write((SSL *)Con->TLS,buf,num);
+    if(retVal>0)
+        return retVal;
+
+    switch(SSL_get_error((SSL *)Con->TLS,retVal))
+    {
+        case SSL_ERROR_WANT_WRITE:
+        case SSL_ERROR_WANT_READ:
+            /* Full, try again later */
+            ERR_clear_error();
+        return 0;
+        default:
+            PRIV_SocketsCon_Error(Con,e_ConnectError_WriteTX_SOCKET_ERROR);
+        return -1;
+    }
+}
+#endif
@@ -34,10 +34,18 @@
 #define __SOCKETSCON_H_
 
 /***  HEADER FILES TO INCLUDE          ***/
+#include "SocketsDNS.h"
 #include <stdbool.h>
 #include <stdint.h>
 
 /***  DEFINES                          ***/
+#define SOCKETSCON_FIRST_INHERITED_HANDLE   3       // The LISTEN_FDS protocol starts its sockets here (after stdin/out/err)
+#define SOCKETSCON_MAX_HANDLES              64      // The most sockets SocketsCon_SendHandles() can send at once
+#ifndef SOCKETSCON_TLS
+#define SOCKETSCON_TLS                      0       // Build in TLS (needs OpenSSL, "make TLS=1" passes this in)
+#endif
+#define SOCKETSCON_TLS_SESSION_CACHE        128     // The number of TLS 1.2 sessions kept for clients that reconnect
+#define SOCKETSCON_TLS_TICKETS              1       // The number of TLS 1.3 session tickets sent to each client
 
 /***  MACROS                           ***/
 
@@ -67,12 +75,14 @@ typedef enum
     e_ConnectError_Failed2Bind,
     e_ConnectError_AcceptError,
     e_ConnectError_AcceptTX_SOCKET_ERROR,
+    e_ConnectError_Failed2Setsockopt,
     e_ConnectErrorMAX
 } e_ConnectErrorType;
 
 typedef enum
 {
     e_ConnectState_Idle=0,
+    e_ConnectState_Resolving,
     e_ConnectState_Connecting,
     e_ConnectState_Connected,
     e_ConnectState_Listening,
@@ -88,10 +98,31 @@ struct SocketCon
     int Last_errno;
     uint32_t TimeoutTS;
     e_ConnectErrorType ErrorCode;
+    void *TLS;              // The TLS session (SSL *) or NULL for a plain connection
+    bool UseTLS;            // Listening sockets: the connections we accept use TLS
+    char ServerName[SOCKETSDNS_MAX_NAME];   // The server SocketsCon_Connect() is looking up
+    int ServerPort;
 };
 
 typedef int t_ConSocketHandle;
 
+struct SocketConListenOptions
+{
+    int Backlog;            // How many connections the kernel queues up for us to accept
+    bool NoDelay;           // Turn off Nagle on accepted connections (TCP_NODELAY)
+    int DeferAccept;        // Only wake us for a new connection once it has sent something, waiting up to this many seconds (TCP_DEFER_ACCEPT, 0=off)
+    int FastOpen;           // The max number of TCP fast open connections waiting for the handshake (TCP_FASTOPEN, 0=off)
+    int BusyPoll;           // How many microseconds to busy poll the network device for reads (SO_BUSY_POLL, 0=off)
+    int RecvBufferSize;     // The socket receive buffer size (SO_RCVBUF, 0=system default)
+    int SendBufferSize;     // The socket send buffer size (SO_SNDBUF, 0=system default)
+};
+
+struct SocketConRelay
+{
+    int Pipe[2];            // The pipe SocketsCon_Relay() splices though (-1 until it's first used)
+    int InPipe;             // Bytes taken from the source that haven't been sent on yet
+};
+
 /***  CLASS DEFINITIONS                ***/
 
 /***  GLOBAL VARIABLE DEFINITIONS      ***/
@@ -104,9 +135,14 @@ bool SocketsCon_Connect(struct SocketCon *Con,const char *ServerName,
         int portNo);
 void SocketsCon_Tick(struct SocketCon *Con);
 bool SocketsCon_Write(struct SocketCon *Con,const void *buf,int num);
+int SocketsCon_WriteSome(struct SocketCon *Con,const void *buf,int num);
 int SocketsCon_Read(struct SocketCon *Con,void *buf,int num);
+bool SocketsCon_CanWrite(struct SocketCon *Con);
 void SocketsCon_Close(struct SocketCon *Con);
 bool SocketsCon_Listen(struct SocketCon *Con,const char *bindadd,int PortNo);
+void SocketsCon_InitListenOptions(struct SocketConListenOptions *Options);
+bool SocketsCon_ListenWithOptions(struct SocketCon *Con,const char *bindadd,
+        int PortNo,const struct SocketConListenOptions *Options);
 bool SocketsCon_Accept(struct SocketCon *Con,struct SocketCon *NewCon);
 bool SocketsCon_HasError(struct SocketCon *Con);
 bool SocketsCon_IsConnected(struct SocketCon *Con);
@@ -115,5 +151,23 @@ e_ConnectErrorType SocketsCon_GetErrorCode(struct SocketCon *Con);
 bool SocketsCon_EnableAddressReuse(struct SocketCon *Con,bool Enable);
 bool SocketsCon_GetSocketHandle(struct SocketCon *Con,
         t_ConSocketHandle *RetHandle);
+bool SocketsCon_ListenUnix(struct SocketCon *Con,const char *Path);
+bool SocketsCon_ConnectUnix(struct SocketCon *Con,const char *Path);
+bool SocketsCon_UseHandle(struct SocketCon *Con,t_ConSocketHandle Handle);
+bool SocketsCon_SendHandles(struct SocketCon *Con,
+        const t_ConSocketHandle *Handles,int Count);
+int SocketsCon_ReadHandles(struct SocketCon *Con,t_ConSocketHandle *Handles,
+        int MaxCount);
+int SocketsCon_InheritedHandles(t_ConSocketHandle *Handles,int MaxCount);
+bool SocketsCon_GetLocalPort(struct SocketCon *Con,int *RetPort);
+bool SocketsCon_InitTLS(const char *CertFile,const char *KeyFile);
+bool SocketsCon_EnableTLS(struct SocketCon *Con);
+bool SocketsCon_IsTLS(struct SocketCon *Con);
+bool SocketsCon_IsKernelTLS(struct SocketCon *Con);
+int SocketsCon_Peek(struct SocketCon *Con,void *buf,int num);
+void SocketsCon_InitRelay(struct SocketConRelay *Relay);
+void SocketsCon_FreeRelay(struct SocketConRelay *Relay);
+int SocketsCon_Relay(struct SocketCon *From,struct SocketCon *To,
+        struct SocketConRelay *Relay,int MaxLen);
 
 #endif
@@ -0,0 +1,1232 @@
+/*******************************************************************************
+ * FILENAME: SocketsDNS.c
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This is a small non-blocking DNS stub resolver with a cache, so
+ *    SocketsCon_Connect() doesn't stop the whole loop while a name is looked
+ *    up (gethostbyname() can take seconds on a bad link).
+ *
+ *    SocketsDNS_Lookup() is polled until it gives an answer.  The first
+ *    call sends an A and an AAAA query over UDP to the nameserver from
+ *    resolv.conf (or the one from SocketsDNS_SetNameServer()) and returns
+ *    e_SocketsDNS_Pending.  Later calls read the answers.  If a nameserver
+ *    doesn't answer in SOCKETSDNS_TIMEOUT the next one is asked, up to
+ *    SOCKETSDNS_TRIES times.  IPv4 addresses are used before IPv6 ones.
+ *
+ *    Answers are kept for their TTL (held between SOCKETSDNS_MIN_TTL and
+ *    SOCKETSDNS_MAX_TTL).  Names that don't exist are kept for the SOA
+ *    negative TTL (RFC 2308, up to SOCKETSDNS_NEGATIVE_TTL) and names no
+ *    nameserver answered for are kept for SOCKETSDNS_FAILED_TTL.  When the
+ *    cache is full the least recently used name is thrown out.
+ *
+ *    Numeric addresses are answered right away and the hosts file is read
+ *    before asking a nameserver.  Search domains, TCP fallback for
+ *    truncated answers, and IPv6 nameservers are not supported.
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ ******************************************************************************/
+
+/*** HEADER FILES TO INCLUDE  ***/
+#include "SocketsDNS.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+/*** DEFINES                  ***/
+#define DNS_PORT                    53
+#define DNS_PACKET_SIZE             512     // The biggest UDP DNS message (without EDNS)
+#define DNS_HEADER_SIZE             12
+#define DNS_TYPE_A                  1
+#define DNS_TYPE_CNAME              5
+#define DNS_TYPE_SOA                6
+#define DNS_TYPE_AAAA               28
+#define DNS_CLASS_IN                1
+#define DNS_FLAG_QR                 0x8000  // This is a response
+#define DNS_FLAG_RD                 0x0100  // Recursion desired
+#define DNS_RCODE_MASK              0x000F
+#define DNS_RCODE_NOERROR           0
+#define DNS_RCODE_NXDOMAIN          3
+#define DNS_MAX_POINTERS            16      // Give up on a name with more compression pointers than this (loops)
+
+/*** MACROS                   ***/
+#define DNS_GET16(p)                ((uint16_t)(((p)[0]<<8)|(p)[1]))
+#define DNS_GET32(p)                (((uint32_t)(p)[0]<<24)|((uint32_t)(p)[1]<<16)|((uint32_t)(p)[2]<<8)|(p)[3])
+
+/*** TYPE DEFINITIONS         ***/
+typedef enum
+{
+    e_SocketsDNSEntry_Free=0,
+    e_SocketsDNSEntry_Pending,
+    e_SocketsDNSEntry_Found,
+    e_SocketsDNSEntry_NotFound,
+    e_SocketsDNSEntry_Failed,
+    e_SocketsDNSEntryMAX
+} e_SocketsDNSEntryType;
+
+struct SocketsDNSEntry
+{
+    e_SocketsDNSEntryType State;
+    char Name[SOCKETSDNS_MAX_NAME];
+    uint32_t Expires;           // ms (PRIV_SocketsDNS_GetMS()) when the answer is no good
+    uint32_t LastUsed;          // ms, for throwing out the least recently used
+    uint32_t SentTS;            // ms when we last sent the queries
+    int Tries;
+    uint16_t IDv4;              // The query IDs we are waiting for
+    uint16_t IDv6;
+    bool DoneV4;                // We have the answer to the A query
+    bool DoneV6;                // We have the answer to the AAAA query
+    bool HaveV6;                // 'V6' has an address in it
+    bool Fresh;                 // Just found (the first lookup to see it isn't a cache hit)
+    uint32_t TTL;               // The smallest TTL in the answers (seconds)
+    struct sockaddr_in V4;
+    struct sockaddr_in6 V6;
+};
+
+/*** FUNCTION PROTOTYPES      ***/
+static uint32_t PRIV_SocketsDNS_GetMS(void);
+static uint16_t PRIV_SocketsDNS_NewID(void);
+static void PRIV_SocketsDNS_ReadResolvConf(void);
+static bool PRIV_SocketsDNS_ValidName(const char *Name);
+static bool PRIV_SocketsDNS_ReadHosts(struct SocketsDNSEntry *Entry);
+static struct SocketsDNSEntry *PRIV_SocketsDNS_NewEntry(const char *Name);
+static void PRIV_SocketsDNS_SendQueries(struct SocketsDNSEntry *Entry);
+static bool PRIV_SocketsDNS_SendQuery(struct SocketsDNSEntry *Entry,
+        uint16_t ID,uint16_t Type);
+static void PRIV_SocketsDNS_ProcessReply(const uint8_t *Pkt,int Len);
+static int PRIV_SocketsDNS_ReadName(const uint8_t *Pkt,int Len,int Pos,
+        char *Name,int MaxName);
+static void PRIV_SocketsDNS_Finish(struct SocketsDNSEntry *Entry,
+        e_SocketsDNSEntryType State,uint32_t TTL);
+
+/*** VARIABLE DEFINITIONS     ***/
+static struct SocketsDNSEntry m_DNSCache[SOCKETSDNS_CACHE_SIZE];
+static struct sockaddr_in m_DNSServers[SOCKETSDNS_MAX_SERVERS];
+static int m_DNSServerCount;
+static int m_DNSSocket=-1;
+static uint32_t m_DNSRandom;
+static struct SocketsDNSStats m_DNSStats;
+
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsDNS_GetMS
+ *
+ * SYNOPSIS:
+ *    static uint32_t PRIV_SocketsDNS_GetMS(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function gets a ms counter for timeouts and TTLs.
+ *
+ * RETURNS:
+ *    The number of ms from some point (it wraps, compare by subtracting)
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+static uint32_t PRIV_SocketsDNS_GetMS(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint32_t)(ts.tv_sec*1000+ts.tv_nsec/1000000);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsDNS_NewID
+ *
+ * SYNOPSIS:
+ *    static uint16_t PRIV_SocketsDNS_NewID(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function makes a random query ID (xorshift seeded from
+ *    /dev/urandom), so answers are hard to forge.
+ *
+ * RETURNS:
+ *    The new ID
+ *
+ * SEE ALSO:
+ *    SocketsDNS_Init()
+ ******************************************************************************/
+static uint16_t PRIV_SocketsDNS_NewID(void)
+{
+    m_DNSRandom^=m_DNSRandom<<13;
+    m_DNSRandom^=m_DNSRandom>>17;
+    m_DNSRandom^=m_DNSRandom<<5;
+    return (uint16_t)(m_DNSRandom>>8);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsDNS_Init
+ *
+ * SYNOPSIS:
+ *    bool SocketsDNS_Init(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function sets up the resolver.  It reads the nameservers from
+ *    SOCKETSDNS_RESOLV_CONF (using 127.0.0.1 if there aren't any) and opens
+ *    the UDP socket the queries go out on.
+ *
+ *    This is called by SocketsCon_InitSocketConSystem().
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- We couldn't open the socket (only numbers and the hosts file
+ *             will work)
+ *
+ * SEE ALSO:
+ *    SocketsDNS_Shutdown(), SocketsDNS_SetNameServer()
+ ******************************************************************************/
+bool SocketsDNS_Init(void)
+{
+    int fd;
+    int flags;
+
+    memset(m_DNSCache,0x00,sizeof(m_DNSCache));
+    memset(&m_DNSStats,0x00,sizeof(m_DNSStats));
+
+    m_DNSRandom=0;
+    fd=open("/dev/urandom",O_RDONLY);
+    if(fd>=0)
+    {
+        if(read(fd,&m_DNSRandom,sizeof(m_DNSRandom))!=sizeof(m_DNSRandom))
+            m_DNSRandom=0;
+        close(fd);
+    }
+    if(m_DNSRandom==0)
+        m_DNSRandom=(uint32_t)time(NULL)^((uint32_t)getpid()<<16)^1;
+
+    PRIV_SocketsDNS_ReadResolvConf();
+
+    m_DNSSocket=socket(AF_INET,SOCK_DGRAM,0);
+    if(m_DNSSocket<0)
+        return false;
+
+    flags=fcntl(m_DNSSocket,F_GETFL,0);
+    if(flags<0)
+        flags=0;
+    fcntl(m_DNSSocket,F_SETFL,flags|O_NONBLOCK);
+    fcntl(m_DNSSocket,F_SETFD,FD_CLOEXEC);
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsDNS_Shutdown
+ *
+ * SYNOPSIS:
+ *    void SocketsDNS_Shutdown(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function closes the resolver's socket.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    SocketsDNS_Init()
+ ******************************************************************************/
+void SocketsDNS_Shutdown(void)
+{
+    if(m_DNSSocket>=0)
+        close(m_DNSSocket);
+    m_DNSSocket=-1;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsDNS_SetNameServer
+ *
+ * SYNOPSIS:
+ *    bool SocketsDNS_SetNameServer(const char *Address,int Port);
+ *
+ * PARAMETERS:
+ *    Address [I] -- The IPv4 address of the nameserver
+ *    Port [I] -- The UDP port it answers on (normally 53)
+ *
+ * FUNCTION:
+ *    This function uses one nameserver in place of the ones from
+ *    resolv.conf (for example a stand in nameserver when testing) and
+ *    forgets everything in the cache.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- 'Address' isn't an IPv4 address
+ *
+ * SEE ALSO:
+ *    SocketsDNS_Init()
+ ******************************************************************************/
+bool SocketsDNS_SetNameServer(const char *Address,int Port)
+{
+    struct sockaddr_in Server;
+
+    memset(&Server,0x00,sizeof(Server));
+    Server.sin_family=AF_INET;
+    Server.sin_port=htons(Port);
+    if(inet_pton(AF_INET,Address,&Server.sin_addr)!=1)
+        return false;
+
+    m_DNSServers[0]=Server;
+    m_DNSServerCount=1;
+    memset(m_DNSCache,0x00,sizeof(m_DNSCache));
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsDNS_GetStats
+ *
+ * SYNOPSIS:
+ *    void SocketsDNS_GetStats(struct SocketsDNSStats *Stats);
+ *
+ * PARAMETERS:
+ *    Stats [O] -- The counters
+ *
+ * FUNCTION:
+ *    This function gets the resolver counters (cache hits and misses etc).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    SocketsDNS_Lookup()
+ ******************************************************************************/
+void SocketsDNS_GetStats(struct SocketsDNSStats *Stats)
+{
+    *Stats=m_DNSStats;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsDNS_Lookup
+ *
+ * SYNOPSIS:
+ *    e_SocketsDNSResultType SocketsDNS_Lookup(const char *Name,
+ *              struct sockaddr_storage *Addr,socklen_t *AddrLen);
+ *
+ * PARAMETERS:
+ *    Name [I] -- The host name (or numeric address) to look up
+ *    Addr [O] -- The address (a sockaddr_in or sockaddr_in6 with the port
+ *                set to 0)
+ *    AddrLen [O] -- The size of the address in 'Addr'
+ *
+ * FUNCTION:
+ *    This function looks up a host name without waiting.  If the answer
+ *    isn't in the cache the nameserver is asked and this returns
+ *    e_SocketsDNS_Pending.  Keep calling it (each time around your main
+ *    loop) until it returns something else.
+ *
+ * RETURNS:
+ *    e_SocketsDNS_Found -- 'Addr' has the address
+ *    e_SocketsDNS_Pending -- Waiting for the nameserver
+ *    e_SocketsDNS_NotFound -- The name doesn't have an address
+ *    e_SocketsDNS_Failed -- No nameserver answered or the name is too long
+ *
+ * SEE ALSO:
+ *    SocketsDNS_Tick(), SocketsCon_Connect()
+ ******************************************************************************/
+e_SocketsDNSResultType SocketsDNS_Lookup(const char *Name,
+        struct sockaddr_storage *Addr,socklen_t *AddrLen)
+{
+    struct SocketsDNSEntry *Entry;
+    struct sockaddr_in *V4;
+    struct sockaddr_in6 *V6;
+    uint32_t Now;
+    bool WasPending;
+    int r;
+
+    memset(Addr,0x00,sizeof(*Addr));
+
+    /* Numbers don't need looking up */
+    V4=(struct sockaddr_in *)Addr;
+    if(inet_pton(AF_INET,Name,&V4->sin_addr)==1)
+    {
+        V4->sin_family=AF_INET;
+        *AddrLen=sizeof(struct sockaddr_in);
+        return e_SocketsDNS_Found;
+    }
+    V6=(struct sockaddr_in6 *)Addr;
+    if(inet_pton(AF_INET6,Name,&V6->sin6_addr)==1)
+    {
+        V6->sin6_family=AF_INET6;
+        *AddrLen=sizeof(struct sockaddr_in6);
+        return e_SocketsDNS_Found;
+    }
+
+    if(!PRIV_SocketsDNS_ValidName(Name))
+        return e_SocketsDNS_Failed;
+
+    SocketsDNS_Tick();
+
+    Now=PRIV_SocketsDNS_GetMS();
+    Entry=NULL;
+    for(r=0;r<SOCKETSDNS_CACHE_SIZE;r++)
+    {
+        if(m_DNSCache[r].State!=e_SocketsDNSEntry_Free &&
+                strcasecmp(m_DNSCache[r].Name,Name)==0)
+        {
+            Entry=&m_DNSCache[r];
+            break;
+        }
+    }
+
+    /* Expired answers are looked up again */
+    if(Entry!=NULL && Entry->State!=e_SocketsDNSEntry_Pending &&
+            (int32_t)(Entry->Expires-Now)<=0)
+    {
+        Entry->State=e_SocketsDNSEntry_Free;
+        Entry=NULL;
+    }
+
+    WasPending=Entry!=NULL && Entry->State==e_SocketsDNSEntry_Pending;
+    if(Entry==NULL)
+    {
+        m_DNSStats.Lookups++;
+        m_DNSStats.Misses++;
+        Entry=PRIV_SocketsDNS_NewEntry(Name);
+        if(Entry==NULL)
+        {
+            /* Everything in the cache is being looked up, try later */
+            return e_SocketsDNS_Pending;
+        }
+
+        if(!PRIV_SocketsDNS_ReadHosts(Entry))
+            PRIV_SocketsDNS_SendQueries(Entry);
+    }
+    else if(!WasPending && !Entry->Fresh)
+    {
+        m_DNSStats.Lookups++;
+        if(Entry->State==e_SocketsDNSEntry_Found)
+            m_DNSStats.Hits++;
+        else
+            m_DNSStats.NegativeHits++;
+    }
+    Entry->LastUsed=Now;
+
+    switch(Entry->State)
+    {
+        case e_SocketsDNSEntry_Found:
+            Entry->Fresh=false;
+            if(Entry->V4.sin_family==AF_INET)
+            {
+                memcpy(Addr,&Entry->V4,sizeof(Entry->V4));
+                *AddrLen=sizeof(Entry->V4);
+            }
+            else
+            {
+                memcpy(Addr,&Entry->V6,sizeof(Entry->V6));
+                *AddrLen=sizeof(Entry->V6);
+            }
+            return e_SocketsDNS_Found;
+        case e_SocketsDNSEntry_NotFound:
+            Entry->Fresh=false;
+            return e_SocketsDNS_NotFound;
+        case e_SocketsDNSEntry_Failed:
+            Entry->Fresh=false;
+            return e_SocketsDNS_Failed;
+        case e_SocketsDNSEntry_Pending:
+        case e_SocketsDNSEntry_Free:
+        case e_SocketsDNSEntryMAX:
+        default:
+        break;
+    }
+    return e_SocketsDNS_Pending;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    SocketsDNS_Tick
+ *
+ * SYNOPSIS:
+ *    void SocketsDNS_Tick(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function reads any answers that have come in and asks again for
+ *    names that haven't been answered in SOCKETSDNS_TIMEOUT.  It is called
+ *    by SocketsDNS_Lookup() so you only need to call it if you want
+ *    answers to come in without looking anything up.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    SocketsDNS_Lookup()
+ ******************************************************************************/
+void SocketsDNS_Tick(void)
+{
+    uint8_t Pkt[DNS_PACKET_SIZE];
+    struct sockaddr_in From;
+    socklen_t FromLen;
+    struct SocketsDNSEntry *Entry;
+    uint32_t Now;
+    int Len;
+    int r;
+
+    if(m_DNSSocket<0)
+        return;
+
+    for(;;)
+    {
+        FromLen=sizeof(From);
+        Len=recvfrom(m_DNSSocket,Pkt,sizeof(Pkt),0,(struct sockaddr *)&From,
+                &FromLen);
+        if(Len<0)
+            break;
+
+        /* Only take answers from the nameservers we asked */
+        for(r=0;r<m_DNSServerCount;r++)
+        {
+            if(From.sin_addr.s_addr==m_DNSServers[r].sin_addr.s_addr &&
+                    From.sin_port==m_DNSServers[r].sin_port)
+            {
+                break;
+            }
+        }
+        if(r<m_DNSServerCount)
+            PRIV_SocketsDNS_ProcessReply(Pkt,Len);
+    }
+
+    Now=PRIV_SocketsDNS_GetMS();
+    for(r=0;r<SOCKETSDNS_CACHE_SIZE;r++)
+    {
+        Entry=&m_DNSCache[r];
+        if(Entry->State!=e_SocketsDNSEntry_Pending ||
+                Now-Entry->SentTS<SOCKETSDNS_TIMEOUT)
+        {
+            continue;
+        }
+
+        if(Entry->Tries>=SOCKETSDNS_TRIES)
+        {
+            /* Nobody answered.  If we got an IPv6 address use it. */
+            if(Entry->HaveV6)
+                PRIV_SocketsDNS_Finish(Entry,e_SocketsDNSEntry_Found,
+                        Entry->TTL);
+            else
+                PRIV_SocketsDNS_Finish(Entry,e_SocketsDNSEntry_Failed,
+                        SOCKETSDNS_FAILED_TTL);
+            continue;
+        }
+
+        m_DNSStats.Retries++;
+        PRIV_SocketsDNS_SendQueries(Entry);
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsDNS_ReadResolvConf
+ *
+ * SYNOPSIS:
+ *    static void PRIV_SocketsDNS_ReadResolvConf(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function reads the IPv4 "nameserver" lines from
+ *    SOCKETSDNS_RESOLV_CONF.  If there aren't any we use 127.0.0.1 (like
+ *    the C library does).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    SocketsDNS_Init()
+ ******************************************************************************/
+static void PRIV_SocketsDNS_ReadResolvConf(void)
+{
+    char Line[256];
+    char Address[64];
+    FILE *in;
+
+    m_DNSServerCount=0;
+    in=fopen(SOCKETSDNS_RESOLV_CONF,"r");
+    if(in!=NULL)
+    {
+        while(m_DNSServerCount<SOCKETSDNS_MAX_SERVERS &&
+                fgets(Line,sizeof(Line),in)!=NULL)
+        {
+            if(sscanf(Line,"nameserver %63s",Address)!=1)
+                continue;
+            memset(&m_DNSServers[m_DNSServerCount],0x00,
+                    sizeof(m_DNSServers[0]));
+            m_DNSServers[m_DNSServerCount].sin_family=AF_INET;
+            m_DNSServers[m_DNSServerCount].sin_port=htons(DNS_PORT);
+            if(inet_pton(AF_INET,Address,
+                    &m_DNSServers[m_DNSServerCount].sin_addr)==1)
+            {
+                m_DNSServerCount++;
+            }
+        }
+        fclose(in);
+    }
+
+    if(m_DNSServerCount==0)
+    {
+        memset(&m_DNSServers[0],0x00,sizeof(m_DNSServers[0]));
+        m_DNSServers[0].sin_family=AF_INET;
+        m_DNSServers[0].sin_port=htons(DNS_PORT);
+        m_DNSServers[0].sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        m_DNSServerCount=1;
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsDNS_ValidName
+ *
+ * SYNOPSIS:
+ *    static bool PRIV_SocketsDNS_ValidName(const char *Name);
+ *
+ * PARAMETERS:
+ *    Name [I] -- The host name
+ *
+ * FUNCTION:
+ *    This function checks that a name can be sent to a nameserver.  It has
+ *    to fit in SOCKETSDNS_MAX_NAME and be labels of 1 to 63 chars with dots
+ *    between them (a dot at the end is ok).
+ *
+ * RETURNS:
+ *    true -- The name is ok
+ *    false -- It can't be looked up
+ *
+ * SEE ALSO:
+ *    SocketsDNS_Lookup()
+ ******************************************************************************/
+static bool PRIV_SocketsDNS_ValidName(const char *Name)
+{
+    const char *Pos;
+    int LabelLen;
+
+    if(strlen(Name)>=SOCKETSDNS_MAX_NAME || *Name==0)
+        return false;
+
+    LabelLen=0;
+    for(Pos=Name;*Pos!=0;Pos++)
+    {
+        if(*Pos=='.')
+        {
+            if(LabelLen==0)
+                return false;
+            LabelLen=0;
+        }
+        else if(++LabelLen>63)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsDNS_ReadHosts
+ *
+ * SYNOPSIS:
+ *    static bool PRIV_SocketsDNS_ReadHosts(struct SocketsDNSEntry *Entry);
+ *
+ * PARAMETERS:
+ *    Entry [I/O] -- The cache entry for the name to look for
+ *
+ * FUNCTION:
+ *    This function looks for a name in SOCKETSDNS_HOSTS_FILE (this is how
+ *    "localhost" and names set up by hand are found).  It's a small local
+ *    file so reading it doesn't hold things up like a nameserver can.
+ *
+ * RETURNS:
+ *    true -- Found it ('Entry' is filled in)
+ *    false -- It's not in there
+ *
+ * SEE ALSO:
+ *    SocketsDNS_Lookup()
+ ******************************************************************************/
+static bool PRIV_SocketsDNS_ReadHosts(struct SocketsDNSEntry *Entry)
+{
+    char Line[256];
+    char *Pos;
+    char *Address;
+    char *Host;
+    struct in_addr V4;
+    struct in6_addr V6;
+    FILE *in;
+
+    in=fopen(SOCKETSDNS_HOSTS_FILE,"r");
+    if(in==NULL)
+        return false;
+
+    while(fgets(Line,sizeof(Line),in)!=NULL)
+    {
+        Pos=strchr(Line,'#');
+        if(Pos!=NULL)
+            *Pos=0;
+
+        Address=strtok_r(Line," \t\r\n",&Pos);
+        if(Address==NULL)
+            continue;
+        while((Host=strtok_r(NULL," \t\r\n",&Pos))!=NULL)
+        {
+            if(strcasecmp(Host,Entry->Name)!=0)
+                continue;
+
+            if(inet_pton(AF_INET,Address,&V4)==1)
+            {
+                Entry->V4.sin_family=AF_INET;
+                Entry->V4.sin_addr=V4;
+            }
+            else if(!Entry->HaveV6 && inet_pton(AF_INET6,Address,&V6)==1)
+            {
+                Entry->V6.sin6_family=AF_INET6;
+                Entry->V6.sin6_addr=V6;
+                Entry->HaveV6=true;
+            }
+            break;
+        }
+        if(Entry->V4.sin_family==AF_INET)
+            break;
+    }
+    fclose(in);
+
+    if(Entry->V4.sin_family!=AF_INET && !Entry->HaveV6)
+        return false;
+
+    PRIV_SocketsDNS_Finish(Entry,e_SocketsDNSEntry_Found,SOCKETSDNS_HOSTS_TTL);
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsDNS_NewEntry
+ *
+ * SYNOPSIS:
+ *    static struct SocketsDNSEntry *PRIV_SocketsDNS_NewEntry(
+ *              const char *Name);
+ *
+ * PARAMETERS:
+ *    Name [I] -- The name the entry is for
+ *
+ * FUNCTION:
+ *    This function gets a cache entry for a new name.  A free one is used
+ *    if there is one, otherwise the least recently used answer is thrown
+ *    out.
+ *
+ * RETURNS:
+ *    The entry (set to pending) or NULL if every entry is being looked up.
+ *
+ * SEE ALSO:
+ *    SocketsDNS_Lookup()
+ ******************************************************************************/
+static struct SocketsDNSEntry *PRIV_SocketsDNS_NewEntry(const char *Name)
+{
+    struct SocketsDNSEntry *Entry;
+    uint32_t Now;
+    int r;
+
+    Now=PRIV_SocketsDNS_GetMS();
+    Entry=NULL;
+    for(r=0;r<SOCKETSDNS_CACHE_SIZE;r++)
+    {
+        if(m_DNSCache[r].State==e_SocketsDNSEntry_Free)
+        {
+            Entry=&m_DNSCache[r];
+            break;
+        }
+        if(m_DNSCache[r].State==e_SocketsDNSEntry_Pending)
+            continue;
+        if(Entry==NULL || Now-m_DNSCache[r].LastUsed>Now-Entry->LastUsed)
+            Entry=&m_DNSCache[r];
+    }
+    if(Entry==NULL)
+        return NULL;
+
+    memset(Entry,0x00,sizeof(*Entry));
+    strcpy(Entry->Name,Name);
+    Entry->State=e_SocketsDNSEntry_Pending;
+    Entry->TTL=SOCKETSDNS_MAX_TTL;
+    Entry->LastUsed=Now;
+
+    return Entry;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsDNS_SendQueries
+ *
+ * SYNOPSIS:
+ *    static void PRIV_SocketsDNS_SendQueries(struct SocketsDNSEntry *Entry);
+ *
+ * PARAMETERS:
+ *    Entry [I/O] -- The name to ask about
+ *
+ * FUNCTION:
+ *    This function sends the A and AAAA queries that haven't been answered
+ *    yet to the next nameserver (each try goes to the next one in the
+ *    list).  New IDs are used each time.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    PRIV_SocketsDNS_SendQuery()
+ ******************************************************************************/
+static void PRIV_SocketsDNS_SendQueries(struct SocketsDNSEntry *Entry)
+{
+    bool Sent;
+
+    Sent=false;
+    if(!Entry->DoneV4)
+    {
+        Entry->IDv4=PRIV_SocketsDNS_NewID();
+        Sent|=PRIV_SocketsDNS_SendQuery(Entry,Entry->IDv4,DNS_TYPE_A);
+    }
+    if(!Entry->DoneV6)
+    {
+        Entry->IDv6=PRIV_SocketsDNS_NewID();
+        if(Entry->IDv6==Entry->IDv4)
+            Entry->IDv6++;
+        Sent|=PRIV_SocketsDNS_SendQuery(Entry,Entry->IDv6,DNS_TYPE_AAAA);
+    }
+
+    Entry->Tries++;
+    Entry->SentTS=PRIV_SocketsDNS_GetMS();
+
+    if(!Sent && Entry->Tries>=SOCKETSDNS_TRIES)
+        PRIV_SocketsDNS_Finish(Entry,e_SocketsDNSEntry_Failed,
+                SOCKETSDNS_FAILED_TTL);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsDNS_SendQuery
+ *
+ * SYNOPSIS:
+ *    static bool PRIV_SocketsDNS_SendQuery(struct SocketsDNSEntry *Entry,
+ *              uint16_t ID,uint16_t Type);
+ *
+ * PARAMETERS:
+ *    Entry [I] -- The name to ask about
+ *    ID [I] -- The query ID
+ *    Type [I] -- The record type (DNS_TYPE_A or DNS_TYPE_AAAA)
+ *
+ * FUNCTION:
+ *    This function builds a query and sends it to the nameserver for this
+ *    try.
+ *
+ * RETURNS:
+ *    true -- It was sent
+ *    false -- The name isn't a valid DNS name or the send failed
+ *
+ * SEE ALSO:
+ *    PRIV_SocketsDNS_SendQueries()
+ ******************************************************************************/
+static bool PRIV_SocketsDNS_SendQuery(struct SocketsDNSEntry *Entry,
+        uint16_t ID,uint16_t Type)
+{
+    uint8_t Pkt[DNS_HEADER_SIZE+SOCKETSDNS_MAX_NAME+1+4];
+    const char *Label;
+    const char *Dot;
+    struct sockaddr_in *Server;
+    int Pos;
+    int Len;
+
+    if(m_DNSSocket<0)
+        return false;
+
+    memset(Pkt,0x00,DNS_HEADER_SIZE);
+    Pkt[0]=ID>>8;
+    Pkt[1]=ID&0xFF;
+    Pkt[2]=DNS_FLAG_RD>>8;
+    Pkt[5]=1;                   // 1 question
+
+    /* "www.example.com" -> 3www7example3com0 */
+    Pos=DNS_HEADER_SIZE;
+    for(Label=Entry->Name;*Label!=0;Label=Dot+1)
+    {
+        Dot=strchr(Label,'.');
+        if(Dot==NULL)
+            Dot=Label+strlen(Label);
+        Len=Dot-Label;
+        if(Len<1 || Len>63)
+            return false;
+        Pkt[Pos++]=Len;
+        memcpy(&Pkt[Pos],Label,Len);
+        Pos+=Len;
+        if(*Dot==0)
+            break;
+    }
+    Pkt[Pos++]=0;
+    Pkt[Pos++]=Type>>8;
+    Pkt[Pos++]=Type&0xFF;
+    Pkt[Pos++]=DNS_CLASS_IN>>8;
+    Pkt[Pos++]=DNS_CLASS_IN&0xFF;
+
+    Server=&m_DNSServers[Entry->Tries%m_DNSServerCount];
+    m_DNSStats.Queries++;
+    if(sendto(m_DNSSocket,Pkt,Pos,0,(struct sockaddr *)Server,
+            sizeof(*Server))!=Pos)
+    {
+        return false;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsDNS_ReadName
+ *
+ * SYNOPSIS:
+ *    static int PRIV_SocketsDNS_ReadName(const uint8_t *Pkt,int Len,int Pos,
+ *              char *Name,int MaxName);
+ *
+ * PARAMETERS:
+ *    Pkt [I] -- The DNS message
+ *    Len [I] -- The size of the message
+ *    Pos [I] -- Where the name starts
+ *    Name [O] -- The name in dotted form (NULL to just skip it)
+ *    MaxName [I] -- The size of 'Name'
+ *
+ * FUNCTION:
+ *    This function reads a (maybe compressed) name out of a DNS message.
+ *    Names too long for 'Name' are cut off (they won't match ours).
+ *
+ * RETURNS:
+ *    Where the data after the name starts or -1 if the name is bad.
+ *
+ * SEE ALSO:
+ *    PRIV_SocketsDNS_ProcessReply()
+ ******************************************************************************/
+static int PRIV_SocketsDNS_ReadName(const uint8_t *Pkt,int Len,int Pos,
+        char *Name,int MaxName)
+{
+    int End;
+    int Out;
+    int Pointers;
+    int LabelLen;
+
+    End=-1;
+    Out=0;
+    Pointers=0;
+    for(;;)
+    {
+        if(Pos>=Len)
+            return -1;
+        LabelLen=Pkt[Pos];
+        if(LabelLen==0)
+        {
+            Pos++;
+            break;
+        }
+        if((LabelLen&0xC0)==0xC0)
+        {
+            /* Compression pointer */
+            if(Pos+1>=Len || ++Pointers>DNS_MAX_POINTERS)
+                return -1;
+            if(End<0)
+                End=Pos+2;
+            Pos=((LabelLen&0x3F)<<8)|Pkt[Pos+1];
+            continue;
+        }
+        if((LabelLen&0xC0)!=0 || Pos+1+LabelLen>Len)
+            return -1;
+
+        if(Name!=NULL)
+        {
+            if(Out>0 && Out<MaxName-1)
+                Name[Out++]='.';
+            if(Out+LabelLen<MaxName-1)
+            {
+                memcpy(&Name[Out],&Pkt[Pos+1],LabelLen);
+                Out+=LabelLen;
+            }
+            else
+            {
+                Out=MaxName-1;
+            }
+        }
+        Pos+=1+LabelLen;
+    }
+
+    if(Name!=NULL)
+        Name[Out]=0;
+
+    return End<0?Pos:End;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsDNS_ProcessReply
+ *
+ * SYNOPSIS:
+ *    static void PRIV_SocketsDNS_ProcessReply(const uint8_t *Pkt,int Len);
+ *
+ * PARAMETERS:
+ *    Pkt [I] -- The message from the nameserver
+ *    Len [I] -- The size of the message
+ *
+ * FUNCTION:
+ *    This function handles an answer from a nameserver.  It has to have
+ *    the ID of a query we are waiting for and the same question.  The
+ *    first address (A or AAAA, following CNAMEs) is taken and the smallest
+ *    TTL of the answer records is used.  A name that doesn't exist (or has
+ *    no address) uses the negative TTL from the SOA (RFC 2308).  Server
+ *    errors move on to the next nameserver.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    SocketsDNS_Tick()
+ ******************************************************************************/
+static void PRIV_SocketsDNS_ProcessReply(const uint8_t *Pkt,int Len)
+{
+    struct SocketsDNSEntry *Entry;
+    char QName[SOCKETSDNS_MAX_NAME+1];
+    uint16_t ID;
+    uint16_t Flags;
+    uint16_t QType;
+    uint16_t Type;
+    uint16_t Class;
+    uint16_t RDLen;
+    uint32_t TTL;
+    uint32_t NegTTL;
+    int Answers;
+    int Authority;
+    bool IsV6;
+    bool GotAddr;
+    int Pos;
+    int r;
+
+    if(Len<DNS_HEADER_SIZE)
+        return;
+
+    ID=DNS_GET16(&Pkt[0]);
+    Flags=DNS_GET16(&Pkt[2]);
+    if((Flags&DNS_FLAG_QR)==0 || DNS_GET16(&Pkt[4])!=1)
+        return;
+
+    Entry=NULL;
+    IsV6=false;
+    for(r=0;r<SOCKETSDNS_CACHE_SIZE;r++)
+    {
+        if(m_DNSCache[r].State!=e_SocketsDNSEntry_Pending)
+            continue;
+        if(!m_DNSCache[r].DoneV4 && m_DNSCache[r].IDv4==ID)
+        {
+            Entry=&m_DNSCache[r];
+            break;
+        }
+        if(!m_DNSCache[r].DoneV6 && m_DNSCache[r].IDv6==ID)
+        {
+            Entry=&m_DNSCache[r];
+            IsV6=true;
+            break;
+        }
+    }
+    if(Entry==NULL)
+        return;
+
+    /* The question has to be the one we asked */
+    Pos=PRIV_SocketsDNS_ReadName(Pkt,Len,DNS_HEADER_SIZE,QName,sizeof(QName));
+    if(Pos<0 || Pos+4>Len)
+        return;
+    r=strlen(Entry->Name);
+    if(r>0 && Entry->Name[r-1]=='.')
+        r--;
+    QType=DNS_GET16(&Pkt[Pos]);
+    if(strncasecmp(QName,Entry->Name,r)!=0 || QName[r]!=0 ||
+            QType!=(IsV6?DNS_TYPE_AAAA:DNS_TYPE_A))
+    {
+        return;
+    }
+    Pos+=4;
+
+    switch(Flags&DNS_RCODE_MASK)
+    {
+        case DNS_RCODE_NOERROR:
+        case DNS_RCODE_NXDOMAIN:
+        break;
+        default:
+            /* SERVFAIL, REFUSED, ... ask the next nameserver */
+            if(Entry->Tries<SOCKETSDNS_TRIES)
+                PRIV_SocketsDNS_SendQueries(Entry);
+            else
+                PRIV_SocketsDNS_Finish(Entry,e_SocketsDNSEntry_Failed,
+                        SOCKETSDNS_FAILED_TTL);
+        return;
+    }
+
+    if(IsV6)
+        Entry->DoneV6=true;
+    else
+        Entry->DoneV4=true;
+
+    /* Answers */
+    Answers=DNS_GET16(&Pkt[6]);
+    Authority=DNS_GET16(&Pkt[8]);
+    GotAddr=false;
+    NegTTL=SOCKETSDNS_NEGATIVE_TTL;
+    for(r=0;r<Answers+Authority;r++)
+    {
+        Pos=PRIV_SocketsDNS_ReadName(Pkt,Len,Pos,NULL,0);
+        if(Pos<0 || Pos+10>Len)
+            break;
+        Type=DNS_GET16(&Pkt[Pos]);
+        Class=DNS_GET16(&Pkt[Pos+2]);
+        TTL=DNS_GET32(&Pkt[Pos+4]);
+        RDLen=DNS_GET16(&Pkt[Pos+8]);
+        Pos+=10;
+        if(Pos+RDLen>Len)
+            break;
+
+        if(r<Answers)
+        {
+            if(Class!=DNS_CLASS_IN)
+            {
+                /* Not for us */
+            }
+            else if(Type==DNS_TYPE_A && RDLen==4 && !GotAddr)
+            {
+                Entry->V4.sin_family=AF_INET;
+                memcpy(&Entry->V4.sin_addr,&Pkt[Pos],4);
+                GotAddr=true;
+                if(TTL<Entry->TTL)
+                    Entry->TTL=TTL;
+            }
+            else if(Type==DNS_TYPE_AAAA && RDLen==16 && !GotAddr)
+            {
+                Entry->V6.sin6_family=AF_INET6;
+                memcpy(&Entry->V6.sin6_addr,&Pkt[Pos],16);
+                Entry->HaveV6=true;
+                GotAddr=true;
+                if(TTL<Entry->TTL)
+                    Entry->TTL=TTL;
+            }
+            else if(Type==DNS_TYPE_CNAME)
+            {
+                if(TTL<Entry->TTL)
+                    Entry->TTL=TTL;
+            }
+        }
+        else if(Type==DNS_TYPE_SOA)
+        {
+            /* Negative TTL is min(SOA TTL, SOA MINIMUM) (RFC 2308 5) */
+            if(TTL<NegTTL)
+                NegTTL=TTL;
+            RDLen+=Pos;
+            Pos=PRIV_SocketsDNS_ReadName(Pkt,Len,Pos,NULL,0);
+            if(Pos>=0)
+                Pos=PRIV_SocketsDNS_ReadName(Pkt,Len,Pos,NULL,0);
+            if(Pos>=0 && Pos+20<=RDLen && DNS_GET32(&Pkt[Pos+16])<NegTTL)
+                NegTTL=DNS_GET32(&Pkt[Pos+16]);
+            Pos=RDLen;
+            continue;
+        }
+        Pos+=RDLen;
+    }
+
+    if((Flags&DNS_RCODE_MASK)==DNS_RCODE_NXDOMAIN)
+    {
+        PRIV_SocketsDNS_Finish(Entry,e_SocketsDNSEntry_NotFound,NegTTL);
+        return;
+    }
+
+    /* IPv4 wins.  IPv6 is only used once we know there's no IPv4. */
+    if(Entry->V4.sin_family==AF_INET)
+    {
+        PRIV_SocketsDNS_Finish(Entry,e_SocketsDNSEntry_Found,Entry->TTL);
+    }
+    else if(Entry->DoneV4 && Entry->DoneV6)
+    {
+        if(Entry->HaveV6)
+            PRIV_SocketsDNS_Finish(Entry,e_SocketsDNSEntry_Found,Entry->TTL);
+        else
+            PRIV_SocketsDNS_Finish(Entry,e_SocketsDNSEntry_NotFound,NegTTL);
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    PRIV_SocketsDNS_Finish
+ *
+ * SYNOPSIS:
+ *    static void PRIV_SocketsDNS_Finish(struct SocketsDNSEntry *Entry,
+ *              e_SocketsDNSEntryType State,uint32_t TTL);
+ *
+ * PARAMETERS:
+ *    Entry [I/O] -- The cache entry
+ *    State [I] -- Found, NotFound, or Failed
+ *    TTL [I] -- How many seconds to keep the answer
+ *
+ * FUNCTION:
+ *    This function stores the answer for a name.  Found answers are kept
+ *    for between SOCKETSDNS_MIN_TTL and SOCKETSDNS_MAX_TTL seconds.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    PRIV_SocketsDNS_ProcessReply()
+ ******************************************************************************/
+static void PRIV_SocketsDNS_Finish(struct SocketsDNSEntry *Entry,
+        e_SocketsDNSEntryType State,uint32_t TTL)
+{
+    if(TTL<SOCKETSDNS_MIN_TTL)
+        TTL=SOCKETSDNS_MIN_TTL;
+    if(TTL>SOCKETSDNS_MAX_TTL)
+        TTL=SOCKETSDNS_MAX_TTL;
+
+    if(State==e_SocketsDNSEntry_Failed)
+        m_DNSStats.Failed++;
+
+    Entry->State=State;
+    Entry->Fresh=true;
+    Entry->Expires=PRIV_SocketsDNS_GetMS()+TTL*1000;
+}
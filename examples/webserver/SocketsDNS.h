@@ -0,0 +1,91 @@
+/*******************************************************************************
+ * FILENAME: SocketsDNS.h
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This has the non-blocking host name lookup used by SocketsCon_Connect()
+ *    in it (SocketsDNS.c).
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ *******************************************************************************/
+#ifndef __SOCKETSDNS_H_
+#define __SOCKETSDNS_H_
+
+/***  HEADER FILES TO INCLUDE          ***/
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/***  DEFINES                          ***/
+#define SOCKETSDNS_MAX_NAME                 64      // The longest host name we can look up (including the \0)
+#define SOCKETSDNS_CACHE_SIZE               16      // The number of names we remember (found, not found, and being looked up)
+#define SOCKETSDNS_MAX_SERVERS              3       // The number of nameservers we use from resolv.conf
+#define SOCKETSDNS_TIMEOUT                  1000    // How long (ms) we wait for an answer before asking again (the next nameserver)
+#define SOCKETSDNS_TRIES                    4       // How many times we ask before giving up on a name
+#define SOCKETSDNS_MIN_TTL                  5       // The shortest (seconds) we keep an answer, whatever its TTL says
+#define SOCKETSDNS_MAX_TTL                  3600    // The longest (seconds) we keep an answer, whatever its TTL says
+#define SOCKETSDNS_NEGATIVE_TTL             60      // The longest (seconds) we remember that a name doesn't exist (less if the zone's SOA says so)
+#define SOCKETSDNS_FAILED_TTL               5       // How long (seconds) we remember that no nameserver answered (so we don't keep asking)
+#define SOCKETSDNS_HOSTS_TTL                60      // How long (seconds) we keep a name from the hosts file
+#define SOCKETSDNS_RESOLV_CONF              "/etc/resolv.conf"
+#define SOCKETSDNS_HOSTS_FILE               "/etc/hosts"
+
+/***  MACROS                           ***/
+
+/***  TYPE DEFINITIONS                 ***/
+typedef enum
+{
+    e_SocketsDNS_Found,         // The address is filled in
+    e_SocketsDNS_Pending,       // Still asking, call again
+    e_SocketsDNS_NotFound,      // The name doesn't exist (or has no address)
+    e_SocketsDNS_Failed,        // No nameserver answered (or the name is bad)
+    e_SocketsDNSMAX
+} e_SocketsDNSResultType;
+
+struct SocketsDNSStats
+{
+    uint32_t Lookups;       // Names asked for (not counting asking again while pending)
+    uint32_t Hits;          // Answered from the cache
+    uint32_t NegativeHits;  // Answered "not found" from the cache
+    uint32_t Misses;        // Had to ask a nameserver (or read the hosts file)
+    uint32_t Queries;       // Packets sent to nameservers
+    uint32_t Retries;       // Packets sent again because there was no answer
+    uint32_t Failed;        // Names no nameserver answered for
+};
+
+/***  CLASS DEFINITIONS                ***/
+
+/***  GLOBAL VARIABLE DEFINITIONS      ***/
+
+/***  EXTERNAL FUNCTION PROTOTYPES     ***/
+bool SocketsDNS_Init(void);
+void SocketsDNS_Shutdown(void);
+bool SocketsDNS_SetNameServer(const char *Address,int Port);
+e_SocketsDNSResultType SocketsDNS_Lookup(const char *Name,
+        struct sockaddr_storage *Addr,socklen_t *AddrLen);
+void SocketsDNS_Tick(void);
+void SocketsDNS_GetStats(struct SocketsDNSStats *Stats);
+
+#endif
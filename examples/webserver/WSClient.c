@@ -0,0 +1,1263 @@
+/*******************************************************************************
+ * FILENAME: WSClient.c
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This file has an outbound HTTP/1.1 client that runs in the same loop as
+ *    the web server (call WSClient_Tick() along with WS_Tick()).  Nothing in
+ *    here waits on the network.
+ *
+ *    WSClient_Request() copies the request into a free request slot and
+ *    returns.  WSClient_Tick() then puts it on a connection to that
+ *    host:port.  Connections are kept open after a response (unless the
+ *    server says not to) and reused for the next request to the same
+ *    host:port, up to WS_OPT_CLIENT_PER_HOST connections per host and
+ *    WS_OPT_CLIENT_CONNECTIONS in all.  Idempotent requests (GET, HEAD, ...)
+ *    are pipelined, up to WS_OPT_CLIENT_PIPELINE on a connection, once the
+ *    server has shown it keeps connections open.
+ *
+ *    The response is streamed to the request's callback as it comes in: the
+ *    status line, each header line, the body in whatever size pieces the
+ *    socket gave us (chunked bodies are decoded), and then done (or an
+ *    error).  Nothing is buffered beyond one header line.
+ *
+ *    If a kept alive connection is closed by the server before it answers
+ *    (it timed out the connection as we sent), idempotent requests are
+ *    sent again once on a new connection.
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ ******************************************************************************/
+
+/*** HEADER FILES TO INCLUDE  ***/
+#include "WSClient.h"
+#include "WSMetrics.h"
+#include "WebServer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*** DEFINES                  ***/
+#define WSC_MAX_HOST                64      // The longest host name we keep
+#define WSC_READ_SIZE               512     // How much we read from a connection at a time
+#define WSC_NO_CON                  -1      // WSClientReq.Con for requests waiting for a connection
+
+/*** MACROS                   ***/
+
+/*** TYPE DEFINITIONS         ***/
+typedef enum
+{
+    e_WSCParse_Status,
+    e_WSCParse_Headers,
+    e_WSCParse_Body,            // Content-Length bytes of body
+    e_WSCParse_ChunkSize,
+    e_WSCParse_ChunkData,
+    e_WSCParse_ChunkEnd,        // The \r\n after the chunk data
+    e_WSCParse_Trailers,
+    e_WSCParse_UntilClose,      // No length, the body ends when the server hangs up
+    e_WSCParseMAX
+} e_WSCParseType;
+
+struct WSClientReq
+{
+    bool InUse;
+    bool Cancelled;         // Don't call the callback any more
+    bool Idempotent;        // Safe to pipeline and to send again
+    bool Head;              // The response has no body
+    bool Retried;
+    uint16_t Seq;           // Changed each time the slot is used (for the handle)
+    uint32_t Order;         // Requests are put on connections in this order
+    int Con;                // The connection it's on (WSC_NO_CON if waiting)
+    t_ElapsedTime Queued;
+    char Host[WSC_MAX_HOST];
+    int Port;
+    t_WSClientCallback Callback;
+    void *UserData;
+    int Len;
+    char Data[WS_OPT_CLIENT_REQUEST_SIZE];
+};
+
+struct WSClientCon
+{
+    struct SocketCon Con;
+    bool InUse;
+    bool Connected;         // We got connected (so errors aren't connect errors)
+    bool KeepAlive;         // The last response said the server will keep the connection open
+    uint32_t Served;        // Responses we have had on this connection
+    char Host[WSC_MAX_HOST];
+    int Port;
+    int Queue[WS_OPT_CLIENT_PIPELINE];  // The requests on this connection (Queue[0] is being answered)
+    int QueueCount;
+    int Sent;               // How many at the start of 'Queue' have been sent
+    t_ElapsedTime LastActive;
+    e_WSCParseType Parse;
+    bool GotBytes;          // Some of the response to Queue[0] has come in
+    int Status;
+    bool Chunked;
+    bool HaveLength;
+    uint64_t BodyLeft;
+    int LineLen;
+    char Line[WS_LINE_BUFFER_SIZE];
+};
+
+/*** FUNCTION PROTOTYPES      ***/
+static void WSClient_Assign(void);
+static bool WSClient_AssignRequest(int ReqIndex);
+static bool WSClient_CanTake(struct WSClientCon *Con,
+        struct WSClientReq *Req);
+static void WSClient_TickCon(struct WSClientCon *Con);
+static void WSClient_Parse(struct WSClientCon *Con,const char *Data,int Len);
+static void WSClient_ProcessLine(struct WSClientCon *Con,
+        struct WSClientReq *Req);
+static void WSClient_EndHeaders(struct WSClientCon *Con,
+        struct WSClientReq *Req);
+static void WSClient_ResponseDone(struct WSClientCon *Con);
+static void WSClient_ConLost(struct WSClientCon *Con,
+        e_WSClientErrorType Error);
+static void WSClient_Event(struct WSClientReq *Req,e_WSClientEventType Event,
+        const char *Data,int Len);
+static void WSClient_Finish(struct WSClientReq *Req,
+        e_WSClientEventType Event,int Len);
+
+/*** VARIABLE DEFINITIONS     ***/
+static struct WSClientReq m_ClientReqs[WS_OPT_CLIENT_REQUESTS];
+static struct WSClientCon m_ClientCons[WS_OPT_CLIENT_CONNECTIONS];
+static struct WSClientStats m_ClientStats;
+static uint32_t m_NextOrder;
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_Init
+ *
+ * SYNOPSIS:
+ *    void WSClient_Init(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function sets up the HTTP client.  Call it after
+ *    SocketsCon_InitSocketConSystem().
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSClient_Shutdown(), WSClient_Tick()
+ ******************************************************************************/
+void WSClient_Init(void)
+{
+    int r;
+
+    memset(&m_ClientStats,0x00,sizeof(m_ClientStats));
+    m_NextOrder=0;
+
+    for(r=0;r<WS_OPT_CLIENT_REQUESTS;r++)
+    {
+        m_ClientReqs[r].InUse=false;
+        m_ClientReqs[r].Seq=1;
+    }
+
+    for(r=0;r<WS_OPT_CLIENT_CONNECTIONS;r++)
+    {
+        m_ClientCons[r].InUse=false;
+        SocketsCon_InitSockCon(&m_ClientCons[r].Con);
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_Shutdown
+ *
+ * SYNOPSIS:
+ *    void WSClient_Shutdown(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function closes all the client connections.  Requests that haven't
+ *    finished get an e_WSClientEvent_Error (e_WSClientError_Closed).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSClient_Init()
+ ******************************************************************************/
+void WSClient_Shutdown(void)
+{
+    int r;
+
+    for(r=0;r<WS_OPT_CLIENT_CONNECTIONS;r++)
+    {
+        if(m_ClientCons[r].InUse)
+        {
+            SocketsCon_Close(&m_ClientCons[r].Con);
+            m_ClientCons[r].InUse=false;
+        }
+    }
+
+    for(r=0;r<WS_OPT_CLIENT_REQUESTS;r++)
+        if(m_ClientReqs[r].InUse)
+            WSClient_Finish(&m_ClientReqs[r],e_WSClientEvent_Error,
+                    e_WSClientError_Closed);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_Request
+ *
+ * SYNOPSIS:
+ *    t_WSClientHandle WSClient_Request(const char *Host,int Port,
+ *              const char *Method,const char *Path,const char *Headers,
+ *              const void *Body,int BodyLen,t_WSClientCallback Callback,
+ *              void *UserData);
+ *
+ * PARAMETERS:
+ *    Host [I] -- The server to send the request to
+ *    Port [I] -- The port on the server
+ *    Method [I] -- The HTTP method ("GET", "POST", ...)
+ *    Path [I] -- The path (and query string) to ask for
+ *    Headers [I] -- Extra header lines to send, each ending in "\r\n" (NULL
+ *                   for none).  "Host:" and "Content-Length:" are added for
+ *                   you.
+ *    Body [I] -- The body to send (NULL for none)
+ *    BodyLen [I] -- The number of bytes in 'Body'
+ *    Callback [I] -- The function to call with the response.  It is called
+ *                    from WSClient_Tick() with:
+ *                      e_WSClientEvent_Status -- The status line ('Data'
+ *                          is the line, 'Len' is the status code)
+ *                      e_WSClientEvent_Header -- Each header line
+ *                      e_WSClientEvent_Body -- Each piece of the body
+ *                      e_WSClientEvent_Done -- The response is all in
+ *                      e_WSClientEvent_Error -- The request failed ('Len'
+ *                          is a e_WSClientErrorType)
+ *                    Done or Error is always the last call.  If a request
+ *                    fails after some of the response came in and is sent
+ *                    again the response starts over with a new Status.
+ *    UserData [I] -- Passed to 'Callback'
+ *
+ * FUNCTION:
+ *    This function queues a request to a server.  The request is copied
+ *    (it has to fit in WS_OPT_CLIENT_REQUEST_SIZE bytes) and sent from
+ *    WSClient_Tick() on a pooled connection to 'Host':'Port'.
+ *
+ *    The host name is looked up when a new connection is made (without
+ *    waiting, see SocketsDNS_Lookup()) and the answer is cached for its
+ *    TTL.
+ *
+ * RETURNS:
+ *    A handle for WSClient_Cancel() or WSCLIENT_INVALID if there was no free
+ *    request slot or the request was too big.
+ *
+ * SEE ALSO:
+ *    WSClient_Cancel(), WSClient_Tick()
+ ******************************************************************************/
+t_WSClientHandle WSClient_Request(const char *Host,int Port,
+        const char *Method,const char *Path,const char *Headers,
+        const void *Body,int BodyLen,t_WSClientCallback Callback,
+        void *UserData)
+{
+    static const char *Idempotent[]={"GET","HEAD","PUT","DELETE","OPTIONS",
+            "TRACE",NULL};
+    struct WSClientReq *Req;
+    int Len;
+    int r;
+
+    if(strlen(Host)>=WSC_MAX_HOST)
+        return WSCLIENT_INVALID;
+
+    for(r=0;r<WS_OPT_CLIENT_REQUESTS;r++)
+        if(!m_ClientReqs[r].InUse)
+            break;
+    if(r==WS_OPT_CLIENT_REQUESTS)
+        return WSCLIENT_INVALID;
+    Req=&m_ClientReqs[r];
+
+    if(Port==80)
+    {
+        Len=snprintf(Req->Data,sizeof(Req->Data),
+                "%s %s HTTP/1.1\r\nHost: %s\r\n%s",Method,Path,Host,
+                Headers==NULL?"":Headers);
+    }
+    else
+    {
+        Len=snprintf(Req->Data,sizeof(Req->Data),
+                "%s %s HTTP/1.1\r\nHost: %s:%d\r\n%s",Method,Path,Host,Port,
+                Headers==NULL?"":Headers);
+    }
+    if(Len<0 || Len>=(int)sizeof(Req->Data))
+        return WSCLIENT_INVALID;
+
+    if(Body!=NULL)
+    {
+        Len+=snprintf(&Req->Data[Len],sizeof(Req->Data)-Len,
+                "Content-Length: %d\r\n",BodyLen);
+        if(Len>=(int)sizeof(Req->Data))
+            return WSCLIENT_INVALID;
+    }
+
+    if(Len+2+(Body==NULL?0:BodyLen)>(int)sizeof(Req->Data))
+        return WSCLIENT_INVALID;
+    memcpy(&Req->Data[Len],"\r\n",2);
+    Len+=2;
+    if(Body!=NULL)
+    {
+        memcpy(&Req->Data[Len],Body,BodyLen);
+        Len+=BodyLen;
+    }
+    Req->Len=Len;
+
+    Req->Idempotent=false;
+    for(r=0;Idempotent[r]!=NULL;r++)
+        if(strcmp(Method,Idempotent[r])==0)
+            Req->Idempotent=true;
+    Req->Head=strcmp(Method,"HEAD")==0;
+
+    strcpy(Req->Host,Host);
+    Req->Port=Port;
+    Req->Callback=Callback;
+    Req->UserData=UserData;
+    Req->Cancelled=false;
+    Req->Retried=false;
+    Req->Con=WSC_NO_CON;
+    Req->Order=m_NextOrder++;
+    Req->Queued=ReadElapsedClock();
+    Req->InUse=true;
+
+    m_ClientStats.Requests++;
+
+    return ((t_WSClientHandle)Req->Seq<<16)|(Req-m_ClientReqs+1);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_Cancel
+ *
+ * SYNOPSIS:
+ *    void WSClient_Cancel(t_WSClientHandle Handle);
+ *
+ * PARAMETERS:
+ *    Handle [I] -- The handle from WSClient_Request()
+ *
+ * FUNCTION:
+ *    This function stops the callback for a request being called again.  If
+ *    the request hasn't been put on a connection yet it's dropped, otherwise
+ *    the response is still read (so the connection can be reused) but
+ *    thrown away.
+ *
+ *    It's safe to cancel a request that has already finished.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSClient_Request()
+ ******************************************************************************/
+void WSClient_Cancel(t_WSClientHandle Handle)
+{
+    struct WSClientReq *Req;
+    unsigned int Index;
+
+    Index=(Handle&0xFFFF)-1;
+    if(Index>=WS_OPT_CLIENT_REQUESTS)
+        return;
+    Req=&m_ClientReqs[Index];
+    if(!Req->InUse || Req->Seq!=(Handle>>16))
+        return;
+
+    Req->Cancelled=true;
+    if(Req->Con==WSC_NO_CON)
+        WSClient_Finish(Req,e_WSClientEvent_Error,e_WSClientError_Closed);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_GetStats
+ *
+ * SYNOPSIS:
+ *    void WSClient_GetStats(struct WSClientStats *Stats);
+ *
+ * PARAMETERS:
+ *    Stats [O] -- The stats
+ *
+ * FUNCTION:
+ *    This function gets the client counters (pool hits and misses etc) and
+ *    how many connections are open.  The counters are also in the metrics
+ *    page (bittyhttp_client_*).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSClient_Request()
+ ******************************************************************************/
+void WSClient_GetStats(struct WSClientStats *Stats)
+{
+    int r;
+
+    *Stats=m_ClientStats;
+    Stats->Open=0;
+    Stats->Idle=0;
+    for(r=0;r<WS_OPT_CLIENT_CONNECTIONS;r++)
+    {
+        if(m_ClientCons[r].InUse)
+        {
+            Stats->Open++;
+            if(m_ClientCons[r].QueueCount==0)
+                Stats->Idle++;
+        }
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_Tick
+ *
+ * SYNOPSIS:
+ *    void WSClient_Tick(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function runs the client.  It puts waiting requests on
+ *    connections, sends them, reads responses (calling the callbacks), and
+ *    closes connections that have been idle for WS_OPT_CLIENT_IDLE_TIMEOUT.
+ *    Call it from the same loop as WS_Tick().
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSClient_Request()
+ ******************************************************************************/
+void WSClient_Tick(void)
+{
+    int r;
+
+    WSClient_Assign();
+
+    for(r=0;r<WS_OPT_CLIENT_CONNECTIONS;r++)
+        if(m_ClientCons[r].InUse)
+            WSClient_TickCon(&m_ClientCons[r]);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_Assign
+ *
+ * SYNOPSIS:
+ *    static void WSClient_Assign(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function puts the requests that are waiting on connections (oldest
+ *    first).  Requests that have been waiting longer than
+ *    WS_OPT_CLIENT_TIMEOUT fail.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSClient_AssignRequest()
+ ******************************************************************************/
+static void WSClient_Assign(void)
+{
+    int Waiting[WS_OPT_CLIENT_REQUESTS];
+    int Count;
+    int Hold;
+    t_ElapsedTime Now;
+    int r;
+    int i;
+
+    Now=ReadElapsedClock();
+
+    /* Sort the waiting requests by age (insertion sort, there are only a
+       few of them) */
+    Count=0;
+    for(r=0;r<WS_OPT_CLIENT_REQUESTS;r++)
+    {
+        if(!m_ClientReqs[r].InUse || m_ClientReqs[r].Con!=WSC_NO_CON)
+            continue;
+
+        if(Now-m_ClientReqs[r].Queued>WS_OPT_CLIENT_TIMEOUT)
+        {
+            m_ClientStats.Errors++;
+            WSMetrics_Count(e_WSMetricCounter_ClientErrors,1);
+            WSClient_Finish(&m_ClientReqs[r],e_WSClientEvent_Error,
+                    e_WSClientError_Timeout);
+            continue;
+        }
+
+        for(i=Count;i>0 && (int32_t)(m_ClientReqs[Waiting[i-1]].Order-
+                m_ClientReqs[r].Order)>0;i--)
+        {
+            Waiting[i]=Waiting[i-1];
+        }
+        Waiting[i]=r;
+        Count++;
+    }
+
+    for(r=0;r<Count;r++)
+    {
+        Hold=Waiting[r];
+        if(m_ClientReqs[Hold].InUse && m_ClientReqs[Hold].Con==WSC_NO_CON)
+            WSClient_AssignRequest(Hold);
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_AssignRequest
+ *
+ * SYNOPSIS:
+ *    static bool WSClient_AssignRequest(int ReqIndex);
+ *
+ * PARAMETERS:
+ *    ReqIndex [I] -- The request to find a connection for
+ *
+ * FUNCTION:
+ *    This function puts a request on a connection.  An idle connection to
+ *    the same host is used first, then one we can pipeline on.  If there
+ *    isn't one and the host has less than WS_OPT_CLIENT_PER_HOST
+ *    connections a new one is made (closing the longest idle connection to
+ *    another host if all the slots are in use).
+ *
+ * RETURNS:
+ *    true -- The request is on a connection (or failed)
+ *    false -- The request has to keep waiting
+ *
+ * SEE ALSO:
+ *    WSClient_CanTake()
+ ******************************************************************************/
+static bool WSClient_AssignRequest(int ReqIndex)
+{
+    struct WSClientReq *Req;
+    struct WSClientCon *Con;
+    struct WSClientCon *Best;
+    struct WSClientCon *Free;
+    struct WSClientCon *Oldest;
+    int HostCons;
+    int r;
+
+    Req=&m_ClientReqs[ReqIndex];
+
+    Best=NULL;
+    Free=NULL;
+    Oldest=NULL;
+    HostCons=0;
+    for(r=0;r<WS_OPT_CLIENT_CONNECTIONS;r++)
+    {
+        Con=&m_ClientCons[r];
+        if(!Con->InUse)
+        {
+            if(Free==NULL)
+                Free=Con;
+            continue;
+        }
+
+        if(Con->Port==Req->Port && strcmp(Con->Host,Req->Host)==0)
+        {
+            HostCons++;
+            if(WSClient_CanTake(Con,Req) &&
+                    (Best==NULL || Con->QueueCount<Best->QueueCount))
+            {
+                Best=Con;
+            }
+        }
+        else if(Con->QueueCount==0 &&
+                (Oldest==NULL || Con->LastActive<Oldest->LastActive))
+        {
+            Oldest=Con;
+        }
+    }
+
+    if(Best!=NULL)
+    {
+        /* Pool hit */
+        m_ClientStats.PoolHits++;
+        WSMetrics_Count(e_WSMetricCounter_ClientPoolHits,1);
+        if(Best->QueueCount>0)
+        {
+            m_ClientStats.Pipelined++;
+            WSMetrics_Count(e_WSMetricCounter_ClientPipelined,1);
+        }
+        Best->Queue[Best->QueueCount++]=ReqIndex;
+        Req->Con=Best-m_ClientCons;
+        return true;
+    }
+
+    if(HostCons>=WS_OPT_CLIENT_PER_HOST)
+        return false;
+
+    if(Free==NULL)
+    {
+        if(Oldest==NULL)
+            return false;
+        SocketsCon_Close(&Oldest->Con);
+        Oldest->InUse=false;
+        Free=Oldest;
+    }
+
+    /* Pool miss, make a new connection */
+    m_ClientStats.PoolMisses++;
+    WSMetrics_Count(e_WSMetricCounter_ClientPoolMisses,1);
+
+    Con=Free;
+    SocketsCon_InitSockCon(&Con->Con);
+    if(!SocketsCon_Connect(&Con->Con,Req->Host,Req->Port))
+    {
+        SocketsCon_Close(&Con->Con);
+        m_ClientStats.Errors++;
+        WSMetrics_Count(e_WSMetricCounter_ClientErrors,1);
+        WSClient_Finish(Req,e_WSClientEvent_Error,e_WSClientError_Connect);
+        return true;
+    }
+
+    Con->InUse=true;
+    Con->Connected=false;
+    Con->KeepAlive=false;
+    Con->Served=0;
+    strcpy(Con->Host,Req->Host);
+    Con->Port=Req->Port;
+    Con->QueueCount=0;
+    Con->Sent=0;
+    Con->LastActive=ReadElapsedClock();
+    Con->Parse=e_WSCParse_Status;
+    Con->GotBytes=false;
+    Con->LineLen=0;
+
+    Con->Queue[Con->QueueCount++]=ReqIndex;
+    Req->Con=Con-m_ClientCons;
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_CanTake
+ *
+ * SYNOPSIS:
+ *    static bool WSClient_CanTake(struct WSClientCon *Con,
+ *              struct WSClientReq *Req);
+ *
+ * PARAMETERS:
+ *    Con [I] -- The connection (to the same host as 'Req')
+ *    Req [I] -- The request
+ *
+ * FUNCTION:
+ *    This function checks if a request can go on a connection.  An idle
+ *    connection can take anything.  A busy one can only take a request if
+ *    the server has already kept it open for us, there's room in the
+ *    pipeline, and everything on it (and the new request) is idempotent
+ *    (we don't pipeline behind a POST, RFC 9112 9.3.2).
+ *
+ * RETURNS:
+ *    true -- The request can go on the connection
+ *    false -- It can't
+ *
+ * SEE ALSO:
+ *    WSClient_AssignRequest()
+ ******************************************************************************/
+static bool WSClient_CanTake(struct WSClientCon *Con,
+        struct WSClientReq *Req)
+{
+    int r;
+
+    if(SocketsCon_HasError(&Con->Con))
+        return false;
+
+    if(Con->QueueCount==0)
+        return true;
+
+    if(Con->QueueCount>=WS_OPT_CLIENT_PIPELINE || Con->Served==0 ||
+            !Con->KeepAlive || !Req->Idempotent)
+    {
+        return false;
+    }
+
+    for(r=0;r<Con->QueueCount;r++)
+        if(!m_ClientReqs[Con->Queue[r]].Idempotent)
+            return false;
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_TickCon
+ *
+ * SYNOPSIS:
+ *    static void WSClient_TickCon(struct WSClientCon *Con);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection to work on
+ *
+ * FUNCTION:
+ *    This function runs one connection.  It finishes connecting, sends the
+ *    requests that haven't been sent, reads what has come in, and handles
+ *    timeouts.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSClient_Parse()
+ ******************************************************************************/
+static void WSClient_TickCon(struct WSClientCon *Con)
+{
+    char Buff[WSC_READ_SIZE];
+    struct WSClientReq *Req;
+    t_ElapsedTime Now;
+    int Bytes;
+
+    SocketsCon_Tick(&Con->Con);
+    if(SocketsCon_HasError(&Con->Con))
+    {
+        WSClient_ConLost(Con,Con->Connected?e_WSClientError_Closed:
+                e_WSClientError_Connect);
+        return;
+    }
+    if(!SocketsCon_IsConnected(&Con->Con))
+        return;
+    Con->Connected=true;
+
+    Now=ReadElapsedClock();
+
+    /* Send what's waiting */
+    while(Con->Sent<Con->QueueCount)
+    {
+        Req=&m_ClientReqs[Con->Queue[Con->Sent]];
+        if(!SocketsCon_Write(&Con->Con,Req->Data,Req->Len))
+        {
+            WSClient_ConLost(Con,e_WSClientError_Closed);
+            return;
+        }
+        Con->Sent++;
+        Con->LastActive=Now;
+    }
+
+    /* Read what came in */
+    do
+    {
+        Bytes=SocketsCon_Read(&Con->Con,Buff,sizeof(Buff));
+        if(Bytes<0)
+        {
+            /* The server hung up.  That's the end of a response with no
+               length. */
+            if(Con->QueueCount>0 && Con->Parse==e_WSCParse_UntilClose)
+                WSClient_ResponseDone(Con);
+            if(Con->InUse)
+                WSClient_ConLost(Con,e_WSClientError_Closed);
+            return;
+        }
+        if(Bytes>0)
+        {
+            Con->LastActive=Now;
+            WSClient_Parse(Con,Buff,Bytes);
+            if(!Con->InUse)
+                return;
+        }
+    } while(Bytes==sizeof(Buff));
+
+    if(Con->QueueCount>0)
+    {
+        if(Now-Con->LastActive>WS_OPT_CLIENT_TIMEOUT)
+            WSClient_ConLost(Con,e_WSClientError_Timeout);
+    }
+    else if(Now-Con->LastActive>WS_OPT_CLIENT_IDLE_TIMEOUT)
+    {
+        SocketsCon_Close(&Con->Con);
+        Con->InUse=false;
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_Parse
+ *
+ * SYNOPSIS:
+ *    static void WSClient_Parse(struct WSClientCon *Con,const char *Data,
+ *              int Len);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection the data came in on
+ *    Data [I] -- The bytes that came in
+ *    Len [I] -- The number of bytes in 'Data'
+ *
+ * FUNCTION:
+ *    This function runs bytes from the server through the response parser.
+ *    Body bytes go straight to the callback, the rest is collected a line at
+ *    a time.
+ *
+ *    'Con' may be closed when this returns (check 'InUse').
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSClient_ProcessLine()
+ ******************************************************************************/
+static void WSClient_Parse(struct WSClientCon *Con,const char *Data,int Len)
+{
+    struct WSClientReq *Req;
+    const char *End;
+    int Bytes;
+
+    while(Len>0 && Con->InUse)
+    {
+        if(Con->QueueCount==0)
+        {
+            /* The server sent something we didn't ask for */
+            SocketsCon_Close(&Con->Con);
+            Con->InUse=false;
+            return;
+        }
+
+        Req=&m_ClientReqs[Con->Queue[0]];
+        Con->GotBytes=true;
+
+        switch(Con->Parse)
+        {
+            case e_WSCParse_Body:
+            case e_WSCParse_ChunkData:
+            case e_WSCParse_UntilClose:
+                Bytes=Len;
+                if(Con->Parse!=e_WSCParse_UntilClose &&
+                        (uint64_t)Bytes>Con->BodyLeft)
+                {
+                    Bytes=Con->BodyLeft;
+                }
+                WSClient_Event(Req,e_WSClientEvent_Body,Data,Bytes);
+                Data+=Bytes;
+                Len-=Bytes;
+
+                if(Con->Parse!=e_WSCParse_UntilClose)
+                {
+                    Con->BodyLeft-=Bytes;
+                    if(Con->BodyLeft==0)
+                    {
+                        if(Con->Parse==e_WSCParse_Body)
+                            WSClient_ResponseDone(Con);
+                        else
+                            Con->Parse=e_WSCParse_ChunkEnd;
+                    }
+                }
+            break;
+            case e_WSCParse_Status:
+            case e_WSCParse_Headers:
+            case e_WSCParse_ChunkSize:
+            case e_WSCParse_ChunkEnd:
+            case e_WSCParse_Trailers:
+            case e_WSCParseMAX:
+            default:
+                End=memchr(Data,'\n',Len);
+                Bytes=End==NULL?Len:End-Data;
+
+                /* Lines that are too long are cut off (we only need the
+                   start of the ones we look at) */
+                if(Bytes>(int)sizeof(Con->Line)-1-Con->LineLen)
+                {
+                    memcpy(&Con->Line[Con->LineLen],Data,
+                            sizeof(Con->Line)-1-Con->LineLen);
+                    Con->LineLen=sizeof(Con->Line)-1;
+                }
+                else
+                {
+                    memcpy(&Con->Line[Con->LineLen],Data,Bytes);
+                    Con->LineLen+=Bytes;
+                }
+
+                if(End==NULL)
+                    return;
+
+                Data+=Bytes+1;
+                Len-=Bytes+1;
+
+                if(Con->LineLen>0 && Con->Line[Con->LineLen-1]=='\r')
+                    Con->LineLen--;
+                Con->Line[Con->LineLen]=0;
+                WSClient_ProcessLine(Con,Req);
+                Con->LineLen=0;
+            break;
+        }
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_ProcessLine
+ *
+ * SYNOPSIS:
+ *    static void WSClient_ProcessLine(struct WSClientCon *Con,
+ *              struct WSClientReq *Req);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection with the line in 'Line'
+ *    Req [I] -- The request being answered
+ *
+ * FUNCTION:
+ *    This function handles a status, header, or chunk line of a response.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSClient_Parse()
+ ******************************************************************************/
+static void WSClient_ProcessLine(struct WSClientCon *Con,
+        struct WSClientReq *Req)
+{
+    const char *Value;
+    char *End;
+
+    switch(Con->Parse)
+    {
+        case e_WSCParse_Status:
+            /* "HTTP/1.x NNN Reason" */
+            if(strncmp(Con->Line,"HTTP/1.",7)!=0 || Con->LineLen<12)
+            {
+                WSClient_ConLost(Con,e_WSClientError_BadResponse);
+                return;
+            }
+            Con->KeepAlive=Con->Line[7]!='0';
+            Con->Status=atoi(&Con->Line[9]);
+            Con->Chunked=false;
+            Con->HaveLength=false;
+            Con->Parse=e_WSCParse_Headers;
+
+            /* 1xx are interim responses, the real one follows */
+            if(Con->Status>=200)
+            {
+                WSClient_Event(Req,e_WSClientEvent_Status,Con->Line,
+                        Con->Status);
+            }
+        break;
+        case e_WSCParse_Headers:
+            if(Con->LineLen==0)
+            {
+                WSClient_EndHeaders(Con,Req);
+                return;
+            }
+            if(Con->Status<200)
+                return;
+
+            if(strncasecmp(Con->Line,"Content-Length:",15)==0)
+            {
+                Con->BodyLeft=strtoull(&Con->Line[15],NULL,10);
+                Con->HaveLength=true;
+            }
+            else if(strncasecmp(Con->Line,"Transfer-Encoding:",18)==0)
+            {
+                for(Value=&Con->Line[18];*Value!=0;Value++)
+                    if(strncasecmp(Value,"chunked",7)==0)
+                        Con->Chunked=true;
+            }
+            else if(strncasecmp(Con->Line,"Connection:",11)==0)
+            {
+                for(Value=&Con->Line[11];*Value!=0;Value++)
+                {
+                    if(strncasecmp(Value,"close",5)==0)
+                        Con->KeepAlive=false;
+                    else if(strncasecmp(Value,"keep-alive",10)==0)
+                        Con->KeepAlive=true;
+                }
+            }
+
+            WSClient_Event(Req,e_WSClientEvent_Header,Con->Line,Con->LineLen);
+        break;
+        case e_WSCParse_ChunkSize:
+            Con->BodyLeft=strtoull(Con->Line,&End,16);
+            if(End==Con->Line)
+            {
+                WSClient_ConLost(Con,e_WSClientError_BadResponse);
+                return;
+            }
+            if(Con->BodyLeft==0)
+                Con->Parse=e_WSCParse_Trailers;
+            else
+                Con->Parse=e_WSCParse_ChunkData;
+        break;
+        case e_WSCParse_ChunkEnd:
+            Con->Parse=e_WSCParse_ChunkSize;
+        break;
+        case e_WSCParse_Trailers:
+            if(Con->LineLen==0)
+                WSClient_ResponseDone(Con);
+        break;
+        case e_WSCParse_Body:
+        case e_WSCParse_ChunkData:
+        case e_WSCParse_UntilClose:
+        case e_WSCParseMAX:
+        default:
+        break;
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_EndHeaders
+ *
+ * SYNOPSIS:
+ *    static void WSClient_EndHeaders(struct WSClientCon *Con,
+ *              struct WSClientReq *Req);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection
+ *    Req [I] -- The request being answered
+ *
+ * FUNCTION:
+ *    This function works out how the body is sent once the blank line after
+ *    the headers is in (RFC 9112 6.3).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSClient_ProcessLine()
+ ******************************************************************************/
+static void WSClient_EndHeaders(struct WSClientCon *Con,
+        struct WSClientReq *Req)
+{
+    if(Con->Status<200)
+    {
+        Con->Parse=e_WSCParse_Status;
+        return;
+    }
+
+    if(Req->Head || Con->Status==204 || Con->Status==304)
+        WSClient_ResponseDone(Con);
+    else if(Con->Chunked)
+        Con->Parse=e_WSCParse_ChunkSize;
+    else if(Con->HaveLength && Con->BodyLeft==0)
+        WSClient_ResponseDone(Con);
+    else if(Con->HaveLength)
+        Con->Parse=e_WSCParse_Body;
+    else
+    {
+        Con->Parse=e_WSCParse_UntilClose;
+        Con->KeepAlive=false;
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_ResponseDone
+ *
+ * SYNOPSIS:
+ *    static void WSClient_ResponseDone(struct WSClientCon *Con);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection
+ *
+ * FUNCTION:
+ *    This function finishes the request at the front of a connection.  The
+ *    connection is then ready for the next response, or is closed if the
+ *    server isn't keeping it open (anything pipelined behind is sent again).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSClient_ConLost()
+ ******************************************************************************/
+static void WSClient_ResponseDone(struct WSClientCon *Con)
+{
+    struct WSClientReq *Req;
+
+    Req=&m_ClientReqs[Con->Queue[0]];
+
+    Con->Served++;
+    Con->QueueCount--;
+    Con->Sent--;
+    memmove(&Con->Queue[0],&Con->Queue[1],Con->QueueCount*sizeof(int));
+    Con->Parse=e_WSCParse_Status;
+    Con->GotBytes=false;
+    Con->LineLen=0;
+
+    WSClient_Finish(Req,e_WSClientEvent_Done,0);
+
+    /* The server won't look at anything we pipelined after this, so they
+       can go again as if they had never been sent (RFC 9112 9.6) */
+    if(!Con->KeepAlive)
+    {
+        Con->Sent=0;
+        WSClient_ConLost(Con,e_WSClientError_Closed);
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_ConLost
+ *
+ * SYNOPSIS:
+ *    static void WSClient_ConLost(struct WSClientCon *Con,
+ *              e_WSClientErrorType Error);
+ *
+ * PARAMETERS:
+ *    Con [I/O] -- The connection to close
+ *    Error [I] -- Why
+ *
+ * FUNCTION:
+ *    This function closes a connection and deals with the requests on it.
+ *    Ones that were never sent wait for another connection.  Ones that were
+ *    sent but got nothing back are sent again once if they are idempotent
+ *    and were pipelined behind another request, or the connection had
+ *    already been used (the server closed an idle connection as we sent on
+ *    it).  The rest fail with 'Error' (or
+ *    e_WSClientError_Connect if we never got connected).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSClient_ResponseDone()
+ ******************************************************************************/
+static void WSClient_ConLost(struct WSClientCon *Con,
+        e_WSClientErrorType Error)
+{
+    struct WSClientReq *Req;
+    int Count;
+    int Sent;
+    int r;
+
+    /* Done with the connection first, so callbacks see a free slot */
+    SocketsCon_Close(&Con->Con);
+    Con->InUse=false;
+    Count=Con->QueueCount;
+    Sent=Con->Sent;
+    Con->QueueCount=0;
+    Con->Sent=0;
+
+    for(r=0;r<Count;r++)
+    {
+        Req=&m_ClientReqs[Con->Queue[r]];
+        Req->Con=WSC_NO_CON;
+
+        if(!Con->Connected)
+        {
+            m_ClientStats.Errors++;
+            WSMetrics_Count(e_WSMetricCounter_ClientErrors,1);
+            WSClient_Finish(Req,e_WSClientEvent_Error,
+                    e_WSClientError_Connect);
+        }
+        else if(r>=Sent)
+        {
+            /* Never sent, it can go on another connection */
+        }
+        else if(Req->Idempotent && !Req->Retried &&
+                (r>0 || (Error==e_WSClientError_Closed && !Con->GotBytes &&
+                Con->Served>0)))
+        {
+            Req->Retried=true;
+            m_ClientStats.Retries++;
+            WSMetrics_Count(e_WSMetricCounter_ClientRetries,1);
+        }
+        else
+        {
+            m_ClientStats.Errors++;
+            WSMetrics_Count(e_WSMetricCounter_ClientErrors,1);
+            WSClient_Finish(Req,e_WSClientEvent_Error,Error);
+        }
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_Event
+ *
+ * SYNOPSIS:
+ *    static void WSClient_Event(struct WSClientReq *Req,
+ *              e_WSClientEventType Event,const char *Data,int Len);
+ *
+ * PARAMETERS:
+ *    Req [I] -- The request
+ *    Event [I] -- What happened
+ *    Data [I] -- The data for the event
+ *    Len [I] -- The length of 'Data' (or the status code / error)
+ *
+ * FUNCTION:
+ *    This function calls a request's callback (unless it was cancelled).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSClient_Finish()
+ ******************************************************************************/
+static void WSClient_Event(struct WSClientReq *Req,e_WSClientEventType Event,
+        const char *Data,int Len)
+{
+    if(!Req->Cancelled && Req->Callback!=NULL)
+        Req->Callback(Req->UserData,Event,Data,Len);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSClient_Finish
+ *
+ * SYNOPSIS:
+ *    static void WSClient_Finish(struct WSClientReq *Req,
+ *              e_WSClientEventType Event,int Len);
+ *
+ * PARAMETERS:
+ *    Req [I/O] -- The request
+ *    Event [I] -- e_WSClientEvent_Done or e_WSClientEvent_Error
+ *    Len [I] -- The e_WSClientErrorType for errors
+ *
+ * FUNCTION:
+ *    This function frees a request slot and then makes the last call to the
+ *    callback (so the callback can queue another request in the slot).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSClient_Event()
+ ******************************************************************************/
+static void WSClient_Finish(struct WSClientReq *Req,
+        e_WSClientEventType Event,int Len)
+{
+    t_WSClientCallback Callback;
+    void *UserData;
+    bool Cancelled;
+
+    Callback=Req->Callback;
+    UserData=Req->UserData;
+    Cancelled=Req->Cancelled;
+
+    Req->InUse=false;
+    Req->Con=WSC_NO_CON;
+    Req->Seq++;
+    if(Req->Seq==0)
+        Req->Seq=1;
+
+    if(!Cancelled && Callback!=NULL)
+        Callback(UserData,Event,NULL,Len);
+}
@@ -0,0 +1,95 @@
+/*******************************************************************************
+ * FILENAME: WSClient.h
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This has the outbound HTTP client in it (WSClient.c).
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ *******************************************************************************/
+#ifndef __WSCLIENT_H_
+#define __WSCLIENT_H_
+
+/***  HEADER FILES TO INCLUDE          ***/
+#include <stdbool.h>
+#include <stdint.h>
+
+/***  DEFINES                          ***/
+#define WSCLIENT_INVALID                    0       // A t_WSClientHandle that is never valid
+
+/***  MACROS                           ***/
+
+/***  TYPE DEFINITIONS                 ***/
+typedef enum
+{
+    e_WSClientEvent_Status,     // The status line (Data=the line, Len=the status code)
+    e_WSClientEvent_Header,     // One header line (Data="Name: value", Len=it's length)
+    e_WSClientEvent_Body,       // Some of the body (chunked bodies come decoded)
+    e_WSClientEvent_Done,       // The whole response is in
+    e_WSClientEvent_Error,      // The request failed (Len=the e_WSClientErrorType)
+    e_WSClientEventMAX
+} e_WSClientEventType;
+
+typedef enum
+{
+    e_WSClientError_Connect,    // Couldn't connect to the server
+    e_WSClientError_Closed,     // The server hung up before the response was done
+    e_WSClientError_Timeout,    // Nothing came in for WS_OPT_CLIENT_TIMEOUT seconds
+    e_WSClientError_BadResponse,// The response wasn't HTTP/1.x
+    e_WSClientErrorMAX
+} e_WSClientErrorType;
+
+typedef uint32_t t_WSClientHandle;
+typedef void (*t_WSClientCallback)(void *UserData,e_WSClientEventType Event,
+        const char *Data,int Len);
+
+struct WSClientStats
+{
+    uint32_t Requests;      // Requests queued with WSClient_Request()
+    uint32_t PoolHits;      // Requests sent on a connection that was already open
+    uint32_t PoolMisses;    // Requests that had to open a new connection
+    uint32_t Pipelined;     // Requests sent before the one ahead of them was answered
+    uint32_t Retries;       // Requests sent again because a kept alive connection closed under them
+    uint32_t Errors;        // Requests that ended in e_WSClientEvent_Error
+    uint32_t Open;          // Connections open right now
+    uint32_t Idle;          // How many of them have nothing to do
+};
+
+/***  CLASS DEFINITIONS                ***/
+
+/***  GLOBAL VARIABLE DEFINITIONS      ***/
+
+/***  EXTERNAL FUNCTION PROTOTYPES     ***/
+void WSClient_Init(void);
+void WSClient_Shutdown(void);
+void WSClient_Tick(void);
+t_WSClientHandle WSClient_Request(const char *Host,int Port,
+        const char *Method,const char *Path,const char *Headers,
+        const void *Body,int BodyLen,t_WSClientCallback Callback,
+        void *UserData);
+void WSClient_Cancel(t_WSClientHandle Handle);
+void WSClient_GetStats(struct WSClientStats *Stats);
+
+#endif
@@ -0,0 +1,655 @@
+/*******************************************************************************
+ * FILENAME: WSEvents.c
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This file has server-sent events (the text/event-stream that a
+ *    browser's EventSource reads).  A page subscribes its connection to a
+ *    channel with WS_SubscribeEvents() and the connection is kept open.
+ *    Anything on the web server thread can then send an event to everyone
+ *    on the channel with WSEvents_Publish().
+ *
+ *    Each channel has a ring buffer that events are written into once, as
+ *    they will be sent.  A subscriber is just a position in its channel's
+ *    ring, and WS_Tick() sends each one the bytes between its position and
+ *    the end of the ring.  Nothing is copied per subscriber, so an idle
+ *    subscriber costs one small struct.  A subscriber that falls so far
+ *    behind that the ring has written over what it still needed is hung up
+ *    on (the browser reconnects and resumes with Last-Event-ID).
+ *
+ *    The ring also keeps the last WS_OPT_EVENTS_RING_EVENTS events so a
+ *    browser that reconnects with Last-Event-ID is sent the ones it missed
+ *    (as many as are still in the ring).  Event ids are
+ *    "<run>-<number>", where the run is when the server started, so an id
+ *    from before a restart doesn't match this run's events.
+ *
+ *    Everything in here has to be called from the web server thread.
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ ******************************************************************************/
+
+/*** HEADER FILES TO INCLUDE  ***/
+#include "WSEvents.h"
+#include "WSMetrics.h"
+#include "WebServer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*** DEFINES                  ***/
+#define WSE_READ_SIZE               128     // How much we read (and throw away) from a subscriber at a time
+#define WSE_ID_LINE_SIZE            32      // Room for the "id: " line of an event
+#define WSE_RING_MASK               (WS_OPT_EVENTS_RING_SIZE-1)
+
+/*** MACROS                   ***/
+
+/*** TYPE DEFINITIONS         ***/
+struct WSEventsEntry
+{
+    uint32_t Number;            // The event's number (the second part of its id)
+    uint32_t Pos;               // Where it starts in the ring
+};
+
+struct WSEventsChannel
+{
+    char Name[WS_OPT_EVENTS_NAME_SIZE]; // ""=this slot is free
+    uint32_t NextNumber;        // The number the next event gets
+    uint32_t Head;              // Where the next event goes in the ring (this counts up forever, it's masked to index 'Ring')
+    uint32_t Tail;              // Where the oldest event still in the ring starts
+    int First;                  // The oldest event in 'Events'
+    int Count;                  // The number of events in 'Events'
+    struct WSEventsEntry Events[WS_OPT_EVENTS_RING_EVENTS];
+    char Ring[WS_OPT_EVENTS_RING_SIZE];
+};
+
+struct WSEventsSub
+{
+    struct WebServer *Web;      // The connection (NULL=this slot is free)
+    struct WSEventsChannel *Channel;
+    uint32_t Pos;               // The next byte of the channel's ring to send
+    t_ElapsedTime LastSent;
+    uint8_t KeepAliveLeft;      // Bytes of m_KeepAlive still to send
+    bool Dropped;               // A write failed or we fell behind, hang up
+};
+
+/*** FUNCTION PROTOTYPES      ***/
+static struct WSEventsChannel *WSEvents_FindChannel(const char *Name,
+        bool Make);
+static uint32_t WSEvents_ResumePos(struct WSEventsChannel *Channel,
+        const char *LastEventID);
+static void WSEvents_Put(struct WSEventsChannel *Channel,const char *Data,
+        int Len);
+static bool WSEvents_Flush(struct WSEventsSub *Sub);
+
+/*** VARIABLE DEFINITIONS     ***/
+static struct WSEventsChannel m_Channels[WS_OPT_EVENTS_CHANNELS];
+static struct WSEventsSub m_Subs[WS_OPT_EVENTS_SUBSCRIBERS];
+static uint32_t m_RunID;
+
+/* A comment line, sent when a stream has been quiet for a while */
+static const char m_KeepAlive[]=":\n\n";
+
+/*******************************************************************************
+ * NAME:
+ *    WSEvents_Init
+ *
+ * SYNOPSIS:
+ *    void WSEvents_Init(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function sets up the event channels.  It's called from WS_Init().
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSEvents_Subscribe()
+ ******************************************************************************/
+void WSEvents_Init(void)
+{
+    int r;
+
+    for(r=0;r<WS_OPT_EVENTS_CHANNELS;r++)
+        m_Channels[r].Name[0]=0;
+    for(r=0;r<WS_OPT_EVENTS_SUBSCRIBERS;r++)
+        m_Subs[r].Web=NULL;
+
+    m_RunID=time(NULL);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSEvents_Subscribe
+ *
+ * SYNOPSIS:
+ *    struct WSEventsSub *WSEvents_Subscribe(struct WebServer *Web,
+ *          const char *Channel,const char *LastEventID);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The connection to send the events on
+ *    Channel [I] -- The name of the channel to subscribe to (it's made if
+ *                   it's new)
+ *    LastEventID [I] -- The Last-Event-ID the browser sent ("" if none).
+ *                       The events after this one that are still in the
+ *                       ring are sent first.
+ *
+ * FUNCTION:
+ *    This function subscribes a connection to a channel.  It's called from
+ *    WS_SubscribeEvents().
+ *
+ * RETURNS:
+ *    The subscription or NULL if WS_OPT_EVENTS_SUBSCRIBERS are in use, or
+ *    the channel is new and there is no room for it.
+ *
+ * SEE ALSO:
+ *    WSEvents_Release()
+ ******************************************************************************/
+struct WSEventsSub *WSEvents_Subscribe(struct WebServer *Web,
+        const char *Channel,const char *LastEventID)
+{
+    struct WSEventsChannel *Chan;
+    struct WSEventsSub *Sub;
+    int r;
+
+    for(r=0;r<WS_OPT_EVENTS_SUBSCRIBERS;r++)
+        if(m_Subs[r].Web==NULL)
+            break;
+    if(r==WS_OPT_EVENTS_SUBSCRIBERS)
+        return NULL;
+
+    Chan=WSEvents_FindChannel(Channel,true);
+    if(Chan==NULL)
+        return NULL;
+
+    Sub=&m_Subs[r];
+    Sub->Web=Web;
+    Sub->Channel=Chan;
+    Sub->Pos=WSEvents_ResumePos(Chan,LastEventID);
+    Sub->LastSent=ReadElapsedClock();
+    Sub->KeepAliveLeft=0;
+    Sub->Dropped=false;
+
+    return Sub;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSEvents_Release
+ *
+ * SYNOPSIS:
+ *    void WSEvents_Release(struct WSEventsSub *Sub);
+ *
+ * PARAMETERS:
+ *    Sub [I/O] -- The subscription to free
+ *
+ * FUNCTION:
+ *    This function is called when a subscribed connection is closed.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSEvents_Subscribe()
+ ******************************************************************************/
+void WSEvents_Release(struct WSEventsSub *Sub)
+{
+    Sub->Web=NULL;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSEvents_Run
+ *
+ * SYNOPSIS:
+ *    bool WSEvents_Run(struct WSEventsSub *Sub);
+ *
+ * PARAMETERS:
+ *    Sub [I/O] -- The subscription to work on
+ *
+ * FUNCTION:
+ *    This function is called from WS_Tick() for each subscribed connection.
+ *    It sends the events the subscriber hasn't had yet (as much as the
+ *    connection will take) and a comment if the stream has been quiet for
+ *    WS_OPT_EVENTS_KEEPALIVE seconds.
+ *
+ * RETURNS:
+ *    true -- Keep going
+ *    false -- The client hung up, a write failed, or the subscriber fell too
+ *             far behind.  Hang up.
+ *
+ * SEE ALSO:
+ *    WSEvents_Publish()
+ ******************************************************************************/
+bool WSEvents_Run(struct WSEventsSub *Sub)
+{
+    char Buff[WSE_READ_SIZE];
+    t_ElapsedTime Now;
+    int Bytes;
+
+    if(Sub->Dropped)
+        return false;
+
+    /* The client has nothing to say, but we have to read to see it hang
+       up */
+    Bytes=SocketsCon_Read(&Sub->Web->Con,Buff,sizeof(Buff));
+    if(Bytes<0)
+        return false;
+    if(Bytes>0)
+        WSMetrics_Count(e_WSMetricCounter_BytesIn,Bytes);
+
+    /* Comments can only go between events */
+    Now=ReadElapsedClock();
+    if(Sub->Pos==Sub->Channel->Head && Sub->KeepAliveLeft==0 &&
+            Now-Sub->LastSent>=WS_OPT_EVENTS_KEEPALIVE)
+    {
+        Sub->KeepAliveLeft=sizeof(m_KeepAlive)-1;
+        Sub->LastSent=Now;
+    }
+
+    return WSEvents_Flush(Sub);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSEvents_Publish
+ *
+ * SYNOPSIS:
+ *    uint32_t WSEvents_Publish(const char *Channel,const char *Event,
+ *          const char *Data);
+ *
+ * PARAMETERS:
+ *    Channel [I] -- The channel to send on (it's made if it's new)
+ *    Event [I] -- The event type (the browser's addEventListener() name).
+ *                 NULL for a plain "message" event.
+ *    Data [I] -- The event data.  This can have more than one line in it
+ *                (split with \n).
+ *
+ * FUNCTION:
+ *    This function sends an event to everyone subscribed to a channel.  The
+ *    event is written into the channel's ring once and sent to each
+ *    subscriber from there (right away if the connection can take it,
+ *    otherwise from WS_Tick()).
+ *
+ *    The event is also kept for browsers that reconnect with Last-Event-ID
+ *    until the ring writes over it.
+ *
+ *    'Event' can't have a \r or \n in it and 'Data' can't have a \r.
+ *
+ * RETURNS:
+ *    The number part of the event's id or 0 if the event is bigger than
+ *    the ring (WS_OPT_EVENTS_RING_SIZE) or there is no room for a new
+ *    channel.
+ *
+ * SEE ALSO:
+ *    WS_SubscribeEvents(), WSEvents_Count()
+ ******************************************************************************/
+uint32_t WSEvents_Publish(const char *Channel,const char *Event,
+        const char *Data)
+{
+    struct WSEventsChannel *Chan;
+    struct WSEventsEntry *Entry;
+    char IDLine[WSE_ID_LINE_SIZE];
+    const char *Line;
+    const char *End;
+    uint32_t Number;
+    int IDLen;
+    int Len;
+    int r;
+
+    Chan=WSEvents_FindChannel(Channel,true);
+    if(Chan==NULL)
+        return 0;
+
+    Number=Chan->NextNumber;
+    IDLen=snprintf(IDLine,sizeof(IDLine),"id: %u-%u\n",m_RunID,Number);
+
+    /* Work out how big it is ("data: " for each line, and a blank line at
+       the end) */
+    Len=IDLen+1;
+    if(Event!=NULL)
+        Len+=7+strlen(Event)+1;
+    Len+=6+strlen(Data)+1;
+    for(Line=Data;*Line!=0;Line++)
+        if(*Line=='\n')
+            Len+=6;
+    if(Len>WS_OPT_EVENTS_RING_SIZE)
+        return 0;
+
+    /* Make room (anyone still sending what we write over is hung up on
+       when they get to it) */
+    while(Chan->Count>0 && (Chan->Count==WS_OPT_EVENTS_RING_EVENTS ||
+            Chan->Head+Len-Chan->Tail>WS_OPT_EVENTS_RING_SIZE))
+    {
+        Chan->First=(Chan->First+1)%WS_OPT_EVENTS_RING_EVENTS;
+        Chan->Count--;
+        Chan->Tail=Chan->Head;
+        if(Chan->Count>0)
+            Chan->Tail=Chan->Events[Chan->First].Pos;
+    }
+
+    Entry=&Chan->Events[(Chan->First+Chan->Count)%WS_OPT_EVENTS_RING_EVENTS];
+    Entry->Number=Number;
+    Entry->Pos=Chan->Head;
+    Chan->Count++;
+    Chan->NextNumber++;
+
+    WSEvents_Put(Chan,IDLine,IDLen);
+    if(Event!=NULL)
+    {
+        WSEvents_Put(Chan,"event: ",7);
+        WSEvents_Put(Chan,Event,strlen(Event));
+        WSEvents_Put(Chan,"\n",1);
+    }
+    Line=Data;
+    for(;;)
+    {
+        End=strchr(Line,'\n');
+        if(End==NULL)
+            End=Line+strlen(Line);
+        WSEvents_Put(Chan,"data: ",6);
+        WSEvents_Put(Chan,Line,End-Line);
+        WSEvents_Put(Chan,"\n",1);
+        if(*End==0)
+            break;
+        Line=End+1;
+    }
+    WSEvents_Put(Chan,"\n",1);
+
+    WSMetrics_Count(e_WSMetricCounter_EventsPublished,1);
+
+    /* Get it going (the first write usually takes the whole event) */
+    for(r=0;r<WS_OPT_EVENTS_SUBSCRIBERS;r++)
+    {
+        if(m_Subs[r].Web!=NULL && m_Subs[r].Channel==Chan &&
+                !m_Subs[r].Dropped && !WSEvents_Flush(&m_Subs[r]))
+        {
+            m_Subs[r].Dropped=true;
+        }
+    }
+
+    return Number;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSEvents_Count
+ *
+ * SYNOPSIS:
+ *    int WSEvents_Count(const char *Channel);
+ *
+ * PARAMETERS:
+ *    Channel [I] -- The channel to count
+ *
+ * FUNCTION:
+ *    This function counts the connections subscribed to a channel (so you
+ *    can skip building an event no one will get).
+ *
+ * RETURNS:
+ *    The number of subscribers.
+ *
+ * SEE ALSO:
+ *    WSEvents_Publish()
+ ******************************************************************************/
+int WSEvents_Count(const char *Channel)
+{
+    struct WSEventsChannel *Chan;
+    int Count;
+    int r;
+
+    Chan=WSEvents_FindChannel(Channel,false);
+    if(Chan==NULL)
+        return 0;
+
+    Count=0;
+    for(r=0;r<WS_OPT_EVENTS_SUBSCRIBERS;r++)
+        if(m_Subs[r].Web!=NULL && m_Subs[r].Channel==Chan)
+            Count++;
+
+    return Count;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSEvents_FindChannel
+ *
+ * SYNOPSIS:
+ *    static struct WSEventsChannel *WSEvents_FindChannel(const char *Name,
+ *          bool Make);
+ *
+ * PARAMETERS:
+ *    Name [I] -- The name of the channel
+ *    Make [I] -- Make the channel if there isn't one with this name
+ *
+ * FUNCTION:
+ *    This function finds a channel by name.  Channels aren't freed once
+ *    they are made (their ring is kept for browsers that resume).
+ *
+ * RETURNS:
+ *    The channel or NULL if it wasn't found (and couldn't be made).
+ *
+ * SEE ALSO:
+ *    WSEvents_Subscribe(), WSEvents_Publish()
+ ******************************************************************************/
+static struct WSEventsChannel *WSEvents_FindChannel(const char *Name,
+        bool Make)
+{
+    struct WSEventsChannel *Free;
+    int r;
+
+    if(Name[0]==0 || strlen(Name)>=WS_OPT_EVENTS_NAME_SIZE)
+        return NULL;
+
+    Free=NULL;
+    for(r=0;r<WS_OPT_EVENTS_CHANNELS;r++)
+    {
+        if(m_Channels[r].Name[0]==0)
+        {
+            if(Free==NULL)
+                Free=&m_Channels[r];
+        }
+        else if(strcmp(m_Channels[r].Name,Name)==0)
+        {
+            return &m_Channels[r];
+        }
+    }
+
+    if(!Make || Free==NULL)
+        return NULL;
+
+    strcpy(Free->Name,Name);
+    Free->NextNumber=1;
+    Free->Head=0;
+    Free->Tail=0;
+    Free->First=0;
+    Free->Count=0;
+
+    return Free;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSEvents_ResumePos
+ *
+ * SYNOPSIS:
+ *    static uint32_t WSEvents_ResumePos(struct WSEventsChannel *Channel,
+ *          const char *LastEventID);
+ *
+ * PARAMETERS:
+ *    Channel [I] -- The channel being subscribed to
+ *    LastEventID [I] -- The Last-Event-ID the browser sent ("" if none)
+ *
+ * FUNCTION:
+ *    This function works out where in the ring a new subscriber starts.
+ *    Without a Last-Event-ID it only gets new events.  With one from this
+ *    run it gets the events after that one, and with one from another run
+ *    (before a restart) it gets everything still in the ring.
+ *
+ * RETURNS:
+ *    The position in the ring to start sending from.
+ *
+ * SEE ALSO:
+ *    WSEvents_Subscribe()
+ ******************************************************************************/
+static uint32_t WSEvents_ResumePos(struct WSEventsChannel *Channel,
+        const char *LastEventID)
+{
+    struct WSEventsEntry *Entry;
+    unsigned long Run;
+    unsigned long Number;
+    char *End;
+    int r;
+
+    if(LastEventID[0]==0)
+        return Channel->Head;
+
+    Run=strtoul(LastEventID,&End,10);
+    if(*End!='-' || Run!=m_RunID)
+        return Channel->Tail;
+    Number=strtoul(End+1,NULL,10);
+
+    /* The first event after the one they have */
+    for(r=0;r<Channel->Count;r++)
+    {
+        Entry=&Channel->Events[(Channel->First+r)%WS_OPT_EVENTS_RING_EVENTS];
+        if(Entry->Number>Number)
+            return Entry->Pos;
+    }
+    return Channel->Head;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSEvents_Put
+ *
+ * SYNOPSIS:
+ *    static void WSEvents_Put(struct WSEventsChannel *Channel,
+ *          const char *Data,int Len);
+ *
+ * PARAMETERS:
+ *    Channel [I/O] -- The channel to add to
+ *    Data [I] -- The bytes to add
+ *    Len [I] -- The number of bytes in 'Data'
+ *
+ * FUNCTION:
+ *    This function adds bytes to the end of a channel's ring (wrapping
+ *    around to the start).  The caller has already made room.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSEvents_Publish()
+ ******************************************************************************/
+static void WSEvents_Put(struct WSEventsChannel *Channel,const char *Data,
+        int Len)
+{
+    uint32_t Start;
+    int First;
+
+    Start=Channel->Head&WSE_RING_MASK;
+    First=Len;
+    if(Start+First>WS_OPT_EVENTS_RING_SIZE)
+        First=WS_OPT_EVENTS_RING_SIZE-Start;
+
+    memcpy(&Channel->Ring[Start],Data,First);
+    memcpy(Channel->Ring,&Data[First],Len-First);
+    Channel->Head+=Len;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSEvents_Flush
+ *
+ * SYNOPSIS:
+ *    static bool WSEvents_Flush(struct WSEventsSub *Sub);
+ *
+ * PARAMETERS:
+ *    Sub [I/O] -- The subscription to send on
+ *
+ * FUNCTION:
+ *    This function sends a subscriber as much of what it hasn't had yet as
+ *    the connection will take right now.  It's sent straight out of the
+ *    channel's ring.
+ *
+ * RETURNS:
+ *    true -- Things worked out (there may still be more to send)
+ *    false -- The write failed or the ring wrote over what the subscriber
+ *             still needed
+ *
+ * SEE ALSO:
+ *    WSEvents_Run()
+ ******************************************************************************/
+static bool WSEvents_Flush(struct WSEventsSub *Sub)
+{
+    struct WSEventsChannel *Chan;
+    uint32_t Start;
+    int Len;
+    int Sent;
+
+    Chan=Sub->Channel;
+
+    if(Sub->KeepAliveLeft>0)
+    {
+        Sent=SocketsCon_WriteSome(&Sub->Web->Con,
+                &m_KeepAlive[sizeof(m_KeepAlive)-1-Sub->KeepAliveLeft],
+                Sub->KeepAliveLeft);
+        if(Sent<0)
+            return false;
+        Sub->KeepAliveLeft-=Sent;
+        if(Sub->KeepAliveLeft>0)
+            return true;
+    }
+
+    if((int32_t)(Sub->Pos-Chan->Tail)<0)
+    {
+        WSMetrics_Count(e_WSMetricCounter_EventsDropped,1);
+        return false;
+    }
+
+    while(Sub->Pos!=Chan->Head)
+    {
+        Start=Sub->Pos&WSE_RING_MASK;
+        Len=Chan->Head-Sub->Pos;
+        if(Start+Len>WS_OPT_EVENTS_RING_SIZE)
+            Len=WS_OPT_EVENTS_RING_SIZE-Start;
+
+        Sent=SocketsCon_WriteSome(&Sub->Web->Con,&Chan->Ring[Start],Len);
+        if(Sent<0)
+            return false;
+        if(Sent==0)
+            break;
+        WSMetrics_Count(e_WSMetricCounter_BytesOut,Sent);
+
+        Sub->Pos+=Sent;
+        Sub->LastSent=ReadElapsedClock();
+        if(Sent<Len)
+            break;
+    }
+    return true;
+}
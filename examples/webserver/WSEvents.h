@@ -0,0 +1,62 @@
+/*******************************************************************************
+ * FILENAME: WSEvents.h
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This has the server-sent event channels in it (WSEvents.c).
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ *******************************************************************************/
+#ifndef __WSEVENTS_H_
+#define __WSEVENTS_H_
+
+/***  HEADER FILES TO INCLUDE          ***/
+#include "WebServer.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/***  DEFINES                          ***/
+
+/***  MACROS                           ***/
+
+/***  TYPE DEFINITIONS                 ***/
+
+/***  CLASS DEFINITIONS                ***/
+
+/***  GLOBAL VARIABLE DEFINITIONS      ***/
+
+/***  EXTERNAL FUNCTION PROTOTYPES     ***/
+uint32_t WSEvents_Publish(const char *Channel,const char *Event,
+        const char *Data);
+int WSEvents_Count(const char *Channel);
+
+/* Web server calls these */
+void WSEvents_Init(void);
+struct WSEventsSub *WSEvents_Subscribe(struct WebServer *Web,
+        const char *Channel,const char *LastEventID);
+bool WSEvents_Run(struct WSEventsSub *Sub);
+void WSEvents_Release(struct WSEventsSub *Sub);
+
+#endif
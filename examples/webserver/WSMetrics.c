@@ -0,0 +1,662 @@
+/*******************************************************************************
+ * FILENAME: WSMetrics.c
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This file keeps the web server's counters and latency histograms and
+ *    sends them as a Prometheus text format page.
+ *
+ *    Each thread that records something gets it's own block of counters
+ *    so recording is just adding to a number only that thread writes (no
+ *    locks, no allocation).  The page adds up all the blocks when it is
+ *    sent.  The counters are relaxed atomics so the page can read them
+ *    while they are being updated.
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ ******************************************************************************/
+
+/*** HEADER FILES TO INCLUDE  ***/
+#include "WSMetrics.h"
+#include "WebServer.h"
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if WS_OPT_METRICS
+
+/*** DEFINES                  ***/
+#define WSM_BUCKETS                 17      // Not counting +Inf
+#define WSM_MAX_THREADS             (WS_OPT_OFFLOAD_THREADS+2)  // The web server thread + workers + one spare
+
+/*** MACROS                   ***/
+
+/*** TYPE DEFINITIONS         ***/
+struct WSMetricsHistogram
+{
+    _Atomic uint64_t Buckets[WSM_BUCKETS+1];    // Not cumulative, the last is +Inf
+    _Atomic uint64_t SumNS;
+    _Atomic uint64_t Count;
+};
+
+struct WSMetricsBlock
+{
+    _Atomic uint64_t Counters[e_WSMetricCounterMAX];
+    _Atomic uint64_t Requests[WS_OPT_METRICS_MAX_ROUTES][e_ReplyStatusMAX+1];
+    struct WSMetricsHistogram Phases[e_WSMetricPhaseMAX];
+};
+
+/*** FUNCTION PROTOTYPES      ***/
+static struct WSMetricsBlock *WSMetrics_GetBlock(void);
+static void WSMetrics_Add(_Atomic uint64_t *Value,uint64_t Add);
+static uint64_t WSMetrics_Sum(const _Atomic uint64_t *Value);
+static int WSMetrics_FindRoute(const char *Route);
+static void WSMetrics_Printf(struct WebServer *Web,const char *Fmt,...);
+
+/*** VARIABLE DEFINITIONS     ***/
+static struct WSMetricsBlock m_Blocks[WSM_MAX_THREADS];
+static atomic_int m_BlocksUsed;
+static __thread struct WSMetricsBlock *m_MyBlock;
+
+/* Route 0 is for anything that doesn't have a route name (404s) or when the
+   table is full.  Only the web server thread adds routes. */
+static const char *m_Routes[WS_OPT_METRICS_MAX_ROUTES];
+static atomic_int m_RouteCount;
+
+/* The top of each histogram bucket in ns and what it is called on the page */
+static const uint64_t m_BucketTops[WSM_BUCKETS]=
+{
+    50000ULL,100000ULL,250000ULL,500000ULL,
+    1000000ULL,2500000ULL,5000000ULL,10000000ULL,25000000ULL,50000000ULL,
+    100000000ULL,250000000ULL,500000000ULL,
+    1000000000ULL,2500000000ULL,5000000000ULL,10000000000ULL
+};
+static const char *m_BucketNames[WSM_BUCKETS+1]=
+{
+    "0.00005","0.0001","0.00025","0.0005",
+    "0.001","0.0025","0.005","0.01","0.025","0.05",
+    "0.1","0.25","0.5",
+    "1","2.5","5","10","+Inf"
+};
+
+static const char *m_CounterNames[e_WSMetricCounterMAX]=
+{
+    [e_WSMetricCounter_BytesIn]="bittyhttp_received_bytes_total",
+    [e_WSMetricCounter_BytesOut]="bittyhttp_sent_bytes_total",
+    [e_WSMetricCounter_Accepted]="bittyhttp_connections_accepted_total",
+    [e_WSMetricCounter_AcceptFailed]="bittyhttp_accept_failures_total",
+    [e_WSMetricCounter_Shed]="bittyhttp_connections_shed_total",
+    [e_WSMetricCounter_TimeoutIdle]="bittyhttp_timeouts_total{reason=\"idle\"}",
+    [e_WSMetricCounter_TimeoutStalled]=
+            "bittyhttp_timeouts_total{reason=\"stalled\"}",
+    [e_WSMetricCounter_TimeoutDeferred]=
+            "bittyhttp_timeouts_total{reason=\"deferred\"}",
+    [e_WSMetricCounter_TimeoutHeaders]=
+            "bittyhttp_timeouts_total{reason=\"headers\"}",
+    [e_WSMetricCounter_TimeoutBody]="bittyhttp_timeouts_total{reason=\"body\"}",
+    [e_WSMetricCounter_TimeoutSlow]="bittyhttp_timeouts_total{reason=\"slow\"}",
+    [e_WSMetricCounter_TimeoutProxy]="bittyhttp_timeouts_total{reason=\"proxy\"}",
+    [e_WSMetricCounter_ClientPoolHits]=
+            "bittyhttp_client_pool_total{result=\"hit\"}",
+    [e_WSMetricCounter_ClientPoolMisses]=
+            "bittyhttp_client_pool_total{result=\"miss\"}",
+    [e_WSMetricCounter_ClientPipelined]="bittyhttp_client_pipelined_total",
+    [e_WSMetricCounter_ClientRetries]="bittyhttp_client_retries_total",
+    [e_WSMetricCounter_ClientErrors]="bittyhttp_client_errors_total",
+    [e_WSMetricCounter_ProxyPoolHits]=
+            "bittyhttp_proxy_pool_total{result=\"hit\"}",
+    [e_WSMetricCounter_ProxyPoolMisses]=
+            "bittyhttp_proxy_pool_total{result=\"miss\"}",
+    [e_WSMetricCounter_ProxyRetries]="bittyhttp_proxy_retries_total",
+    [e_WSMetricCounter_ProxyErrors]="bittyhttp_proxy_errors_total",
+    [e_WSMetricCounter_WebSocketFramesIn]=
+            "bittyhttp_websocket_frames_total{direction=\"in\"}",
+    [e_WSMetricCounter_WebSocketFramesOut]=
+            "bittyhttp_websocket_frames_total{direction=\"out\"}",
+    [e_WSMetricCounter_WebSocketBroadcasts]=
+            "bittyhttp_websocket_broadcasts_total",
+    [e_WSMetricCounter_WebSocketDropped]="bittyhttp_websocket_dropped_total",
+    [e_WSMetricCounter_EventsPublished]="bittyhttp_events_published_total",
+    [e_WSMetricCounter_EventsDropped]="bittyhttp_events_dropped_total",
+};
+
+static const char *m_PhaseNames[e_WSMetricPhaseMAX]=
+{
+    [e_WSMetricPhase_Parse]="parse",
+    [e_WSMetricPhase_Handler]="handler",
+    [e_WSMetricPhase_Write]="write",
+    [e_WSMetricPhase_Total]="total",
+};
+
+static const char *m_StatusCodes[e_ReplyStatusMAX+1]=
+{
+    [e_ReplyStatus_SwitchingProtocols]="101",
+    [e_ReplyStatus_Ok]="200",
+    [e_ReplyStatus_MovedPerm]="301",
+    [e_ReplyStatus_NotModified]="304",
+    [e_ReplyStatus_TmpRedirect]="307",
+    [e_ReplyStatus_PermRedirect]="308",
+    [e_ReplyStatus_BadRequest]="400",
+    [e_ReplyStatus_Forbidden]="403",
+    [e_ReplyStatus_NotFound]="404",
+    [e_ReplyStatus_MethodNotAllowed]="405",
+    [e_ReplyStatus_URITooLong]="414",
+    [e_ReplyStatus_RequestHeaderFieldsTooLarge]="431",
+    [e_ReplyStatus_InternalServerError]="500",
+    [e_ReplyStatus_NotImplemented]="501",
+    [e_ReplyStatus_BadGateway]="502",
+    [e_ReplyStatus_GatewayTimeout]="504",
+    [e_ReplyStatus_HTTPVersionNotSupported]="505",
+    [e_ReplyStatus_InsufficientStorage]="507",
+    [e_ReplyStatusMAX]="none",  // Connection closed before a reply was sent
+};
+
+static const char *m_StateNames[e_WebServerStateMAX]=
+{
+    [e_WebServerState_Closed]="closed",
+    [e_WebServerState_Request]="request",
+    [e_WebServerState_Headers]="headers",
+    [e_WebServerState_Body]="body",
+    [e_WebServerState_Response]="response",
+    [e_WebServerState_Generating]="generating",
+    [e_WebServerState_Deferred]="deferred",
+    [e_WebServerState_Offloaded]="offloaded",
+    [e_WebServerState_Proxying]="proxying",
+    [e_WebServerState_WebSocket]="websocket",
+    [e_WebServerState_Events]="events",
+};
+
+/*******************************************************************************
+ * NAME:
+ *    WSMetrics_Init
+ *
+ * SYNOPSIS:
+ *    void WSMetrics_Init(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function sets up the metrics.  It is called from WS_Init() before
+ *    any other threads are started.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+void WSMetrics_Init(void)
+{
+    m_Routes[0]="other";
+    atomic_store(&m_RouteCount,1);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSMetrics_Now
+ *
+ * SYNOPSIS:
+ *    uint64_t WSMetrics_Now(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function gets the time to use for measuring how long things take.
+ *
+ * RETURNS:
+ *    A time in ns.  This only has meaning compared to another call to this
+ *    function.  It is never 0.
+ *
+ * SEE ALSO:
+ *    WSMetrics_RecordPhase()
+ ******************************************************************************/
+uint64_t WSMetrics_Now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec+1;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSMetrics_Count
+ *
+ * SYNOPSIS:
+ *    void WSMetrics_Count(e_WSMetricCounterType Counter,uint64_t Add);
+ *
+ * PARAMETERS:
+ *    Counter [I] -- The counter to add to
+ *    Add [I] -- How much to add
+ *
+ * FUNCTION:
+ *    This function adds to one of the counters.  It can be called from any
+ *    thread.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+void WSMetrics_Count(e_WSMetricCounterType Counter,uint64_t Add)
+{
+    struct WSMetricsBlock *Block;
+
+    Block=WSMetrics_GetBlock();
+    if(Block==NULL)
+        return;
+
+    WSMetrics_Add(&Block->Counters[Counter],Add);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSMetrics_RecordPhase
+ *
+ * SYNOPSIS:
+ *    void WSMetrics_RecordPhase(e_WSMetricPhaseType Phase,uint64_t NS);
+ *
+ * PARAMETERS:
+ *    Phase [I] -- What part of handling a request this is for
+ *    NS [I] -- How long it took
+ *
+ * FUNCTION:
+ *    This function adds a time to the histogram for a phase.  It can be
+ *    called from any thread.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSMetrics_Now()
+ ******************************************************************************/
+void WSMetrics_RecordPhase(e_WSMetricPhaseType Phase,uint64_t NS)
+{
+    struct WSMetricsBlock *Block;
+    struct WSMetricsHistogram *Hist;
+    int b;
+
+    Block=WSMetrics_GetBlock();
+    if(Block==NULL)
+        return;
+
+    for(b=0;b<WSM_BUCKETS;b++)
+        if(NS<=m_BucketTops[b])
+            break;
+
+    Hist=&Block->Phases[Phase];
+    WSMetrics_Add(&Hist->Buckets[b],1);
+    WSMetrics_Add(&Hist->SumNS,NS);
+    WSMetrics_Add(&Hist->Count,1);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSMetrics_CountRequest
+ *
+ * SYNOPSIS:
+ *    void WSMetrics_CountRequest(const char *Route,e_ReplyStatusType Status);
+ *
+ * PARAMETERS:
+ *    Route [I] -- The name of the page (from WSPageProp.Route).  This must
+ *                 be a string that stays around (not a copy of the URL).
+ *                 NULL for "other".
+ *    Status [I] -- The status that was sent (e_ReplyStatusMAX for none)
+ *
+ * FUNCTION:
+ *    This function counts a finished request.  It must only be called from
+ *    the web server thread.
+ *
+ *    Routes are added to the table the first time they are seen.  When
+ *    the table is full (WS_OPT_METRICS_MAX_ROUTES) new routes are counted
+ *    as "other".
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+void WSMetrics_CountRequest(const char *Route,e_ReplyStatusType Status)
+{
+    struct WSMetricsBlock *Block;
+
+    Block=WSMetrics_GetBlock();
+    if(Block==NULL)
+        return;
+
+    WSMetrics_Add(&Block->Requests[WSMetrics_FindRoute(Route)][Status],1);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSMetrics_WritePage
+ *
+ * SYNOPSIS:
+ *    void WSMetrics_WritePage(struct WebServer *Web,
+ *          const struct WSMetricsPool *Pool);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to send the page on
+ *    Pool [I] -- Info about the connections right now
+ *
+ * FUNCTION:
+ *    This function sends all the metrics in the Prometheus text format
+ *    (version 0.0.4).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+void WSMetrics_WritePage(struct WebServer *Web,
+        const struct WSMetricsPool *Pool)
+{
+    int Routes;
+    int Counter;
+    int Phase;
+    int Route;
+    int Status;
+    int State;
+    int b;
+    uint64_t Value;
+    uint64_t Cumulative;
+    const char *LastName;
+    int NameLen;
+
+    WS_Header(Web,"Content-Type: text/plain; version=0.0.4");
+
+    /* Requests by route and status */
+    WSMetrics_Printf(Web,"# HELP bittyhttp_requests_total Requests by route "
+            "and reply status.\n# TYPE bittyhttp_requests_total counter\n");
+    Routes=atomic_load(&m_RouteCount);
+    for(Route=0;Route<Routes;Route++)
+    {
+        for(Status=0;Status<=e_ReplyStatusMAX;Status++)
+        {
+            Value=WSMetrics_Sum(&m_Blocks[0].Requests[Route][Status]);
+            if(Value==0)
+                continue;
+            WSMetrics_Printf(Web,"bittyhttp_requests_total{route=\"%s\","
+                    "status=\"%s\"} %llu\n",m_Routes[Route],
+                    m_StatusCodes[Status],(unsigned long long)Value);
+        }
+    }
+
+    /* Plain counters (the timeouts share a name with different labels) */
+    LastName="";
+    for(Counter=0;Counter<e_WSMetricCounterMAX;Counter++)
+    {
+        NameLen=strcspn(m_CounterNames[Counter],"{");
+        if(strncmp(LastName,m_CounterNames[Counter],NameLen)!=0)
+        {
+            WSMetrics_Printf(Web,"# TYPE %.*s counter\n",NameLen,
+                    m_CounterNames[Counter]);
+        }
+        LastName=m_CounterNames[Counter];
+        WSMetrics_Printf(Web,"%s %llu\n",m_CounterNames[Counter],
+                (unsigned long long)WSMetrics_Sum(&m_Blocks[0].Counters[Counter]));
+    }
+
+    /* Phase timings */
+    WSMetrics_Printf(Web,"# HELP bittyhttp_phase_seconds Time spent in each "
+            "phase of a request.\n# TYPE bittyhttp_phase_seconds histogram\n");
+    for(Phase=0;Phase<e_WSMetricPhaseMAX;Phase++)
+    {
+        Cumulative=0;
+        for(b=0;b<=WSM_BUCKETS;b++)
+        {
+            Cumulative+=WSMetrics_Sum(&m_Blocks[0].Phases[Phase].Buckets[b]);
+            WSMetrics_Printf(Web,"bittyhttp_phase_seconds_bucket{phase=\"%s\","
+                    "le=\"%s\"} %llu\n",m_PhaseNames[Phase],m_BucketNames[b],
+                    (unsigned long long)Cumulative);
+        }
+        Value=WSMetrics_Sum(&m_Blocks[0].Phases[Phase].SumNS);
+        WSMetrics_Printf(Web,"bittyhttp_phase_seconds_sum{phase=\"%s\"} "
+                "%llu.%09llu\n",m_PhaseNames[Phase],
+                (unsigned long long)(Value/1000000000ULL),
+                (unsigned long long)(Value%1000000000ULL));
+        WSMetrics_Printf(Web,"bittyhttp_phase_seconds_count{phase=\"%s\"} "
+                "%llu\n",m_PhaseNames[Phase],(unsigned long long)
+                WSMetrics_Sum(&m_Blocks[0].Phases[Phase].Count));
+    }
+
+    /* Connection pool */
+    WSMetrics_Printf(Web,"# HELP bittyhttp_connections Connections by state."
+            "\n# TYPE bittyhttp_connections gauge\n");
+    for(State=0;State<e_WebServerStateMAX;State++)
+    {
+        WSMetrics_Printf(Web,"bittyhttp_connections{state=\"%s\"} %d\n",
+                m_StateNames[State],Pool->States[State]);
+    }
+    WSMetrics_Printf(Web,"# TYPE bittyhttp_connections_max gauge\n"
+            "bittyhttp_connections_max %d\n",Pool->MaxConnections);
+    WSMetrics_Printf(Web,"# TYPE bittyhttp_offload_workers gauge\n"
+            "bittyhttp_offload_workers %d\n",Pool->Workers);
+    WSMetrics_Printf(Web,"# TYPE bittyhttp_offload_workers_busy gauge\n"
+            "bittyhttp_offload_workers_busy %d\n",Pool->WorkersBusy);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSMetrics_GetBlock
+ *
+ * SYNOPSIS:
+ *    static struct WSMetricsBlock *WSMetrics_GetBlock(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function gets the block of counters for the thread that called
+ *    it.  The first time a thread calls this it is given the next free
+ *    block.
+ *
+ * RETURNS:
+ *    The block of counters or NULL if there are more threads than blocks
+ *    (anything that thread records is dropped).
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+static struct WSMetricsBlock *WSMetrics_GetBlock(void)
+{
+    int Index;
+
+    if(m_MyBlock==NULL)
+    {
+        Index=atomic_fetch_add(&m_BlocksUsed,1);
+        if(Index>=WSM_MAX_THREADS)
+            return NULL;
+        m_MyBlock=&m_Blocks[Index];
+    }
+    return m_MyBlock;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSMetrics_Add
+ *
+ * SYNOPSIS:
+ *    static void WSMetrics_Add(_Atomic uint64_t *Value,uint64_t Add);
+ *
+ * PARAMETERS:
+ *    Value [I/O] -- The counter to add to
+ *    Add [I] -- How much to add
+ *
+ * FUNCTION:
+ *    This function adds to a counter in this thread's block.  Only this
+ *    thread writes it so this is a plain load and store (no locked add).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSMetrics_Sum()
+ ******************************************************************************/
+static void WSMetrics_Add(_Atomic uint64_t *Value,uint64_t Add)
+{
+    atomic_store_explicit(Value,
+            atomic_load_explicit(Value,memory_order_relaxed)+Add,
+            memory_order_relaxed);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSMetrics_Sum
+ *
+ * SYNOPSIS:
+ *    static uint64_t WSMetrics_Sum(const _Atomic uint64_t *Value);
+ *
+ * PARAMETERS:
+ *    Value [I] -- The counter in m_Blocks[0] to add up
+ *
+ * FUNCTION:
+ *    This function adds up a counter over all the thread blocks.  The
+ *    counter is passed as it's address in the first block and the same
+ *    offset is used in the others.
+ *
+ * RETURNS:
+ *    The total
+ *
+ * SEE ALSO:
+ *    WSMetrics_Add()
+ ******************************************************************************/
+static uint64_t WSMetrics_Sum(const _Atomic uint64_t *Value)
+{
+    size_t Offset;
+    uint64_t Total;
+    int Blocks;
+    int r;
+
+    Offset=(const char *)Value-(const char *)&m_Blocks[0];
+    Blocks=atomic_load(&m_BlocksUsed);
+    if(Blocks>WSM_MAX_THREADS)
+        Blocks=WSM_MAX_THREADS;
+
+    Total=0;
+    for(r=0;r<Blocks;r++)
+    {
+        Total+=atomic_load_explicit((const _Atomic uint64_t *)
+                ((const char *)&m_Blocks[r]+Offset),memory_order_relaxed);
+    }
+    return Total;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSMetrics_FindRoute
+ *
+ * SYNOPSIS:
+ *    static int WSMetrics_FindRoute(const char *Route);
+ *
+ * PARAMETERS:
+ *    Route [I] -- The route name to look up (NULL for "other")
+ *
+ * FUNCTION:
+ *    This function finds a route in the route table, adding it if it's
+ *    not there.
+ *
+ * RETURNS:
+ *    The index of the route (0 for "other")
+ *
+ * SEE ALSO:
+ *    WSMetrics_CountRequest()
+ ******************************************************************************/
+static int WSMetrics_FindRoute(const char *Route)
+{
+    int Count;
+    int r;
+
+    if(Route==NULL)
+        return 0;
+
+    Count=atomic_load_explicit(&m_RouteCount,memory_order_relaxed);
+
+    /* Route names are normally the same pointer every time */
+    for(r=1;r<Count;r++)
+        if(m_Routes[r]==Route)
+            return r;
+    for(r=1;r<Count;r++)
+        if(strcmp(m_Routes[r],Route)==0)
+            return r;
+
+    if(Count>=WS_OPT_METRICS_MAX_ROUTES)
+        return 0;
+
+    m_Routes[Count]=Route;
+    atomic_store_explicit(&m_RouteCount,Count+1,memory_order_release);
+
+    return Count;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSMetrics_Printf
+ *
+ * SYNOPSIS:
+ *    static void WSMetrics_Printf(struct WebServer *Web,const char *Fmt,...);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to send on
+ *    Fmt [I] -- printf() format
+ *    ... [I] -- The args for 'Fmt'
+ *
+ * FUNCTION:
+ *    This function sends a printf() formatted chunk of the page.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * LIMITATIONS:
+ *    Each call is clipped to 255 chars.
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+static void WSMetrics_Printf(struct WebServer *Web,const char *Fmt,...)
+{
+    char buff[256];
+    va_list ap;
+    int Len;
+
+    va_start(ap,Fmt);
+    Len=vsnprintf(buff,sizeof(buff),Fmt,ap);
+    va_end(ap);
+
+    if(Len<0)
+        return;
+    if(Len>=(int)sizeof(buff))
+        Len=sizeof(buff)-1;
+
+    WS_WriteChunk(Web,buff,Len);
+}
+
+#endif
@@ -0,0 +1,118 @@
+/*******************************************************************************
+ * FILENAME: WSMetrics.h
+ * 
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This file has the counters and histograms the web server keeps about
+ *    what it's doing, and the page that sends them in the Prometheus text
+ *    format.
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ *******************************************************************************/
+#ifndef __WSMETRICS_H_
+#define __WSMETRICS_H_
+
+/***  HEADER FILES TO INCLUDE          ***/
+#include "WebServer.h"
+#include <stdint.h>
+
+/***  DEFINES                          ***/
+
+/***  MACROS                           ***/
+#if !WS_OPT_METRICS
+#define WSMetrics_Init()
+#define WSMetrics_Now()                             0
+#define WSMetrics_Count(Counter,Add)
+#define WSMetrics_RecordPhase(Phase,NS)
+#define WSMetrics_CountRequest(Route,Status)
+#endif
+
+/***  TYPE DEFINITIONS                 ***/
+typedef enum
+{
+    e_WSMetricCounter_BytesIn,
+    e_WSMetricCounter_BytesOut,
+    e_WSMetricCounter_Accepted,
+    e_WSMetricCounter_AcceptFailed,
+    e_WSMetricCounter_Shed,                 // Sent a 503 because we were full
+    e_WSMetricCounter_TimeoutIdle,          // Client stopped sending
+    e_WSMetricCounter_TimeoutStalled,       // Client stopped taking a generated reply
+    e_WSMetricCounter_TimeoutDeferred,      // Deferred reply wasn't completed
+    e_WSMetricCounter_TimeoutHeaders,       // Client took too long to send the headers
+    e_WSMetricCounter_TimeoutBody,          // Client took too long to send the body
+    e_WSMetricCounter_TimeoutSlow,          // Client sent the request too slowly
+    e_WSMetricCounter_TimeoutProxy,         // Upstream server stopped taking or sending
+    e_WSMetricCounter_ClientPoolHits,       // WSClient.c request went on an open connection
+    e_WSMetricCounter_ClientPoolMisses,     // WSClient.c request needed a new connection
+    e_WSMetricCounter_ClientPipelined,      // WSClient.c request sent behind one not answered yet
+    e_WSMetricCounter_ClientRetries,        // WSClient.c request sent again after the connection closed
+    e_WSMetricCounter_ClientErrors,         // WSClient.c request failed
+    e_WSMetricCounter_ProxyPoolHits,        // Proxied request went on a kept open upstream connection
+    e_WSMetricCounter_ProxyPoolMisses,      // Proxied request needed a new upstream connection
+    e_WSMetricCounter_ProxyRetries,         // Proxied request sent again after the upstream closed a kept connection
+    e_WSMetricCounter_ProxyErrors,          // Proxied request failed because of the upstream (502 or hung up)
+    e_WSMetricCounter_WebSocketFramesIn,    // WebSocket frame came in from a client
+    e_WSMetricCounter_WebSocketFramesOut,   // WebSocket frame was sent to a client
+    e_WSMetricCounter_WebSocketBroadcasts,  // WSWebSocket_Broadcast() built a frame
+    e_WSMetricCounter_WebSocketDropped,     // WebSocket client hung up on because its queue was full
+    e_WSMetricCounter_EventsPublished,      // WSEvents_Publish() wrote an event into a channel
+    e_WSMetricCounter_EventsDropped,        // Event stream hung up on because it fell behind its channel's ring
+    e_WSMetricCounterMAX
+} e_WSMetricCounterType;
+
+typedef enum
+{
+    e_WSMetricPhase_Parse,      // First byte of the request to the end of the body
+    e_WSMetricPhase_Handler,    // Time spent in the page (FS_SendFile() etc)
+    e_WSMetricPhase_Write,      // Time spent writing to the socket
+    e_WSMetricPhase_Total,      // First byte of the request to the end of the reply
+    e_WSMetricPhaseMAX
+} e_WSMetricPhaseType;
+
+/* Info about the connections that is read when the page is sent */
+struct WSMetricsPool
+{
+    int States[e_WebServerStateMAX];    // How many connections are in each state
+    int MaxConnections;
+    int Workers;
+    int WorkersBusy;
+};
+
+/***  CLASS DEFINITIONS                ***/
+
+/***  GLOBAL VARIABLE DEFINITIONS      ***/
+
+/***  EXTERNAL FUNCTION PROTOTYPES     ***/
+#if WS_OPT_METRICS
+void WSMetrics_Init(void);
+uint64_t WSMetrics_Now(void);
+void WSMetrics_Count(e_WSMetricCounterType Counter,uint64_t Add);
+void WSMetrics_RecordPhase(e_WSMetricPhaseType Phase,uint64_t NS);
+void WSMetrics_CountRequest(const char *Route,e_ReplyStatusType Status);
+void WSMetrics_WritePage(struct WebServer *Web,
+        const struct WSMetricsPool *Pool);
+#endif
+
+#endif
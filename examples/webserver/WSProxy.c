@@ -0,0 +1,1570 @@
+/*******************************************************************************
+ * FILENAME: WSProxy.c
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This file has the reverse proxy.  Routes in FileServer.c that have an
+ *    upstream ("host:port" or "unix:/path") are passed on to that server
+ *    instead of being answered here, so helper daemons on the same board
+ *    can be put behind the web server.
+ *
+ *    WebServer.c gets a connection with WSProxy_Open() when the request
+ *    line comes in and gives it the request line and headers as they are
+ *    read (hop-by-hop headers, and the headers the Connection: header
+ *    lists, are dropped both ways).  Once the headers are done
+ *    WSProxy_Run() is called from WS_Tick() until the response has all been
+ *    sent.  Nothing in here waits on the network.
+ *
+ *    The request body and the response body are moved between the sockets
+ *    with splice() (see SocketsCon_Relay()) so the body bytes never come
+ *    into our memory.  Only the heads, and the size lines of a chunked
+ *    response, are read (chunked responses are passed on as they are, the
+ *    size lines are peeked at to find where each chunk ends).
+ *
+ *    Connections to the upstreams are kept open after a response (unless
+ *    the upstream says not to) and reused for the next request to the same
+ *    upstream.  If a kept open connection turns out to have been closed by
+ *    the upstream the request is sent again once on a new connection (as
+ *    long as none of the body had to be spliced).
+ *
+ *    Request bodies have to have a Content-Length (chunked request bodies
+ *    get a 501).  Upgrades (WebSockets) aren't passed on.
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ ******************************************************************************/
+
+/*** HEADER FILES TO INCLUDE  ***/
+#include "WSProxy.h"
+#include "WSMetrics.h"
+#include "WebServer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*** DEFINES                  ***/
+#define WSP_RELAY_SIZE              (1024*1024) // The most we ask SocketsCon_Relay() to move at once (the pipe takes less)
+#define WSP_MAX_TURNS               32          // The steps WSProxy_Run() takes before letting the other connections have a turn
+#define WSP_HEAD_EXTRA              32          // Room for the headers we add to a response head ("Connection: close")
+#define WSP_CONNECTION_SIZE         64          // Room for the header names the client's Connection: headers list
+
+/*** MACROS                   ***/
+
+/*** TYPE DEFINITIONS         ***/
+typedef enum
+{
+    e_WSProxyStep_Connecting,   // Waiting for the connect to finish (then the head is sent)
+    e_WSProxyStep_Body,         // Passing the rest of the request body to the upstream
+    e_WSProxyStep_Head,         // Waiting for the response head
+    e_WSProxyStep_Length,       // Passing a Content-Length body to the client
+    e_WSProxyStep_Chunked,      // Passing a chunked body to the client
+    e_WSProxyStep_UntilClose,   // Passing the body to the client until the upstream hangs up
+    e_WSProxyStep_Done,         // Sending what's left in the pipe
+    e_WSProxyStepMAX
+} e_WSProxyStepType;
+
+struct WSProxyCon
+{
+    struct SocketCon Con;
+    struct SocketConRelay Relay;
+    const char *Upstream;   // The server this is connected to (NULL=the slot is free)
+    bool Busy;              // A request is using it (false=kept open for the next one)
+    bool Reused;            // This request went on a connection kept from an earlier one
+    bool Retried;           // This request has already been sent again
+    bool Failed;            // Something went wrong, don't keep the connection
+    bool Answered;          // Some of the response has come in
+    bool Replied;           // Some of the response has been sent to the client
+    bool BodySent;          // Some of the request body was spliced (so it can't be sent again)
+    bool HeadRequest;       // The response has no body
+    bool ExpectContinue;    // The client is waiting for a 100 Continue before sending the body
+    bool KeepAlive;         // The upstream will keep the connection open after this response
+    bool CloseClient;       // Hang up on the client after this response
+    bool LastChunk;         // 'Left' is the last chunk and the trailers
+    int Status;
+    t_ElapsedTime LastActive;
+    e_WSProxyStepType Step;
+    uint32_t BodyLeft;      // Request body still to come from the client
+    uint64_t Left;          // Response body (or the current chunk) still to send
+    int ConnectionLen;
+    char Connection[WSP_CONNECTION_SIZE];   // The values of the client's Connection: headers (comma separated)
+    int HeadLen;
+    char Head[WS_OPT_PROXY_HEAD_SIZE];
+};
+
+/*** FUNCTION PROTOTYPES      ***/
+static bool WSProxy_Connect(struct WSProxyCon *Proxy);
+static void WSProxy_Close(struct WSProxyCon *Proxy);
+static bool WSProxy_AddHead(struct WSProxyCon *Proxy,const char *Data,int Len);
+static bool WSProxy_IsHeader(const char *Line,const char *Name);
+static bool WSProxy_HasToken(const char *Line,int LineLen,const char *Token);
+static bool WSProxy_IsListed(const char *List,int ListLen,const char *Line,
+        int LineLen);
+static bool WSProxy_ConnectionLists(const char *Head,int Start,int HeadLen,
+        const char *Line,int LineLen);
+static void WSProxy_DropListed(struct WSProxyCon *Proxy);
+static int WSProxy_Find(const char *Buff,int Start,int Len,const char *Str);
+static e_WSProxyResultType WSProxy_SendHead(struct WSProxyCon *Proxy,
+        struct SocketCon *Client,int HeadLen);
+static e_WSProxyResultType WSProxy_NextChunk(struct WSProxyCon *Proxy);
+static int WSProxy_Relay(struct WSProxyCon *Proxy,struct SocketCon *From,
+        struct SocketCon *To,uint64_t MaxLen);
+static e_WSProxyResultType WSProxy_Waiting(struct WSProxyCon *Proxy);
+static e_WSProxyResultType WSProxy_UpstreamLost(struct WSProxyCon *Proxy);
+static e_WSProxyResultType WSProxy_BadResponse(struct WSProxyCon *Proxy);
+
+/*** VARIABLE DEFINITIONS     ***/
+static struct WSProxyCon m_ProxyCons[WS_OPT_PROXY_CONNECTIONS];
+
+/* Headers that are about the connection to us, not the request */
+static const char *m_HopByHop[]=
+{
+    "Connection",
+    "Keep-Alive",
+    "Proxy-Connection",
+    "TE",
+    "Trailer",
+    "Upgrade",
+    NULL
+};
+
+static const char m_Continue[]="HTTP/1.1 100 Continue\r\n\r\n";
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_Init
+ *
+ * SYNOPSIS:
+ *    void WSProxy_Init(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function sets up the reverse proxy.  It's called from WS_Init().
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSProxy_Shutdown()
+ ******************************************************************************/
+void WSProxy_Init(void)
+{
+    int r;
+
+    for(r=0;r<WS_OPT_PROXY_CONNECTIONS;r++)
+    {
+        SocketsCon_InitSockCon(&m_ProxyCons[r].Con);
+        SocketsCon_InitRelay(&m_ProxyCons[r].Relay);
+        m_ProxyCons[r].Upstream=NULL;
+        m_ProxyCons[r].Busy=false;
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_Shutdown
+ *
+ * SYNOPSIS:
+ *    void WSProxy_Shutdown(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function closes all the upstream connections.  It's called from
+ *    WS_Shutdown().
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSProxy_Init()
+ ******************************************************************************/
+void WSProxy_Shutdown(void)
+{
+    int r;
+
+    for(r=0;r<WS_OPT_PROXY_CONNECTIONS;r++)
+        WSProxy_Close(&m_ProxyCons[r]);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_Tick
+ *
+ * SYNOPSIS:
+ *    void WSProxy_Tick(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function closes upstream connections that have been kept open
+ *    without being used for WS_OPT_PROXY_IDLE_TIMEOUT seconds.  It's called
+ *    from WS_Tick().
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSProxy_Release()
+ ******************************************************************************/
+void WSProxy_Tick(void)
+{
+    t_ElapsedTime Now;
+    int r;
+
+    Now=ReadElapsedClock();
+    for(r=0;r<WS_OPT_PROXY_CONNECTIONS;r++)
+    {
+        if(m_ProxyCons[r].Upstream!=NULL && !m_ProxyCons[r].Busy &&
+                Now-m_ProxyCons[r].LastActive>=WS_OPT_PROXY_IDLE_TIMEOUT)
+        {
+            WSProxy_Close(&m_ProxyCons[r]);
+        }
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_Open
+ *
+ * SYNOPSIS:
+ *    struct WSProxyCon *WSProxy_Open(const char *Upstream);
+ *
+ * PARAMETERS:
+ *    Upstream [I] -- The server to pass the request on to.  This is
+ *                    "host:port" ("[addr]:port" for an IPv6 address) or
+ *                    "unix:" followed by the path of a unix domain socket.
+ *                    This must stay around until the connection is closed
+ *                    (it's kept to match the next request to).
+ *
+ * FUNCTION:
+ *    This function gets a connection to an upstream for a request.  A
+ *    connection kept open from an earlier request to the same upstream is
+ *    used if there is one, otherwise a new one is started (if all the
+ *    connections are being kept open for other upstreams the one that has
+ *    been idle longest is closed).
+ *
+ *    A connect to a "host:port" upstream finishes in WSProxy_Run().
+ *
+ * RETURNS:
+ *    The connection to build the request on or NULL if we couldn't get one
+ *    (all in use, a bad 'Upstream', or a unix socket no one is listening
+ *    on).
+ *
+ * SEE ALSO:
+ *    WSProxy_AddRequestLine(), WSProxy_Release()
+ ******************************************************************************/
+struct WSProxyCon *WSProxy_Open(const char *Upstream)
+{
+    struct WSProxyCon *Proxy;
+    struct WSProxyCon *Free;
+    struct WSProxyCon *Oldest;
+    char Junk;
+    int r;
+
+    Proxy=NULL;
+    Free=NULL;
+    Oldest=NULL;
+    for(r=0;r<WS_OPT_PROXY_CONNECTIONS;r++)
+    {
+        if(m_ProxyCons[r].Upstream==NULL)
+        {
+            if(Free==NULL)
+                Free=&m_ProxyCons[r];
+            continue;
+        }
+        if(m_ProxyCons[r].Busy)
+            continue;
+
+        if(strcmp(m_ProxyCons[r].Upstream,Upstream)==0)
+        {
+            /* It's no good if the upstream closed it (or sent something
+               we didn't ask for) */
+            if(SocketsCon_Peek(&m_ProxyCons[r].Con,&Junk,1)==0)
+            {
+                Proxy=&m_ProxyCons[r];
+                break;
+            }
+            WSProxy_Close(&m_ProxyCons[r]);
+            if(Free==NULL)
+                Free=&m_ProxyCons[r];
+            continue;
+        }
+
+        if(Oldest==NULL || m_ProxyCons[r].LastActive<Oldest->LastActive)
+            Oldest=&m_ProxyCons[r];
+    }
+
+    if(Proxy!=NULL)
+    {
+        WSMetrics_Count(e_WSMetricCounter_ProxyPoolHits,1);
+        Proxy->Reused=true;
+    }
+    else
+    {
+        if(Free==NULL)
+        {
+            if(Oldest==NULL)
+            {
+                WSMetrics_Count(e_WSMetricCounter_ProxyErrors,1);
+                return NULL;
+            }
+            WSProxy_Close(Oldest);
+            Free=Oldest;
+        }
+
+        Proxy=Free;
+        Proxy->Upstream=Upstream;
+        if(!WSProxy_Connect(Proxy))
+        {
+            WSProxy_Close(Proxy);
+            WSMetrics_Count(e_WSMetricCounter_ProxyErrors,1);
+            return NULL;
+        }
+        WSMetrics_Count(e_WSMetricCounter_ProxyPoolMisses,1);
+        Proxy->Reused=false;
+    }
+
+    Proxy->Busy=true;
+    Proxy->Retried=false;
+    Proxy->Failed=false;
+    Proxy->Answered=false;
+    Proxy->Replied=false;
+    Proxy->BodySent=false;
+    Proxy->HeadRequest=false;
+    Proxy->ExpectContinue=false;
+    Proxy->KeepAlive=false;
+    Proxy->CloseClient=false;
+    Proxy->LastChunk=false;
+    Proxy->Status=0;
+    Proxy->LastActive=ReadElapsedClock();
+    Proxy->Step=e_WSProxyStep_Connecting;
+    Proxy->BodyLeft=0;
+    Proxy->Left=0;
+    Proxy->ConnectionLen=0;
+    Proxy->HeadLen=0;
+
+    return Proxy;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_AddRequestLine
+ *
+ * SYNOPSIS:
+ *    bool WSProxy_AddRequestLine(struct WSProxyCon *Proxy,const char *Method,
+ *          int MethodLen,const char *Path,const char *Args);
+ *
+ * PARAMETERS:
+ *    Proxy [I/O] -- The connection from WSProxy_Open()
+ *    Method [I] -- The request method (doesn't have to end in a \0)
+ *    MethodLen [I] -- The number of chars in 'Method'
+ *    Path [I] -- The path that was asked for
+ *    Args [I] -- The query string (without the '?', "" for none)
+ *
+ * FUNCTION:
+ *    This function starts the request that will be sent to the upstream.
+ *    Call it first, then WSProxy_AddHeader() for each header.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- It doesn't fit in WS_OPT_PROXY_HEAD_SIZE
+ *
+ * SEE ALSO:
+ *    WSProxy_Open(), WSProxy_AddHeader()
+ ******************************************************************************/
+bool WSProxy_AddRequestLine(struct WSProxyCon *Proxy,const char *Method,
+        int MethodLen,const char *Path,const char *Args)
+{
+    Proxy->HeadRequest=(MethodLen==4 && strncmp(Method,"HEAD",4)==0);
+
+    if(!WSProxy_AddHead(Proxy,Method,MethodLen) ||
+            !WSProxy_AddHead(Proxy," ",1) ||
+            !WSProxy_AddHead(Proxy,Path,strlen(Path)))
+    {
+        return false;
+    }
+    if(*Args!=0)
+    {
+        if(!WSProxy_AddHead(Proxy,"?",1) ||
+                !WSProxy_AddHead(Proxy,Args,strlen(Args)))
+        {
+            return false;
+        }
+    }
+    return WSProxy_AddHead(Proxy," HTTP/1.1\r\n",11);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_AddHeader
+ *
+ * SYNOPSIS:
+ *    e_ReplyStatusType WSProxy_AddHeader(struct WSProxyCon *Proxy,
+ *          const char *Line);
+ *
+ * PARAMETERS:
+ *    Proxy [I/O] -- The connection from WSProxy_Open()
+ *    Line [I] -- The header line from the client (without the \r\n)
+ *
+ * FUNCTION:
+ *    This function adds a header to the request that will be sent to the
+ *    upstream.  Hop-by-hop headers (Connection, Keep-Alive, Upgrade, ...)
+ *    are dropped.  The names a Connection: header lists are kept and those
+ *    headers are dropped from the request in WSProxy_Start() (they can
+ *    come before or after the Connection: header).  "Expect: 100-continue"
+ *    is answered by us in WSProxy_Start() instead of being passed on.
+ *
+ * RETURNS:
+ *    e_ReplyStatusMAX if things worked out, or the error to send the client:
+ *      e_ReplyStatus_RequestHeaderFieldsTooLarge -- It doesn't fit in
+ *              WS_OPT_PROXY_HEAD_SIZE (or the Connection: headers list
+ *              more than we have room to remember)
+ *      e_ReplyStatus_NotImplemented -- The body is sent chunked
+ *
+ * SEE ALSO:
+ *    WSProxy_AddRequestLine(), WSProxy_Start()
+ ******************************************************************************/
+e_ReplyStatusType WSProxy_AddHeader(struct WSProxyCon *Proxy,
+        const char *Line)
+{
+    const char *Value;
+    int Len;
+    int r;
+
+    if(WSProxy_IsHeader(Line,"Connection"))
+    {
+        /* Remember what it lists so WSProxy_Start() can drop them */
+        Value=&Line[11];
+        Len=strlen(Value);
+        if(Proxy->ConnectionLen+Len+1>WSP_CONNECTION_SIZE)
+            return e_ReplyStatus_RequestHeaderFieldsTooLarge;
+        if(Proxy->ConnectionLen>0)
+            Proxy->Connection[Proxy->ConnectionLen++]=',';
+        memcpy(&Proxy->Connection[Proxy->ConnectionLen],Value,Len);
+        Proxy->ConnectionLen+=Len;
+        return e_ReplyStatusMAX;
+    }
+
+    for(r=0;m_HopByHop[r]!=NULL;r++)
+        if(WSProxy_IsHeader(Line,m_HopByHop[r]))
+            return e_ReplyStatusMAX;
+
+    if(WSProxy_IsHeader(Line,"Expect"))
+    {
+        if(WSProxy_HasToken(Line,strlen(Line),"100-continue"))
+            Proxy->ExpectContinue=true;
+        return e_ReplyStatusMAX;
+    }
+
+    /* We only know where the body ends from the Content-Length */
+    if(WSProxy_IsHeader(Line,"Transfer-Encoding"))
+        return e_ReplyStatus_NotImplemented;
+
+    if(!WSProxy_AddHead(Proxy,Line,strlen(Line)) ||
+            !WSProxy_AddHead(Proxy,"\r\n",2))
+    {
+        return e_ReplyStatus_RequestHeaderFieldsTooLarge;
+    }
+
+    return e_ReplyStatusMAX;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_Start
+ *
+ * SYNOPSIS:
+ *    bool WSProxy_Start(struct WSProxyCon *Proxy,struct SocketCon *Client,
+ *          const char *Body,int BodyLen,uint32_t BodyLeft);
+ *
+ * PARAMETERS:
+ *    Proxy [I/O] -- The connection from WSProxy_Open()
+ *    Client [I/O] -- The connection to the client
+ *    Body [I] -- The start of the body (it came in with the headers)
+ *    BodyLen [I] -- The number of bytes in 'Body'
+ *    BodyLeft [I] -- The number of body bytes still to come from the client
+ *
+ * FUNCTION:
+ *    This function ends the request head.  The headers the client's
+ *    Connection: headers listed are taken out of it first.  It's sent (with
+ *    'Body') as soon as the upstream is connected, and the rest of the body
+ *    is spliced straight from the client.  Call WSProxy_Run() after this.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- It doesn't fit in WS_OPT_PROXY_HEAD_SIZE
+ *
+ * SEE ALSO:
+ *    WSProxy_Run()
+ ******************************************************************************/
+bool WSProxy_Start(struct WSProxyCon *Proxy,struct SocketCon *Client,
+        const char *Body,int BodyLen,uint32_t BodyLeft)
+{
+    if(Proxy->ConnectionLen>0)
+        WSProxy_DropListed(Proxy);
+
+    if(!WSProxy_AddHead(Proxy,"\r\n",2) ||
+            !WSProxy_AddHead(Proxy,Body,BodyLen))
+    {
+        return false;
+    }
+
+    Proxy->BodyLeft=BodyLeft;
+
+    /* The Expect: wasn't passed on, so we tell the client to go ahead */
+    if(Proxy->ExpectContinue && BodyLeft>0)
+        SocketsCon_Write(Client,m_Continue,sizeof(m_Continue)-1);
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_Run
+ *
+ * SYNOPSIS:
+ *    e_WSProxyResultType WSProxy_Run(struct WSProxyCon *Proxy,
+ *          struct SocketCon *Client);
+ *
+ * PARAMETERS:
+ *    Proxy [I/O] -- The connection from WSProxy_Open()
+ *    Client [I/O] -- The connection to the client
+ *
+ * FUNCTION:
+ *    This function moves the request along.  It finishes the connect, sends
+ *    the head, splices the body to the upstream, passes the response head
+ *    on to the client, and splices the response body back.  It returns
+ *    when it has to wait for either side.
+ *
+ *    If nothing moves for WS_OPT_PROXY_TIMEOUT seconds we give up.
+ *
+ * RETURNS:
+ *    e_WSProxyResult_Busy -- Call this again
+ *    Anything else -- The request is over, call WSProxy_Release() (see
+ *                     e_WSProxyResultType for what to do with the client)
+ *
+ * SEE ALSO:
+ *    WSProxy_Start(), WSProxy_Release()
+ ******************************************************************************/
+e_WSProxyResultType WSProxy_Run(struct WSProxyCon *Proxy,
+        struct SocketCon *Client)
+{
+    e_WSProxyResultType Result;
+    int Turns;
+    int Moved;
+    int Len;
+    int End;
+
+    for(Turns=0;Turns<WSP_MAX_TURNS;Turns++)
+    {
+        switch(Proxy->Step)
+        {
+            case e_WSProxyStep_Connecting:
+                SocketsCon_Tick(&Proxy->Con);
+                if(SocketsCon_HasError(&Proxy->Con))
+                    return WSProxy_UpstreamLost(Proxy);
+                if(!SocketsCon_IsConnected(&Proxy->Con))
+                    return WSProxy_Waiting(Proxy);
+
+                /* Send the head (and the start of the body) */
+                if(!SocketsCon_Write(&Proxy->Con,Proxy->Head,Proxy->HeadLen))
+                    return WSProxy_UpstreamLost(Proxy);
+                Proxy->LastActive=ReadElapsedClock();
+                Proxy->Step=e_WSProxyStep_Body;
+            break;
+            case e_WSProxyStep_Body:
+                if(Proxy->BodyLeft>0 || Proxy->Relay.InPipe>0)
+                {
+                    Moved=WSProxy_Relay(Proxy,Client,&Proxy->Con,
+                            Proxy->BodyLeft);
+                    if(Moved<0)
+                    {
+                        if(!SocketsCon_IsConnected(Client))
+                        {
+                            /* The client hung up */
+                            Proxy->Failed=true;
+                            return e_WSProxyResult_Failed;
+                        }
+                        return WSProxy_UpstreamLost(Proxy);
+                    }
+                    if(Moved>0)
+                    {
+                        WSMetrics_Count(e_WSMetricCounter_BytesIn,Moved);
+                        Proxy->BodyLeft-=Moved;
+                        Proxy->BodySent=true;
+                    }
+                    if(Proxy->BodyLeft>0 || Proxy->Relay.InPipe>0)
+                    {
+                        if(Moved>0)
+                            continue;
+                        return WSProxy_Waiting(Proxy);
+                    }
+                }
+                Proxy->Step=e_WSProxyStep_Head;
+            break;
+            case e_WSProxyStep_Head:
+                Len=SocketsCon_Peek(&Proxy->Con,Proxy->Head,
+                        sizeof(Proxy->Head));
+                if(Len<0)
+                    return WSProxy_UpstreamLost(Proxy);
+                if(Len==0)
+                    return WSProxy_Waiting(Proxy);
+                Proxy->Answered=true;
+
+                End=WSProxy_Find(Proxy->Head,0,Len,"\r\n\r\n");
+                if(End<0)
+                {
+                    if(Len==sizeof(Proxy->Head))
+                        return WSProxy_BadResponse(Proxy);
+                    return WSProxy_Waiting(Proxy);
+                }
+
+                /* Take the head off the connection (the body is left for
+                   splice()) */
+                if(SocketsCon_Read(&Proxy->Con,Proxy->Head,End)!=End)
+                    return WSProxy_UpstreamLost(Proxy);
+                Proxy->LastActive=ReadElapsedClock();
+
+                Result=WSProxy_SendHead(Proxy,Client,End);
+                if(Result!=e_WSProxyResult_Busy)
+                    return Result;
+            break;
+            case e_WSProxyStep_Length:
+                Moved=WSProxy_Relay(Proxy,&Proxy->Con,Client,Proxy->Left);
+                if(Moved<0)
+                {
+                    /* Hung up before the end, the client has to be told by
+                       hanging up on it too */
+                    if(SocketsCon_IsConnected(Client))
+                        WSMetrics_Count(e_WSMetricCounter_ProxyErrors,1);
+                    Proxy->Failed=true;
+                    return e_WSProxyResult_Failed;
+                }
+                WSMetrics_Count(e_WSMetricCounter_BytesOut,Moved);
+                Proxy->Left-=Moved;
+                if(Proxy->Left==0)
+                    Proxy->Step=e_WSProxyStep_Done;
+                else if(Moved==0)
+                    return WSProxy_Waiting(Proxy);
+            break;
+            case e_WSProxyStep_Chunked:
+                if(Proxy->Left==0)
+                {
+                    if(Proxy->LastChunk)
+                    {
+                        Proxy->Step=e_WSProxyStep_Done;
+                        break;
+                    }
+
+                    Result=WSProxy_NextChunk(Proxy);
+                    if(Result!=e_WSProxyResult_Busy)
+                        return Result;
+                    if(Proxy->Left==0)
+                        return WSProxy_Waiting(Proxy);
+                }
+
+                Moved=WSProxy_Relay(Proxy,&Proxy->Con,Client,Proxy->Left);
+                if(Moved<0)
+                {
+                    if(SocketsCon_IsConnected(Client))
+                        WSMetrics_Count(e_WSMetricCounter_ProxyErrors,1);
+                    Proxy->Failed=true;
+                    return e_WSProxyResult_Failed;
+                }
+                WSMetrics_Count(e_WSMetricCounter_BytesOut,Moved);
+                Proxy->Left-=Moved;
+                if(Moved==0)
+                    return WSProxy_Waiting(Proxy);
+            break;
+            case e_WSProxyStep_UntilClose:
+                Moved=WSProxy_Relay(Proxy,&Proxy->Con,Client,WSP_RELAY_SIZE);
+                if(Moved==-55)
+                {
+                    /* That's the end of the body */
+                    Proxy->Step=e_WSProxyStep_Done;
+                    break;
+                }
+                if(Moved<0)
+                {
+                    Proxy->Failed=true;
+                    return e_WSProxyResult_Failed;
+                }
+                WSMetrics_Count(e_WSMetricCounter_BytesOut,Moved);
+                if(Moved==0)
+                    return WSProxy_Waiting(Proxy);
+            break;
+            case e_WSProxyStep_Done:
+                if(Proxy->Relay.InPipe>0)
+                {
+                    if(WSProxy_Relay(Proxy,&Proxy->Con,Client,0)<0)
+                    {
+                        Proxy->Failed=true;
+                        return e_WSProxyResult_Failed;
+                    }
+                    if(Proxy->Relay.InPipe>0)
+                        return WSProxy_Waiting(Proxy);
+                }
+                if(Proxy->CloseClient)
+                    return e_WSProxyResult_DoneClose;
+                return e_WSProxyResult_Done;
+            break;
+            case e_WSProxyStepMAX:
+            default:
+                Proxy->Failed=true;
+            return e_WSProxyResult_Failed;
+        }
+    }
+
+    /* Give the other connections a turn */
+    return e_WSProxyResult_Busy;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_GetStatus
+ *
+ * SYNOPSIS:
+ *    int WSProxy_GetStatus(struct WSProxyCon *Proxy);
+ *
+ * PARAMETERS:
+ *    Proxy [I] -- The connection from WSProxy_Open()
+ *
+ * FUNCTION:
+ *    This function gets the status code the upstream answered with.
+ *
+ * RETURNS:
+ *    The status code (200, 404, ...) or 0 if the response head hasn't come
+ *    in yet.
+ *
+ * SEE ALSO:
+ *    WSProxy_Run()
+ ******************************************************************************/
+int WSProxy_GetStatus(struct WSProxyCon *Proxy)
+{
+    return Proxy->Status;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_Release
+ *
+ * SYNOPSIS:
+ *    void WSProxy_Release(struct WSProxyCon *Proxy);
+ *
+ * PARAMETERS:
+ *    Proxy [I/O] -- The connection from WSProxy_Open()
+ *
+ * FUNCTION:
+ *    This function is called when the request is over (or the client went
+ *    away).  If the response was all passed on and the upstream will keep
+ *    the connection open it's kept for the next request to that upstream,
+ *    otherwise it's closed.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSProxy_Open(), WSProxy_Tick()
+ ******************************************************************************/
+void WSProxy_Release(struct WSProxyCon *Proxy)
+{
+    if(Proxy->Step==e_WSProxyStep_Done && Proxy->KeepAlive &&
+            !Proxy->Failed && Proxy->Relay.InPipe==0 &&
+            SocketsCon_IsConnected(&Proxy->Con))
+    {
+        Proxy->Busy=false;
+        Proxy->LastActive=ReadElapsedClock();
+        return;
+    }
+
+    WSProxy_Close(Proxy);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_Connect
+ *
+ * SYNOPSIS:
+ *    static bool WSProxy_Connect(struct WSProxyCon *Proxy);
+ *
+ * PARAMETERS:
+ *    Proxy [I/O] -- The connection to start ('Proxy->Upstream' is set)
+ *
+ * FUNCTION:
+ *    This function starts connecting to the upstream.  Unix domain sockets
+ *    are connected right away, "host:port" connects finish in
+ *    WSProxy_Run().
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- 'Proxy->Upstream' is bad or the connect failed
+ *
+ * SEE ALSO:
+ *    WSProxy_Open()
+ ******************************************************************************/
+static bool WSProxy_Connect(struct WSProxyCon *Proxy)
+{
+    char Host[SOCKETSDNS_MAX_NAME];
+    const char *Start;
+    const char *Port;
+    int Len;
+
+    if(strncmp(Proxy->Upstream,WSPROXY_UNIX_PREFIX,
+            sizeof(WSPROXY_UNIX_PREFIX)-1)==0)
+    {
+        return SocketsCon_ConnectUnix(&Proxy->Con,
+                &Proxy->Upstream[sizeof(WSPROXY_UNIX_PREFIX)-1]);
+    }
+
+    Port=strrchr(Proxy->Upstream,':');
+    if(Port==NULL)
+        return false;
+
+    /* IPv6 addresses are in []'s */
+    Start=Proxy->Upstream;
+    Len=Port-Start;
+    if(Len>=2 && Start[0]=='[' && Start[Len-1]==']')
+    {
+        Start++;
+        Len-=2;
+    }
+    if(Len<=0 || (size_t)Len>=sizeof(Host))
+        return false;
+    memcpy(Host,Start,Len);
+    Host[Len]=0;
+
+    return SocketsCon_Connect(&Proxy->Con,Host,atoi(Port+1));
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_Close
+ *
+ * SYNOPSIS:
+ *    static void WSProxy_Close(struct WSProxyCon *Proxy);
+ *
+ * PARAMETERS:
+ *    Proxy [I/O] -- The connection to close
+ *
+ * FUNCTION:
+ *    This function closes an upstream connection and frees its slot.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSProxy_Release()
+ ******************************************************************************/
+static void WSProxy_Close(struct WSProxyCon *Proxy)
+{
+    SocketsCon_Close(&Proxy->Con);
+    SocketsCon_FreeRelay(&Proxy->Relay);
+    Proxy->Upstream=NULL;
+    Proxy->Busy=false;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_AddHead
+ *
+ * SYNOPSIS:
+ *    static bool WSProxy_AddHead(struct WSProxyCon *Proxy,const char *Data,
+ *          int Len);
+ *
+ * PARAMETERS:
+ *    Proxy [I/O] -- The connection to work on
+ *    Data [I] -- The bytes to add
+ *    Len [I] -- The number of bytes in 'Data'
+ *
+ * FUNCTION:
+ *    This function adds to the request head that will be sent to the
+ *    upstream.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- Out of space
+ *
+ * SEE ALSO:
+ *    WSProxy_AddHeader()
+ ******************************************************************************/
+static bool WSProxy_AddHead(struct WSProxyCon *Proxy,const char *Data,int Len)
+{
+    if(Len<0 || Proxy->HeadLen+Len>(int)sizeof(Proxy->Head))
+        return false;
+
+    memcpy(&Proxy->Head[Proxy->HeadLen],Data,Len);
+    Proxy->HeadLen+=Len;
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_IsHeader
+ *
+ * SYNOPSIS:
+ *    static bool WSProxy_IsHeader(const char *Line,const char *Name);
+ *
+ * PARAMETERS:
+ *    Line [I] -- The header line
+ *    Name [I] -- The header name to check for (without the ':')
+ *
+ * FUNCTION:
+ *    This function checks if a header line is for a header (the case of
+ *    the name doesn't matter).
+ *
+ * RETURNS:
+ *    true -- It's that header
+ *    false -- It's some other header
+ *
+ * SEE ALSO:
+ *    WSProxy_HasToken()
+ ******************************************************************************/
+static bool WSProxy_IsHeader(const char *Line,const char *Name)
+{
+    int Len;
+
+    Len=strlen(Name);
+    return strncasecmp(Line,Name,Len)==0 && Line[Len]==':';
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_HasToken
+ *
+ * SYNOPSIS:
+ *    static bool WSProxy_HasToken(const char *Line,int LineLen,
+ *          const char *Token);
+ *
+ * PARAMETERS:
+ *    Line [I] -- The header line (doesn't have to end in a \0)
+ *    LineLen [I] -- The number of chars in 'Line'
+ *    Token [I] -- The word to look for
+ *
+ * FUNCTION:
+ *    This function checks if a word is in the value of a header (for
+ *    "Connection: close" or "Transfer-Encoding: gzip, chunked").  The case
+ *    doesn't matter.
+ *
+ * RETURNS:
+ *    true -- It's there
+ *    false -- It's not
+ *
+ * SEE ALSO:
+ *    WSProxy_IsHeader()
+ ******************************************************************************/
+static bool WSProxy_HasToken(const char *Line,int LineLen,const char *Token)
+{
+    int Len;
+    int r;
+
+    Len=strlen(Token);
+    for(r=0;r+Len<=LineLen;r++)
+        if(strncasecmp(&Line[r],Token,Len)==0)
+            return true;
+    return false;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_IsListed
+ *
+ * SYNOPSIS:
+ *    static bool WSProxy_IsListed(const char *List,int ListLen,
+ *          const char *Line,int LineLen);
+ *
+ * PARAMETERS:
+ *    List [I] -- The value of a Connection: header (doesn't have to end in
+ *                a \0)
+ *    ListLen [I] -- The number of chars in 'List'
+ *    Line [I] -- The header line to check (doesn't have to end in a \0)
+ *    LineLen [I] -- The number of chars in 'Line'
+ *
+ * FUNCTION:
+ *    This function checks if the name of a header is one of the comma
+ *    separated names in a Connection: header (RFC 9110 7.6.1).  The case
+ *    doesn't matter.
+ *
+ * RETURNS:
+ *    true -- It's listed
+ *    false -- It's not (or 'Line' isn't a header)
+ *
+ * SEE ALSO:
+ *    WSProxy_ConnectionLists(), WSProxy_DropListed()
+ ******************************************************************************/
+static bool WSProxy_IsListed(const char *List,int ListLen,const char *Line,
+        int LineLen)
+{
+    int NameLen;
+    int Start;
+    int r;
+
+    for(NameLen=0;NameLen<LineLen && Line[NameLen]!=':';NameLen++)
+        ;
+    if(NameLen==0 || NameLen==LineLen)
+        return false;
+
+    r=0;
+    while(r<ListLen)
+    {
+        /* Skip the commas and spaces between the names */
+        while(r<ListLen && (List[r]==',' || List[r]==' ' || List[r]=='\t' ||
+                List[r]=='\r' || List[r]=='\n'))
+        {
+            r++;
+        }
+        Start=r;
+        while(r<ListLen && List[r]!=',' && List[r]!=' ' && List[r]!='\t' &&
+                List[r]!='\r' && List[r]!='\n')
+        {
+            r++;
+        }
+        if(r-Start==NameLen && strncasecmp(&List[Start],Line,NameLen)==0)
+            return true;
+    }
+    return false;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_ConnectionLists
+ *
+ * SYNOPSIS:
+ *    static bool WSProxy_ConnectionLists(const char *Head,int Start,
+ *          int HeadLen,const char *Line,int LineLen);
+ *
+ * PARAMETERS:
+ *    Head [I] -- The response head
+ *    Start [I] -- Where the headers start in 'Head' (after the status line)
+ *    HeadLen [I] -- The length of 'Head'
+ *    Line [I] -- The header line to check
+ *    LineLen [I] -- The number of chars in 'Line'
+ *
+ * FUNCTION:
+ *    This function checks if any of the Connection: headers in a response
+ *    head list a header line's name.
+ *
+ * RETURNS:
+ *    true -- It's listed (drop it)
+ *    false -- It's not
+ *
+ * SEE ALSO:
+ *    WSProxy_IsListed()
+ ******************************************************************************/
+static bool WSProxy_ConnectionLists(const char *Head,int Start,int HeadLen,
+        const char *Line,int LineLen)
+{
+    int Pos;
+    int Next;
+
+    for(Pos=Start;Pos<HeadLen;Pos=Next)
+    {
+        Next=WSProxy_Find(Head,Pos,HeadLen,"\r\n");
+        if(Next<0 || Next-Pos==2)
+            break;
+        if(WSProxy_IsHeader(&Head[Pos],"Connection") &&
+                WSProxy_IsListed(&Head[Pos+11],Next-Pos-11,Line,LineLen))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_DropListed
+ *
+ * SYNOPSIS:
+ *    static void WSProxy_DropListed(struct WSProxyCon *Proxy);
+ *
+ * PARAMETERS:
+ *    Proxy [I/O] -- The connection with the request head to clean up
+ *
+ * FUNCTION:
+ *    This function takes the headers the client's Connection: headers
+ *    listed ('Proxy->Connection') out of the request head.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSProxy_IsListed(), WSProxy_Start()
+ ******************************************************************************/
+static void WSProxy_DropListed(struct WSProxyCon *Proxy)
+{
+    int Pos;
+    int Next;
+    int Out;
+
+    /* Leave the request line alone */
+    Pos=WSProxy_Find(Proxy->Head,0,Proxy->HeadLen,"\r\n");
+    if(Pos<0)
+        return;
+
+    for(Out=Pos;Pos<Proxy->HeadLen;Pos=Next)
+    {
+        Next=WSProxy_Find(Proxy->Head,Pos,Proxy->HeadLen,"\r\n");
+        if(Next<0)
+            Next=Proxy->HeadLen;
+        if(WSProxy_IsListed(Proxy->Connection,Proxy->ConnectionLen,
+                &Proxy->Head[Pos],Next-Pos))
+        {
+            continue;
+        }
+        memmove(&Proxy->Head[Out],&Proxy->Head[Pos],Next-Pos);
+        Out+=Next-Pos;
+    }
+    Proxy->HeadLen=Out;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_Find
+ *
+ * SYNOPSIS:
+ *    static int WSProxy_Find(const char *Buff,int Start,int Len,
+ *          const char *Str);
+ *
+ * PARAMETERS:
+ *    Buff [I] -- The bytes to look in
+ *    Start [I] -- Where in 'Buff' to start looking
+ *    Len [I] -- The number of bytes in 'Buff'
+ *    Str [I] -- What to look for ("\r\n" or "\r\n\r\n")
+ *
+ * FUNCTION:
+ *    This function finds a string in a buffer that isn't \0 terminated.
+ *
+ * RETURNS:
+ *    The offset just after where 'Str' was found or -1 if it wasn't found.
+ *
+ * SEE ALSO:
+ *
+ ******************************************************************************/
+static int WSProxy_Find(const char *Buff,int Start,int Len,const char *Str)
+{
+    int StrLen;
+    int r;
+
+    StrLen=strlen(Str);
+    for(r=Start;r+StrLen<=Len;r++)
+        if(memcmp(&Buff[r],Str,StrLen)==0)
+            return r+StrLen;
+    return -1;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_SendHead
+ *
+ * SYNOPSIS:
+ *    static e_WSProxyResultType WSProxy_SendHead(struct WSProxyCon *Proxy,
+ *          struct SocketCon *Client,int HeadLen);
+ *
+ * PARAMETERS:
+ *    Proxy [I/O] -- The connection to work on
+ *    Client [I/O] -- The connection to the client
+ *    HeadLen [I] -- The length of the response head in 'Proxy->Head'
+ *                   (including the blank line)
+ *
+ * FUNCTION:
+ *    This function passes the response head from the upstream on to the
+ *    client and works out how the body ends.  The status line is sent as
+ *    HTTP/1.1 and the upstream's Connection / Keep-Alive headers, and the
+ *    headers its Connection: headers list, are dropped (we add
+ *    "Connection: close" if the body ends when the upstream hangs up).
+ *
+ *    1xx responses are passed on and we go back to waiting for the real
+ *    response.
+ *
+ * RETURNS:
+ *    e_WSProxyResult_Busy if things worked out, or the result to return
+ *    from WSProxy_Run().
+ *
+ * SEE ALSO:
+ *    WSProxy_Run()
+ ******************************************************************************/
+static e_WSProxyResultType WSProxy_SendHead(struct WSProxyCon *Proxy,
+        struct SocketCon *Client,int HeadLen)
+{
+    char Out[WS_OPT_PROXY_HEAD_SIZE+WSP_HEAD_EXTRA];
+    const char *Line;
+    int LineLen;
+    int OutLen;
+    int Pos;
+    int Next;
+    int First;
+    bool Version11;
+    bool Close;
+    bool KeepAlive;
+    bool Chunked;
+    bool HaveLength;
+    uint64_t Length;
+
+    /* "HTTP/1.x NNN ..." */
+    if(HeadLen<16 || strncmp(Proxy->Head,"HTTP/1.",7)!=0 ||
+            Proxy->Head[8]!=' ' || Proxy->Head[9]<'1' || Proxy->Head[9]>'5')
+    {
+        return WSProxy_BadResponse(Proxy);
+    }
+    Version11=Proxy->Head[7]!='0';
+    Proxy->Status=atoi(&Proxy->Head[9]);
+    Next=WSProxy_Find(Proxy->Head,8,HeadLen,"\r\n");
+    if(Next<8)
+        return WSProxy_BadResponse(Proxy);
+
+    /* We are HTTP/1.1 to the client whatever the upstream is */
+    memcpy(Out,"HTTP/1.1",8);
+    memcpy(&Out[8],&Proxy->Head[8],Next-8);
+    OutLen=Next;
+    First=Next;
+
+    Close=false;
+    KeepAlive=false;
+    Chunked=false;
+    HaveLength=false;
+    Length=0;
+    for(Pos=Next;Pos<HeadLen;Pos=Next)
+    {
+        Next=WSProxy_Find(Proxy->Head,Pos,HeadLen,"\r\n");
+        Line=&Proxy->Head[Pos];
+        LineLen=Next-Pos;
+        if(LineLen==2)
+            break;  // The blank line
+
+        if(WSProxy_IsHeader(Line,"Connection"))
+        {
+            if(WSProxy_HasToken(Line,LineLen,"close"))
+                Close=true;
+            if(WSProxy_HasToken(Line,LineLen,"keep-alive"))
+                KeepAlive=true;
+            continue;
+        }
+        if(WSProxy_IsHeader(Line,"Keep-Alive") ||
+                WSProxy_IsHeader(Line,"Proxy-Connection") ||
+                WSProxy_ConnectionLists(Proxy->Head,First,HeadLen,Line,
+                LineLen))
+        {
+            continue;
+        }
+        if(WSProxy_IsHeader(Line,"Transfer-Encoding"))
+            Chunked=WSProxy_HasToken(Line,LineLen,"chunked");
+        if(WSProxy_IsHeader(Line,"Content-Length"))
+        {
+            HaveLength=true;
+            Length=strtoull(&Line[15],NULL,10);
+        }
+
+        memcpy(&Out[OutLen],Line,LineLen);
+        OutLen+=LineLen;
+    }
+
+    if(Proxy->Status<200)
+    {
+        /* We never ask to switch protocols */
+        if(Proxy->Status==101)
+            return WSProxy_BadResponse(Proxy);
+
+        /* 100 Continue and friends come before the real response */
+        memcpy(&Out[OutLen],"\r\n",2);
+        OutLen+=2;
+        if(!SocketsCon_Write(Client,Out,OutLen))
+        {
+            Proxy->Failed=true;
+            return e_WSProxyResult_Failed;
+        }
+        WSMetrics_Count(e_WSMetricCounter_BytesOut,OutLen);
+        return e_WSProxyResult_Busy;
+    }
+
+    Proxy->KeepAlive=Version11?!Close:KeepAlive;
+    if(Proxy->HeadRequest || Proxy->Status==204 || Proxy->Status==304)
+    {
+        Proxy->Step=e_WSProxyStep_Done;
+    }
+    else if(Chunked)
+    {
+        Proxy->Step=e_WSProxyStep_Chunked;
+        Proxy->Left=0;
+        Proxy->LastChunk=false;
+    }
+    else if(HaveLength)
+    {
+        Proxy->Step=e_WSProxyStep_Length;
+        Proxy->Left=Length;
+        if(Length==0)
+            Proxy->Step=e_WSProxyStep_Done;
+    }
+    else
+    {
+        /* The body ends when the upstream hangs up, so the client has to be
+           hung up on too */
+        Proxy->Step=e_WSProxyStep_UntilClose;
+        Proxy->KeepAlive=false;
+        Proxy->CloseClient=true;
+        memcpy(&Out[OutLen],"Connection: close\r\n",19);
+        OutLen+=19;
+    }
+    memcpy(&Out[OutLen],"\r\n",2);
+    OutLen+=2;
+
+    if(!SocketsCon_Write(Client,Out,OutLen))
+    {
+        Proxy->Failed=true;
+        return e_WSProxyResult_Failed;
+    }
+    WSMetrics_Count(e_WSMetricCounter_BytesOut,OutLen);
+    Proxy->Replied=true;
+
+    return e_WSProxyResult_Busy;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_NextChunk
+ *
+ * SYNOPSIS:
+ *    static e_WSProxyResultType WSProxy_NextChunk(struct WSProxyCon *Proxy);
+ *
+ * PARAMETERS:
+ *    Proxy [I/O] -- The connection to work on
+ *
+ * FUNCTION:
+ *    This function peeks at the size line of the next chunk of a chunked
+ *    response and sets 'Proxy->Left' to the whole chunk (the size line, the
+ *    data, and the \r\n after it).  For the last chunk it's the size line,
+ *    the trailers, and the blank line.
+ *
+ *    'Proxy->Left' is left at 0 if the size line (or the trailers) hasn't
+ *    all come in yet.
+ *
+ * RETURNS:
+ *    e_WSProxyResult_Busy if things worked out, or the result to return
+ *    from WSProxy_Run().
+ *
+ * SEE ALSO:
+ *    WSProxy_Run()
+ ******************************************************************************/
+static e_WSProxyResultType WSProxy_NextChunk(struct WSProxyCon *Proxy)
+{
+    uint64_t Size;
+    char *EndOfNum;
+    int Len;
+    int End;
+
+    Len=SocketsCon_Peek(&Proxy->Con,Proxy->Head,sizeof(Proxy->Head));
+    if(Len<0)
+        return WSProxy_BadResponse(Proxy);
+
+    End=WSProxy_Find(Proxy->Head,0,Len,"\r\n");
+    if(End<0)
+    {
+        if(Len==sizeof(Proxy->Head))
+            return WSProxy_BadResponse(Proxy);
+        return e_WSProxyResult_Busy;
+    }
+
+    Size=strtoull(Proxy->Head,&EndOfNum,16);
+    if(EndOfNum==Proxy->Head)
+        return WSProxy_BadResponse(Proxy);
+
+    if(Size>0)
+    {
+        Proxy->Left=End+Size+2;
+        return e_WSProxyResult_Busy;
+    }
+
+    /* The last chunk.  The trailers (if any) end with a blank line. */
+    End=WSProxy_Find(Proxy->Head,End-2,Len,"\r\n\r\n");
+    if(End<0)
+    {
+        if(Len==sizeof(Proxy->Head))
+            return WSProxy_BadResponse(Proxy);
+        return e_WSProxyResult_Busy;
+    }
+    Proxy->Left=End;
+    Proxy->LastChunk=true;
+
+    return e_WSProxyResult_Busy;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_Relay
+ *
+ * SYNOPSIS:
+ *    static int WSProxy_Relay(struct WSProxyCon *Proxy,
+ *          struct SocketCon *From,struct SocketCon *To,uint64_t MaxLen);
+ *
+ * PARAMETERS:
+ *    Proxy [I/O] -- The connection to work on
+ *    From [I/O] -- The connection to read from
+ *    To [I/O] -- The connection to send to
+ *    MaxLen [I] -- The max number of bytes to take from 'From'
+ *
+ * FUNCTION:
+ *    This function calls SocketsCon_Relay() using this connection's pipe
+ *    and notes if anything moved (for WS_OPT_PROXY_TIMEOUT).
+ *
+ * RETURNS:
+ *    What SocketsCon_Relay() returned.
+ *
+ * SEE ALSO:
+ *    SocketsCon_Relay()
+ ******************************************************************************/
+static int WSProxy_Relay(struct WSProxyCon *Proxy,struct SocketCon *From,
+        struct SocketCon *To,uint64_t MaxLen)
+{
+    int InPipe;
+    int Moved;
+
+    if(MaxLen>WSP_RELAY_SIZE)
+        MaxLen=WSP_RELAY_SIZE;
+
+    InPipe=Proxy->Relay.InPipe;
+    Moved=SocketsCon_Relay(From,To,&Proxy->Relay,MaxLen);
+    if(Moved>0 || Proxy->Relay.InPipe!=InPipe)
+        Proxy->LastActive=ReadElapsedClock();
+
+    return Moved;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_Waiting
+ *
+ * SYNOPSIS:
+ *    static e_WSProxyResultType WSProxy_Waiting(struct WSProxyCon *Proxy);
+ *
+ * PARAMETERS:
+ *    Proxy [I/O] -- The connection to work on
+ *
+ * FUNCTION:
+ *    This function is called when WSProxy_Run() has to wait.  It checks if
+ *    we have been waiting too long.
+ *
+ * RETURNS:
+ *    The result to return from WSProxy_Run().
+ *
+ * SEE ALSO:
+ *    WSProxy_Run()
+ ******************************************************************************/
+static e_WSProxyResultType WSProxy_Waiting(struct WSProxyCon *Proxy)
+{
+    if(ReadElapsedClock()-Proxy->LastActive<WS_OPT_PROXY_TIMEOUT)
+        return e_WSProxyResult_Busy;
+
+    WSMetrics_Count(e_WSMetricCounter_TimeoutProxy,1);
+    Proxy->Failed=true;
+
+    /* If we are still waiting on the client's body we just hang up (like a
+       slow body to one of our pages) */
+    if(Proxy->Replied || Proxy->Step==e_WSProxyStep_Body)
+        return e_WSProxyResult_Failed;
+
+    return e_WSProxyResult_Timeout;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_UpstreamLost
+ *
+ * SYNOPSIS:
+ *    static e_WSProxyResultType WSProxy_UpstreamLost(
+ *          struct WSProxyCon *Proxy);
+ *
+ * PARAMETERS:
+ *    Proxy [I/O] -- The connection to work on
+ *
+ * FUNCTION:
+ *    This function is called when the connect to the upstream failed or
+ *    the upstream hung up before the response came in.
+ *
+ *    A connection we kept open can be closed by the upstream just as we
+ *    send on it.  If nothing that can't be sent again has gone out the
+ *    request is sent again once on a new connection.
+ *
+ * RETURNS:
+ *    The result to return from WSProxy_Run().
+ *
+ * SEE ALSO:
+ *    WSProxy_Run()
+ ******************************************************************************/
+static e_WSProxyResultType WSProxy_UpstreamLost(struct WSProxyCon *Proxy)
+{
+    if(Proxy->Reused && !Proxy->Retried && !Proxy->BodySent &&
+            !Proxy->Answered)
+    {
+        SocketsCon_Close(&Proxy->Con);
+        SocketsCon_FreeRelay(&Proxy->Relay);
+        if(WSProxy_Connect(Proxy))
+        {
+            WSMetrics_Count(e_WSMetricCounter_ProxyRetries,1);
+            Proxy->Retried=true;
+            Proxy->Reused=false;
+            Proxy->LastActive=ReadElapsedClock();
+            Proxy->Step=e_WSProxyStep_Connecting;
+            return e_WSProxyResult_Busy;
+        }
+    }
+
+    WSMetrics_Count(e_WSMetricCounter_ProxyErrors,1);
+    Proxy->Failed=true;
+    if(Proxy->Replied)
+        return e_WSProxyResult_Failed;
+    return e_WSProxyResult_BadGateway;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSProxy_BadResponse
+ *
+ * SYNOPSIS:
+ *    static e_WSProxyResultType WSProxy_BadResponse(struct WSProxyCon *Proxy);
+ *
+ * PARAMETERS:
+ *    Proxy [I/O] -- The connection to work on
+ *
+ * FUNCTION:
+ *    This function is called when the upstream sent something we can't
+ *    understand (or that doesn't fit in WS_OPT_PROXY_HEAD_SIZE).
+ *
+ * RETURNS:
+ *    The result to return from WSProxy_Run().
+ *
+ * SEE ALSO:
+ *    WSProxy_Run()
+ ******************************************************************************/
+static e_WSProxyResultType WSProxy_BadResponse(struct WSProxyCon *Proxy)
+{
+    WSMetrics_Count(e_WSMetricCounter_ProxyErrors,1);
+    Proxy->Failed=true;
+    if(Proxy->Replied)
+        return e_WSProxyResult_Failed;
+    return e_WSProxyResult_BadGateway;
+}
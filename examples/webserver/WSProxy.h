@@ -0,0 +1,80 @@
+/*******************************************************************************
+ * FILENAME: WSProxy.h
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This has the reverse proxy in it (WSProxy.c).
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ *******************************************************************************/
+#ifndef __WSPROXY_H_
+#define __WSPROXY_H_
+
+/***  HEADER FILES TO INCLUDE          ***/
+#include "WebServer.h"
+#include "SocketsCon.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/***  DEFINES                          ***/
+#define WSPROXY_UNIX_PREFIX                 "unix:" // Upstreams starting with this are a unix domain socket path
+
+/***  MACROS                           ***/
+
+/***  TYPE DEFINITIONS                 ***/
+typedef enum
+{
+    e_WSProxyResult_Busy,       // Still going, call WSProxy_Run() again
+    e_WSProxyResult_Done,       // The whole response has been sent to the client
+    e_WSProxyResult_DoneClose,  // The whole response has been sent, hang up on the client (the body ended when the upstream hung up)
+    e_WSProxyResult_BadGateway, // The upstream couldn't be reached or sent a bad response (nothing has been sent to the client)
+    e_WSProxyResult_Timeout,    // The upstream didn't answer in time (nothing has been sent to the client)
+    e_WSProxyResult_Failed,     // The client or the upstream went away part way though, hang up on the client
+    e_WSProxyResultMAX
+} e_WSProxyResultType;
+
+struct WSProxyCon;
+
+/***  CLASS DEFINITIONS                ***/
+
+/***  GLOBAL VARIABLE DEFINITIONS      ***/
+
+/***  EXTERNAL FUNCTION PROTOTYPES     ***/
+void WSProxy_Init(void);
+void WSProxy_Shutdown(void);
+void WSProxy_Tick(void);
+struct WSProxyCon *WSProxy_Open(const char *Upstream);
+bool WSProxy_AddRequestLine(struct WSProxyCon *Proxy,const char *Method,
+        int MethodLen,const char *Path,const char *Args);
+e_ReplyStatusType WSProxy_AddHeader(struct WSProxyCon *Proxy,
+        const char *Line);
+bool WSProxy_Start(struct WSProxyCon *Proxy,struct SocketCon *Client,
+        const char *Body,int BodyLen,uint32_t BodyLeft);
+e_WSProxyResultType WSProxy_Run(struct WSProxyCon *Proxy,
+        struct SocketCon *Client);
+int WSProxy_GetStatus(struct WSProxyCon *Proxy);
+void WSProxy_Release(struct WSProxyCon *Proxy);
+
+#endif
@@ -0,0 +1,219 @@
+/*******************************************************************************
+ * FILENAME: WSQueue.c
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This is a bounded lock free queue that any number of threads can push
+ *    to and pop from at the same time (Dmitry Vyukov's MPMC queue).  Each
+ *    cell has a sequence number that says if it is ready to be written or
+ *    read, so a push or pop is one compare and swap with no locks.
+ *
+ *    The cells are passed in by the caller so there is no malloc().
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ ******************************************************************************/
+
+/*** HEADER FILES TO INCLUDE  ***/
+#include "WSQueue.h"
+
+/*** DEFINES                  ***/
+
+/*** MACROS                   ***/
+
+/*** TYPE DEFINITIONS         ***/
+
+/*** FUNCTION PROTOTYPES      ***/
+
+/*** VARIABLE DEFINITIONS     ***/
+
+/*******************************************************************************
+ * NAME:
+ *    WSQueue_Init
+ *
+ * SYNOPSIS:
+ *    bool WSQueue_Init(struct WSQueue *Queue,struct WSQueueCell *Cells,
+ *          size_t Size);
+ *
+ * PARAMETERS:
+ *    Queue [O] -- The queue to setup
+ *    Cells [I] -- The memory to use for the queue.  This must stay around
+ *                 as long as the queue is used.
+ *    Size [I] -- The number of cells in 'Cells'.  This must be a power of 2.
+ *
+ * FUNCTION:
+ *    This function sets up a queue to be empty.  It must be called before
+ *    any thread uses the queue.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- 'Size' isn't a power of 2
+ *
+ * SEE ALSO:
+ *    WSQueue_Push(), WSQueue_Pop()
+ ******************************************************************************/
+bool WSQueue_Init(struct WSQueue *Queue,struct WSQueueCell *Cells,
+        size_t Size)
+{
+    size_t r;
+
+    if(Size<2 || (Size&(Size-1))!=0)
+        return false;
+
+    for(r=0;r<Size;r++)
+        atomic_init(&Cells[r].Seq,r);
+
+    Queue->Cells=Cells;
+    Queue->Mask=Size-1;
+    atomic_init(&Queue->Head,0);
+    atomic_init(&Queue->Tail,0);
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSQueue_Push
+ *
+ * SYNOPSIS:
+ *    bool WSQueue_Push(struct WSQueue *Queue,const struct WSQueueItem *Item);
+ *
+ * PARAMETERS:
+ *    Queue [I] -- The queue to add to
+ *    Item [I] -- The item to copy into the queue
+ *
+ * FUNCTION:
+ *    This function adds an item to the end of a queue.  It can be called
+ *    from any thread.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- The queue is full
+ *
+ * SEE ALSO:
+ *    WSQueue_Pop()
+ ******************************************************************************/
+bool WSQueue_Push(struct WSQueue *Queue,const struct WSQueueItem *Item)
+{
+    struct WSQueueCell *Cell;
+    size_t Pos;
+    size_t Seq;
+    intptr_t Diff;
+
+    Pos=atomic_load_explicit(&Queue->Head,memory_order_relaxed);
+    for(;;)
+    {
+        Cell=&Queue->Cells[Pos&Queue->Mask];
+        Seq=atomic_load_explicit(&Cell->Seq,memory_order_acquire);
+        Diff=(intptr_t)Seq-(intptr_t)Pos;
+        if(Diff==0)
+        {
+            /* The cell is free, try to claim it */
+            if(atomic_compare_exchange_weak_explicit(&Queue->Head,&Pos,Pos+1,
+                    memory_order_relaxed,memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(Diff<0)
+        {
+            /* The cell still has an item that hasn't been popped, full */
+            return false;
+        }
+        else
+        {
+            /* Someone else pushed first, try again */
+            Pos=atomic_load_explicit(&Queue->Head,memory_order_relaxed);
+        }
+    }
+
+    Cell->Item=*Item;
+    atomic_store_explicit(&Cell->Seq,Pos+1,memory_order_release);
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSQueue_Pop
+ *
+ * SYNOPSIS:
+ *    bool WSQueue_Pop(struct WSQueue *Queue,struct WSQueueItem *Item);
+ *
+ * PARAMETERS:
+ *    Queue [I] -- The queue to take from
+ *    Item [O] -- The item that was at the front of the queue
+ *
+ * FUNCTION:
+ *    This function takes the item from the front of a queue.  It can be
+ *    called from any thread.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- The queue is empty ('Item' is not changed)
+ *
+ * SEE ALSO:
+ *    WSQueue_Push()
+ ******************************************************************************/
+bool WSQueue_Pop(struct WSQueue *Queue,struct WSQueueItem *Item)
+{
+    struct WSQueueCell *Cell;
+    size_t Pos;
+    size_t Seq;
+    intptr_t Diff;
+
+    Pos=atomic_load_explicit(&Queue->Tail,memory_order_relaxed);
+    for(;;)
+    {
+        Cell=&Queue->Cells[Pos&Queue->Mask];
+        Seq=atomic_load_explicit(&Cell->Seq,memory_order_acquire);
+        Diff=(intptr_t)Seq-(intptr_t)(Pos+1);
+        if(Diff==0)
+        {
+            /* The cell has an item, try to claim it */
+            if(atomic_compare_exchange_weak_explicit(&Queue->Tail,&Pos,Pos+1,
+                    memory_order_relaxed,memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(Diff<0)
+        {
+            /* Nothing has been pushed here yet, empty */
+            return false;
+        }
+        else
+        {
+            /* Someone else popped first, try again */
+            Pos=atomic_load_explicit(&Queue->Tail,memory_order_relaxed);
+        }
+    }
+
+    *Item=Cell->Item;
+
+    /* Mark the cell free for the push that is one lap around the queue */
+    atomic_store_explicit(&Cell->Seq,Pos+Queue->Mask+1,memory_order_release);
+
+    return true;
+}
@@ -0,0 +1,78 @@
+/*******************************************************************************
+ * FILENAME: WSQueue.h
+ * 
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This file has the lock free queue that is used to pass work between
+ *    the web server thread and other threads.
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ *******************************************************************************/
+#ifndef __WSQUEUE_H_
+#define __WSQUEUE_H_
+
+/***  HEADER FILES TO INCLUDE          ***/
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/***  DEFINES                          ***/
+
+/***  MACROS                           ***/
+
+/***  TYPE DEFINITIONS                 ***/
+struct WSQueueItem
+{
+    uintptr_t Value;        // What these mean is up to the user of the queue
+    void *Ptr;
+    void (*Fn)(void);
+};
+
+struct WSQueueCell
+{
+    atomic_size_t Seq;
+    struct WSQueueItem Item;
+};
+
+struct WSQueue
+{
+    struct WSQueueCell *Cells;
+    size_t Mask;
+    _Alignas(64) atomic_size_t Head;    // Pushed here (own cache line so
+    _Alignas(64) atomic_size_t Tail;    // pushers and poppers don't fight)
+};
+
+/***  CLASS DEFINITIONS                ***/
+
+/***  GLOBAL VARIABLE DEFINITIONS      ***/
+
+/***  EXTERNAL FUNCTION PROTOTYPES     ***/
+bool WSQueue_Init(struct WSQueue *Queue,struct WSQueueCell *Cells,
+        size_t Size);
+bool WSQueue_Push(struct WSQueue *Queue,const struct WSQueueItem *Item);
+bool WSQueue_Pop(struct WSQueue *Queue,struct WSQueueItem *Item);
+
+#endif
@@ -0,0 +1,514 @@
+/*******************************************************************************
+ * FILENAME: WSTrace.c
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This file has the request tracing ring buffers.
+ *
+ *    Each thread that records events gets it's own ring buffer so
+ *    recording is just filling in the next slot (no locks, no allocation).
+ *    When the ring is full the oldest events are written over, so a dump
+ *    has the last WS_OPT_TRACE_EVENTS events from each thread.
+ *
+ *    The dump is in the Chrome trace event format (load it in
+ *    chrome://tracing or ui.perfetto.dev).  Each connection is it's own
+ *    track.
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ ******************************************************************************/
+
+/*** HEADER FILES TO INCLUDE  ***/
+#include "WSTrace.h"
+#include "WebServer.h"
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if WS_OPT_TRACE
+
+/*** DEFINES                  ***/
+#define WST_MAX_THREADS             (WS_OPT_OFFLOAD_THREADS+2)  // The web server thread + workers + one spare
+#define WST_LINE_SIZE               200     // Biggest JSON line for one event
+
+/*** MACROS                   ***/
+
+/*** TYPE DEFINITIONS         ***/
+struct WSTraceEvent
+{
+    uint64_t When;          // ns (WSTrace_Now())
+    uint32_t Dur;           // ns, spans only
+    uint32_t Arg;
+    uint16_t Type;
+    uint16_t Con;
+};
+
+struct WSTraceRing
+{
+    _Atomic uint64_t Head;  // The number of events ever recorded
+    struct WSTraceEvent Events[WS_OPT_TRACE_EVENTS];
+};
+
+typedef void (*t_WSTraceOutputFn)(void *Ctx,const char *Str,int Len);
+
+/*** FUNCTION PROTOTYPES      ***/
+static struct WSTraceRing *WSTrace_GetRing(void);
+static void WSTrace_Record(e_WSTraceType Type,int Con,uint64_t When,
+        uint64_t Dur,uint32_t Arg);
+static void WSTrace_Dump(t_WSTraceOutputFn Output,void *Ctx);
+static void WSTrace_OutputToPage(void *Ctx,const char *Str,int Len);
+static void WSTrace_OutputToFile(void *Ctx,const char *Str,int Len);
+
+/*** VARIABLE DEFINITIONS     ***/
+static struct WSTraceRing m_Rings[WST_MAX_THREADS];
+static atomic_int m_RingsUsed;
+static __thread struct WSTraceRing *m_MyRing;
+static volatile sig_atomic_t m_DumpRequested;
+
+static const char *m_EventNames[e_WSTraceMAX]=
+{
+    [e_WSTrace_Accept]="accept",
+    [e_WSTrace_FirstByte]="first byte",
+    [e_WSTrace_HeadersEnd]="headers end",
+    [e_WSTrace_Handler]="handler",
+    [e_WSTrace_Write]="write",
+    [e_WSTrace_ReplyEnd]="reply end",
+    [e_WSTrace_Close]="close",
+};
+
+/*******************************************************************************
+ * NAME:
+ *    WSTrace_Now
+ *
+ * SYNOPSIS:
+ *    uint64_t WSTrace_Now(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function gets the time that events are stamped with.
+ *
+ * RETURNS:
+ *    A time in ns.  This only has meaning compared to another call to this
+ *    function.
+ *
+ * SEE ALSO:
+ *    WSTrace_Span()
+ ******************************************************************************/
+uint64_t WSTrace_Now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSTrace_Event
+ *
+ * SYNOPSIS:
+ *    void WSTrace_Event(e_WSTraceType Type,int Con,uint32_t Arg);
+ *
+ * PARAMETERS:
+ *    Type [I] -- What happened
+ *    Con [I] -- The connection it happened on
+ *    Arg [I] -- Extra info (depends on 'Type')
+ *
+ * FUNCTION:
+ *    This function records that something happened now.  It can be called
+ *    from any thread.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSTrace_Span()
+ ******************************************************************************/
+void WSTrace_Event(e_WSTraceType Type,int Con,uint32_t Arg)
+{
+    WSTrace_Record(Type,Con,WSTrace_Now(),0,Arg);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSTrace_Span
+ *
+ * SYNOPSIS:
+ *    void WSTrace_Span(e_WSTraceType Type,int Con,uint64_t Start,
+ *          uint64_t Dur,uint32_t Arg);
+ *
+ * PARAMETERS:
+ *    Type [I] -- What was being done
+ *    Con [I] -- The connection it was done for
+ *    Start [I] -- When it started (from WSTrace_Now())
+ *    Dur [I] -- How long it took in ns
+ *    Arg [I] -- Extra info (depends on 'Type')
+ *
+ * FUNCTION:
+ *    This function records something that took some time.  It's recorded
+ *    when it's done so there is only one event for it.  It can be called
+ *    from any thread.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSTrace_Event()
+ ******************************************************************************/
+void WSTrace_Span(e_WSTraceType Type,int Con,uint64_t Start,uint64_t Dur,
+        uint32_t Arg)
+{
+    WSTrace_Record(Type,Con,Start,Dur,Arg);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSTrace_RequestDump
+ *
+ * SYNOPSIS:
+ *    void WSTrace_RequestDump(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function asks for the trace to be written to WS_OPT_TRACE_FILE
+ *    the next time WSTrace_Tick() is called.  It is safe to call from a
+ *    signal handler.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSTrace_Tick()
+ ******************************************************************************/
+void WSTrace_RequestDump(void)
+{
+    m_DumpRequested=1;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSTrace_Tick
+ *
+ * SYNOPSIS:
+ *    void WSTrace_Tick(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function writes the trace to WS_OPT_TRACE_FILE if
+ *    WSTrace_RequestDump() was called.  It is called from WS_Tick().
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSTrace_RequestDump()
+ ******************************************************************************/
+void WSTrace_Tick(void)
+{
+    FILE *out;
+
+    if(!m_DumpRequested)
+        return;
+    m_DumpRequested=0;
+
+    out=fopen(WS_OPT_TRACE_FILE,"w");
+    if(out==NULL)
+        return;
+    WSTrace_Dump(WSTrace_OutputToFile,out);
+    fclose(out);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSTrace_WritePage
+ *
+ * SYNOPSIS:
+ *    void WSTrace_WritePage(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to send the page on
+ *
+ * FUNCTION:
+ *    This function sends the trace as a page.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSTrace_Tick()
+ ******************************************************************************/
+void WSTrace_WritePage(struct WebServer *Web)
+{
+    WS_Header(Web,"Content-Type: application/json");
+    WSTrace_Dump(WSTrace_OutputToPage,Web);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSTrace_GetRing
+ *
+ * SYNOPSIS:
+ *    static struct WSTraceRing *WSTrace_GetRing(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function gets the ring buffer for the thread that called it.  The
+ *    first time a thread calls this it is given the next free ring.
+ *
+ * RETURNS:
+ *    The ring or NULL if there are more threads than rings (that thread's
+ *    events are dropped).
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+static struct WSTraceRing *WSTrace_GetRing(void)
+{
+    int Index;
+
+    if(m_MyRing==NULL)
+    {
+        Index=atomic_fetch_add(&m_RingsUsed,1);
+        if(Index>=WST_MAX_THREADS)
+            return NULL;
+        m_MyRing=&m_Rings[Index];
+    }
+    return m_MyRing;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSTrace_Record
+ *
+ * SYNOPSIS:
+ *    static void WSTrace_Record(e_WSTraceType Type,int Con,uint64_t When,
+ *          uint64_t Dur,uint32_t Arg);
+ *
+ * PARAMETERS:
+ *    Type [I] -- What happened
+ *    Con [I] -- The connection it happened on
+ *    When [I] -- When it happened (or started)
+ *    Dur [I] -- How long it took (0 for events)
+ *    Arg [I] -- Extra info
+ *
+ * FUNCTION:
+ *    This function adds an event to this thread's ring.  The slot is filled
+ *    in before 'Head' is moved so the dump can tell which slots may have
+ *    been written over while it was reading them.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSTrace_Dump()
+ ******************************************************************************/
+static void WSTrace_Record(e_WSTraceType Type,int Con,uint64_t When,
+        uint64_t Dur,uint32_t Arg)
+{
+    struct WSTraceRing *Ring;
+    struct WSTraceEvent *Event;
+    uint64_t Head;
+
+    Ring=WSTrace_GetRing();
+    if(Ring==NULL)
+        return;
+
+    Head=atomic_load_explicit(&Ring->Head,memory_order_relaxed);
+    Event=&Ring->Events[Head&(WS_OPT_TRACE_EVENTS-1)];
+    Event->When=When;
+    Event->Dur=Dur>UINT32_MAX?UINT32_MAX:Dur;
+    Event->Arg=Arg;
+    Event->Type=Type;
+    Event->Con=Con;
+    atomic_store_explicit(&Ring->Head,Head+1,memory_order_release);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSTrace_Dump
+ *
+ * SYNOPSIS:
+ *    static void WSTrace_Dump(t_WSTraceOutputFn Output,void *Ctx);
+ *
+ * PARAMETERS:
+ *    Output [I] -- The function to send the JSON to
+ *    Ctx [I] -- Passed to 'Output'
+ *
+ * FUNCTION:
+ *    This function writes out all the rings as a Chrome trace.  Events are
+ *    still being recorded while this runs, any event that could have been
+ *    written over while it was being read is left out.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSTrace_Record()
+ ******************************************************************************/
+static void WSTrace_Dump(t_WSTraceOutputFn Output,void *Ctx)
+{
+    struct WSTraceRing *Ring;
+    struct WSTraceEvent Event;
+    char Line[WST_LINE_SIZE];
+    uint64_t Head;
+    uint64_t Latest;
+    uint64_t r;
+    int Rings;
+    int Ring2Do;
+    int Len;
+    int Con;
+    const char *Sep;
+
+    Len=snprintf(Line,sizeof(Line),"{\"displayTimeUnit\":\"ns\","
+            "\"traceEvents\":[\n");
+    Output(Ctx,Line,Len);
+    Sep="";
+
+    /* Name the tracks */
+    for(Con=0;Con<WS_OPT_MAX_CONNECTIONS;Con++)
+    {
+        Len=snprintf(Line,sizeof(Line),"%s{\"name\":\"thread_name\","
+                "\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"connection %d\"}}",Sep,Con,Con);
+        Output(Ctx,Line,Len);
+        Sep=",\n";
+    }
+
+    Rings=atomic_load(&m_RingsUsed);
+    if(Rings>WST_MAX_THREADS)
+        Rings=WST_MAX_THREADS;
+
+    for(Ring2Do=0;Ring2Do<Rings;Ring2Do++)
+    {
+        Ring=&m_Rings[Ring2Do];
+        Head=atomic_load_explicit(&Ring->Head,memory_order_acquire);
+        r=Head>WS_OPT_TRACE_EVENTS?Head-WS_OPT_TRACE_EVENTS:0;
+        for(;r<Head;r++)
+        {
+            memcpy(&Event,&Ring->Events[r&(WS_OPT_TRACE_EVENTS-1)],
+                    sizeof(Event));
+
+            /* If the writer has got to this slot again it may have been
+               changing it while we copied it */
+            atomic_thread_fence(memory_order_acquire);
+            Latest=atomic_load_explicit(&Ring->Head,memory_order_relaxed);
+            if(Latest>=r+WS_OPT_TRACE_EVENTS)
+                continue;
+
+            if(Event.Type>=e_WSTraceMAX)
+                continue;
+
+            /* Chrome wants microseconds, the ns are kept as the fraction */
+            if(Event.Type==e_WSTrace_Handler || Event.Type==e_WSTrace_Write)
+            {
+                Len=snprintf(Line,sizeof(Line),"%s{\"name\":\"%s\","
+                        "\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                        "\"ts\":%llu.%03llu,\"dur\":%u.%03u,"
+                        "\"args\":{\"thread\":%d,\"arg\":%u}}",Sep,
+                        m_EventNames[Event.Type],Event.Con,
+                        (unsigned long long)(Event.When/1000),
+                        (unsigned long long)(Event.When%1000),
+                        Event.Dur/1000,Event.Dur%1000,Ring2Do,Event.Arg);
+            }
+            else
+            {
+                Len=snprintf(Line,sizeof(Line),"%s{\"name\":\"%s\","
+                        "\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%u,"
+                        "\"ts\":%llu.%03llu,"
+                        "\"args\":{\"thread\":%d,\"arg\":%u}}",Sep,
+                        m_EventNames[Event.Type],Event.Con,
+                        (unsigned long long)(Event.When/1000),
+                        (unsigned long long)(Event.When%1000),
+                        Ring2Do,Event.Arg);
+            }
+            Output(Ctx,Line,Len);
+        }
+    }
+
+    Output(Ctx,"\n]}\n",4);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSTrace_OutputToPage
+ *
+ * SYNOPSIS:
+ *    static void WSTrace_OutputToPage(void *Ctx,const char *Str,int Len);
+ *
+ * PARAMETERS:
+ *    Ctx [I] -- The web server context to send on
+ *    Str [I] -- The text to send
+ *    Len [I] -- The number of bytes in 'Str'
+ *
+ * FUNCTION:
+ *    This function sends part of the trace on a connection.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSTrace_WritePage()
+ ******************************************************************************/
+static void WSTrace_OutputToPage(void *Ctx,const char *Str,int Len)
+{
+    WS_WriteChunk((struct WebServer *)Ctx,Str,Len);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSTrace_OutputToFile
+ *
+ * SYNOPSIS:
+ *    static void WSTrace_OutputToFile(void *Ctx,const char *Str,int Len);
+ *
+ * PARAMETERS:
+ *    Ctx [I] -- The FILE to write to
+ *    Str [I] -- The text to write
+ *    Len [I] -- The number of bytes in 'Str'
+ *
+ * FUNCTION:
+ *    This function writes part of the trace to a file.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSTrace_Tick()
+ ******************************************************************************/
+static void WSTrace_OutputToFile(void *Ctx,const char *Str,int Len)
+{
+    fwrite(Str,1,Len,(FILE *)Ctx);
+}
+
+#endif
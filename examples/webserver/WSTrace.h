@@ -0,0 +1,80 @@
+/*******************************************************************************
+ * FILENAME: WSTrace.h
+ * 
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This file has the request tracing ring buffers.  Timestamped events
+ *    are recorded as connections are handled and can be dumped as a Chrome
+ *    trace (JSON) to see where a slow request spent it's time.
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ *******************************************************************************/
+#ifndef __WSTRACE_H_
+#define __WSTRACE_H_
+
+/***  HEADER FILES TO INCLUDE          ***/
+#include "WebServer.h"
+#include <stdint.h>
+
+/***  DEFINES                          ***/
+
+/***  MACROS                           ***/
+#if !WS_OPT_TRACE
+#define WSTrace_Now()                               0
+#define WSTrace_Event(Type,Con,Arg)
+#define WSTrace_Span(Type,Con,Start,Dur,Arg)
+#define WSTrace_RequestDump()
+#define WSTrace_Tick()
+#endif
+
+/***  TYPE DEFINITIONS                 ***/
+typedef enum
+{
+    e_WSTrace_Accept,
+    e_WSTrace_FirstByte,        // Arg = bytes read
+    e_WSTrace_HeadersEnd,
+    e_WSTrace_Handler,          // Span
+    e_WSTrace_Write,            // Span, Arg = bytes written
+    e_WSTrace_ReplyEnd,         // Arg = reply status
+    e_WSTrace_Close,
+    e_WSTraceMAX
+} e_WSTraceType;
+
+/***  CLASS DEFINITIONS                ***/
+
+/***  GLOBAL VARIABLE DEFINITIONS      ***/
+
+/***  EXTERNAL FUNCTION PROTOTYPES     ***/
+#if WS_OPT_TRACE
+uint64_t WSTrace_Now(void);
+void WSTrace_Event(e_WSTraceType Type,int Con,uint32_t Arg);
+void WSTrace_Span(e_WSTraceType Type,int Con,uint64_t Start,uint64_t Dur,
+        uint32_t Arg);
+void WSTrace_RequestDump(void);
+void WSTrace_Tick(void);
+void WSTrace_WritePage(struct WebServer *Web);
+#endif
+
+#endif
@@ -0,0 +1,1288 @@
+/*******************************************************************************
+ * FILENAME: WSWebSocket.c
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This file has WebSockets (RFC 6455).  A page upgrades its request with
+ *    WS_AcceptWebSocket() and from then on the connection carries frames.
+ *    Messages from the client are given to the page's callback and the
+ *    page (or anything else on the web server thread) sends with
+ *    WSWebSocket_Send() and WSWebSocket_Broadcast().
+ *
+ *    Each WebSocket has a queue of frames waiting to go out.  The frames
+ *    are reference counted, so WSWebSocket_Broadcast() builds the frame
+ *    once and puts the same frame on every WebSocket in the group.  Sending
+ *    to 100 WebSockets takes one frame of memory, not 100.  The queues are
+ *    sent from WS_Tick() as the connections can take them (nothing waits on
+ *    a slow client).  A client that lets WS_OPT_WEBSOCKET_QUEUE frames back
+ *    up is hung up on.
+ *
+ *    Client frames are unmasked as they come in.  Fragmented messages are
+ *    put back together (up to WS_OPT_WEBSOCKET_MESSAGE_SIZE), pings are
+ *    answered, and a quiet client is pinged after WS_OPT_WEBSOCKET_PING
+ *    seconds.  Extensions (compression) aren't supported.
+ *
+ *    Everything in here has to be called from the web server thread.
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ ******************************************************************************/
+
+/*** HEADER FILES TO INCLUDE  ***/
+#include "WSWebSocket.h"
+#include "WSMetrics.h"
+#include "WebServer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*** DEFINES                  ***/
+#define WSW_READ_SIZE               512     // How much we read from a WebSocket at a time
+#define WSW_MAX_HEAD                14      // The biggest frame head a client can send (2 + 8 byte length + 4 byte mask)
+#define WSW_MAX_SEND_HEAD           10      // The biggest frame head we send (2 + 8 byte length, we don't mask)
+#define WSW_MAX_CONTROL             125     // The biggest control frame (ping, pong, close) payload
+#define WSW_CLOSE_TIMEOUT           5       // How many seconds we wait for the client to answer our close before hanging up
+#define WSW_GUID                    "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"  // Added to the key for Sec-WebSocket-Accept
+
+/* Opcodes */
+#define WSW_OP_CONTINUATION         0x0
+#define WSW_OP_TEXT                 0x1
+#define WSW_OP_BINARY               0x2
+#define WSW_OP_CLOSE                0x8
+#define WSW_OP_PING                 0x9
+#define WSW_OP_PONG                 0xA
+
+/*** MACROS                   ***/
+#define WSW_ROL(x,n)                (((x)<<(n))|((x)>>(32-(n))))
+
+/*** TYPE DEFINITIONS         ***/
+typedef enum
+{
+    e_WSWStep_Head,             // Collecting the frame head
+    e_WSWStep_Payload,          // Collecting (and unmasking) the payload
+    e_WSWStepMAX
+} e_WSWStepType;
+
+/* A frame ready to send.  It's shared by every WebSocket it's queued on. */
+struct WSWebSocketFrame
+{
+    int Refs;                   // The number of queues it's on
+    int Len;
+    uint8_t Data[];             // The frame head then the payload
+};
+
+struct WSWebSocket
+{
+    struct WebServer *Web;      // The connection (NULL=this slot is free)
+    t_WSWebSocketFn Callback;
+    void *UserData;
+    uintptr_t Group;            // What WSWebSocket_Broadcast() sends to
+    bool Closing;               // We sent a close (nothing more can be sent)
+    bool PeerClosed;            // The client sent a close (hang up once our queue is out)
+    bool CloseReported;         // The callback has had e_WSWebSocketEvent_Close
+    bool Dropped;               // The queue overflowed or a write failed, hang up
+    bool PingSent;
+    t_ElapsedTime LastHeard;
+    t_ElapsedTime ClosedAt;
+
+    /* Coming in */
+    e_WSWStepType Step;
+    int HeadLen;
+    uint8_t Head[WSW_MAX_HEAD];
+    uint8_t Opcode;             // Of the frame coming in
+    bool Fin;
+    uint64_t PayloadLeft;
+    uint8_t Mask[4];
+    unsigned int MaskPos;
+    bool InMessage;             // A fragmented message is being put together
+    uint8_t MsgOpcode;          // WSW_OP_TEXT or WSW_OP_BINARY
+    int MsgLen;
+    char Msg[WS_OPT_WEBSOCKET_MESSAGE_SIZE+1];  // +1 for the \0 after text
+    int CtrlLen;
+    uint8_t Ctrl[WSW_MAX_CONTROL];  // Control frames can come in the middle of a message
+
+    /* Going out */
+    struct WSWebSocketFrame *Queue[WS_OPT_WEBSOCKET_QUEUE];
+    int QueueHead;
+    int QueueCount;
+    int Sent;                   // Bytes of the first frame in the queue already sent
+};
+
+/*** FUNCTION PROTOTYPES      ***/
+static struct WSWebSocketFrame *WSWebSocket_NewFrame(uint8_t Opcode,
+        const void *Data,int Len);
+static void WSWebSocket_FreeFrame(struct WSWebSocketFrame *Frame);
+static bool WSWebSocket_Queue(struct WSWebSocket *Socket,
+        struct WSWebSocketFrame *Frame);
+static bool WSWebSocket_SendControl(struct WSWebSocket *Socket,
+        uint8_t Opcode,const void *Data,int Len);
+static bool WSWebSocket_Flush(struct WSWebSocket *Socket);
+static int WSWebSocket_HeadSize(const uint8_t *Head,int HeadLen);
+static bool WSWebSocket_StartFrame(struct WSWebSocket *Socket);
+static bool WSWebSocket_EndFrame(struct WSWebSocket *Socket);
+static bool WSWebSocket_Fail(struct WSWebSocket *Socket,uint16_t Code);
+static void WSWebSocket_SHA1(const uint8_t *Data,int Len,uint8_t *Digest);
+static void WSWebSocket_SHA1Block(uint32_t *Hash,const uint8_t *Block);
+
+/*** VARIABLE DEFINITIONS     ***/
+static struct WSWebSocket m_WebSockets[WS_OPT_WEBSOCKET_CONNECTIONS];
+
+static const char m_Base64[]=
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_Init
+ *
+ * SYNOPSIS:
+ *    void WSWebSocket_Init(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function sets up the WebSockets.  It's called from WS_Init().
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSWebSocket_Open()
+ ******************************************************************************/
+void WSWebSocket_Init(void)
+{
+    int r;
+
+    for(r=0;r<WS_OPT_WEBSOCKET_CONNECTIONS;r++)
+        m_WebSockets[r].Web=NULL;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_Open
+ *
+ * SYNOPSIS:
+ *    struct WSWebSocket *WSWebSocket_Open(struct WebServer *Web,
+ *          t_WSWebSocketFn Callback,void *UserData,uintptr_t Group);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The connection that is being upgraded
+ *    Callback [I] -- The function to call with messages from the client
+ *                    (and when the WebSocket goes away)
+ *    UserData [I] -- Passed to 'Callback'
+ *    Group [I] -- The group WSWebSocket_Broadcast() sends to this WebSocket
+ *                 under
+ *
+ * FUNCTION:
+ *    This function gets a WebSocket for a connection.  It's called from
+ *    WS_AcceptWebSocket().
+ *
+ * RETURNS:
+ *    The WebSocket or NULL if WS_OPT_WEBSOCKET_CONNECTIONS are in use.
+ *
+ * SEE ALSO:
+ *    WSWebSocket_Release()
+ ******************************************************************************/
+struct WSWebSocket *WSWebSocket_Open(struct WebServer *Web,
+        t_WSWebSocketFn Callback,void *UserData,uintptr_t Group)
+{
+    struct WSWebSocket *Socket;
+    int r;
+
+    for(r=0;r<WS_OPT_WEBSOCKET_CONNECTIONS;r++)
+        if(m_WebSockets[r].Web==NULL)
+            break;
+    if(r==WS_OPT_WEBSOCKET_CONNECTIONS)
+        return NULL;
+
+    Socket=&m_WebSockets[r];
+    Socket->Web=Web;
+    Socket->Callback=Callback;
+    Socket->UserData=UserData;
+    Socket->Group=Group;
+    Socket->Closing=false;
+    Socket->PeerClosed=false;
+    Socket->CloseReported=false;
+    Socket->Dropped=false;
+    Socket->PingSent=false;
+    Socket->LastHeard=ReadElapsedClock();
+    Socket->ClosedAt=0;
+    Socket->Step=e_WSWStep_Head;
+    Socket->HeadLen=0;
+    Socket->InMessage=false;
+    Socket->MsgLen=0;
+    Socket->QueueHead=0;
+    Socket->QueueCount=0;
+    Socket->Sent=0;
+
+    return Socket;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_Release
+ *
+ * SYNOPSIS:
+ *    void WSWebSocket_Release(struct WSWebSocket *Socket);
+ *
+ * PARAMETERS:
+ *    Socket [I/O] -- The WebSocket to free
+ *
+ * FUNCTION:
+ *    This function is called when the connection is closed.  The callback
+ *    gets e_WSWebSocketEvent_Close (if it hasn't already) and anything
+ *    still queued is thrown away.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSWebSocket_Open()
+ ******************************************************************************/
+void WSWebSocket_Release(struct WSWebSocket *Socket)
+{
+    if(!Socket->CloseReported)
+    {
+        Socket->CloseReported=true;
+        Socket->Callback(Socket->Web,Socket->UserData,
+                e_WSWebSocketEvent_Close,NULL,0);
+    }
+
+    while(Socket->QueueCount>0)
+    {
+        WSWebSocket_FreeFrame(Socket->Queue[Socket->QueueHead]);
+        Socket->QueueHead=(Socket->QueueHead+1)%WS_OPT_WEBSOCKET_QUEUE;
+        Socket->QueueCount--;
+    }
+
+    Socket->Web=NULL;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_MakeAccept
+ *
+ * SYNOPSIS:
+ *    void WSWebSocket_MakeAccept(const char *Key,char *Accept);
+ *
+ * PARAMETERS:
+ *    Key [I] -- The Sec-WebSocket-Key the client sent (WS_WEBSOCKET_KEY_LEN
+ *               chars)
+ *    Accept [O] -- The Sec-WebSocket-Accept to send back.  This must have
+ *                  room for WSWEBSOCKET_ACCEPT_LEN+1 chars.
+ *
+ * FUNCTION:
+ *    This function works out the Sec-WebSocket-Accept for a handshake (the
+ *    base64 of the SHA-1 of the key and the WebSocket GUID).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_AcceptWebSocket()
+ ******************************************************************************/
+void WSWebSocket_MakeAccept(const char *Key,char *Accept)
+{
+    uint8_t Buff[WS_WEBSOCKET_KEY_LEN+sizeof(WSW_GUID)-1];
+    uint8_t Digest[20];
+    uint32_t Bits;
+    int r;
+
+    memcpy(Buff,Key,WS_WEBSOCKET_KEY_LEN);
+    memcpy(&Buff[WS_WEBSOCKET_KEY_LEN],WSW_GUID,sizeof(WSW_GUID)-1);
+    WSWebSocket_SHA1(Buff,sizeof(Buff),Digest);
+
+    /* Base64 (20 bytes is 6 groups of 3 and 2 left over) */
+    for(r=0;r<18;r+=3)
+    {
+        Bits=(Digest[r]<<16)|(Digest[r+1]<<8)|Digest[r+2];
+        *Accept++=m_Base64[(Bits>>18)&0x3F];
+        *Accept++=m_Base64[(Bits>>12)&0x3F];
+        *Accept++=m_Base64[(Bits>>6)&0x3F];
+        *Accept++=m_Base64[Bits&0x3F];
+    }
+    Bits=(Digest[18]<<16)|(Digest[19]<<8);
+    *Accept++=m_Base64[(Bits>>18)&0x3F];
+    *Accept++=m_Base64[(Bits>>12)&0x3F];
+    *Accept++=m_Base64[(Bits>>6)&0x3F];
+    *Accept++='=';
+    *Accept=0;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_Input
+ *
+ * SYNOPSIS:
+ *    bool WSWebSocket_Input(struct WSWebSocket *Socket,const uint8_t *Data,
+ *          int Len);
+ *
+ * PARAMETERS:
+ *    Socket [I/O] -- The WebSocket the bytes came in on
+ *    Data [I] -- The bytes from the client
+ *    Len [I] -- The number of bytes in 'Data'
+ *
+ * FUNCTION:
+ *    This function takes bytes from the client and splits them into frames.
+ *    The frames don't have to come in all at once.  The payload is unmasked
+ *    as it comes in and whole messages are given to the callback.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- The client broke the protocol (we sent a close), hang up
+ *
+ * SEE ALSO:
+ *    WSWebSocket_Run()
+ ******************************************************************************/
+bool WSWebSocket_Input(struct WSWebSocket *Socket,const uint8_t *Data,
+        int Len)
+{
+    uint8_t *Dest;
+    int Use;
+    int r;
+
+    while(Len>0)
+    {
+        if(Socket->Step==e_WSWStep_Head)
+        {
+            Socket->Head[Socket->HeadLen++]=*Data++;
+            Len--;
+            if(Socket->HeadLen<WSWebSocket_HeadSize(Socket->Head,
+                    Socket->HeadLen))
+            {
+                continue;
+            }
+            if(!WSWebSocket_StartFrame(Socket))
+                return false;
+            continue;
+        }
+
+        /* Payload (WSWebSocket_StartFrame() checked that it fits) */
+        Use=Len;
+        if(Socket->PayloadLeft<(uint64_t)Use)
+            Use=Socket->PayloadLeft;
+        if(Socket->Opcode>=WSW_OP_CLOSE)
+        {
+            Dest=&Socket->Ctrl[Socket->CtrlLen];
+            Socket->CtrlLen+=Use;
+        }
+        else
+        {
+            Dest=(uint8_t *)&Socket->Msg[Socket->MsgLen];
+            Socket->MsgLen+=Use;
+        }
+        for(r=0;r<Use;r++)
+            Dest[r]=Data[r]^Socket->Mask[(Socket->MaskPos++)&3];
+
+        Data+=Use;
+        Len-=Use;
+        Socket->PayloadLeft-=Use;
+        if(Socket->PayloadLeft==0)
+        {
+            if(!WSWebSocket_EndFrame(Socket))
+                return false;
+        }
+    }
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_Run
+ *
+ * SYNOPSIS:
+ *    bool WSWebSocket_Run(struct WSWebSocket *Socket);
+ *
+ * PARAMETERS:
+ *    Socket [I/O] -- The WebSocket to work on
+ *
+ * FUNCTION:
+ *    This function is called from WS_Tick() for each WebSocket.  It reads
+ *    what the client sent, sends what is queued (as much as the connection
+ *    will take), and pings the client if it has been quiet.
+ *
+ * RETURNS:
+ *    true -- Keep going
+ *    false -- The WebSocket is done (closed, timed out, or failed), hang up
+ *
+ * SEE ALSO:
+ *    WSWebSocket_Input()
+ ******************************************************************************/
+bool WSWebSocket_Run(struct WSWebSocket *Socket)
+{
+    uint8_t Buff[WSW_READ_SIZE];
+    t_ElapsedTime Now;
+    int Bytes;
+
+    if(Socket->Dropped)
+        return false;
+
+    Now=ReadElapsedClock();
+
+    Bytes=SocketsCon_Read(&Socket->Web->Con,Buff,sizeof(Buff));
+    if(Bytes<0)
+        return false;
+    if(Bytes>0)
+    {
+        WSMetrics_Count(e_WSMetricCounter_BytesIn,Bytes);
+        Socket->LastHeard=Now;
+        Socket->PingSent=false;
+        if(!WSWebSocket_Input(Socket,Buff,Bytes))
+            return false;
+    }
+
+    /* Make sure the client is still there */
+    if(Now-Socket->LastHeard>=WS_OPT_WEBSOCKET_PING*2)
+    {
+        WSMetrics_Count(e_WSMetricCounter_TimeoutIdle,1);
+        return false;
+    }
+    if(!Socket->PingSent && Now-Socket->LastHeard>=WS_OPT_WEBSOCKET_PING)
+    {
+        WSWebSocket_SendControl(Socket,WSW_OP_PING,NULL,0);
+        Socket->PingSent=true;
+    }
+
+    if(!WSWebSocket_Flush(Socket))
+        return false;
+
+    /* The close handshake is done once our queue is out, or we gave up
+       waiting for the client's answer */
+    if(Socket->PeerClosed && Socket->QueueCount==0)
+        return false;
+    if(Socket->Closing && Now-Socket->ClosedAt>=WSW_CLOSE_TIMEOUT)
+        return false;
+
+    return !Socket->Dropped;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_Send
+ *
+ * SYNOPSIS:
+ *    bool WSWebSocket_Send(struct WebServer *Web,bool Text,const void *Data,
+ *          int Len);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The connection to send on (it must be a WebSocket)
+ *    Text [I] -- true = send a text message (UTF-8), false = binary
+ *    Data [I] -- The message
+ *    Len [I] -- The number of bytes in 'Data'
+ *
+ * FUNCTION:
+ *    This function queues a message on one WebSocket.  It's sent from
+ *    WS_Tick() as the connection can take it (we try right away too).
+ *
+ * RETURNS:
+ *    true -- The message is queued
+ *    false -- It's not a WebSocket, it's closing, we are out of memory, or
+ *             the queue is full (the connection will be hung up)
+ *
+ * SEE ALSO:
+ *    WSWebSocket_Broadcast(), WS_AcceptWebSocket()
+ ******************************************************************************/
+bool WSWebSocket_Send(struct WebServer *Web,bool Text,const void *Data,
+        int Len)
+{
+    struct WSWebSocketFrame *Frame;
+    struct WSWebSocket *Socket;
+
+    Socket=Web->WebSocket;
+    if(Socket==NULL || Socket->Closing)
+        return false;
+
+    Frame=WSWebSocket_NewFrame(Text?WSW_OP_TEXT:WSW_OP_BINARY,Data,Len);
+    if(Frame==NULL)
+        return false;
+
+    if(!WSWebSocket_Queue(Socket,Frame))
+    {
+        free(Frame);
+        return false;
+    }
+    if(!WSWebSocket_Flush(Socket))
+        Socket->Dropped=true;
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_Broadcast
+ *
+ * SYNOPSIS:
+ *    int WSWebSocket_Broadcast(uintptr_t Group,bool Text,const void *Data,
+ *          int Len);
+ *
+ * PARAMETERS:
+ *    Group [I] -- The group to send to (the 'Group' given to
+ *                 WS_AcceptWebSocket())
+ *    Text [I] -- true = send a text message (UTF-8), false = binary
+ *    Data [I] -- The message
+ *    Len [I] -- The number of bytes in 'Data'
+ *
+ * FUNCTION:
+ *    This function sends a message to every WebSocket in a group.  The
+ *    frame is built once and the same frame is queued on each WebSocket
+ *    (it's freed when the last one has sent it).
+ *
+ *    WebSockets whose queue is full are hung up on.
+ *
+ * RETURNS:
+ *    The number of WebSockets the message was queued on.
+ *
+ * SEE ALSO:
+ *    WSWebSocket_Send(), WSWebSocket_Count()
+ ******************************************************************************/
+int WSWebSocket_Broadcast(uintptr_t Group,bool Text,const void *Data,int Len)
+{
+    struct WSWebSocketFrame *Frame;
+    int Count;
+    int r;
+
+    Frame=NULL;
+    Count=0;
+    for(r=0;r<WS_OPT_WEBSOCKET_CONNECTIONS;r++)
+    {
+        if(m_WebSockets[r].Web==NULL || m_WebSockets[r].Group!=Group ||
+                m_WebSockets[r].Closing)
+        {
+            continue;
+        }
+
+        if(Frame==NULL)
+        {
+            Frame=WSWebSocket_NewFrame(Text?WSW_OP_TEXT:WSW_OP_BINARY,Data,
+                    Len);
+            if(Frame==NULL)
+                return 0;
+            WSMetrics_Count(e_WSMetricCounter_WebSocketBroadcasts,1);
+        }
+        if(WSWebSocket_Queue(&m_WebSockets[r],Frame))
+            Count++;
+    }
+
+    if(Frame==NULL)
+        return 0;
+
+    /* Get it going (the first write usually takes the whole frame) */
+    Frame->Refs++;
+    for(r=0;r<WS_OPT_WEBSOCKET_CONNECTIONS;r++)
+    {
+        if(m_WebSockets[r].Web!=NULL && m_WebSockets[r].Group==Group &&
+                !WSWebSocket_Flush(&m_WebSockets[r]))
+        {
+            m_WebSockets[r].Dropped=true;
+        }
+    }
+    WSWebSocket_FreeFrame(Frame);
+
+    return Count;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_Close
+ *
+ * SYNOPSIS:
+ *    void WSWebSocket_Close(struct WebServer *Web,uint16_t Code);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The connection to close (it must be a WebSocket)
+ *    Code [I] -- The close code to send (WSWEBSOCKET_CLOSE_NORMAL, ...)
+ *
+ * FUNCTION:
+ *    This function starts closing a WebSocket.  What is already queued is
+ *    sent, then a close.  The connection is hung up on when the client
+ *    answers (or after a few seconds).  The callback gets
+ *    e_WSWebSocketEvent_Close when it's gone.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_AcceptWebSocket()
+ ******************************************************************************/
+void WSWebSocket_Close(struct WebServer *Web,uint16_t Code)
+{
+    struct WSWebSocket *Socket;
+    uint8_t Payload[2];
+
+    Socket=Web->WebSocket;
+    if(Socket==NULL || Socket->Closing)
+        return;
+
+    Payload[0]=Code>>8;
+    Payload[1]=Code;
+    WSWebSocket_SendControl(Socket,WSW_OP_CLOSE,Payload,sizeof(Payload));
+    Socket->Closing=true;
+    Socket->ClosedAt=ReadElapsedClock();
+    if(!WSWebSocket_Flush(Socket))
+        Socket->Dropped=true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_Count
+ *
+ * SYNOPSIS:
+ *    int WSWebSocket_Count(uintptr_t Group);
+ *
+ * PARAMETERS:
+ *    Group [I] -- The group to count
+ *
+ * FUNCTION:
+ *    This function counts the open WebSockets in a group (so you can skip
+ *    building a message no one will get).
+ *
+ * RETURNS:
+ *    The number of WebSockets in the group that aren't closing.
+ *
+ * SEE ALSO:
+ *    WSWebSocket_Broadcast()
+ ******************************************************************************/
+int WSWebSocket_Count(uintptr_t Group)
+{
+    int Count;
+    int r;
+
+    Count=0;
+    for(r=0;r<WS_OPT_WEBSOCKET_CONNECTIONS;r++)
+    {
+        if(m_WebSockets[r].Web!=NULL && m_WebSockets[r].Group==Group &&
+                !m_WebSockets[r].Closing)
+        {
+            Count++;
+        }
+    }
+    return Count;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_NewFrame
+ *
+ * SYNOPSIS:
+ *    static struct WSWebSocketFrame *WSWebSocket_NewFrame(uint8_t Opcode,
+ *          const void *Data,int Len);
+ *
+ * PARAMETERS:
+ *    Opcode [I] -- The frame type (WSW_OP_TEXT, WSW_OP_PING, ...)
+ *    Data [I] -- The payload (can be NULL if 'Len' is 0)
+ *    Len [I] -- The number of bytes in 'Data'
+ *
+ * FUNCTION:
+ *    This function builds a frame to send (server frames aren't masked).
+ *    It isn't on any queue yet.
+ *
+ * RETURNS:
+ *    The frame or NULL if we are out of memory.
+ *
+ * SEE ALSO:
+ *    WSWebSocket_Queue(), WSWebSocket_FreeFrame()
+ ******************************************************************************/
+static struct WSWebSocketFrame *WSWebSocket_NewFrame(uint8_t Opcode,
+        const void *Data,int Len)
+{
+    struct WSWebSocketFrame *Frame;
+    uint8_t *Pos;
+    int r;
+
+    Frame=malloc(sizeof(struct WSWebSocketFrame)+WSW_MAX_SEND_HEAD+Len);
+    if(Frame==NULL)
+        return NULL;
+
+    Pos=Frame->Data;
+    *Pos++=0x80|Opcode;     // FIN (we never fragment)
+    if(Len<126)
+    {
+        *Pos++=Len;
+    }
+    else if(Len<65536)
+    {
+        *Pos++=126;
+        *Pos++=Len>>8;
+        *Pos++=Len;
+    }
+    else
+    {
+        *Pos++=127;
+        for(r=7;r>=0;r--)
+            *Pos++=(uint64_t)Len>>(r*8);
+    }
+    if(Len>0)
+        memcpy(Pos,Data,Len);
+
+    Frame->Refs=0;
+    Frame->Len=Pos-Frame->Data+Len;
+
+    return Frame;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_FreeFrame
+ *
+ * SYNOPSIS:
+ *    static void WSWebSocket_FreeFrame(struct WSWebSocketFrame *Frame);
+ *
+ * PARAMETERS:
+ *    Frame [I/O] -- The frame to let go of
+ *
+ * FUNCTION:
+ *    This function drops a reference to a frame (it's taken off a queue).
+ *    The frame is freed when no queue has it.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSWebSocket_NewFrame()
+ ******************************************************************************/
+static void WSWebSocket_FreeFrame(struct WSWebSocketFrame *Frame)
+{
+    Frame->Refs--;
+    if(Frame->Refs<=0)
+        free(Frame);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_Queue
+ *
+ * SYNOPSIS:
+ *    static bool WSWebSocket_Queue(struct WSWebSocket *Socket,
+ *          struct WSWebSocketFrame *Frame);
+ *
+ * PARAMETERS:
+ *    Socket [I/O] -- The WebSocket to send on
+ *    Frame [I/O] -- The frame to send
+ *
+ * FUNCTION:
+ *    This function adds a reference to a frame to the end of a WebSocket's
+ *    queue.  If the queue is full the client isn't keeping up and the
+ *    WebSocket is marked to be hung up on.
+ *
+ * RETURNS:
+ *    true -- It's queued
+ *    false -- The queue is full (or the WebSocket is being dropped)
+ *
+ * SEE ALSO:
+ *    WSWebSocket_Flush()
+ ******************************************************************************/
+static bool WSWebSocket_Queue(struct WSWebSocket *Socket,
+        struct WSWebSocketFrame *Frame)
+{
+    if(Socket->Dropped)
+        return false;
+
+    if(Socket->QueueCount==WS_OPT_WEBSOCKET_QUEUE)
+    {
+        WSMetrics_Count(e_WSMetricCounter_WebSocketDropped,1);
+        Socket->Dropped=true;
+        return false;
+    }
+
+    Frame->Refs++;
+    Socket->Queue[(Socket->QueueHead+Socket->QueueCount)%
+            WS_OPT_WEBSOCKET_QUEUE]=Frame;
+    Socket->QueueCount++;
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_SendControl
+ *
+ * SYNOPSIS:
+ *    static bool WSWebSocket_SendControl(struct WSWebSocket *Socket,
+ *          uint8_t Opcode,const void *Data,int Len);
+ *
+ * PARAMETERS:
+ *    Socket [I/O] -- The WebSocket to send on
+ *    Opcode [I] -- WSW_OP_PING, WSW_OP_PONG, or WSW_OP_CLOSE
+ *    Data [I] -- The payload (up to WSW_MAX_CONTROL bytes)
+ *    Len [I] -- The number of bytes in 'Data'
+ *
+ * FUNCTION:
+ *    This function queues a control frame.
+ *
+ * RETURNS:
+ *    true -- It's queued
+ *    false -- Out of memory or the queue is full
+ *
+ * SEE ALSO:
+ *    WSWebSocket_Queue()
+ ******************************************************************************/
+static bool WSWebSocket_SendControl(struct WSWebSocket *Socket,
+        uint8_t Opcode,const void *Data,int Len)
+{
+    struct WSWebSocketFrame *Frame;
+
+    Frame=WSWebSocket_NewFrame(Opcode,Data,Len);
+    if(Frame==NULL)
+        return false;
+
+    if(!WSWebSocket_Queue(Socket,Frame))
+    {
+        free(Frame);
+        return false;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_Flush
+ *
+ * SYNOPSIS:
+ *    static bool WSWebSocket_Flush(struct WSWebSocket *Socket);
+ *
+ * PARAMETERS:
+ *    Socket [I/O] -- The WebSocket to send on
+ *
+ * FUNCTION:
+ *    This function sends as much of the queue as the connection will take
+ *    right now.  A frame that only partly goes is finished next time.
+ *
+ * RETURNS:
+ *    true -- Things worked out (there may still be frames queued)
+ *    false -- The write failed
+ *
+ * SEE ALSO:
+ *    WSWebSocket_Queue()
+ ******************************************************************************/
+static bool WSWebSocket_Flush(struct WSWebSocket *Socket)
+{
+    struct WSWebSocketFrame *Frame;
+    int Sent;
+
+    while(Socket->QueueCount>0)
+    {
+        Frame=Socket->Queue[Socket->QueueHead];
+        Sent=SocketsCon_WriteSome(&Socket->Web->Con,&Frame->Data[Socket->Sent],
+                Frame->Len-Socket->Sent);
+        if(Sent<0)
+            return false;
+        if(Sent==0)
+            break;
+        WSMetrics_Count(e_WSMetricCounter_BytesOut,Sent);
+
+        Socket->Sent+=Sent;
+        if(Socket->Sent<Frame->Len)
+            break;
+
+        WSMetrics_Count(e_WSMetricCounter_WebSocketFramesOut,1);
+        WSWebSocket_FreeFrame(Frame);
+        Socket->QueueHead=(Socket->QueueHead+1)%WS_OPT_WEBSOCKET_QUEUE;
+        Socket->QueueCount--;
+        Socket->Sent=0;
+    }
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_HeadSize
+ *
+ * SYNOPSIS:
+ *    static int WSWebSocket_HeadSize(const uint8_t *Head,int HeadLen);
+ *
+ * PARAMETERS:
+ *    Head [I] -- The start of the frame head
+ *    HeadLen [I] -- The number of bytes of 'Head' we have
+ *
+ * FUNCTION:
+ *    This function works out how big a frame head is from the first 2
+ *    bytes.
+ *
+ * RETURNS:
+ *    The size of the whole head (2 if we don't have the first 2 bytes yet).
+ *
+ * SEE ALSO:
+ *    WSWebSocket_StartFrame()
+ ******************************************************************************/
+static int WSWebSocket_HeadSize(const uint8_t *Head,int HeadLen)
+{
+    int Size;
+
+    if(HeadLen<2)
+        return 2;
+
+    Size=2;
+    if((Head[1]&0x7F)==126)
+        Size+=2;
+    else if((Head[1]&0x7F)==127)
+        Size+=8;
+    if(Head[1]&0x80)
+        Size+=4;    // The mask
+
+    return Size;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_StartFrame
+ *
+ * SYNOPSIS:
+ *    static bool WSWebSocket_StartFrame(struct WSWebSocket *Socket);
+ *
+ * PARAMETERS:
+ *    Socket [I/O] -- The WebSocket to work on
+ *
+ * FUNCTION:
+ *    This function is called when a whole frame head has come in.  It
+ *    checks the frame and gets ready for the payload.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- The frame is bad (we sent a close), hang up
+ *
+ * SEE ALSO:
+ *    WSWebSocket_EndFrame()
+ ******************************************************************************/
+static bool WSWebSocket_StartFrame(struct WSWebSocket *Socket)
+{
+    const uint8_t *Pos;
+    uint64_t Len;
+    int r;
+
+    Socket->Fin=(Socket->Head[0]&0x80)!=0;
+    Socket->Opcode=Socket->Head[0]&0x0F;
+
+    /* No extensions were agreed so the RSV bits must be 0, and clients
+       must mask */
+    if((Socket->Head[0]&0x70)!=0 || (Socket->Head[1]&0x80)==0)
+        return WSWebSocket_Fail(Socket,WSWEBSOCKET_CLOSE_PROTOCOL_ERROR);
+
+    Pos=&Socket->Head[2];
+    Len=Socket->Head[1]&0x7F;
+    if(Len==126)
+    {
+        Len=(Pos[0]<<8)|Pos[1];
+        Pos+=2;
+    }
+    else if(Len==127)
+    {
+        Len=0;
+        for(r=0;r<8;r++)
+            Len=(Len<<8)|*Pos++;
+    }
+    memcpy(Socket->Mask,Pos,4);
+    Socket->MaskPos=0;
+
+    switch(Socket->Opcode)
+    {
+        case WSW_OP_CLOSE:
+        case WSW_OP_PING:
+        case WSW_OP_PONG:
+            if(!Socket->Fin || Len>WSW_MAX_CONTROL)
+            {
+                return WSWebSocket_Fail(Socket,
+                        WSWEBSOCKET_CLOSE_PROTOCOL_ERROR);
+            }
+            Socket->CtrlLen=0;
+        break;
+        case WSW_OP_TEXT:
+        case WSW_OP_BINARY:
+            if(Socket->InMessage)
+            {
+                return WSWebSocket_Fail(Socket,
+                        WSWEBSOCKET_CLOSE_PROTOCOL_ERROR);
+            }
+            Socket->InMessage=true;
+            Socket->MsgOpcode=Socket->Opcode;
+            Socket->MsgLen=0;
+        break;
+        case WSW_OP_CONTINUATION:
+            if(!Socket->InMessage)
+            {
+                return WSWebSocket_Fail(Socket,
+                        WSWEBSOCKET_CLOSE_PROTOCOL_ERROR);
+            }
+        break;
+        default:
+        return WSWebSocket_Fail(Socket,WSWEBSOCKET_CLOSE_PROTOCOL_ERROR);
+    }
+
+    if(Socket->Opcode<WSW_OP_CLOSE &&
+            Len>(uint64_t)(WS_OPT_WEBSOCKET_MESSAGE_SIZE-Socket->MsgLen))
+    {
+        return WSWebSocket_Fail(Socket,WSWEBSOCKET_CLOSE_TOO_BIG);
+    }
+
+    Socket->PayloadLeft=Len;
+    Socket->Step=e_WSWStep_Payload;
+    Socket->HeadLen=0;
+
+    if(Len==0)
+        return WSWebSocket_EndFrame(Socket);
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_EndFrame
+ *
+ * SYNOPSIS:
+ *    static bool WSWebSocket_EndFrame(struct WSWebSocket *Socket);
+ *
+ * PARAMETERS:
+ *    Socket [I/O] -- The WebSocket to work on
+ *
+ * FUNCTION:
+ *    This function is called when the whole payload of a frame has come in.
+ *    Control frames are handled here and finished messages are given to the
+ *    callback.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- Hang up
+ *
+ * SEE ALSO:
+ *    WSWebSocket_StartFrame()
+ ******************************************************************************/
+static bool WSWebSocket_EndFrame(struct WSWebSocket *Socket)
+{
+    e_WSWebSocketEventType Event;
+
+    Socket->Step=e_WSWStep_Head;
+    WSMetrics_Count(e_WSMetricCounter_WebSocketFramesIn,1);
+
+    switch(Socket->Opcode)
+    {
+        case WSW_OP_CLOSE:
+            /* Answer with the same code (if we haven't sent our own close
+               already), then hang up once it's out */
+            if(!Socket->Closing)
+            {
+                WSWebSocket_SendControl(Socket,WSW_OP_CLOSE,Socket->Ctrl,
+                        Socket->CtrlLen>=2?2:0);
+                Socket->Closing=true;
+                Socket->ClosedAt=ReadElapsedClock();
+            }
+            Socket->PeerClosed=true;
+            if(!Socket->CloseReported)
+            {
+                Socket->CloseReported=true;
+                Socket->Callback(Socket->Web,Socket->UserData,
+                        e_WSWebSocketEvent_Close,NULL,0);
+            }
+        break;
+        case WSW_OP_PING:
+            if(!Socket->Closing)
+            {
+                WSWebSocket_SendControl(Socket,WSW_OP_PONG,Socket->Ctrl,
+                        Socket->CtrlLen);
+            }
+        break;
+        case WSW_OP_PONG:
+            /* It's an answer to our ping (Run() noted that we heard from
+               the client) */
+        break;
+        default:
+            if(!Socket->Fin)
+                break;
+
+            /* That's the whole message */
+            Socket->InMessage=false;
+            Socket->Msg[Socket->MsgLen]=0;
+            if(Socket->Closing)
+                break;
+
+            Event=e_WSWebSocketEvent_Binary;
+            if(Socket->MsgOpcode==WSW_OP_TEXT)
+                Event=e_WSWebSocketEvent_Text;
+            Socket->Callback(Socket->Web,Socket->UserData,Event,Socket->Msg,
+                    Socket->MsgLen);
+        break;
+    }
+
+    return !Socket->Dropped;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_Fail
+ *
+ * SYNOPSIS:
+ *    static bool WSWebSocket_Fail(struct WSWebSocket *Socket,uint16_t Code);
+ *
+ * PARAMETERS:
+ *    Socket [I/O] -- The WebSocket to work on
+ *    Code [I] -- The close code to send
+ *
+ * FUNCTION:
+ *    This function is called when the client breaks the protocol.  We send
+ *    a close (if the connection will take it right now) and give up.
+ *
+ * RETURNS:
+ *    false (hang up)
+ *
+ * SEE ALSO:
+ *    WSWebSocket_StartFrame()
+ ******************************************************************************/
+static bool WSWebSocket_Fail(struct WSWebSocket *Socket,uint16_t Code)
+{
+    WSWebSocket_Close(Socket->Web,Code);
+    WSWebSocket_Flush(Socket);
+    return false;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_SHA1
+ *
+ * SYNOPSIS:
+ *    static void WSWebSocket_SHA1(const uint8_t *Data,int Len,
+ *          uint8_t *Digest);
+ *
+ * PARAMETERS:
+ *    Data [I] -- The bytes to hash
+ *    Len [I] -- The number of bytes in 'Data' (under 120)
+ *    Digest [O] -- The 20 byte SHA-1 of 'Data'
+ *
+ * FUNCTION:
+ *    This function does a SHA-1 of a short buffer.  It's only used for the
+ *    handshake (SHA-1 isn't used for anything that needs it to be secure).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSWebSocket_MakeAccept()
+ ******************************************************************************/
+static void WSWebSocket_SHA1(const uint8_t *Data,int Len,uint8_t *Digest)
+{
+    uint8_t Blocks[128];
+    uint32_t Hash[5];
+    uint64_t Bits;
+    int BlocksLen;
+    int r;
+
+    Hash[0]=0x67452301;
+    Hash[1]=0xEFCDAB89;
+    Hash[2]=0x98BADCFE;
+    Hash[3]=0x10325476;
+    Hash[4]=0xC3D2E1F0;
+
+    /* Pad with a 1 bit, 0's, then the length in bits */
+    BlocksLen=(Len+8)/64*64+64;
+    memset(Blocks,0x00,BlocksLen);
+    memcpy(Blocks,Data,Len);
+    Blocks[Len]=0x80;
+    Bits=(uint64_t)Len*8;
+    for(r=0;r<8;r++)
+        Blocks[BlocksLen-1-r]=Bits>>(r*8);
+
+    for(r=0;r<BlocksLen;r+=64)
+        WSWebSocket_SHA1Block(Hash,&Blocks[r]);
+
+    for(r=0;r<5;r++)
+    {
+        Digest[r*4]=Hash[r]>>24;
+        Digest[r*4+1]=Hash[r]>>16;
+        Digest[r*4+2]=Hash[r]>>8;
+        Digest[r*4+3]=Hash[r];
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WSWebSocket_SHA1Block
+ *
+ * SYNOPSIS:
+ *    static void WSWebSocket_SHA1Block(uint32_t *Hash,const uint8_t *Block);
+ *
+ * PARAMETERS:
+ *    Hash [I/O] -- The 5 words of the hash so far
+ *    Block [I] -- The next 64 bytes
+ *
+ * FUNCTION:
+ *    This function runs one block through SHA-1.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSWebSocket_SHA1()
+ ******************************************************************************/
+static void WSWebSocket_SHA1Block(uint32_t *Hash,const uint8_t *Block)
+{
+    uint32_t W[80];
+    uint32_t a,b,c,d,e;
+    uint32_t f,k,t;
+    int r;
+
+    for(r=0;r<16;r++)
+    {
+        W[r]=((uint32_t)Block[r*4]<<24)|((uint32_t)Block[r*4+1]<<16)|
+                ((uint32_t)Block[r*4+2]<<8)|Block[r*4+3];
+    }
+    for(;r<80;r++)
+        W[r]=WSW_ROL(W[r-3]^W[r-8]^W[r-14]^W[r-16],1);
+
+    a=Hash[0];
+    b=Hash[1];
+    c=Hash[2];
+    d=Hash[3];
+    e=Hash[4];
+    for(r=0;r<80;r++)
+    {
+        if(r<20)
+        {
+            f=(b&c)|(~b&d);
+            k=0x5A827999;
+        }
+        else if(r<40)
+        {
+            f=b^c^d;
+            k=0x6ED9EBA1;
+        }
+        else if(r<60)
+        {
+            f=(b&c)|(b&d)|(c&d);
+            k=0x8F1BBCDC;
+        }
+        else
+        {
+            f=b^c^d;
+            k=0xCA62C1D6;
+        }
+        t=WSW_ROL(a,5)+f+e+k+W[r];
+        e=d;
+        d=c;
+        c=WSW_ROL(b,30);
+        b=a;
+        a=t;
+    }
+    Hash[0]+=a;
+    Hash[1]+=b;
+    Hash[2]+=c;
+    Hash[3]+=d;
+    Hash[4]+=e;
+}
@@ -0,0 +1,74 @@
+/*******************************************************************************
+ * FILENAME: WSWebSocket.h
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This has the WebSocket framing and broadcast in it (WSWebSocket.c).
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ *******************************************************************************/
+#ifndef __WSWEBSOCKET_H_
+#define __WSWEBSOCKET_H_
+
+/***  HEADER FILES TO INCLUDE          ***/
+#include "WebServer.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/***  DEFINES                          ***/
+#define WSWEBSOCKET_ACCEPT_LEN              28      // The length of a Sec-WebSocket-Accept (20 bytes in base64)
+
+/* Close codes (RFC 6455 7.4.1) */
+#define WSWEBSOCKET_CLOSE_NORMAL            1000
+#define WSWEBSOCKET_CLOSE_GOING_AWAY        1001
+#define WSWEBSOCKET_CLOSE_PROTOCOL_ERROR    1002
+#define WSWEBSOCKET_CLOSE_TOO_BIG           1009
+
+/***  MACROS                           ***/
+
+/***  TYPE DEFINITIONS                 ***/
+
+/***  CLASS DEFINITIONS                ***/
+
+/***  GLOBAL VARIABLE DEFINITIONS      ***/
+
+/***  EXTERNAL FUNCTION PROTOTYPES     ***/
+bool WSWebSocket_Send(struct WebServer *Web,bool Text,const void *Data,
+        int Len);
+int WSWebSocket_Broadcast(uintptr_t Group,bool Text,const void *Data,int Len);
+void WSWebSocket_Close(struct WebServer *Web,uint16_t Code);
+int WSWebSocket_Count(uintptr_t Group);
+
+/* Web server calls these */
+void WSWebSocket_Init(void);
+struct WSWebSocket *WSWebSocket_Open(struct WebServer *Web,
+        t_WSWebSocketFn Callback,void *UserData,uintptr_t Group);
+void WSWebSocket_MakeAccept(const char *Key,char *Accept);
+bool WSWebSocket_Input(struct WSWebSocket *Socket,const uint8_t *Data,
+        int Len);
+bool WSWebSocket_Run(struct WSWebSocket *Socket);
+void WSWebSocket_Release(struct WSWebSocket *Socket);
+
+#endif
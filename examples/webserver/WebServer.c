@@ -37,17 +37,78 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
+#include "WSQueue.h"
+#include "WSMetrics.h"
+#include "WSTrace.h"
+#include "WSProxy.h"
+#include "WSWebSocket.h"
+#include "WSEvents.h"
 #include <stdlib.h>
+#include <strings.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 
 /*** DEFINES                  ***/
+#define WS_HTTP_DATE_LEN                29      // "Sun, 06 Nov 1994 08:49:37 GMT"
+#define WS_REPLY_HEAD_SIZE              256     // Enough for the biggest status line + Date + ETag + canned reply
+#define WS_TAKEOVER_WAIT                2       // How many seconds WS_TakeOver() waits for the old server to send its sockets
 
 /*** MACROS                   ***/
+/* Builds a m_StatusLines[] entry.  'Len' must be the strlen() of 'Msg' (it's
+   the Content-Length of the canned reply) */
+#define WS_STATUS_LINE(Msg,Len) \
+    { \
+        "HTTP/1.1 " Msg "\r\nServer: BittyHTTP\r\n", \
+        sizeof("HTTP/1.1 " Msg "\r\nServer: BittyHTTP\r\n")-1, \
+        "Content-Length: " #Len "\r\n\r\n" Msg, \
+        sizeof("Content-Length: " #Len "\r\n\r\n" Msg)-1 \
+    }
+
+/* The ns clock used for the metrics and the trace (0 if neither is used) */
+#if WS_OPT_METRICS
+#define WS_NOW()                        WSMetrics_Now()
+#elif WS_OPT_TRACE
+#define WS_NOW()                        WSTrace_Now()
+#else
+#define WS_NOW()                        0
+#endif
+
+/* The connection number of a web server context (for the trace) */
+#define WS_CON_INDEX(Web)               ((int)((Web)-m_WebServers))
+
+/* Turns a number #define into a string */
+#define WS_STR(x)                       #x
+#define WS_XSTR(x)                      WS_STR(x)
 
 /*** TYPE DEFINITIONS         ***/
+struct WSStatusLine
+{
+    const char *Head;       // The status line and the headers we always send
+    int HeadLen;
+    const char *Canned;     // The rest of the reply when we only send the status
+    int CannedLen;
+};
+
+struct WSDateCache
+{
+    time_t When;
+    char Str[WS_HTTP_DATE_LEN+1];
+};
+
+struct WSHandlerMark
+{
+    uint64_t Start;         // When the page was called
+    uint64_t WriteNS;       // 'Web->WriteNS' when the page was called
+};
 
 /*** FUNCTION PROTOTYPES      ***/
 static int WS_GetNextLine(struct WebServer *Web,char *ReadBuff,int Bytes);
 static void WS_RunServer(struct WebServer *Web,char *ReadBuff,int Bytes);
+static void WS_KeepPipelined(struct WebServer *Web,const char *Bytes,int Len);
 static bool WS_ProcessURI(struct WebServer *Web);
 static void WS_ProcessGetVars(struct WebServer *Web);
 static void WS_ProcessCookieVars(struct WebServer *Web);
@@ -56,19 +117,216 @@ static void WS_SendResponse(struct WebServer *Web);
 static void WS_ProcessETag(struct WebServer *Web,bool Weak,const char *ETag);
 static void WS_ResetWebServer(struct WebServer *Web);
 static void WS_EndReply(struct WebServer *Web);
-static char *WS_SkipStorageArgs(char *StartingPos,const char **ArgsList);
-static const char *WS_FindArgInStorage(char *Pos,const char *Arg,
-        const char **ArgsList);
+static void WS_InitArgIndex(struct WebServer *Web);
+static const char **WS_GetArgsList(struct WebServer *Web,e_WSArgTypeType Type);
+static int WS_FindArgIndex(const char **ArgsList,const char *Arg);
+static const char *WS_GetArgByIndex(struct WebServer *Web,
+        e_WSArgTypeType Type,int Index);
+static struct WSArgIndex *WS_GetArgEntry(struct WebServer *Web,
+        e_WSArgTypeType Type,int Index,bool Add);
+static void WS_StoreArg(struct WebServer *Web,e_WSArgTypeType Type,
+        const char *Name,char *Value,bool Decode);
+static void WS_ParseArgList(struct WebServer *Web,e_WSArgTypeType Type,
+        char *Args);
+#if WS_OPT_LAZY_ARGS
+static bool WS_SaveLazyArgs(struct WebServer *Web,e_WSArgTypeType Type,
+        const char *Args);
+static void WS_ParseLazyArgs(struct WebServer *Web,e_WSArgTypeType Type);
+#endif
 static void WS_StartReply(struct WebServer *Web);
 static void WS_StartProcessingPOSTVar(struct WebServer *Web);
-static bool WS_CopyLineBuffer2POSTVar(struct WebServer *Web);
-static void WS_InsertCopy(char *Dest,char *DestEnd,const char *Src,int CopyLen);
+static bool WS_CopyLineBuffer2POSTVar(struct WebServer *Web,bool EndOfVar);
+static const char *WS_GetHTTPDate(struct WSDateCache *Cache,time_t When);
+static int WS_FormatDecimal(char *Output,unsigned int Value);
+static char *WS_FormatChunkHead(char *End,unsigned int Len);
+static void WS_SendChunkBuffer(struct WebServer *Web,bool LastChunk);
+static void WS_StartChunkedReply(struct WebServer *Web);
+static void WS_RunGenerator(struct WebServer *Web);
+static void WS_StopGenerator(struct WebServer *Web);
+static void WS_FinishResponse(struct WebServer *Web);
+static struct WebServer *WS_GetDeferred(t_WSDeferHandle Handle);
+static void WS_RunDeferredCompletions(void);
+static void WS_DeferredTimedOut(struct WebServer *Web);
+static void WS_Send(struct WebServer *Web,const void *Buffer,int Len);
+static void WS_SignalCompletion(void);
+static bool WS_CheckCompletions(void);
+static bool WS_OffloadResponse(struct WebServer *Web);
+static void WS_RunOffloadCompletions(void);
+static bool WS_GetPageProperties(struct WebServer *Web,const char *Filename);
+static void WS_CloseConnection(struct WebServer *Web);
+static void WS_StartProxy(struct WebServer *Web,int MethodLen);
+static void WS_RunProxy(struct WebServer *Web);
+static void WS_StopProxy(struct WebServer *Web);
+static void WS_StopWebSocket(struct WebServer *Web);
+static void WS_StopEvents(struct WebServer *Web);
+static e_ReplyStatusType WS_StatusFromCode(int Code);
+static void WS_EndRequestMetrics(struct WebServer *Web);
+static void WS_HandlerStart(struct WebServer *Web,struct WSHandlerMark *Mark);
+static void WS_HandlerDone(struct WebServer *Web,struct WSHandlerMark *Mark);
+static int WS_ConnectionsInUse(void);
+static void WS_StartPhase(struct WebServer *Web,uint32_t Bytes);
+static bool WS_PastDeadline(struct WebServer *Web);
+static void WS_RunHandoff(void);
+static struct SocketCon *WS_NewListener(void);
+static bool WS_AcceptConnection(struct SocketCon *NewCon);
+#if WS_OPT_SHED_LOAD
+static void WS_ShedConnections(void);
+#endif
+#if WS_OPT_METRICS
+static void WS_SendMetrics(struct WebServer *Web);
+#endif
+#if WS_OPT_OFFLOAD_THREADS>0
+static void *WS_OffloadWorker(void *Arg);
+#endif
 //static void DEBUG_PrintStoredArgs(struct WebServer *Web);
 
 /*** VARIABLE DEFINITIONS     ***/
-struct SocketCon m_ListeningSocket;
+struct SocketCon m_Listeners[WS_MAX_LISTENERS];
+int m_ListenerCount;
 struct WebServer m_WebServers[WS_OPT_MAX_CONNECTIONS];
 
+static const char m_HexDigits[]="0123456789ABCDEF";
+
+/* The start of the reply for each status.  e_ReplyStatusMAX is used when
+   no one set a status so it's a 500 */
+static const struct WSStatusLine m_StatusLines[e_ReplyStatusMAX+1]=
+{
+    [e_ReplyStatus_SwitchingProtocols]=
+            WS_STATUS_LINE("101 Switching Protocols",23),
+    [e_ReplyStatus_Ok]=WS_STATUS_LINE("200 OK",6),
+    [e_ReplyStatus_MovedPerm]=WS_STATUS_LINE("301 Moved Permanently",21),
+    [e_ReplyStatus_NotModified]=WS_STATUS_LINE("304 Not Modified",16),
+    [e_ReplyStatus_TmpRedirect]=WS_STATUS_LINE("307 Temporary Redirect",22),
+    [e_ReplyStatus_PermRedirect]=WS_STATUS_LINE("308 Permanent Redirect",22),
+    [e_ReplyStatus_BadRequest]=WS_STATUS_LINE("400 Bad Request",15),
+    [e_ReplyStatus_Forbidden]=WS_STATUS_LINE("403 Forbidden",13),
+    [e_ReplyStatus_NotFound]=WS_STATUS_LINE("404 Not Found",13),
+    [e_ReplyStatus_MethodNotAllowed]=WS_STATUS_LINE("405 Method Not Allowed",22),
+    [e_ReplyStatus_URITooLong]=WS_STATUS_LINE("414 URI Too Long",16),
+    [e_ReplyStatus_RequestHeaderFieldsTooLarge]=
+            WS_STATUS_LINE("431 Request Header Fields Too Large",35),
+    [e_ReplyStatus_InternalServerError]=
+            WS_STATUS_LINE("500 Internal Server Error",25),
+    [e_ReplyStatus_NotImplemented]=WS_STATUS_LINE("501 Not Implemented",19),
+    [e_ReplyStatus_BadGateway]=WS_STATUS_LINE("502 Bad Gateway",15),
+    [e_ReplyStatus_GatewayTimeout]=WS_STATUS_LINE("504 Gateway Timeout",19),
+    [e_ReplyStatus_HTTPVersionNotSupported]=
+            WS_STATUS_LINE("505 HTTP Version Not Supported",30),
+    [e_ReplyStatus_InsufficientStorage]=
+            WS_STATUS_LINE("507 Insufficient Storage",24),
+    [e_ReplyStatusMAX]=WS_STATUS_LINE("500 Internal Server Error",25),
+};
+
+static const char m_ETagLine[]="ETag: \"" DOCVER "\"\r\n";
+
+/* The headers of a WebSocket handshake reply (the accept key goes after) */
+static const char m_WebSocketHead[]="Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\nSec-WebSocket-Accept: ";
+
+/* The end of the headers of an event stream (the body runs until we hang
+   up) */
+static const char m_EventsHead[]="Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n\r\n";
+
+#if WS_OPT_SHED_LOAD
+/* The whole reply sent to connections we don't have room for */
+static const char m_ShedReply[]=
+        "HTTP/1.1 503 Service Unavailable\r\n"
+        "Server: BittyHTTP\r\n"
+        "Retry-After: " WS_XSTR(WS_OPT_RETRY_AFTER) "\r\n"
+        "Connection: close\r\n"
+        "Content-Length: 19\r\n"
+        "\r\n"
+        "Service Unavailable";
+#endif
+
+static const char m_DayNames[7][4]=
+{
+    "Sun","Mon","Tue","Wed","Thu","Fri","Sat"
+};
+static const char m_MonthNames[12][4]=
+{
+    "Jan","Feb","Mar","Apr","May","Jun","Jul","Aug","Sep","Oct","Nov","Dec"
+};
+
+/* The last formatted HTTP dates.  These only get reformatted when the time
+   changes (so at most once a second).  Offloaded pages write replies from
+   the worker threads so each thread has it's own. */
+static __thread struct WSDateCache m_DateCache;     // Date: header
+static __thread struct WSDateCache m_ExpiresCache;  // Set-Cookie Expires=
+
+/* WS_CompleteDeferred() can be called from other threads so this queue is
+   the only thing they touch.  WS_Tick() empties it. */
+static struct WSQueue m_DeferredQueue;
+static struct WSQueueCell m_DeferredCells[WS_OPT_DEFERRED_QUEUE_SIZE];
+
+/* Other threads poke this when they queue something for WS_Tick() (so it
+   only has to look at the queues when there is something there) */
+static int m_CompletionFD=-1;
+
+/* A new copy of the server connects to this to take over our listening
+   socket (WS_StartHandoff()).  After that we only finish what we have. */
+static struct SocketCon m_HandoffSocket;
+static bool m_HandedOff;
+static t_ElapsedTime m_HandoffTime;
+
+#if WS_OPT_OFFLOAD_THREADS>0
+/* The worker threads for pages marked Offload.  The connection is passed
+   to a worker on m_OffloadJobs and back to WS_Tick() on m_OffloadDone. */
+static pthread_t m_OffloadThreads[WS_OPT_OFFLOAD_THREADS];
+static int m_OffloadThreadCount;
+static sem_t m_OffloadSem;                  // Counts the jobs waiting
+static atomic_bool m_OffloadQuit;
+static struct WSQueue m_OffloadJobs;
+static struct WSQueueCell m_OffloadJobCells[WS_OPT_OFFLOAD_QUEUE_SIZE];
+static struct WSQueue m_OffloadDone;
+static struct WSQueueCell m_OffloadDoneCells[WS_OPT_OFFLOAD_QUEUE_SIZE];
+static atomic_int m_OffloadBusy;            // Workers running a page right now
+#endif
+
+/* The value of a hex digit with bit 4 set (0 for chars that are not hex
+   digits).  Used for decoding % esc seqs. */
+static const uint8_t m_URLHexValue[256]=
+{
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 0x00
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 0x10
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 0x20
+    0x10,0x11,0x12,0x13,0x14,0x15,0x16,0x17,0x18,0x19,0x00,0x00,0x00,0x00,0x00,0x00,  // 0x30
+    0x00,0x1A,0x1B,0x1C,0x1D,0x1E,0x1F,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 0x40
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 0x50
+    0x00,0x1A,0x1B,0x1C,0x1D,0x1E,0x1F,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 0x60
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 0x70
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 0x80
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 0x90
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 0xA0
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 0xB0
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 0xC0
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 0xD0
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 0xE0
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,  // 0xF0
+};
+
+/* Non zero for the chars that don't need to be % encoded (A-Z a-z 0-9 -_.~) */
+static const uint8_t m_URLUnreserved[256]=
+{
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  // 0x00
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  // 0x10
+    0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,0,  // 0x20
+    1,1,1,1,1,1,1,1,1,1,0,0,0,0,0,0,  // 0x30
+    0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,  // 0x40
+    1,1,1,1,1,1,1,1,1,1,1,0,0,0,0,1,  // 0x50
+    0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,  // 0x60
+    1,1,1,1,1,1,1,1,1,1,1,0,0,0,1,0,  // 0x70
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  // 0x80
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  // 0x90
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  // 0xA0
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  // 0xB0
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  // 0xC0
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  // 0xD0
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  // 0xE0
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,  // 0xF0
+};
+
 /*******************************************************************************
  * NAME:
  *    WS_Init
@@ -92,9 +350,43 @@ void WS_Init(void)
 {
     int r;
 
-    SocketsCon_InitSockCon(&m_ListeningSocket);
+    for(r=0;r<WS_MAX_LISTENERS;r++)
+        SocketsCon_InitSockCon(&m_Listeners[r]);
+    m_ListenerCount=0;
     for(r=0;r<WS_OPT_MAX_CONNECTIONS;r++)
         SocketsCon_InitSockCon(&m_WebServers[r].Con);
+
+    SocketsCon_InitSockCon(&m_HandoffSocket);
+    m_HandedOff=false;
+
+    WSMetrics_Init();
+    WSProxy_Init();
+    WSWebSocket_Init();
+    WSEvents_Init();
+
+    WSQueue_Init(&m_DeferredQueue,m_DeferredCells,WS_OPT_DEFERRED_QUEUE_SIZE);
+
+    /* If this fails we just check the queues every tick */
+    m_CompletionFD=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+
+#if WS_OPT_OFFLOAD_THREADS>0
+    WSQueue_Init(&m_OffloadJobs,m_OffloadJobCells,WS_OPT_OFFLOAD_QUEUE_SIZE);
+    WSQueue_Init(&m_OffloadDone,m_OffloadDoneCells,WS_OPT_OFFLOAD_QUEUE_SIZE);
+    atomic_init(&m_OffloadQuit,false);
+    atomic_init(&m_OffloadBusy,0);
+    sem_init(&m_OffloadSem,0,0);
+
+    /* If we can't start the threads, offloaded pages run on this thread */
+    for(m_OffloadThreadCount=0;m_OffloadThreadCount<WS_OPT_OFFLOAD_THREADS;
+            m_OffloadThreadCount++)
+    {
+        if(pthread_create(&m_OffloadThreads[m_OffloadThreadCount],NULL,
+                WS_OffloadWorker,NULL)!=0)
+        {
+            break;
+        }
+    }
+#endif
 }
 
 /*******************************************************************************
@@ -122,9 +414,36 @@ void WS_Shutdown(void)
 {
     int r;
 
-    SocketsCon_Close(&m_ListeningSocket);
+#if WS_OPT_OFFLOAD_THREADS>0
+    /* Stop the workers (any page they are running is finished first) */
+    atomic_store(&m_OffloadQuit,true);
+    for(r=0;r<m_OffloadThreadCount;r++)
+        sem_post(&m_OffloadSem);
+    for(r=0;r<m_OffloadThreadCount;r++)
+        pthread_join(m_OffloadThreads[r],NULL);
+    m_OffloadThreadCount=0;
+    sem_destroy(&m_OffloadSem);
+#endif
+
+    for(r=0;r<m_ListenerCount;r++)
+        SocketsCon_Close(&m_Listeners[r]);
+    m_ListenerCount=0;
+    SocketsCon_Close(&m_HandoffSocket);
     for(r=0;r<WS_OPT_MAX_CONNECTIONS;r++)
+    {
+        WS_StopGenerator(&m_WebServers[r]);
+        WS_StopProxy(&m_WebServers[r]);
+        WS_StopWebSocket(&m_WebServers[r]);
+        WS_StopEvents(&m_WebServers[r]);
         SocketsCon_Close(&m_WebServers[r].Con);
+        free(m_WebServers[r].OutputBuff);
+        m_WebServers[r].OutputBuff=NULL;
+    }
+    WSProxy_Shutdown();
+
+    if(m_CompletionFD>=0)
+        close(m_CompletionFD);
+    m_CompletionFD=-1;
 }
 
 /*******************************************************************************
@@ -140,22 +459,399 @@ void WS_Shutdown(void)
  * FUNCTION:
  *    This function starts the web server listening for incoming connections.
  *
+ *    This can be called along with WS_StartUnix() and WS_StartOnHandle() to
+ *    listen on more than one socket (up to WS_MAX_LISTENERS).
+ *
+ *    The listening socket is set up with the WS_OPT_LISTEN_xxx options, use
+ *    WS_StartWithOptions() to pick them at run time.
+ *
  * RETURNS:
  *    true -- Things worked out
  *    false -- There was an error
  *
  * SEE ALSO:
- *    WS_WriteWhole(), WS_WriteChunk(), WS_Header(),
+ *    WS_WriteWhole(), WS_WriteChunk(), WS_Header(), WS_StartUnix(),
+ *    WS_StartWithOptions()
  ******************************************************************************/
 bool WS_Start(uint16_t Port)
 {
-    SocketsCon_EnableAddressReuse(&m_ListeningSocket,true);
+    struct SocketConListenOptions Options;
+
+    SocketsCon_InitListenOptions(&Options);
+    Options.Backlog=WS_OPT_LISTEN_BACKLOG;
+    Options.NoDelay=WS_OPT_LISTEN_NODELAY;
+    Options.DeferAccept=WS_OPT_LISTEN_DEFER_ACCEPT;
+    Options.FastOpen=WS_OPT_LISTEN_FASTOPEN;
+    Options.BusyPoll=WS_OPT_LISTEN_BUSY_POLL;
+    Options.RecvBufferSize=WS_OPT_LISTEN_RCVBUF;
+    Options.SendBufferSize=WS_OPT_LISTEN_SNDBUF;
+
+    return WS_StartWithOptions(Port,&Options);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_StartWithOptions
+ *
+ * SYNOPSIS:
+ *    bool WS_StartWithOptions(uint16_t Port,
+ *          const struct SocketConListenOptions *Options);
+ *
+ * PARAMETERS:
+ *    Port [I] -- What port to listen on
+ *    Options [I] -- How to set up the listening socket.  Fill this in with
+ *                   SocketsCon_InitListenOptions() and then change the ones
+ *                   you want.
+ *
+ * FUNCTION:
+ *    This function is WS_Start() with the listening socket options picked
+ *    by the caller (the backlog, TCP_NODELAY, TCP_DEFER_ACCEPT,
+ *    TCP_FASTOPEN, SO_BUSY_POLL, and the buffer sizes).  This lets each
+ *    deployment tune for latency (bench/loadgen is the tool to measure
+ *    with).
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- There was an error
+ *
+ * SEE ALSO:
+ *    WS_Start(), SocketsCon_InitListenOptions()
+ ******************************************************************************/
+bool WS_StartWithOptions(uint16_t Port,
+        const struct SocketConListenOptions *Options)
+{
+    struct SocketCon *Listener;
+
+    Listener=WS_NewListener();
+    if(Listener==NULL)
+        return false;
+
+    SocketsCon_EnableAddressReuse(Listener,true);
+
+    if(!SocketsCon_ListenWithOptions(Listener,NULL,Port,Options))
+    {
+        SocketsCon_Close(Listener);
+        return false;
+    }
+    m_ListenerCount++;
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_StartTLS
+ *
+ * SYNOPSIS:
+ *    bool WS_StartTLS(uint16_t Port,const char *CertFile,const char *KeyFile);
+ *
+ * PARAMETERS:
+ *    Port [I] -- What port to listen on for HTTPS
+ *    CertFile [I] -- The PEM file with our certificate (and the chain)
+ *    KeyFile [I] -- The PEM file with the private key for 'CertFile'
+ *
+ * FUNCTION:
+ *    This function starts the web server listening for HTTPS connections.
+ *    This can be used with WS_Start() to serve both.  SocketsCon needs to
+ *    be built with TLS (SOCKETSCON_TLS).
+ *
+ *    If we already have a socket listening on 'Port' (from WS_TakeOver()
+ *    or WS_StartOnHandle()) it's switched to TLS instead of opening a new
+ *    one.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- There was an error (or we don't have TLS)
+ *
+ * SEE ALSO:
+ *    WS_Start(), SocketsCon_InitTLS()
+ ******************************************************************************/
+bool WS_StartTLS(uint16_t Port,const char *CertFile,const char *KeyFile)
+{
+    int ListenPort;
+    int r;
+
+    if(!SocketsCon_InitTLS(CertFile,KeyFile))
+        return false;
+
+    for(r=0;r<m_ListenerCount;r++)
+    {
+        if(SocketsCon_GetLocalPort(&m_Listeners[r],&ListenPort) &&
+                ListenPort==Port)
+        {
+            return SocketsCon_EnableTLS(&m_Listeners[r]);
+        }
+    }
+
+    if(!WS_Start(Port))
+        return false;
+
+    return SocketsCon_EnableTLS(&m_Listeners[m_ListenerCount-1]);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_StartUnix
+ *
+ * SYNOPSIS:
+ *    bool WS_StartUnix(const char *Path);
+ *
+ * PARAMETERS:
+ *    Path [I] -- The file name of the unix domain socket to listen on
+ *
+ * FUNCTION:
+ *    This function starts the web server listening on a unix domain socket.
+ *    This is for when a reverse proxy on the same machine sends us the
+ *    requests (nginx "proxy_pass http://unix:<Path>;"), which skips going
+ *    through the TCP/IP stack for every request.
+ *
+ *    Any old socket file at 'Path' is removed first.  The socket file gets
+ *    the permissions from our umask, the proxy has to be able to write to
+ *    it.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- There was an error
+ *
+ * SEE ALSO:
+ *    WS_Start()
+ ******************************************************************************/
+bool WS_StartUnix(const char *Path)
+{
+    struct SocketCon *Listener;
+
+    Listener=WS_NewListener();
+    if(Listener==NULL)
+        return false;
+
+    if(!SocketsCon_ListenUnix(Listener,Path))
+    {
+        SocketsCon_Close(Listener);
+        return false;
+    }
+    m_ListenerCount++;
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_StartOnHandle
+ *
+ * SYNOPSIS:
+ *    bool WS_StartOnHandle(t_ConSocketHandle Handle);
+ *
+ * PARAMETERS:
+ *    Handle [I] -- A socket that is already bound and listening
+ *
+ * FUNCTION:
+ *    This function starts the web server on a listening socket someone else
+ *    opened for us (socket activation, see SocketsCon_InheritedHandles()).
+ *    This is used instead of WS_Start().
+ *
+ *    Because the socket was open before we started, connections that came
+ *    in while we were starting (or restarting) are waiting for us.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- 'Handle' isn't a listening socket
+ *
+ * SEE ALSO:
+ *    WS_Start(), SocketsCon_InheritedHandles()
+ ******************************************************************************/
+bool WS_StartOnHandle(t_ConSocketHandle Handle)
+{
+    struct SocketCon *Listener;
+
+    Listener=WS_NewListener();
+    if(Listener==NULL)
+        return false;
+
+    if(!SocketsCon_UseHandle(Listener,Handle))
+        return false;
+
+    if(Listener->State!=e_ConnectState_Listening)
+    {
+        SocketsCon_Close(Listener);
+        return false;
+    }
+    m_ListenerCount++;
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_StartHandoff
+ *
+ * SYNOPSIS:
+ *    bool WS_StartHandoff(const char *Path);
+ *
+ * PARAMETERS:
+ *    Path [I] -- The unix domain socket to wait for the new server on
+ *
+ * FUNCTION:
+ *    This function lets a new copy of the server take over from this one
+ *    (for upgrading without dropping connections).  When the new server
+ *    calls WS_TakeOver() with the same 'Path', WS_Tick() sends it the
+ *    listening socket (and any idle keep-alive connections if
+ *    WS_OPT_HANDOFF_IDLE is set) and stops taking new connections.  The
+ *    requests we already have are finished, and WS_HandoffDone() returns
+ *    true when they are (or after WS_OPT_DRAIN_TIMEOUT seconds).
+ *
+ *    The kernel keeps queuing connections on the listening socket the whole
+ *    time so none are refused.
+ *
+ *    Only we can connect to 'Path' (it's made mode 0600) because who ever
+ *    connects gets our listening socket.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- There was an error
+ *
+ * SEE ALSO:
+ *    WS_TakeOver(), WS_HandoffDone()
+ ******************************************************************************/
+bool WS_StartHandoff(const char *Path)
+{
+    if(!SocketsCon_ListenUnix(&m_HandoffSocket,Path))
+        return false;
 
-    if(!SocketsCon_Listen(&m_ListeningSocket,NULL,Port))
+    if(chmod(Path,0600)!=0)
+    {
+        SocketsCon_Close(&m_HandoffSocket);
         return false;
+    }
+
     return true;
 }
 
+/*******************************************************************************
+ * NAME:
+ *    WS_TakeOver
+ *
+ * SYNOPSIS:
+ *    bool WS_TakeOver(const char *Path);
+ *
+ * PARAMETERS:
+ *    Path [I] -- The unix domain socket the running server called
+ *                WS_StartHandoff() with
+ *
+ * FUNCTION:
+ *    This function takes over from a running copy of the server.  The running
+ *    server sends us its listening sockets (and maybe some idle keep-alive
+ *    connections) and we start using them.  This is used instead of
+ *    WS_Start().
+ *
+ *    Call WS_StartHandoff() after this so the next copy can take over from
+ *    us.
+ *
+ * RETURNS:
+ *    true -- We have the listening sockets
+ *    false -- There is no server running on 'Path' (or it didn't answer),
+ *             call WS_Start() instead.
+ *
+ * SEE ALSO:
+ *    WS_StartHandoff(), WS_Start()
+ ******************************************************************************/
+bool WS_TakeOver(const char *Path)
+{
+    t_ConSocketHandle Handles[WS_MAX_LISTENERS+WS_OPT_MAX_CONNECTIONS];
+    struct SocketCon Con;
+    struct SocketCon Extra;
+    struct SocketCon *Listener;
+    t_ElapsedTime Start;
+    int Count;
+    int con;
+    int r;
+
+    SocketsCon_InitSockCon(&Con);
+    if(!SocketsCon_ConnectUnix(&Con,Path))
+        return false;
+
+    /* The old server answers from its WS_Tick() */
+    Start=ReadElapsedClock();
+    do
+    {
+        Count=SocketsCon_ReadHandles(&Con,Handles,
+                sizeof(Handles)/sizeof(Handles[0]));
+        if(Count==0)
+            usleep(1000);
+    } while(Count==0 && ReadElapsedClock()-Start<WS_TAKEOVER_WAIT);
+    SocketsCon_Close(&Con);
+
+    if(Count<=0)
+        return false;
+
+    /* The listening sockets come first, the rest are idle connections */
+    con=0;
+    for(r=0;r<Count;r++)
+    {
+        Listener=WS_NewListener();
+        if(Listener!=NULL && SocketsCon_UseHandle(Listener,Handles[r]))
+        {
+            if(Listener->State==e_ConnectState_Listening)
+            {
+                m_ListenerCount++;
+                continue;
+            }
+
+            /* It's a connection, move it to a connection below */
+            SocketsCon_InitSockCon(Listener);
+        }
+
+        while(con<WS_OPT_MAX_CONNECTIONS &&
+                m_WebServers[con].State!=e_WebServerState_Closed)
+        {
+            con++;
+        }
+        if(con==WS_OPT_MAX_CONNECTIONS)
+        {
+            /* No where to put it */
+            SocketsCon_InitSockCon(&Extra);
+            SocketsCon_UseHandle(&Extra,Handles[r]);
+            SocketsCon_Close(&Extra);
+            continue;
+        }
+
+        SocketsCon_InitSockCon(&m_WebServers[con].Con);
+        if(SocketsCon_UseHandle(&m_WebServers[con].Con,Handles[r]))
+        {
+            WSTrace_Event(e_WSTrace_Accept,con,0);
+            WS_ResetWebServer(&m_WebServers[con]);
+        }
+    }
+
+    return m_ListenerCount>0;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_HandoffDone
+ *
+ * SYNOPSIS:
+ *    bool WS_HandoffDone(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function checks if we have handed off to a new server and finished
+ *    the requests we had (or run out of time to finish them).
+ *
+ * RETURNS:
+ *    true -- We are done, the program can exit
+ *    false -- Keep calling WS_Tick()
+ *
+ * SEE ALSO:
+ *    WS_StartHandoff()
+ ******************************************************************************/
+bool WS_HandoffDone(void)
+{
+    if(!m_HandedOff)
+        return false;
+
+    return WS_ConnectionsInUse()==0 ||
+            ReadElapsedClock()-m_HandoffTime>=WS_OPT_DRAIN_TIMEOUT;
+}
+
 /*******************************************************************************
  * NAME:
  *    WS_ResetWebServer
@@ -177,6 +873,15 @@ bool WS_Start(uint16_t Port)
  ******************************************************************************/
 static void WS_ResetWebServer(struct WebServer *Web)
 {
+#if WS_OPT_LAZY_ARGS
+    int r;
+#endif
+
+    WS_EndRequestMetrics(Web);
+    WS_StopProxy(Web);
+    WS_StopWebSocket(Web);
+    WS_StopEvents(Web);
+
     Web->LineBuffPos=0;
     Web->State=e_WebServerState_Request;
     Web->ReplyStatus=e_ReplyStatusMAX;
@@ -189,10 +894,32 @@ static void WS_ResetWebServer(struct WebServer *Web)
     Web->PageProp.Posts=NULL;
     Web->ReplyStarted=false;
     Web->LastReadTime=ReadElapsedClock();
+    Web->PhaseStarted=false;
     Web->BodySize=0;
     Web->PostState=e_WSPostState_GettingKey;
-    Web->PostWritePos=NULL;
-    Web->PostEndOfStorage=NULL;
+    Web->PostArg=NULL;
+    Web->ArgsStorageUsed=0;
+    Web->ChunkBuffUsed=0;
+    Web->Generator=NULL;
+    Web->GeneratorData=NULL;
+    Web->PageProp.Offload=false;
+    Web->PageProp.Route=NULL;
+    Web->PageProp.Upstream=NULL;
+    Web->WebSocketUpgrade=false;
+    Web->WebSocketVersion=0;
+    Web->WebSocketKey[0]=0;
+    Web->LastEventID[0]=0;
+    Web->BuiltInPage=NULL;
+    Web->CaptureOutput=false;
+    Web->OutputFailed=false;
+    Web->OutputLen=0;
+    memset(Web->ArgCount,0x00,sizeof(Web->ArgCount));
+    Web->ArgIndexLinear=false;
+#if WS_OPT_LAZY_ARGS
+    Web->LazyArgsUsed=0;
+    for(r=0;r<e_WSArgTypeMAX;r++)
+        Web->LazyArgs[r].Offset=WS_ARG_NOT_SET;
+#endif
 }
 
 /*******************************************************************************
@@ -223,65 +950,178 @@ void WS_Tick(void)
 {
     int con;
     int Bytes;
-    char ReadBuff[100];
+    int InUse;
+    char ReadBuff[WS_READ_BUFFER_SIZE];
+
+    for(con=0;con<m_ListenerCount;con++)
+        SocketsCon_Tick(&m_Listeners[con]);
+
+    /* Hand off to a new copy of the server if one is asking */
+    if(!m_HandedOff)
+        WS_RunHandoff();
 
-    SocketsCon_Tick(&m_ListeningSocket);
+    /* Write out the trace if someone asked for it */
+    WSTrace_Tick();
+
+    /* Close upstream connections that have been kept open too long */
+    WSProxy_Tick();
+
+    /* Finish any deferred and offloaded replies that are ready */
+    if(WS_CheckCompletions())
+    {
+        WS_RunDeferredCompletions();
+        WS_RunOffloadCompletions();
+    }
+
+    /* New connections are only taken while we are under WS_OPT_ADMIT_LIMIT */
+    InUse=WS_ConnectionsInUse();
 
     /* Do all the connections */
     for(con=0;con<WS_OPT_MAX_CONNECTIONS;con++)
     {
         SocketsCon_Tick(&m_WebServers[con].Con);
 
+        if(m_WebServers[con].State==e_WebServerState_Offloaded)
+        {
+            /* A worker thread has this connection, leave it alone until
+               it's given back */
+            continue;
+        }
+
         if(!SocketsCon_IsConnected(&m_WebServers[con].Con))
         {
+            /* If the connection dropped in the middle of a generated reply
+               let the generator clean up */
+            WS_StopGenerator(&m_WebServers[con]);
+            WS_StopProxy(&m_WebServers[con]);
+            WS_StopWebSocket(&m_WebServers[con]);
+            WS_StopEvents(&m_WebServers[con]);
+            WS_EndRequestMetrics(&m_WebServers[con]);
+            m_WebServers[con].PipelinedLen=0;
+            if(m_WebServers[con].State!=e_WebServerState_Closed)
+            {
+                /* The client hung up */
+                WSTrace_Event(e_WSTrace_Close,con,0);
+                m_WebServers[con].State=e_WebServerState_Closed;
+                InUse--;
+            }
+
             /* Poll for any new connections (we keep asking giving each free
                connection a chance to get the new connection) */
-            if(SocketsCon_Accept(&m_ListeningSocket,&m_WebServers[con].Con))
+            if(InUse<WS_OPT_ADMIT_LIMIT &&
+                    WS_AcceptConnection(&m_WebServers[con].Con))
             {
                 /* Ok, we got a new connection */
+                WSMetrics_Count(e_WSMetricCounter_Accepted,1);
+                WSTrace_Event(e_WSTrace_Accept,con,0);
                 WS_ResetWebServer(&m_WebServers[con]);
+                InUse++;
             }
-            else
+        }
+        else if(m_WebServers[con].State==e_WebServerState_Generating)
+        {
+            /* Keep the generated reply going (the next request isn't read
+               until this one is done) */
+            WS_RunGenerator(&m_WebServers[con]);
+        }
+        else if(m_WebServers[con].State==e_WebServerState_Deferred)
+        {
+            /* Waiting for WS_CompleteDeferred() (we don't read the next
+               request until this one is done) */
+            if(ReadElapsedClock()-m_WebServers[con].LastReadTime>=
+                    WS_OPT_DEFERRED_TIMEOUT)
             {
-                if(SocketsCon_GetErrorCode(&m_ListeningSocket)!=
-                        e_ConnectError_AllOk)
-                {
-                    /* We had an error accepting the connection, the listening
-                       socket it now closed */
-                }
+                WS_DeferredTimedOut(&m_WebServers[con]);
             }
         }
-        else
+        else if(m_WebServers[con].State==e_WebServerState_Proxying)
         {
-            /* Handle requests from connected connections */
-            Bytes=SocketsCon_Read(&m_WebServers[con].Con,ReadBuff,
-                    sizeof(ReadBuff));
-            if(Bytes==0)
-            {
-
-                if(ReadElapsedClock()-m_WebServers[con].LastReadTime>=
-                        WS_SECONDS_UNTIL_CONNECTION_RELEASE)
-                {
-                    /* Ok, connection timed out, hang up so others can use it */
-                    SocketsCon_Close(&m_WebServers[con].Con);
-                    m_WebServers[con].State=e_WebServerState_Closed;
+            /* Passing the request on to an upstream server (we don't read
+               the next request until the response is done) */
+            WS_RunProxy(&m_WebServers[con]);
+        }
+        else if(m_WebServers[con].State==e_WebServerState_WebSocket)
+        {
+            /* The connection carries frames now (it never goes back to
+               requests) */
+            if(!WSWebSocket_Run(m_WebServers[con].WebSocket))
+                WS_CloseConnection(&m_WebServers[con]);
+        }
+        else if(m_WebServers[con].State==e_WebServerState_Events)
+        {
+            /* Sending the events for the channel it's subscribed to (until
+               one of us hangs up) */
+            if(!WSEvents_Run(m_WebServers[con].Events))
+                WS_CloseConnection(&m_WebServers[con]);
+        }
+        else
+        {
+            /* Hang up on clients that are taking too long to send the
+               request (so a few slow clients can't hold all the
+               connections) */
+            if(WS_PastDeadline(&m_WebServers[con]))
+            {
+                WS_CloseConnection(&m_WebServers[con]);
+                continue;
+            }
+
+            if(m_WebServers[con].PipelinedLen>0)
+            {
+                /* Start on the request that came in behind the last one
+                   before reading any more */
+                Bytes=m_WebServers[con].PipelinedLen;
+                memcpy(ReadBuff,m_WebServers[con].Pipelined,Bytes);
+                m_WebServers[con].PipelinedLen=0;
+            }
+            else
+            {
+                /* Handle requests from connected connections */
+                Bytes=SocketsCon_Read(&m_WebServers[con].Con,ReadBuff,
+                        sizeof(ReadBuff));
+                if(Bytes==0)
+                {
+
+                    if(ReadElapsedClock()-m_WebServers[con].LastReadTime>=
+                            WS_SECONDS_UNTIL_CONNECTION_RELEASE)
+                    {
+                        /* Ok, connection timed out, hang up so others can
+                           use it */
+                        WSMetrics_Count(e_WSMetricCounter_TimeoutIdle,1);
+                        WS_CloseConnection(&m_WebServers[con]);
+                    }
+
+                    continue;
+                }
+                if(Bytes<0)
+                {
+                    /* Error, hang up */
+                    WS_CloseConnection(&m_WebServers[con]);
+                    continue;
                 }
 
-                continue;
+                WSMetrics_Count(e_WSMetricCounter_BytesIn,Bytes);
             }
-            if(Bytes<0)
+            if(m_WebServers[con].MetricsStart==0)
             {
-                /* Error, hang up */
-                SocketsCon_Close(&m_WebServers[con].Con);
-                m_WebServers[con].State=e_WebServerState_Closed;
-                continue;
+                m_WebServers[con].MetricsStart=WS_NOW();
+                WSTrace_Event(e_WSTrace_FirstByte,con,Bytes);
             }
+            if(!m_WebServers[con].PhaseStarted)
+                WS_StartPhase(&m_WebServers[con],0);
+            m_WebServers[con].PhaseBytes+=Bytes;
 
             WS_RunServer(&m_WebServers[con],ReadBuff,Bytes);
 
             m_WebServers[con].LastReadTime=ReadElapsedClock();
         }
     }
+
+#if WS_OPT_SHED_LOAD
+    /* If we are full anyone still waiting to connect gets a 503 now instead
+       of sitting in the listen backlog until they give up */
+    if(WS_ConnectionsInUse()>=WS_OPT_ADMIT_LIMIT)
+        WS_ShedConnections();
+#endif
 }
 
 /*******************************************************************************
@@ -331,8 +1171,7 @@ static void WS_RunServer(struct WebServer *Web,char *ReadBuff,int Bytes)
                     Web->ReplyStatus=e_ReplyStatus_URITooLong;
                     WS_StartReply(Web);
                     WS_EndReply(Web);
-                    SocketsCon_Close(&Web->Con);
-                    Web->State=e_WebServerState_Closed;
+                    WS_CloseConnection(Web);
                     return;
                 }
 
@@ -345,9 +1184,17 @@ static void WS_RunServer(struct WebServer *Web,char *ReadBuff,int Bytes)
 
                     Web->Req=e_ReqType_Get;
                     WS_ProcessURI(Web);
-                    if(FS_GetFileProperties(&Web->LineBuff[4],&Web->PageProp))
+                    if(WS_GetPageProperties(Web,&Web->LineBuff[4]))
                     {
-                        WS_ProcessGetVars(Web);
+                        if(Web->PageProp.Upstream!=NULL)
+                        {
+                            WS_StartProxy(Web,3);
+                        }
+                        else
+                        {
+                            WS_InitArgIndex(Web);
+                            WS_ProcessGetVars(Web);
+                        }
                     }
                     else
                     {
@@ -358,9 +1205,17 @@ static void WS_RunServer(struct WebServer *Web,char *ReadBuff,int Bytes)
                 {
                     Web->Req=e_ReqType_Post;
                     WS_ProcessURI(Web);
-                    if(FS_GetFileProperties(&Web->LineBuff[5],&Web->PageProp))
+                    if(WS_GetPageProperties(Web,&Web->LineBuff[5]))
                     {
-                        WS_ProcessGetVars(Web);
+                        if(Web->PageProp.Upstream!=NULL)
+                        {
+                            WS_StartProxy(Web,4);
+                        }
+                        else
+                        {
+                            WS_InitArgIndex(Web);
+                            WS_ProcessGetVars(Web);
+                        }
                     }
                     else
                     {
@@ -369,7 +1224,18 @@ static void WS_RunServer(struct WebServer *Web,char *ReadBuff,int Bytes)
                 }
                 else
                 {
+                    /* Other methods (PUT, DELETE, HEAD, ...) can only go to
+                       an upstream server */
                     Web->ReplyStatus=e_ReplyStatus_NotImplemented;
+                    BytesUsed=strcspn(Web->LineBuff," ");
+                    if(Web->LineBuff[BytesUsed]==' ' && WS_ProcessURI(Web) &&
+                            WS_GetPageProperties(Web,
+                            &Web->LineBuff[BytesUsed+1]) &&
+                            Web->PageProp.Upstream!=NULL)
+                    {
+                        Web->ReplyStatus=e_ReplyStatusMAX;
+                        WS_StartProxy(Web,BytesUsed);
+                    }
                 }
                 Web->State++;
             break;
@@ -382,8 +1248,7 @@ static void WS_RunServer(struct WebServer *Web,char *ReadBuff,int Bytes)
                     Web->ReplyStatus=e_ReplyStatus_RequestHeaderFieldsTooLarge;
                     WS_StartReply(Web);
                     WS_EndReply(Web);
-                    SocketsCon_Close(&Web->Con);
-                    Web->State=e_WebServerState_Closed;
+                    WS_CloseConnection(Web);
                     continue;
                 }
 
@@ -391,15 +1256,58 @@ static void WS_RunServer(struct WebServer *Web,char *ReadBuff,int Bytes)
                 BytesLeft-=BytesUsed;
 
                 if(Web->LineBuff[0]==0)
+                {
+                    /* End of the headers */
+                    WSTrace_Event(e_WSTrace_HeadersEnd,WS_CON_INDEX(Web),0);
                     Web->State++;
+
+                    /* The rest of this read is the start of the body */
+                    WS_StartPhase(Web,BytesLeft);
+                }
+                else if(Web->PageProp.Upstream!=NULL)
+                {
+                    /* Pass it on (we only need the length of the body) */
+                    if(Web->Proxy!=NULL && Web->ReplyStatus==e_ReplyStatusMAX)
+                    {
+                        Web->ReplyStatus=WSProxy_AddHeader(Web->Proxy,
+                                Web->LineBuff);
+                    }
+                    if(strncasecmp(Web->LineBuff,"Content-Length:",15)==0)
+                        Web->BodySize=strtol(&Web->LineBuff[15],NULL,10);
+                }
                 else
+                {
                     WS_ProcessHeader(Web);
+                }
             break;
             case e_WebServerState_Body:
+                if(Web->Proxy!=NULL && Web->ReplyStatus==e_ReplyStatusMAX)
+                {
+                    /* The upstream server gets the body (the rest of this
+                       read is the start of it) */
+                    BytesUsed=BytesLeft;
+                    if(Web->BodySize<(uint32_t)BytesLeft)
+                        BytesUsed=Web->BodySize;
+                    if(WSProxy_Start(Web->Proxy,&Web->Con,ReadPoint,BytesUsed,
+                            Web->BodySize-BytesUsed))
+                    {
+                        if(Web->MetricsStart!=0)
+                        {
+                            WSMetrics_RecordPhase(e_WSMetricPhase_Parse,
+                                    WS_NOW()-Web->MetricsStart);
+                        }
+                        Web->State=e_WebServerState_Proxying;
+                        WS_KeepPipelined(Web,ReadPoint+BytesUsed,
+                                BytesLeft-BytesUsed);
+                        return;
+                    }
+                    Web->ReplyStatus=e_ReplyStatus_RequestHeaderFieldsTooLarge;
+                }
+
                 /* We need to read in the whole body before moving on */
                 if(Web->Req==e_ReqType_Post)
                 {
-                    while(BytesLeft>0)
+                    while(BytesLeft>0 && Web->BodySize>0)
                     {
                         switch(Web->PostState)
                         {
@@ -413,7 +1321,8 @@ static void WS_RunServer(struct WebServer *Web,char *ReadBuff,int Bytes)
                                     Web->LineBuff[Web->LineBuffPos++]=0;
 
                                     /* Decode the key */
-                                    WS_URLDecodeInPlace(Web->LineBuff);
+                                    WS_URLDecodeInPlaceEx(Web->LineBuff,
+                                            WS_OPT_POST_PLUS_IS_SPACE);
 
                                     /* Setup for starting to store this var */
                                     WS_StartProcessingPOSTVar(Web);
@@ -437,7 +1346,7 @@ static void WS_RunServer(struct WebServer *Web,char *ReadBuff,int Bytes)
                                 {
                                     /* Ok, this is the end of the var, finish
                                        copying */
-                                    if(!WS_CopyLineBuffer2POSTVar(Web))
+                                    if(!WS_CopyLineBuffer2POSTVar(Web,true))
                                     {
                                         Web->PostState=e_WSPostState_Error;
                                         break;
@@ -455,7 +1364,8 @@ static void WS_RunServer(struct WebServer *Web,char *ReadBuff,int Bytes)
                                     if(Web->LineBuffPos>=sizeof(Web->LineBuff)-1)
                                     {
                                         /* Line buffer filled.  Empty it */
-                                        if(!WS_CopyLineBuffer2POSTVar(Web))
+                                        if(!WS_CopyLineBuffer2POSTVar(Web,
+                                                false))
                                         {
                                             Web->PostState=e_WSPostState_Error;
                                             break;
@@ -485,7 +1395,7 @@ static void WS_RunServer(struct WebServer *Web,char *ReadBuff,int Bytes)
                             if(Web->PostState==e_WSPostState_GettingValue)
                             {
                                 /* Finish processing the POST var */
-                                if(!WS_CopyLineBuffer2POSTVar(Web))
+                                if(!WS_CopyLineBuffer2POSTVar(Web,true))
                                 {
                                     Web->PostState=e_WSPostState_Error;
                                     break;
@@ -501,7 +1411,7 @@ static void WS_RunServer(struct WebServer *Web,char *ReadBuff,int Bytes)
                 {
                     if(Web->BodySize<BytesLeft)
                     {
-                        BytesUsed=BytesLeft-Web->BodySize;
+                        BytesUsed=Web->BodySize;
                         Web->BodySize=0;
                     }
                     else
@@ -528,8 +1438,50 @@ static void WS_RunServer(struct WebServer *Web,char *ReadBuff,int Bytes)
             break;
             case e_WebServerState_Response:
 //DEBUG_PrintStoredArgs(Web);
+                if(Web->MetricsStart!=0)
+                {
+                    WSMetrics_RecordPhase(e_WSMetricPhase_Parse,
+                            WS_NOW()-Web->MetricsStart);
+                }
                 WS_SendResponse(Web);
-                WS_ResetWebServer(Web);
+                WS_FinishResponse(Web);
+
+                /* If the page upgraded to a WebSocket the rest of this read
+                   is frames (the client didn't wait for the handshake) */
+                if(Web->State==e_WebServerState_WebSocket)
+                {
+                    if(BytesLeft>0 && !WSWebSocket_Input(Web->WebSocket,
+                            (const uint8_t *)ReadPoint,BytesLeft))
+                    {
+                        WS_CloseConnection(Web);
+                    }
+                    return;
+                }
+
+                /* If the client pipelined the next request it may already
+                   be in this read.  We can only start on it if this reply
+                   is done.  If the reply is generated, deferred, or
+                   offloaded WS_Tick() starts on it when the reply is done. */
+                if(BytesLeft==0)
+                    return;
+                if(Web->State!=e_WebServerState_Request)
+                {
+                    WS_KeepPipelined(Web,ReadPoint,BytesLeft);
+                    return;
+                }
+
+                Web->MetricsStart=WS_NOW();
+                WSTrace_Event(e_WSTrace_FirstByte,WS_CON_INDEX(Web),
+                        BytesLeft);
+                WS_StartPhase(Web,BytesLeft);
+            break;
+            case e_WebServerState_Generating:
+            case e_WebServerState_Deferred:
+            case e_WebServerState_Offloaded:
+            case e_WebServerState_Proxying:
+            case e_WebServerState_WebSocket:
+            case e_WebServerState_Events:
+                /* We don't read until the reply is done */
                 return;
             break;
             case e_WebServerStateMAX:
@@ -538,6 +1490,48 @@ static void WS_RunServer(struct WebServer *Web,char *ReadBuff,int Bytes)
     }
 }
 
+/*******************************************************************************
+ * NAME:
+ *    WS_KeepPipelined
+ *
+ * SYNOPSIS:
+ *    static void WS_KeepPipelined(struct WebServer *Web,const char *Bytes,
+ *          int Len);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Bytes [I] -- The rest of the read after the end of the current request
+ *    Len [I] -- The number of bytes in 'Bytes'
+ *
+ * FUNCTION:
+ *    This function keeps the start of a pipelined request that came in
+ *    with the end of the current one when we can't start on it yet (the
+ *    reply is generated, deferred, offloaded, or passed on to an upstream
+ *    server).  WS_Tick() runs it through WS_RunServer() before reading
+ *    anything else once the connection is back to waiting for a request.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * NOTES:
+ *    We stop reading until the reply is done, so this is never more than
+ *    one read (WS_READ_BUFFER_SIZE).
+ *
+ * SEE ALSO:
+ *    WS_RunServer(), WS_Tick()
+ ******************************************************************************/
+static void WS_KeepPipelined(struct WebServer *Web,const char *Bytes,int Len)
+{
+    if(Len<=0 || Len>(int)sizeof(Web->Pipelined))
+    {
+        Web->PipelinedLen=0;
+        return;
+    }
+
+    memcpy(Web->Pipelined,Bytes,Len);
+    Web->PipelinedLen=Len;
+}
+
 /*******************************************************************************
  * NAME:
  *    WS_GetNextLine
@@ -679,6 +1673,10 @@ static bool WS_ProcessURI(struct WebServer *Web)
  *    Currently supported headers:
  *      Cookie -- Used for sending a cookie back to the server
  *      If-None-Match -- Used for ETag caching.
+ *      Upgrade, Sec-WebSocket-Key, Sec-WebSocket-Version -- Used for
+ *          WebSockets (WS_AcceptWebSocket())
+ *      Last-Event-ID -- Used to resume server-sent events
+ *          (WS_SubscribeEvents())
  *
  * RETURNS:
  *    NONE
@@ -754,6 +1752,38 @@ static void WS_ProcessHeader(struct WebServer *Web)
             Pos++;
         Web->BodySize=strtol(Pos,NULL,10);
     }
+    if(strncasecmp(Web->LineBuff,"Upgrade:",8)==0)
+    {
+        Pos=&Web->LineBuff[8];
+        while(*Pos==' ')
+            Pos++;
+        if(strncasecmp(Pos,"websocket",9)==0)
+            Web->WebSocketUpgrade=true;
+    }
+    if(strncasecmp(Web->LineBuff,"Sec-WebSocket-Key:",18)==0)
+    {
+        Pos=&Web->LineBuff[18];
+        while(*Pos==' ')
+            Pos++;
+        End=Pos;
+        while(*End!=' ' && *End!=0)
+            End++;
+        if(End-Pos==WS_WEBSOCKET_KEY_LEN)
+        {
+            memcpy(Web->WebSocketKey,Pos,WS_WEBSOCKET_KEY_LEN);
+            Web->WebSocketKey[WS_WEBSOCKET_KEY_LEN]=0;
+        }
+    }
+    if(strncasecmp(Web->LineBuff,"Sec-WebSocket-Version:",22)==0)
+        Web->WebSocketVersion=atoi(&Web->LineBuff[22]);
+    if(strncasecmp(Web->LineBuff,"Last-Event-ID:",14)==0)
+    {
+        Pos=&Web->LineBuff[14];
+        while(*Pos==' ')
+            Pos++;
+        if(strlen(Pos)<=WS_LAST_EVENT_ID_LEN)
+            strcpy(Web->LastEventID,Pos);
+    }
 }
 
 /*******************************************************************************
@@ -812,83 +1842,41 @@ static void WS_ProcessETag(struct WebServer *Web,bool Weak,const char *ETag)
  ******************************************************************************/
 static void WS_StartReply(struct WebServer *Web)
 {
-    const char *Msg;
-    char buff[100];
-
-    SocketsCon_Write(&Web->Con,"HTTP/1.1 ",9);
+    const struct WSStatusLine *Status;
+    char buff[WS_REPLY_HEAD_SIZE];
+    char *Pos;
 
-    switch(Web->ReplyStatus)
-    {
-        case e_ReplyStatus_Ok:
-            Msg="200 OK";
-        break;
-        case e_ReplyStatus_MovedPerm:
-            Msg="301 Moved Permanently";
-        break;
-        case e_ReplyStatus_NotModified:
-            Msg="304 Not Modified";
-        break;
-        case e_ReplyStatus_TmpRedirect:
-            Msg="307 Temporary Redirect";
-        break;
-        case e_ReplyStatus_PermRedirect:
-            Msg="308 Permanent Redirect";
-        break;
-        case e_ReplyStatus_BadRequest:
-            Msg="400 Bad Request";
-        break;
-        case e_ReplyStatus_Forbidden:
-            Msg="403 Forbidden";
-        break;
-        case e_ReplyStatus_NotFound:
-            Msg="404 Not Found";
-        break;
-        case e_ReplyStatus_MethodNotAllowed:
-            Msg="405 Method Not Allowed";
-        break;
-        case e_ReplyStatus_URITooLong:
-            Msg="414 URI Too Long";
-        break;
-        case e_ReplyStatus_RequestHeaderFieldsTooLarge:
-            Msg="431 Request Header Fields Too Large";
-        break;
-        case e_ReplyStatusMAX:
-        case e_ReplyStatus_InternalServerError:
-            Msg="500 Internal Server Error";
-        break;
-        case e_ReplyStatus_NotImplemented:
-            Msg="501 Not Implemented";
-        break;
-        case e_ReplyStatus_HTTPVersionNotSupported:
-            Msg="505 HTTP Version Not Supported";
-        break;
-        case e_ReplyStatus_InsufficientStorage:
-            Msg="507 Insufficient Storage";
-        break;
-    }
+    Status=&m_StatusLines[Web->ReplyStatus];
 
-    SocketsCon_Write(&Web->Con,Msg,strlen(Msg));
-    SocketsCon_Write(&Web->Con,"\r\n",2);
+    /* Build the whole header block and send it in one go */
+    Pos=buff;
+    memcpy(Pos,Status->Head,Status->HeadLen);
+    Pos+=Status->HeadLen;
 
-    SocketsCon_Write(&Web->Con,"Server: BittyHTTP\r\n",19);
+    memcpy(Pos,"Date: ",6);
+    Pos+=6;
+    memcpy(Pos,WS_GetHTTPDate(&m_DateCache,time(NULL)),WS_HTTP_DATE_LEN);
+    Pos+=WS_HTTP_DATE_LEN;
+    *Pos++='\r';
+    *Pos++='\n';
 
     if(Web->ReplyStatus!=e_ReplyStatus_Ok && !Web->UserSetReplyStatus)
     {
-        sprintf(buff,"Content-Length: %zd\r\n",strlen(Msg));
-        SocketsCon_Write(&Web->Con,buff,strlen(buff));
-        SocketsCon_Write(&Web->Con,"\r\n",2);
-        SocketsCon_Write(&Web->Con,Msg,strlen(Msg));
+        memcpy(Pos,Status->Canned,Status->CannedLen);
+        Pos+=Status->CannedLen;
     }
     else
     {
         if(!Web->PageProp.DynamicFile)
         {
             /* It's dynamic, so we need to add the ETag */
-            sprintf(buff,"ETag: \"%s\"\r\n",DOCVER);
-            SocketsCon_Write(&Web->Con,buff,strlen(buff));
+            memcpy(Pos,m_ETagLine,sizeof(m_ETagLine)-1);
+            Pos+=sizeof(m_ETagLine)-1;
         }
     }
 
+    WS_Send(Web,buff,Pos-buff);
+
     Web->ReplyStarted=true;
 }
 
@@ -903,8 +1891,9 @@ static void WS_StartReply(struct WebServer *Web)
  *    Web [I] -- The web server context to work on
  *
  * FUNCTION:
- *    This function ends the reply headers and starts the content for the
- *    current request.
+ *    This function ends the reply for the current request.  If the content
+ *    was sent chunked anything left in the chunk buffer is sent along with
+ *    the last chunk.
  *
  * RETURNS:
  *    NONE
@@ -915,10 +1904,10 @@ static void WS_StartReply(struct WebServer *Web)
 static void WS_EndReply(struct WebServer *Web)
 {
     if(Web->WriteChunked)
-    {
-        SocketsCon_Write(&Web->Con,"0\r\n",3);
-        SocketsCon_Write(&Web->Con,"\r\n",2);   // No extra header fields
-    }
+        WS_SendChunkBuffer(Web,true);
+
+    WSTrace_Event(e_WSTrace_ReplyEnd,WS_CON_INDEX(Web),
+            atoi(&m_StatusLines[Web->ReplyStatus].Head[9]));
 }
 
 /*******************************************************************************
@@ -938,6 +1927,8 @@ static void WS_EndReply(struct WebServer *Web)
  *    It may not call the file server if there was an error so there is no
  *    content to send.
  *
+ *    The reply is not ended here, call WS_FinishResponse() after this.
+ *
  * RETURNS:
  *    NONE
  *
@@ -946,19 +1937,86 @@ static void WS_EndReply(struct WebServer *Web)
  ******************************************************************************/
 static void WS_SendResponse(struct WebServer *Web)
 {
+    struct WSHandlerMark Mark;
+
 /* DEBUG PAUL: Let the code handle e_ReplyStatus_InsufficientStorage and
    override it if it wants */
     if(Web->ReplyStatus==e_ReplyStatusMAX)
     {
         /* Ok, process file */
         Web->ReplyStatus=e_ReplyStatus_Ok;
-        FS_SendFile(Web,Web->PageProp.FileID);
+
+        /* CPU heavy pages run on a worker thread */
+        if(Web->PageProp.Offload && WS_OffloadResponse(Web))
+            return;
+
+        WS_HandlerStart(Web,&Mark);
+        if(Web->BuiltInPage!=NULL)
+            Web->BuiltInPage(Web);
+        else
+            FS_SendFile(Web,Web->PageProp.FileID);
+        WS_HandlerDone(Web,&Mark);
     }
     else
     {
         WS_StartReply(Web);
     }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_FinishResponse
+ *
+ * SYNOPSIS:
+ *    static void WS_FinishResponse(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function is called after the page has had it's chance to write
+ *    the reply (FS_SendFile(), a deferred completion, or an offloaded page
+ *    coming back from a worker).  If the page started a generator, deferred
+ *    the reply, or is running on a worker the connection is left waiting
+ *    for that, otherwise the reply is ended and the connection is setup for
+ *    the next request.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_SendResponse(), WS_StartGenerator(), WS_DeferReply(),
+ *    WS_AcceptWebSocket(), WS_SubscribeEvents()
+ ******************************************************************************/
+static void WS_FinishResponse(struct WebServer *Web)
+{
+    if(Web->State==e_WebServerState_WebSocket ||
+            Web->State==e_WebServerState_Events)
+    {
+        /* The reply was the handshake (or the headers of the event
+           stream).  That's the end of the request but the connection
+           stays a WebSocket (or keeps getting events). */
+        WS_EndReply(Web);
+        WS_EndRequestMetrics(Web);
+        return;
+    }
+
+    if(Web->State==e_WebServerState_Deferred ||
+            Web->State==e_WebServerState_Offloaded)
+    {
+        return;
+    }
+
+    if(Web->Generator!=NULL)
+    {
+        /* WS_Tick() will keep calling the generator as the connection can
+           take more */
+        Web->State=e_WebServerState_Generating;
+        return;
+    }
+
     WS_EndReply(Web);
+    WS_ResetWebServer(Web);
 }
 
 /*******************************************************************************
@@ -990,6 +2048,7 @@ static void WS_SendResponse(struct WebServer *Web)
 void WS_WriteWhole(struct WebServer *Web,const char *Buffer,int Len)
 {
     char buff[100];
+    char *Pos;
 
     if(Web->WriteStarted)
     {
@@ -1003,10 +2062,13 @@ void WS_WriteWhole(struct WebServer *Web,const char *Buffer,int Len)
     if(!Web->ReplyStarted)
         WS_StartReply(Web);
 
-    sprintf(buff,"Content-Length: %d\r\n",Len);
-    SocketsCon_Write(&Web->Con,buff,strlen(buff));
-    SocketsCon_Write(&Web->Con,"\r\n",2);
-    SocketsCon_Write(&Web->Con,Buffer,Len);
+    memcpy(buff,"Content-Length: ",16);
+    Pos=buff+16;
+    Pos+=WS_FormatDecimal(Pos,Len);
+    memcpy(Pos,"\r\n\r\n",4);
+    Pos+=4;
+    WS_Send(Web,buff,Pos-buff);
+    WS_Send(Web,Buffer,Len);
 }
 
 /*******************************************************************************
@@ -1030,1408 +2092,3713 @@ void WS_WriteWhole(struct WebServer *Web,const char *Buffer,int Len)
  *    you do not have to build the whole web page in a buffer before
  *    repling.
  *
+ *    Small writes are collected in the connection's chunk buffer and sent
+ *    as one chunk when it fills (WS_OPT_CHUNK_BUFFER_SIZE), when you call
+ *    WS_Flush(), or at the end of the reply.  Writes bigger than the
+ *    buffer are sent as their own chunk without being copied.
+ *
  * RETURNS:
  *    NONE
  *
  * SEE ALSO:
- *    WS_WriteChunkStr(), WS_WriteWhole()
+ *    WS_WriteChunkStr(), WS_WriteWhole(), WS_Flush()
  ******************************************************************************/
 void WS_WriteChunk(struct WebServer *Web,const char *Buffer,int Len)
 {
-    char buff[100];
+    char buff[WS_CHUNK_HEAD_SIZE];
+    char *Start;
 
     if(Len==0)
         return;
 
     if(!Web->WriteStarted)
+        WS_StartChunkedReply(Web);
+
+    if(Web->ChunkBuffUsed+Len>WS_OPT_CHUNK_BUFFER_SIZE)
     {
-        WS_StartReply(Web);
-        SocketsCon_Write(&Web->Con,"Transfer-Encoding: chunked\r\n",28);
-        /* End the headers */
-        SocketsCon_Write(&Web->Con,"\r\n",2);
+        /* It won't fit, send what we have */
+        WS_SendChunkBuffer(Web,false);
+
+        if(Len>=WS_OPT_CHUNK_BUFFER_SIZE)
+        {
+            /* It's big enough to be it's own chunk */
+            Start=WS_FormatChunkHead(&buff[sizeof(buff)],Len);
+            WS_Send(Web,Start,&buff[sizeof(buff)]-Start);
+            WS_Send(Web,Buffer,Len);
+            WS_Send(Web,"\r\n",2);   // End of chunk
+            return;
+        }
     }
-    Web->WriteChunked=true;
-    Web->WriteStarted=true;
 
-    sprintf(buff,"%X\r\n",Len);
-    SocketsCon_Write(&Web->Con,buff,strlen(buff));
-    SocketsCon_Write(&Web->Con,Buffer,Len);
-    SocketsCon_Write(&Web->Con,"\r\n",2);   // End of chunk
+    memcpy(&Web->ChunkBuff[WS_CHUNK_HEAD_SIZE+Web->ChunkBuffUsed],Buffer,Len);
+    Web->ChunkBuffUsed+=Len;
+
+    if(Web->ChunkBuffUsed==WS_OPT_CHUNK_BUFFER_SIZE)
+        WS_SendChunkBuffer(Web,false);
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_WriteWholeStr
+ *    WS_Flush
  *
  * SYNOPSIS:
- *    void WS_WriteWholeStr(struct WebServer *Web,const char *Buffer);
+ *    void WS_Flush(struct WebServer *Web);
  *
  * PARAMETERS:
  *    Web [I] -- The web server context to work on
- *    Buffer [I] -- The buffer with the whole contents to send in it.  This
- *                  is a C string (ending in \0).
  *
  * FUNCTION:
- *    This function sends the content to the client using 'Content-Length'.
- *    After you call this function you can not send any more content or headers.
+ *    This function sends anything that WS_WriteChunk() has collected in the
+ *    chunk buffer as a chunk now instead of waiting for the buffer to fill
+ *    or the reply to end.
  *
- *    This is the same as WS_WriteWhole() except it works on a C string
- *    instead of a buffer.  This function just calls WS_WriteWhole() with
- *    a strlen() for the length.
+ *    You only need this if you have a page that sends a little bit at a
+ *    time and you want the browser to see each bit as it is written.
  *
  * RETURNS:
  *    NONE
  *
  * SEE ALSO:
- *    WS_Start(), WS_WriteWhole()
+ *    WS_WriteChunk()
  ******************************************************************************/
-void WS_WriteWholeStr(struct WebServer *Web,const char *Buffer)
+void WS_Flush(struct WebServer *Web)
 {
-    WS_WriteWhole(Web,Buffer,strlen(Buffer));
+    if(!Web->WriteChunked)
+        return;
+
+    WS_SendChunkBuffer(Web,false);
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_WriteChunkStr
+ *    WS_StartGenerator
  *
  * SYNOPSIS:
- *    void WS_WriteChunkStr(struct WebServer *Web,const char *Buffer);
+ *    bool WS_StartGenerator(struct WebServer *Web,t_WSGeneratorFn Generator,
+ *          void *UserData);
  *
  * PARAMETERS:
  *    Web [I] -- The web server context to work on
- *    Buffer [I] -- The buffer with the contents to send in it.  This is
- *                  a C string (ending in \0).
+ *    Generator [I] -- The function to call to make more of the content.
+ *                     This is:
+ *                      bool Generator(struct WebServer *Web,void *UserData,
+ *                              int Budget);
+ *                          Web -- The web server context to work on
+ *                          UserData -- The 'UserData' passed in here
+ *                          Budget -- How many bytes to write this time.  This
+ *                                    is WS_OPT_GENERATOR_BUDGET or 0 if the
+ *                                    connection was dropped.
+ *                      It writes using WS_WriteChunk() and returns true if
+ *                      it has more to send, or false if it is done.
+ *    UserData [I] -- Anything you want.  This is passed to 'Generator'.
  *
  * FUNCTION:
- *    This function sends content using the chunked method.  This means you
- *    do not need to know the length of the content before sending (you can
- *    build it as you go).
+ *    This function sends the rest of the content with a generator instead
+ *    of having to write it all from FS_SendFile().  This lets you send a
+ *    page that is bigger than you want to buffer (like a big log or CSV)
+ *    without holding up the other connections.
  *
- *    This is the same as WS_WriteChunk() except it works on a C string
- *    instead of a buffer.  This function just calls WS_WriteChunk() with
- *    a strlen() for the length.
+ *    After FS_SendFile() returns, 'Generator' is called each time the
+ *    connection can take more data.  It should write about 'Budget' bytes
+ *    (it can be more or less) and return.  The reply is ended when it
+ *    returns false.
+ *
+ *    If the connection is dropped before the generator returns false it is
+ *    called one last time with 'Budget' set to 0 so it can free anything it
+ *    is using.
+ *
+ *    You can write headers and chunks before calling this, but not use
+ *    WS_WriteWhole().
  *
  * RETURNS:
- *    NONE
+ *    true -- Things worked out
+ *    false -- There was an error (not called from FS_SendFile(), the page
+ *             is marked Offload, a generator was already started, or
+ *             WS_WriteWhole() was used)
+ *
+ * NOTES:
+ *    The same connection will not read the next request until the generator
+ *    is done.
  *
  * SEE ALSO:
- *    WS_Start(), WS_WriteChunk()
+ *    WS_WriteChunk(), WS_Flush()
  ******************************************************************************/
-void WS_WriteChunkStr(struct WebServer *Web,const char *Buffer)
+bool WS_StartGenerator(struct WebServer *Web,t_WSGeneratorFn Generator,
+        void *UserData)
 {
-    WS_WriteChunk(Web,Buffer,strlen(Buffer));
+    if(Web->State!=e_WebServerState_Response || Web->Generator!=NULL)
+        return false;
+
+    if(Web->WriteStarted && !Web->WriteChunked)
+        return false;
+
+    if(!Web->WriteStarted)
+        WS_StartChunkedReply(Web);
+
+    Web->Generator=Generator;
+    Web->GeneratorData=UserData;
+
+    return true;
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_URLDecode
+ *    WS_DeferReply
  *
  * SYNOPSIS:
- *    bool WS_URLDecode(const char *Value,char *Decoded,int MaxLen);
+ *    t_WSDeferHandle WS_DeferReply(struct WebServer *Web);
  *
  * PARAMETERS:
- *    Value [I] -- The string to decode.
- *    Decoded [O] -- The buffer to store the decoded string in.
- *    MaxLen [I] -- The size of 'Decoded'.
+ *    Web [I] -- The web server context to work on
  *
  * FUNCTION:
- *    This function encodes a string into URL encoding (%20 for space)
+ *    This function lets FS_SendFile() return before the reply has been
+ *    written.  Use it when the page has to wait on something slow (a
+ *    sensor, another process, another server) so the other connections
+ *    keep being served while it waits.
+ *
+ *    Keep the handle this returns (not 'Web').  When the work is done call
+ *    WS_CompleteDeferred() with the handle and a function that writes the
+ *    reply.  This can be done from a timer, from an fd being ready, or from
+ *    another thread.
+ *
+ *    If WS_CompleteDeferred() is not called within WS_OPT_DEFERRED_TIMEOUT
+ *    seconds a 504 Gateway Timeout is sent and the handle stops being valid.
+ *
+ *    You can write headers before calling this.
  *
  * RETURNS:
- *    true -- Things worked out
- *    false -- If we had to clip the string to keep it in 'MaxLen'.
+ *    A handle for the deferred reply or WS_DEFER_INVALID if the reply can't
+ *    be deferred (not called from FS_SendFile() or a completion, the page
+ *    is marked Offload, or a generator was started).
  *
  * SEE ALSO:
- *    
+ *    WS_CompleteDeferred(), WS_StartGenerator()
  ******************************************************************************/
-bool WS_URLDecode(const char *Value,char *Decoded,int MaxLen)
+t_WSDeferHandle WS_DeferReply(struct WebServer *Web)
 {
-    char *Write;
-    const char *Read;
-    char buff[100];
+    if(Web->State!=e_WebServerState_Response || Web->Generator!=NULL)
+        return WS_DEFER_INVALID;
 
-    Write=Decoded;
-    Read=Value;
-    while(*Read!=0)
-    {
-        if(*Read=='%')
-        {
-            /* Encoded */
-            Read++; // Move past the %
+    /* The generation makes old handles for this connection stop working
+       (it's never 0 so no handle is WS_DEFER_INVALID) */
+    Web->DeferGeneration++;
+    if(Web->DeferGeneration==0)
+        Web->DeferGeneration=1;
 
-            /* Copy the next 2 bytes */
-            buff[0]=*Read++;
-            buff[1]=*Read++;
-            buff[2]=0;
+    Web->State=e_WebServerState_Deferred;
 
-            *Write++=strtol(buff,NULL,16);
-            if(Write-Decoded>=MaxLen)
-                return false;
-        }
-        else
-        {
-            *Write++=*Read;
-            if(Write-Decoded>=MaxLen)
-                return false;
-            Read++;
-        }
-    }
-    *Write=0;
-    return true;
+    return ((t_WSDeferHandle)Web->DeferGeneration<<16)|(Web-m_WebServers);
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_URLDecodeInPlace
+ *    WS_CompleteDeferred
  *
  * SYNOPSIS:
- *    char *WS_URLDecodeInPlace(char *Value);
+ *    bool WS_CompleteDeferred(t_WSDeferHandle Handle,t_WSDeferredFn Callback,
+ *          void *UserData);
  *
  * PARAMETERS:
- *    Value [I] -- The URL encoded string to decode
+ *    Handle [I] -- The handle from WS_DeferReply()
+ *    Callback [I] -- The function that writes the reply.  This is:
+ *                      void Callback(struct WebServer *Web,void *UserData);
+ *                          Web -- The web server context to write the reply
+ *                                 to.  This is NULL if the connection went
+ *                                 away (or timed out) before now.  You still
+ *                                 get called so you can free 'UserData'.
+ *                          UserData -- The 'UserData' passed in here
+ *                    It works just like FS_SendFile() (it can even defer
+ *                    again or start a generator).
+ *    UserData [I] -- Anything you want.  This is passed to 'Callback'.
  *
  * FUNCTION:
- *    This function decodes a URL encoded string directly over top of the
- *    string.
+ *    This function queues the completion of a deferred reply.  'Callback'
+ *    is called from the next WS_Tick().
+ *
+ *    This is the only web server function that can be called from a thread
+ *    other than the one calling WS_Tick() (pages marked Offload can use
+ *    all the functions that FS_SendFile() can).
  *
  * RETURNS:
- *    A pointer to the char directly after the new string ends (after the \0)
+ *    true -- Things worked out
+ *    false -- The queue is full (WS_OPT_DEFERRED_QUEUE_SIZE), try again
+ *             later.  'Callback' will not be called.
  *
  * SEE ALSO:
- *    
+ *    WS_DeferReply()
  ******************************************************************************/
-char *WS_URLDecodeInPlace(char *Value)
+bool WS_CompleteDeferred(t_WSDeferHandle Handle,t_WSDeferredFn Callback,
+        void *UserData)
 {
-    char *Write;
-    char *Read;
-    char buff[100];
+    struct WSQueueItem Item;
 
-    Write=Value;
-    Read=Value;
-    while(*Read!=0)
-    {
-        if(*Read=='%')
-        {
-            /* Encoded */
-            buff[0]=0;
-            buff[1]=0;
-            buff[2]=0;
+    if(Handle==WS_DEFER_INVALID)
+        return false;
 
-            Read++; // Move past the %
+    Item.Value=Handle;
+    Item.Ptr=UserData;
+    Item.Fn=(void (*)(void))Callback;
+    if(!WSQueue_Push(&m_DeferredQueue,&Item))
+        return false;
 
-            /* Copy the next 2 bytes */
-            if(*Read!=0)
-                buff[0]=*Read++;
-            if(*Read!=0)
-                buff[1]=*Read++;
+    WS_SignalCompletion();
 
-            *Write++=strtol(buff,NULL,16);
-        }
-        else
-        {
-            *Write++=*Read;
-            Read++;
-        }
-    }
-    *Write++=0;
-    return Write;
+    return true;
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_URLEncode
+ *    WS_IsWebSocketRequest
  *
  * SYNOPSIS:
- *    bool WS_URLEncode(const char *Value,char *OutputBuffer,int MaxLen);
+ *    bool WS_IsWebSocketRequest(struct WebServer *Web);
  *
  * PARAMETERS:
- *    Value [I] -- The string to encode.
- *    OutputBuffer [O] -- The buffer to store the encoded string in.  This
- *                        should be 3 times the size of Value for worst case.
- *    MaxLen [I] -- The size of 'OutputBuffer'.
+ *    Web [I] -- The web server context to work on
  *
  * FUNCTION:
- *    This function encodes a string into URL encoding (%20 for space)
+ *    This function checks if the request is asking to be upgraded to a
+ *    WebSocket (a GET with "Upgrade: websocket", a Sec-WebSocket-Key, and
+ *    version 13).  A page that handles both can use this to pick.
  *
  * RETURNS:
- *    true -- Things worked out
- *    false -- If we had to clip the string to keep it in 'MaxLen'.
+ *    true -- It's a WebSocket handshake, call WS_AcceptWebSocket()
+ *    false -- It's a normal request
  *
  * SEE ALSO:
- *    
+ *    WS_AcceptWebSocket()
  ******************************************************************************/
-bool WS_URLEncode(const char *Value,char *OutputBuffer,int MaxLen)
+bool WS_IsWebSocketRequest(struct WebServer *Web)
 {
-    const char *Pos;
-    char *Write;
-    char *End;
-    char c;
-
-    Pos=Value;
-    Write=OutputBuffer;
-    End=OutputBuffer+MaxLen-1;
-    while(*Pos!=0)
-    {
-        c=*Pos++;
-        if((c>='A' && c<='Z') ||
-            (c>='a' && c<='z') ||
-            (c>='0' && c<='9') ||
-            c=='-' || c=='_' || c=='.' || c=='~')
-        {
-            /* Normal copy */
-            *Write++=c;
-            if(Write==End)
-            {
-                *Write++=0;
-                return false;
-            }
-        }
-        else
-        {
-            /* % encode */
-            if(Write+3>=End)
-            {
-                *Write++=0;
-                return false;
-            }
-            sprintf(Write,"%%%02X",c);
-            Write+=3;
-        }
-    }
-    *Write=0;
-    return true;
+    return Web->Req==e_ReqType_Get && Web->WebSocketUpgrade &&
+            Web->WebSocketKey[0]!=0 && Web->WebSocketVersion==13;
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_Header
+ *    WS_AcceptWebSocket
  *
  * SYNOPSIS:
- *    bool WS_Header(struct WebServer *Web,const char *Header);
+ *    bool WS_AcceptWebSocket(struct WebServer *Web,t_WSWebSocketFn Callback,
+ *          void *UserData,uintptr_t Group);
  *
  * PARAMETERS:
  *    Web [I] -- The web server context to work on
- *    Header [I] -- The header to write.
+ *    Callback [I] -- The function to call with messages from the client.
+ *                    This is:
+ *                      void Callback(struct WebServer *Web,void *UserData,
+ *                              e_WSWebSocketEventType Event,
+ *                              const char *Data,int Len);
+ *                          Web -- The connection the message came in on
+ *                          UserData -- The 'UserData' passed in here
+ *                          Event -- What happened:
+ *                              e_WSWebSocketEvent_Text -- A text message
+ *                                  (there is a \0 after it)
+ *                              e_WSWebSocketEvent_Binary -- A binary message
+ *                              e_WSWebSocketEvent_Close -- The WebSocket is
+ *                                  gone ('Web' can't be sent on anymore).
+ *                                  This is always the last call.
+ *                          Data -- The message (NULL for close)
+ *                          Len -- The number of bytes in 'Data'
+ *    UserData [I] -- Anything you want.  This is passed to 'Callback'.
+ *    Group [I] -- The group to put this WebSocket in.  WSWebSocket_Broadcast()
+ *                 sends to every WebSocket in a group.  Use anything you
+ *                 like (0, a pointer, an id).
  *
  * FUNCTION:
- *    This function writes out a header as part of the http reply.
+ *    This function upgrades the connection to a WebSocket.  It's called from
+ *    FS_SendFile() instead of writing a reply.  The handshake is sent and
+ *    from then on the connection carries WebSocket messages (it's no
+ *    longer used for requests).
+ *
+ *    Send with WSWebSocket_Send() or WSWebSocket_Broadcast() and close with
+ *    WSWebSocket_Close().  These can be called from the callback, or from
+ *    anything else running on the web server thread.
+ *
+ *    For example a status page can push the LED state when it changes
+ *    instead of having the browser poll for it:
+ *      if(!WS_AcceptWebSocket(Web,LEDSocketEvent,NULL,LED_GROUP))
+ *          WS_WriteWholeStr(Web,"WebSockets only");
+ *      ...
+ *      WSWebSocket_Broadcast(LED_GROUP,true,"{\"led\":1}",9);
  *
  * RETURNS:
- *    true -- Things worked out
- *    false -- There was an error (have you already started sending content?)
- *
- * NOTES:
- *    You do not need to end the string with a \r\n.  This function adds it
- *    for you.
- *
- * LIMITATIONS:
- *    You can not use this function if you have started sending content.
+ *    true -- The connection is a WebSocket now
+ *    false -- It couldn't be upgraded (it's not a WebSocket handshake
+ *             (WS_IsWebSocketRequest()), the reply was already started, the
+ *             page isn't running on the web server thread, or
+ *             WS_OPT_WEBSOCKET_CONNECTIONS are in use).  Send a normal reply.
  *
  * SEE ALSO:
- *    WS_Start(), WS_WriteChunk()
+ *    WS_IsWebSocketRequest(), WSWebSocket_Send(), WSWebSocket_Broadcast()
  ******************************************************************************/
-bool WS_Header(struct WebServer *Web,const char *Header)
+bool WS_AcceptWebSocket(struct WebServer *Web,t_WSWebSocketFn Callback,
+        void *UserData,uintptr_t Group)
 {
-    if(Header[0]==0)
+    char Accept[WSWEBSOCKET_ACCEPT_LEN+1];
+
+    if(Web->State!=e_WebServerState_Response || Web->Generator!=NULL ||
+            Web->ReplyStarted || !WS_IsWebSocketRequest(Web))
+    {
         return false;
+    }
 
-    if(Web->WriteStarted)
+    Web->WebSocket=WSWebSocket_Open(Web,Callback,UserData,Group);
+    if(Web->WebSocket==NULL)
         return false;
 
-    if(!Web->ReplyStarted)
-        WS_StartReply(Web);
+    WSWebSocket_MakeAccept(Web->WebSocketKey,Accept);
+
+    Web->ReplyStatus=e_ReplyStatus_SwitchingProtocols;
+    Web->UserSetReplyStatus=true;
+    Web->PageProp.DynamicFile=true;     // No ETag
+    WS_StartReply(Web);
+    WS_Send(Web,m_WebSocketHead,sizeof(m_WebSocketHead)-1);
+    WS_Send(Web,Accept,WSWEBSOCKET_ACCEPT_LEN);
+    WS_Send(Web,"\r\n\r\n",4);
 
-    SocketsCon_Write(&Web->Con,Header,strlen(Header));
-    SocketsCon_Write(&Web->Con,"\r\n",2);
+    Web->WriteStarted=true;
+    Web->State=e_WebServerState_WebSocket;
 
     return true;
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_Location
+ *    WS_SubscribeEvents
  *
  * SYNOPSIS:
- *    bool WS_Location(struct WebServer *Web,const char *NewURL);
+ *    bool WS_SubscribeEvents(struct WebServer *Web,const char *Channel);
  *
  * PARAMETERS:
  *    Web [I] -- The web server context to work on
- *    NewURL [I] -- The new URL to redirect the browser to.
+ *    Channel [I] -- The name of the channel to subscribe to.  It's made the
+ *                   first time it's used.
  *
  * FUNCTION:
- *    This function does a 301 Moved Permanently redirect.
- *
- * RETURNS:
- *    true -- Things worked out
- *    false -- There was an error
- *
- * NOTES:
- *    This must be done before anything else is sent (content, header, etc)
- *
- * SEE ALSO:
- *    
- ******************************************************************************/
-bool WS_Location(struct WebServer *Web,const char *NewURL)
-{
-    if(NewURL[0]==0)
-        return false;
-
-    if(!WS_SetHTTPStatusCode(Web,e_ReplyStatus_MovedPerm))
-        return false;
-
-    SocketsCon_Write(&Web->Con,"Location: ",10);
-    SocketsCon_Write(&Web->Con,NewURL,strlen(NewURL));
-    SocketsCon_Write(&Web->Con,"\r\n",2);
-
-    return true;
-}
-
-/*******************************************************************************
- * NAME:
- *    WS_SetHTTPStatusCode
- *
- * SYNOPSIS:
- *    bool WS_SetHTTPStatusCode(struct WebServer *Web,e_ReplyStatusType Code);
+ *    This function makes the reply a server-sent event stream (what a
+ *    browser's EventSource reads) and subscribes the connection to a
+ *    channel.  It's called from FS_SendFile() instead of writing content.
+ *    The connection is kept open and is sent every event published on the
+ *    channel with WSEvents_Publish() until the browser goes away.
  *
- * PARAMETERS:
- *    Web [I] -- The web server context to work on
- *    Code [I] -- The status code to set.  Only a limited set are supported.
+ *    If the browser is reconnecting (it sent a Last-Event-ID) it's first
+ *    sent the events it missed that the channel still has.
  *
- * FUNCTION:
- *    This function sets the http reply status code that is sent out.
+ *    You can write headers before calling this.
  *
  * RETURNS:
- *    true -- Things worked out
- *    false -- There was an error
- *
- * NOTES:
- *    This must be done before anything else is sent (content, header, etc)
+ *    true -- The connection is subscribed
+ *    false -- It couldn't be subscribed (content was already written, the
+ *             page isn't running on the web server thread,
+ *             WS_OPT_EVENTS_SUBSCRIBERS are in use, or there is no room for
+ *             a new channel).  Send a normal reply.
  *
  * SEE ALSO:
- *    WS_Location(), WS_Header()
+ *    WSEvents_Publish(), WS_AcceptWebSocket()
  ******************************************************************************/
-bool WS_SetHTTPStatusCode(struct WebServer *Web,e_ReplyStatusType Code)
+bool WS_SubscribeEvents(struct WebServer *Web,const char *Channel)
 {
-    if(Code>=e_ReplyStatusMAX)
+    if(Web->State!=e_WebServerState_Response || Web->Generator!=NULL ||
+            Web->WriteStarted)
+    {
         return false;
+    }
 
-    if(Web->WriteStarted)
+    Web->Events=WSEvents_Subscribe(Web,Channel,Web->LastEventID);
+    if(Web->Events==NULL)
         return false;
 
-    if(Web->ReplyStarted)
-        return false;
+    if(!Web->ReplyStarted)
+    {
+        Web->PageProp.DynamicFile=true;     // No ETag
+        WS_StartReply(Web);
+    }
+    WS_Send(Web,m_EventsHead,sizeof(m_EventsHead)-1);
 
-    Web->UserSetReplyStatus=true;
-    Web->ReplyStatus=Code;
-    WS_StartReply(Web);
+    Web->WriteStarted=true;
+    Web->State=e_WebServerState_Events;
 
     return true;
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_GET
+ *    WS_WriteWholeStr
  *
  * SYNOPSIS:
- *    const char *WS_GET(struct WebServer *Web,const char *Arg);
+ *    void WS_WriteWholeStr(struct WebServer *Web,const char *Buffer);
  *
  * PARAMETERS:
  *    Web [I] -- The web server context to work on
- *    Arg [I] -- The GET argument to search for an return
+ *    Buffer [I] -- The buffer with the whole contents to send in it.  This
+ *                  is a C string (ending in \0).
  *
  * FUNCTION:
- *    This function gets a GET arg from the request and returns it.
+ *    This function sends the content to the client using 'Content-Length'.
+ *    After you call this function you can not send any more content or headers.
  *
- *    You must place all the GET args you are going to be using (or could want
- *    to use) in the Web->PageProp->Gets[] array for the system to be able
- *    read a GET arg.
+ *    This is the same as WS_WriteWhole() except it works on a C string
+ *    instead of a buffer.  This function just calls WS_WriteWhole() with
+ *    a strlen() for the length.
  *
  * RETURNS:
- *    A pointer to the value or NULL if was not set.
+ *    NONE
  *
  * SEE ALSO:
- *    WS_Start(), WS_COOKIE(), WS_POST()
+ *    WS_Start(), WS_WriteWhole()
  ******************************************************************************/
-const char *WS_GET(struct WebServer *Web,const char *Arg)
+void WS_WriteWholeStr(struct WebServer *Web,const char *Buffer)
 {
-    /* GETS are first so no need to skip anything */
-    return WS_FindArgInStorage(Web->ArgsStorage,Arg,Web->PageProp.Gets);
+    WS_WriteWhole(Web,Buffer,strlen(Buffer));
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_COOKIE
+ *    WS_WriteChunkStr
  *
  * SYNOPSIS:
- *    const char *WS_COOKIE(struct WebServer *Web,const char *Arg);
+ *    void WS_WriteChunkStr(struct WebServer *Web,const char *Buffer);
  *
  * PARAMETERS:
  *    Web [I] -- The web server context to work on
- *    Arg [I] -- The GET argument to search for an return
+ *    Buffer [I] -- The buffer with the contents to send in it.  This is
+ *                  a C string (ending in \0).
  *
  * FUNCTION:
- *    This function gets a COOKIE from the request and returns it.
+ *    This function sends content using the chunked method.  This means you
+ *    do not need to know the length of the content before sending (you can
+ *    build it as you go).
  *
- *    You must place all the COOKIE names you are going to be using (or could
- *    want to use) in the Web->PageProp->Cookies[] array for the system to be
- *    able read a cookie.
+ *    This is the same as WS_WriteChunk() except it works on a C string
+ *    instead of a buffer.  This function just calls WS_WriteChunk() with
+ *    a strlen() for the length.
  *
  * RETURNS:
- *    A pointer to the value or NULL if was not set.
+ *    NONE
  *
  * SEE ALSO:
- *    WS_Start(), WS_GET(), WS_POST()
+ *    WS_Start(), WS_WriteChunk()
  ******************************************************************************/
-const char *WS_COOKIE(struct WebServer *Web,const char *Arg)
+void WS_WriteChunkStr(struct WebServer *Web,const char *Buffer)
 {
-    char *Pos;
-
-    Pos=Web->ArgsStorage;
-
-    /* Skip all the GETS args */
-    Pos=WS_SkipStorageArgs(Pos,Web->PageProp.Gets);
-    return WS_FindArgInStorage(Pos,Arg,Web->PageProp.Cookies);
+    WS_WriteChunk(Web,Buffer,strlen(Buffer));
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_POST
+ *    WS_URLDecode
  *
  * SYNOPSIS:
- *    const char *WS_POST(struct WebServer *Web,const char *Arg);
+ *    bool WS_URLDecode(const char *Value,char *Decoded,int MaxLen);
  *
  * PARAMETERS:
- *    Web [I] -- The web server context to work on
- *    Arg [I] -- The GET argument to search for an return
+ *    Value [I] -- The string to decode.
+ *    Decoded [O] -- The buffer to store the decoded string in.
+ *    MaxLen [I] -- The size of 'Decoded'.
  *
  * FUNCTION:
- *    This function gets a POST arg from the request and returns it.
- *
- *    You must place all the POST args you are going to be using (or could
- *    want to use) in the Web->PageProp->Posts[] array for the system to be
- *    able read a POST arg.
+ *    This function decodes a URL encoded string (%20 for space).  A '+' is
+ *    left as a '+'.  Use WS_URLDecodeEx() if you want '+' to be a space.
  *
  * RETURNS:
- *    A pointer to the value or NULL if was not set.
+ *    true -- Things worked out
+ *    false -- If we had to clip the string to keep it in 'MaxLen'.
  *
  * SEE ALSO:
- *    WS_Start(), WS_GET(), WS_COOKIE()
+ *    WS_URLDecodeEx(), WS_URLDecodeInPlace()
  ******************************************************************************/
-const char *WS_POST(struct WebServer *Web,const char *Arg)
+bool WS_URLDecode(const char *Value,char *Decoded,int MaxLen)
 {
-    char *Pos;
-
-    Pos=Web->ArgsStorage;
-
-    /* Skip all the GETS args */
-    Pos=WS_SkipStorageArgs(Pos,Web->PageProp.Gets);
-    /* Skip all the cookies */
-    Pos=WS_SkipStorageArgs(Pos,Web->PageProp.Cookies);
-
-    return WS_FindArgInStorage(Pos,Arg,Web->PageProp.Posts);
+    return WS_URLDecodeEx(Value,Decoded,MaxLen,false);
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_FindArgInStorage
+ *    WS_URLDecodeEx
  *
  * SYNOPSIS:
- *    static const char *WS_FindArgInStorage(char *Pos,const char *Arg,
- *          const char **ArgsList)
+ *    bool WS_URLDecodeEx(const char *Value,char *Decoded,int MaxLen,
+ *          bool PlusAsSpace);
  *
  * PARAMETERS:
- *    Pos [I] -- The starting pos in 'Web->ArgsStorage' to start searching
- *    Arg [I] -- The arg to search for
- *    ArgsList [I] -- The Web->PageProp->Gets[], Web->PageProp->Posts[], or
- *                    Web->PageProp->Cookies[] array to search.
+ *    Value [I] -- The string to decode.
+ *    Decoded [O] -- The buffer to store the decoded string in.
+ *    MaxLen [I] -- The size of 'Decoded'.
+ *    PlusAsSpace [I] -- If this is true then '+' is decoded as a space (the
+ *                       way form data is encoded).
  *
  * FUNCTION:
- *    This function searchs a section of the 'Web->ArgsStorage' looking for
- *    an arg.
+ *    This function decodes a URL encoded string (%20 for space).
  *
- *    You must set 'Pos' the start of the section you want to search.
+ *    The runs of chars that don't need decoding are found with strcspn()
+ *    and copied in one go, and the % esc seqs are decoded with a lookup
+ *    table.  A % that isn't followed by 2 hex digits is copied as is.
  *
  * RETURNS:
- *    A pointer to the arg's value, or NULL if it was not found.
+ *    true -- Things worked out
+ *    false -- If we had to clip the string to keep it in 'MaxLen'.
  *
  * SEE ALSO:
- *    WS_SkipStorageArgs()
+ *    WS_URLDecode(), WS_URLDecodeInPlaceEx()
  ******************************************************************************/
-static const char *WS_FindArgInStorage(char *Pos,const char *Arg,
-        const char **ArgsList)
+bool WS_URLDecodeEx(const char *Value,char *Decoded,int MaxLen,
+        bool PlusAsSpace)
 {
-    int g;
+    const char *Stops;
+    const char *Read;
+    char *Write;
+    char *End;
+    size_t Run;
+    uint8_t Hi;
+    uint8_t Lo;
 
-    if(ArgsList==NULL)
-        return NULL;
+    if(MaxLen<=0)
+        return false;
 
-    /* Find this arg */
-    for(g=0;ArgsList[g]!=0;g++)
+    Stops=PlusAsSpace?"%+":"%";
+    Read=Value;
+    Write=Decoded;
+    End=Decoded+MaxLen-1;   // Leave room for the \0
+    for(;;)
     {
-        if(strcmp(ArgsList[g],Arg)==0)
+        /* Copy the run of normal chars in one go */
+        Run=strcspn(Read,Stops);
+        if(Run>(size_t)(End-Write))
+        {
+            memcpy(Write,Read,End-Write);
+            *End=0;
+            return false;
+        }
+        memcpy(Write,Read,Run);
+        Write+=Run;
+        Read+=Run;
+
+        if(*Read==0)
+            break;
+
+        if(Write==End)
+        {
+            *Write=0;
+            return false;
+        }
+
+        if(*Read=='+')
         {
-            /* Ok, this is the one */
-            if(*Pos=='N')
-                return NULL;
-            return Pos+1;
+            *Write++=' ';
+            Read++;
+            continue;
         }
 
-        /* Move to the next arg value */
-        if(*Pos=='Y')
+        /* Encoded (we don't look at the 2nd digit if the 1st was the \0) */
+        Hi=m_URLHexValue[(uint8_t)Read[1]];
+        Lo=Hi?m_URLHexValue[(uint8_t)Read[2]]:0;
+        if(Hi && Lo)
         {
-            /* Skip the string (because the 'Y' is also a string we just skip
-               to the end of the string instead of having to Pos++ before
-               skipping) */
-            while(*Pos++!=0)
-                ;
+            *Write++=((Hi&0x0F)<<4)|(Lo&0x0F);
+            Read+=3;
         }
         else
         {
-            /* Nothing after the Y/N so just skip the 'N' */
-            Pos++;
+            /* Not a valid esc seq, keep the % */
+            *Write++=*Read++;
         }
     }
-    return NULL;
+    *Write=0;
+    return true;
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_SkipStorageArgs
+ *    WS_URLDecodeInPlace
  *
  * SYNOPSIS:
- *    static char *WS_SkipStorageArgs(char *StartingPos,const char **ArgsList);
+ *    char *WS_URLDecodeInPlace(char *Value);
  *
  * PARAMETERS:
- *    StartingPos [I] -- A pointer to the section to skip in the
- *                       'Web->ArgsStorage' array.
- *    ArgsList [I] -- The Web->PageProp->Gets[], Web->PageProp->Posts[], or
- *                    Web->PageProp->Cookies[] array to search.
+ *    Value [I] -- The URL encoded string to decode
  *
  * FUNCTION:
- *    This function skips a section in the 'Web->ArgsStorage' storage area.
- *
- *    Because the GETS, COOKIES, and POST are stored one after each other
- *    in the 'Web->ArgsStorage' array if you want to access the COOKIES you
- *    must skip the GETS.  This function provides this.
+ *    This function decodes a URL encoded string directly over top of the
+ *    string.  A '+' is left as a '+'.
  *
  * RETURNS:
- *    A pointer to the next section.
+ *    A pointer to the char directly after the new string ends (after the \0)
  *
  * SEE ALSO:
- *    WS_FindArgInStorage()
+ *    WS_URLDecodeInPlaceEx()
  ******************************************************************************/
-static char *WS_SkipStorageArgs(char *StartingPos,const char **ArgsList)
+char *WS_URLDecodeInPlace(char *Value)
 {
-    char *Pos;
-    int g;
+    return WS_URLDecodeInPlaceEx(Value,false);
+}
 
-    if(ArgsList==NULL)
-        return StartingPos;
+/*******************************************************************************
+ * NAME:
+ *    WS_URLDecodeInPlaceEx
+ *
+ * SYNOPSIS:
+ *    char *WS_URLDecodeInPlaceEx(char *Value,bool PlusAsSpace);
+ *
+ * PARAMETERS:
+ *    Value [I] -- The URL encoded string to decode
+ *    PlusAsSpace [I] -- If this is true then '+' is decoded as a space (the
+ *                       way form data is encoded).
+ *
+ * FUNCTION:
+ *    This function decodes a URL encoded string directly over top of the
+ *    string.
+ *
+ *    Nothing is moved until the first char that needs decoding, after that
+ *    the runs of normal chars are moved down in one go.  See
+ *    WS_URLDecodeEx() for more info.
+ *
+ * RETURNS:
+ *    A pointer to the char directly after the new string ends (after the \0)
+ *
+ * SEE ALSO:
+ *    WS_URLDecodeInPlace(), WS_URLDecodeEx()
+ ******************************************************************************/
+char *WS_URLDecodeInPlaceEx(char *Value,bool PlusAsSpace)
+{
+    const char *Stops;
+    char *Write;
+    char *Read;
+    size_t Run;
+    uint8_t Hi;
+    uint8_t Lo;
+
+    Stops=PlusAsSpace?"%+":"%";
 
-    /* Go over all the args */
-    Pos=StartingPos;
-    for(g=0;ArgsList[g]!=0;g++)
+    /* Skip the start of the string that doesn't need decoding */
+    Read=Value+strcspn(Value,Stops);
+    Write=Read;
+    while(*Read!=0)
     {
-        /* Move to the next arg value */
-        if(*Pos=='Y')
+        if(*Read=='+')
         {
-            /* Skip the string (because the 'Y' is also a string we just skip
-               to the end of the string instead of having to Pos++ before
-               skipping) */
-            while(*Pos++!=0)
-                ;
+            *Write++=' ';
+            Read++;
         }
         else
         {
-            /* Nothing after the Y/N so just skip the 'N' */
-            Pos++;
+            /* Encoded (we don't look at the 2nd digit if the 1st was
+               the \0) */
+            Hi=m_URLHexValue[(uint8_t)Read[1]];
+            Lo=Hi?m_URLHexValue[(uint8_t)Read[2]]:0;
+            if(Hi && Lo)
+            {
+                *Write++=((Hi&0x0F)<<4)|(Lo&0x0F);
+                Read+=3;
+            }
+            else
+            {
+                /* Not a valid esc seq, keep the % */
+                *Write++=*Read++;
+            }
         }
-    }
 
-    return Pos;
+        /* Move the next run of normal chars down in one go */
+        Run=strcspn(Read,Stops);
+        memmove(Write,Read,Run);
+        Write+=Run;
+        Read+=Run;
+    }
+    *Write++=0;
+    return Write;
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_InsertCopy
+ *    WS_URLEncode
  *
  * SYNOPSIS:
- *    static void WS_InsertCopy(char *Dest,char *DestEnd,const char *Src,
- *          int CopyLen);
+ *    bool WS_URLEncode(const char *Value,char *OutputBuffer,int MaxLen);
  *
  * PARAMETERS:
- *    Dest [I] -- The point to insert the 'Src' string at
- *    DestEnd [I] -- The end of the data in the 'Web->ArgsStorage'
- *    Src [I] --  The string to insert.
- *    CopyLen [I] -- How many bytes to insert/copy
+ *    Value [I] -- The string to encode.
+ *    OutputBuffer [O] -- The buffer to store the encoded string in.  This
+ *                        should be 3 times the size of Value for worst case.
+ *    MaxLen [I] -- The size of 'OutputBuffer'.
  *
  * FUNCTION:
- *    This function inserts a string into 'Web->ArgsStorage' by copying
- *    the content above the insert pos to past the end of the current data.
- *
- *    For example:
- *                       012345678901234
- *      Starting String: Cat In The Hat
- *      DestEnd=14;
- *      Dest=6;
- *      Src="/Out"
- *      CopyLen=4;
+ *    This function encodes a string into URL encoding (%20 for space)
  *
- *      This will first copy as follows:
- *          "Cat In____ The Hat"
- *      and then copy the new string in:
- *          "Can In/Out The Hat"
+ *    The runs of chars that don't need encoding are found with a lookup
+ *    table and copied in one go.
  *
  * RETURNS:
- *    NONE
+ *    true -- Things worked out
+ *    false -- If we had to clip the string to keep it in 'MaxLen'.
  *
  * SEE ALSO:
  *    
  ******************************************************************************/
-static void WS_InsertCopy(char *Dest,char *DestEnd,const char *Src,int CopyLen)
+bool WS_URLEncode(const char *Value,char *OutputBuffer,int MaxLen)
 {
-    char *p1;
-    char *p2;
+    const uint8_t *Pos;
+    const uint8_t *Run;
+    char *Write;
+    char *End;
+    int Len;
+
+    if(MaxLen<=0)
+        return false;
+
+    Pos=(const uint8_t *)Value;
+    Write=OutputBuffer;
+    End=OutputBuffer+MaxLen-1;  // Leave room for the \0
+    while(*Pos!=0)
+    {
+        /* Find the run of chars that don't need encoding (the \0 ends it) */
+        Run=Pos;
+        while(m_URLUnreserved[*Run])
+            Run++;
+
+        Len=Run-Pos;
+        if(Len>End-Write)
+        {
+            memcpy(Write,Pos,End-Write);
+            *End=0;
+            return false;
+        }
+        memcpy(Write,Pos,Len);
+        Write+=Len;
+        Pos=Run;
 
-    /* Make room */
-    p2=DestEnd+CopyLen-1;
-    p1=p2-CopyLen;
-    while(p1>=Dest)
-        *p2--=*p1--;
+        if(*Pos==0)
+            break;
 
-    /* Insert the memory */
-    memcpy(Dest,Src,CopyLen);
+        /* % encode */
+        if(End-Write<3)
+        {
+            *Write=0;
+            return false;
+        }
+        Write[0]='%';
+        Write[1]=m_HexDigits[*Pos>>4];
+        Write[2]=m_HexDigits[*Pos&0x0F];
+        Write+=3;
+        Pos++;
+    }
+    *Write=0;
+    return true;
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_SetCookie
+ *    WS_Header
  *
  * SYNOPSIS:
- *    bool WS_SetCookie(struct WebServer *Web,const char *Name,
- *          const char *Value,time_t Expire,const char *Path,const char *Domain,
- *          bool Secure,bool HttpOnly);
+ *    bool WS_Header(struct WebServer *Web,const char *Header);
  *
  * PARAMETERS:
  *    Web [I] -- The web server context to work on
- *    Name [I] -- Name of the cookie.  This can not have ' ', ',', or ';'.
- *    Value [I] -- The value of the cookie. This value is stored on the clients
- *                 computer; do not store sensitive information.  This is also
- *                 not escaped (or URI encoded).  You can not have the chars
- *                 ';', '=', '\r', '\n', ' ', or ','.  Short answer, URI encode
- *                 your string (WS_URLEncode).
- *    Expire [I] -- The time the cookie expires.  This is a time_t
- *                  (Unix timestamp) so is in number of seconds since the epoch.
- *                  This is sent into gmtime() to make a string.  Pass 0 to
- *                  ignore.
- *    Path [I] -- The path on the server in which the cookie will be available
- *                on. If set to '/', the cookie will be available within the
- *                entire domain. If set to '/foo/', the cookie will only be
- *                available within the /foo/ directory and all sub-directories
- *                such as /foo/bar/ of domain.  If you pass NULL the current
- *                directory that the cookie is being set in.
- *    Domain [I] -- The (sub)domain that the cookie is available to. Setting
- *                  this to a subdomain (such as 'www.example.com') will make
- *                  the cookie available to that subdomain and all other
- *                  sub-domains of it (i.e. w2.www.example.com). To make
- *                  the cookie available to the whole domain (including
- *                  all subdomains of it), simply set the value to the
- *                  domain name ('example.com', in this case).
- *
- *                  Older browsers still implementing the deprecated RFC 2109
- *                  may require a leading . to match all subdomains.
- *    Secure [I] -- Indicates that the cookie should only be transmitted over
- *                  a secure HTTPS connection from the client. When set to
- *                  true, the cookie will only be set if a secure connection
- *                  exists. On the server-side, it's on the programmer to
- *                  send this kind of cookie only on secure connection.
- *    HttpOnly [I] -- When true the cookie will be made accessible only
- *                    through the HTTP protocol. This means that the cookie
- *                    won't be accessible by scripting languages, such as
- *                    JavaScript. It has been suggested that this setting
- *                    can effectively help to reduce identity theft through
- *                    XSS attacks (although it is not supported by all
- *                    browsers), but that claim is often disputed.
+ *    Header [I] -- The header to write.
  *
  * FUNCTION:
- *    This function sets a cookie to be sent to the client.
+ *    This function writes out a header as part of the http reply.
  *
  * RETURNS:
  *    true -- Things worked out
  *    false -- There was an error (have you already started sending content?)
  *
  * NOTES:
- *    Most of this header was taken from the PHP doc's.
+ *    You do not need to end the string with a \r\n.  This function adds it
+ *    for you.
+ *
+ * LIMITATIONS:
+ *    You can not use this function if you have started sending content.
  *
  * SEE ALSO:
- *    
+ *    WS_Start(), WS_WriteChunk()
  ******************************************************************************/
-bool WS_SetCookie(struct WebServer *Web,const char *Name,const char *Value,
-        time_t Expire,const char *Path,const char *Domain,bool Secure,
-        bool HttpOnly)
+bool WS_Header(struct WebServer *Web,const char *Header)
 {
-    struct tm *TheTm;
-    char buff[100];
-    static char mon_name[12][3] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun","Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
-    static char wday_name[7][3] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
-    const char *Pos;
-
-    if(Name[0]==0)
+    if(Header[0]==0)
         return false;
 
-    /* Check for bad char's */
-    for(Pos=Name;*Pos!=0;Pos++)
-        if(*Pos==' ' || *Pos==',' || *Pos==';' || *Pos=='\r' || *Pos=='\n')
-            return false;
-
-    for(Pos=Value;*Pos!=0;Pos++)
-        if(*Pos==' ' || *Pos==',' || *Pos==';' || *Pos=='\r' || *Pos=='\n')
-            return false;
-
     if(Web->WriteStarted)
         return false;
 
     if(!Web->ReplyStarted)
         WS_StartReply(Web);
 
-    SocketsCon_Write(&Web->Con,"Set-Cookie: ",12);
-    SocketsCon_Write(&Web->Con,Name,strlen(Name));
-    SocketsCon_Write(&Web->Con,"=",1);
-    SocketsCon_Write(&Web->Con,Value,strlen(Value));
-    if(Expire!=0)
-    {
-        TheTm=gmtime(&Expire);
-        sprintf(buff,"; Expires=%s, %02d %s %04d %02d:%02d:%02d GMT",
-                wday_name[TheTm->tm_wday],
-                TheTm->tm_mday,
-                mon_name[TheTm->tm_mon],
-                TheTm->tm_year+1900,
-                TheTm->tm_hour,
-                TheTm->tm_min,
-                TheTm->tm_sec);
-        SocketsCon_Write(&Web->Con,buff,strlen(buff));
-    }
-    if(Path!=NULL && Path[0]!=0)
-    {
-        SocketsCon_Write(&Web->Con,"; Path=",7);
-        SocketsCon_Write(&Web->Con,Path,strlen(Path));
-    }
-    if(Domain!=NULL && Domain[0]!=0)
-    {
-        SocketsCon_Write(&Web->Con,"; Domain=",7);
-        SocketsCon_Write(&Web->Con,Domain,strlen(Domain));
-    }
-    if(Secure)
-    {
-        SocketsCon_Write(&Web->Con,"; Secure",8);
-    }
-    if(HttpOnly)
-    {
-        SocketsCon_Write(&Web->Con,"; HttpOnly",10);
-    }
-
-    SocketsCon_Write(&Web->Con,"\r\n",2);
+    WS_Send(Web,Header,strlen(Header));
+    WS_Send(Web,"\r\n",2);
 
     return true;
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_GetOSSocketHandles
+ *    WS_Location
  *
  * SYNOPSIS:
- *    int WS_GetOSSocketHandles(t_ConSocketHandle *Handles);
+ *    bool WS_Location(struct WebServer *Web,const char *NewURL);
  *
  * PARAMETERS:
- *    Handles [O] -- An array to fill in with the handles being used by the
- *                   web server.  This must be at least
- *                   'WS_OPT_MAX_CONNECTIONS+1' in size.
+ *    Web [I] -- The web server context to work on
+ *    NewURL [I] -- The new URL to redirect the browser to.
  *
  * FUNCTION:
- *    This function gets all the socket handles being used by the web server.
- *    You can use these handles to wait on.
- *
- *    The returned handles depend on what 't_ConSocketHandle' is defined as.
+ *    This function does a 301 Moved Permanently redirect.
  *
  * RETURNS:
- *    The number of handles being returned
+ *    true -- Things worked out
+ *    false -- There was an error
+ *
+ * NOTES:
+ *    This must be done before anything else is sent (content, header, etc)
  *
  * SEE ALSO:
  *    
  ******************************************************************************/
-int WS_GetOSSocketHandles(t_ConSocketHandle *Handles)
+bool WS_Location(struct WebServer *Web,const char *NewURL)
 {
-    t_ConSocketHandle SocketHandle;
-    int r;
-    int InsertPos;
+    if(NewURL[0]==0)
+        return false;
 
-    /* Fill in the first entry with the listening socket */
-    InsertPos=0;
-    SocketsCon_GetSocketHandle(&m_ListeningSocket,&Handles[InsertPos++]);
-    for(r=0;r<WS_OPT_MAX_CONNECTIONS;r++)
-        if(SocketsCon_GetSocketHandle(&m_WebServers[r].Con,&SocketHandle))
-            Handles[InsertPos++]=SocketHandle;
+    if(!WS_SetHTTPStatusCode(Web,e_ReplyStatus_MovedPerm))
+        return false;
 
-    return InsertPos;
+    WS_Send(Web,"Location: ",10);
+    WS_Send(Web,NewURL,strlen(NewURL));
+    WS_Send(Web,"\r\n",2);
+
+    return true;
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_ProcessGetVars
+ *    WS_SetHTTPStatusCode
  *
  * SYNOPSIS:
- *    static void WS_ProcessGetVars(struct WebServer *Web);
+ *    bool WS_SetHTTPStatusCode(struct WebServer *Web,e_ReplyStatusType Code);
  *
  * PARAMETERS:
  *    Web [I] -- The web server context to work on
+ *    Code [I] -- The status code to set.  Only a limited set are supported.
  *
  * FUNCTION:
- *    This function goes though the URI line (in 'Web->LineBuff') and pulls
- *    out the GET args and stores them in 'Web->ArgsStorage'.
+ *    This function sets the http reply status code that is sent out.
  *
  * RETURNS:
- *    NONE
+ *    true -- Things worked out
+ *    false -- There was an error
  *
  * NOTES:
- *    The format of 'ArgsStorage' is that we store each variable
- *    (GET/POST/COOKIE) in the order they are in listed in the array of
- *    names.  We store a Y or an N depending on if we found the var.  If
- *    it's an N then the next var is right after it in the next byte (0 bytes
- *    between).  If it is Y then we store the string followed by a \0.
+ *    This must be done before anything else is sent (content, header, etc)
  *
- *    We store the GETs first, then the COOKIEs, then POSTs.
+ * SEE ALSO:
+ *    WS_Location(), WS_Header()
+ ******************************************************************************/
+bool WS_SetHTTPStatusCode(struct WebServer *Web,e_ReplyStatusType Code)
+{
+    if(Code>=e_ReplyStatusMAX)
+        return false;
+
+    if(Web->WriteStarted)
+        return false;
+
+    if(Web->ReplyStarted)
+        return false;
+
+    Web->UserSetReplyStatus=true;
+    Web->ReplyStatus=Code;
+    WS_StartReply(Web);
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_GET
  *
- *    For example:
- *      struct WSPageProp Props=
- *      {
- *          .Gets={"one","two","three",NULL},
- *          .Cookies={"four","five",NULL},
- *          .Posts={"six","seven",NULL},
- *      }
+ * SYNOPSIS:
+ *    const char *WS_GET(struct WebServer *Web,const char *Arg);
  *
- *    Where nothing is passed in then 'ArgsStorage' will look like:
- *      NNNNNNN
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Arg [I] -- The GET argument to search for an return
  *
- *    Where one is passed in (?one=value1):
- *      Yvalue1\0NNNNNN
+ * FUNCTION:
+ *    This function gets a GET arg from the request and returns it.
  *
- *    Where two is passed in (?two=value2):
- *      NYvalue2\0NNNNN
+ *    You must place all the GET args you are going to be using (or could want
+ *    to use) in the Web->PageProp->Gets[] array for the system to be able
+ *    read a GET arg.
  *
- *    Where one and two are passed in (?two=value2&one=value1):
- *      Yvalue1\0Yvalue2\0NNNNN
+ * RETURNS:
+ *    A pointer to the value or NULL if was not set.
  *
- *    Where the 'five' cookie is set:
- *      NNNNYcookie\0NN
+ * NOTES:
+ *    This has to search the Gets[] list for 'Arg'.  If you are reading a lot
+ *    of args use WS_GETByIndex() instead.
  *
  * SEE ALSO:
- *    
+ *    WS_Start(), WS_COOKIE(), WS_POST(), WS_GETByIndex()
  ******************************************************************************/
-static void WS_ProcessGetVars(struct WebServer *Web)
+const char *WS_GET(struct WebServer *Web,const char *Arg)
+{
+    return WS_GetArgByIndex(Web,e_WSArgType_Get,
+            WS_FindArgIndex(Web->PageProp.Gets,Arg));
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_COOKIE
+ *
+ * SYNOPSIS:
+ *    const char *WS_COOKIE(struct WebServer *Web,const char *Arg);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Arg [I] -- The GET argument to search for an return
+ *
+ * FUNCTION:
+ *    This function gets a COOKIE from the request and returns it.
+ *
+ *    You must place all the COOKIE names you are going to be using (or could
+ *    want to use) in the Web->PageProp->Cookies[] array for the system to be
+ *    able read a cookie.
+ *
+ * RETURNS:
+ *    A pointer to the value or NULL if was not set.
+ *
+ * SEE ALSO:
+ *    WS_Start(), WS_GET(), WS_POST(), WS_COOKIEByIndex()
+ ******************************************************************************/
+const char *WS_COOKIE(struct WebServer *Web,const char *Arg)
+{
+    return WS_GetArgByIndex(Web,e_WSArgType_Cookie,
+            WS_FindArgIndex(Web->PageProp.Cookies,Arg));
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_POST
+ *
+ * SYNOPSIS:
+ *    const char *WS_POST(struct WebServer *Web,const char *Arg);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Arg [I] -- The GET argument to search for an return
+ *
+ * FUNCTION:
+ *    This function gets a POST arg from the request and returns it.
+ *
+ *    You must place all the POST args you are going to be using (or could
+ *    want to use) in the Web->PageProp->Posts[] array for the system to be
+ *    able read a POST arg.
+ *
+ * RETURNS:
+ *    A pointer to the value or NULL if was not set.
+ *
+ * SEE ALSO:
+ *    WS_Start(), WS_GET(), WS_COOKIE(), WS_POSTByIndex()
+ ******************************************************************************/
+const char *WS_POST(struct WebServer *Web,const char *Arg)
+{
+    return WS_GetArgByIndex(Web,e_WSArgType_Post,
+            WS_FindArgIndex(Web->PageProp.Posts,Arg));
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_GETByIndex
+ *
+ * SYNOPSIS:
+ *    const char *WS_GETByIndex(struct WebServer *Web,int Index);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Index [I] -- The index of the arg in the Web->PageProp->Gets[] array.
+ *
+ * FUNCTION:
+ *    This function gets a GET arg from the request by it's position in the
+ *    Gets[] array instead of by name.  This is a direct lookup in the arg
+ *    index so it does not have to compare any strings.
+ *
+ *    The normal way to use this is to make an enum that matches the order
+ *    of the Gets[] array and pass that in.  For example:
+ *      const char *m_LEDGets[]={"led","state",NULL};
+ *      enum {e_LEDGet_LED,e_LEDGet_State};
+ *
+ *      State=WS_GETByIndex(Web,e_LEDGet_State);
+ *
+ * RETURNS:
+ *    A pointer to the value or NULL if was not set (or 'Index' is out of
+ *    range).
+ *
+ * SEE ALSO:
+ *    WS_GET(), WS_COOKIEByIndex(), WS_POSTByIndex()
+ ******************************************************************************/
+const char *WS_GETByIndex(struct WebServer *Web,int Index)
+{
+    return WS_GetArgByIndex(Web,e_WSArgType_Get,Index);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_COOKIEByIndex
+ *
+ * SYNOPSIS:
+ *    const char *WS_COOKIEByIndex(struct WebServer *Web,int Index);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Index [I] -- The index of the cookie in the Web->PageProp->Cookies[]
+ *                 array.
+ *
+ * FUNCTION:
+ *    This function gets a COOKIE from the request by it's position in the
+ *    Cookies[] array.  See WS_GETByIndex() for more info.
+ *
+ * RETURNS:
+ *    A pointer to the value or NULL if was not set (or 'Index' is out of
+ *    range).
+ *
+ * SEE ALSO:
+ *    WS_COOKIE(), WS_GETByIndex(), WS_POSTByIndex()
+ ******************************************************************************/
+const char *WS_COOKIEByIndex(struct WebServer *Web,int Index)
+{
+    return WS_GetArgByIndex(Web,e_WSArgType_Cookie,Index);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_POSTByIndex
+ *
+ * SYNOPSIS:
+ *    const char *WS_POSTByIndex(struct WebServer *Web,int Index);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Index [I] -- The index of the arg in the Web->PageProp->Posts[] array.
+ *
+ * FUNCTION:
+ *    This function gets a POST arg from the request by it's position in the
+ *    Posts[] array.  See WS_GETByIndex() for more info.
+ *
+ * RETURNS:
+ *    A pointer to the value or NULL if was not set (or 'Index' is out of
+ *    range).
+ *
+ * SEE ALSO:
+ *    WS_POST(), WS_GETByIndex(), WS_COOKIEByIndex()
+ ******************************************************************************/
+const char *WS_POSTByIndex(struct WebServer *Web,int Index)
+{
+    return WS_GetArgByIndex(Web,e_WSArgType_Post,Index);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_GetArgByIndex
+ *
+ * SYNOPSIS:
+ *    static const char *WS_GetArgByIndex(struct WebServer *Web,
+ *          e_WSArgTypeType Type,int Index);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Type [I] -- What type of arg are we getting (GET, COOKIE, or POST)
+ *    Index [I] -- The index of the arg in the list of args for this type.
+ *                 This can be -1 for not found.
+ *
+ * FUNCTION:
+ *    This function looks up an arg in the arg index and returns a pointer
+ *    to it's value in 'Web->ArgsStorage'.
+ *
+ * RETURNS:
+ *    A pointer to the arg's value, or NULL if it was not sent.
+ *
+ * SEE ALSO:
+ *    WS_InitArgIndex()
+ ******************************************************************************/
+static const char *WS_GetArgByIndex(struct WebServer *Web,
+        e_WSArgTypeType Type,int Index)
+{
+    struct WSArgIndex *Entry;
+
+    if(Index<0 || Index>=Web->ArgCount[Type])
+        return NULL;
+
+#if WS_OPT_LAZY_ARGS
+    /* If we haven't parsed this type of arg yet do it now */
+    if(Web->LazyArgs[Type].Offset!=WS_ARG_NOT_SET)
+        WS_ParseLazyArgs(Web,Type);
+#endif
+
+    Entry=WS_GetArgEntry(Web,Type,Index,false);
+    if(Entry==NULL || Entry->Offset==WS_ARG_NOT_SET)
+        return NULL;
+
+    return &Web->ArgsStorage[Entry->Offset];
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_GetArgEntry
+ *
+ * SYNOPSIS:
+ *    static struct WSArgIndex *WS_GetArgEntry(struct WebServer *Web,
+ *          e_WSArgTypeType Type,int Index,bool Add);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Type [I] -- What type of arg this is (GET, COOKIE, or POST)
+ *    Index [I] -- The index of the arg in the list of args for this type
+ *                 (0 to 'Web->ArgCount[Type]'-1)
+ *    Add [I] -- Give the arg an entry if it doesn't have one yet
+ *
+ * FUNCTION:
+ *    This function finds the arg index entry for an arg.
+ *
+ *    Normally every arg the page lists has an entry (see WS_InitArgIndex())
+ *    and this is just a lookup.  If the page lists more args than there
+ *    are entries ('Web->ArgIndexLinear') the entries are handed out to the
+ *    args as they are sent and this searches 'Web->ArgSlot' for the arg.
+ *
+ * RETURNS:
+ *    The entry for the arg or NULL if it doesn't have one ('Add' is false,
+ *    or all WS_OPT_MAX_ARGS entries are in use).
+ *
+ * SEE ALSO:
+ *    WS_InitArgIndex()
+ ******************************************************************************/
+static struct WSArgIndex *WS_GetArgEntry(struct WebServer *Web,
+        e_WSArgTypeType Type,int Index,bool Add)
+{
+    struct WSArgIndex *Entry;
+    uint16_t Pos;
+    int r;
+
+    Pos=Web->ArgBase[Type]+Index;
+    if(!Web->ArgIndexLinear)
+        return &Web->ArgIndex[Pos];
+
+    for(r=0;r<Web->ArgSlotsUsed;r++)
+        if(Web->ArgSlot[r]==Pos)
+            return &Web->ArgIndex[r];
+
+    if(!Add || Web->ArgSlotsUsed>=WS_OPT_MAX_ARGS)
+        return NULL;
+
+    Web->ArgSlot[Web->ArgSlotsUsed]=Pos;
+    Entry=&Web->ArgIndex[Web->ArgSlotsUsed++];
+    Entry->Offset=WS_ARG_NOT_SET;
+    Entry->Len=0;
+
+    return Entry;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_FindArgIndex
+ *
+ * SYNOPSIS:
+ *    static int WS_FindArgIndex(const char **ArgsList,const char *Arg);
+ *
+ * PARAMETERS:
+ *    ArgsList [I] -- The Web->PageProp->Gets[], Web->PageProp->Posts[], or
+ *                    Web->PageProp->Cookies[] array to search.
+ *    Arg [I] -- The arg to search for
+ *
+ * FUNCTION:
+ *    This function finds the position of an arg name in a list of args.
+ *
+ * RETURNS:
+ *    The index of the arg in 'ArgsList' or -1 if it was not found.
+ *
+ * SEE ALSO:
+ *    WS_GetArgByIndex()
+ ******************************************************************************/
+static int WS_FindArgIndex(const char **ArgsList,const char *Arg)
 {
-    char *ArgsStart;
-    char *Start;
-    char *Pos;
-    char *Write;
-    char *StorageStart;
-    char *StartOfLastWrite;
     int g;
-    int ArgCount;
-    int arg;
+
+    if(ArgsList==NULL)
+        return -1;
+
+    for(g=0;ArgsList[g]!=NULL;g++)
+        if(strcmp(ArgsList[g],Arg)==0)
+            return g;
+
+    return -1;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_GetArgsList
+ *
+ * SYNOPSIS:
+ *    static const char **WS_GetArgsList(struct WebServer *Web,
+ *          e_WSArgTypeType Type);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Type [I] -- What list of args to get
+ *
+ * FUNCTION:
+ *    This function gets the list of arg names the page accepts for a type
+ *    of arg.
+ *
+ * RETURNS:
+ *    The Web->PageProp->Gets[], Web->PageProp->Posts[], or
+ *    Web->PageProp->Cookies[] array (can be NULL).
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+static const char **WS_GetArgsList(struct WebServer *Web,e_WSArgTypeType Type)
+{
+    switch(Type)
+    {
+        case e_WSArgType_Get:
+            return Web->PageProp.Gets;
+        case e_WSArgType_Cookie:
+            return Web->PageProp.Cookies;
+        case e_WSArgType_Post:
+            return Web->PageProp.Posts;
+        case e_WSArgTypeMAX:
+        break;
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_InitArgIndex
+ *
+ * SYNOPSIS:
+ *    static void WS_InitArgIndex(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function sets up the arg index for the page that was requested.
+ *    It counts the GET, COOKIE, and POST args that the page accepts and
+ *    gives each of them an entry in 'Web->ArgIndex' (GETs first, then
+ *    COOKIEs, then POSTs) with all of them set to not sent.
+ *
+ *    The index is filled in as the args are parsed and is then used to
+ *    find an arg's value without having to walk 'Web->ArgsStorage'.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * NOTES:
+ *    If the page lists more than 'WS_OPT_MAX_ARGS' args the entries are
+ *    handed out as the args are sent instead (see WS_GetArgEntry()), so
+ *    only WS_OPT_MAX_ARGS of them can be sent in one request.
+ *
+ * SEE ALSO:
+ *    WS_StoreArg(), WS_GetArgByIndex()
+ ******************************************************************************/
+static void WS_InitArgIndex(struct WebServer *Web)
+{
+    const char **ArgsList;
+    int Type;
+    int Count;
+    int Total;
+    int r;
+
+    Total=0;
+    for(Type=0;Type<e_WSArgTypeMAX;Type++)
+    {
+        Count=0;
+        ArgsList=WS_GetArgsList(Web,Type);
+        if(ArgsList!=NULL)
+        {
+            while(ArgsList[Count]!=NULL)
+                Count++;
+        }
+
+        Web->ArgBase[Type]=Total;
+        Web->ArgCount[Type]=Count;
+        Total+=Count;
+    }
+
+    Web->ArgSlotsUsed=0;
+    Web->ArgIndexLinear=Total>WS_OPT_MAX_ARGS;
+    if(Web->ArgIndexLinear)
+    {
+        /* We can't give every arg an entry, WS_GetArgEntry() will hand them
+           out as the args are sent */
+        return;
+    }
+
+    for(r=0;r<Total;r++)
+    {
+        Web->ArgIndex[r].Offset=WS_ARG_NOT_SET;
+        Web->ArgIndex[r].Len=0;
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_StoreArg
+ *
+ * SYNOPSIS:
+ *    static void WS_StoreArg(struct WebServer *Web,e_WSArgTypeType Type,
+ *          const char *Name,char *Value,bool Decode);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Type [I] -- What type of arg this is (GET, COOKIE, or POST)
+ *    Name [I] -- The name of the arg that was sent
+ *    Value [I] -- The value that was sent for this arg
+ *    Decode [I] -- Should the value be URL decoded after it is stored
+ *
+ * FUNCTION:
+ *    This function stores an arg that was sent to us.  If the page accepts
+ *    this arg the value is added to the end of 'Web->ArgsStorage' and the
+ *    arg index is pointed at it.  If the page doesn't accept this arg (or
+ *    we have already stored a value for it) then it is ignored.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_InitArgIndex(), WS_ParseArgList()
+ ******************************************************************************/
+static void WS_StoreArg(struct WebServer *Web,e_WSArgTypeType Type,
+        const char *Name,char *Value,bool Decode)
+{
+    struct WSArgIndex *Entry;
+    char *Write;
+    int Index;
     int Len;
-    bool Found;
 
-    /* Find the end of the string (it will be the start of the args or the real
-       end of the string) */
-    ArgsStart=Web->LineBuff;
-    while(*ArgsStart!=0)
-        ArgsStart++;
-    ArgsStart++;    // Move to the start of args
+    Index=WS_FindArgIndex(WS_GetArgsList(Web,Type),Name);
+    if(Index<0 || Index>=Web->ArgCount[Type])
+        return;
+
+    Entry=WS_GetArgEntry(Web,Type,Index,true);
+    if(Entry==NULL)
+    {
+        Web->ReplyStatus=e_ReplyStatus_InsufficientStorage;
+        return;
+    }
+    if(Entry->Offset!=WS_ARG_NOT_SET)
+    {
+        /* We already have this one, the first one wins */
+        return;
+    }
+
+    Len=strlen(Value);
+    if(Web->ArgsStorageUsed+Len+1>WS_OPT_ARG_MEMORY_SIZE)
+    {
+        Web->ReplyStatus=e_ReplyStatus_InsufficientStorage;
+        return;
+    }
+
+    Write=&Web->ArgsStorage[Web->ArgsStorageUsed];
+    memcpy(Write,Value,Len+1);  // +1 for the end of the string
+    Web->ArgsStorageUsed+=Len+1;
+
+    if(Decode)
+        Len=WS_URLDecodeInPlaceEx(Write,WS_OPT_GET_PLUS_IS_SPACE)-Write-1;
+
+    Entry->Offset=Write-Web->ArgsStorage;
+    Entry->Len=Len;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_SetCookie
+ *
+ * SYNOPSIS:
+ *    bool WS_SetCookie(struct WebServer *Web,const char *Name,
+ *          const char *Value,time_t Expire,const char *Path,const char *Domain,
+ *          bool Secure,bool HttpOnly);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Name [I] -- Name of the cookie.  This can not have ' ', ',', or ';'.
+ *    Value [I] -- The value of the cookie. This value is stored on the clients
+ *                 computer; do not store sensitive information.  This is also
+ *                 not escaped (or URI encoded).  You can not have the chars
+ *                 ';', '=', '\r', '\n', ' ', or ','.  Short answer, URI encode
+ *                 your string (WS_URLEncode).
+ *    Expire [I] -- The time the cookie expires.  This is a time_t
+ *                  (Unix timestamp) so is in number of seconds since the epoch.
+ *                  This is sent as an HTTP (GMT) date.  Pass 0 to ignore.
+ *    Path [I] -- The path on the server in which the cookie will be available
+ *                on. If set to '/', the cookie will be available within the
+ *                entire domain. If set to '/foo/', the cookie will only be
+ *                available within the /foo/ directory and all sub-directories
+ *                such as /foo/bar/ of domain.  If you pass NULL the current
+ *                directory that the cookie is being set in.
+ *    Domain [I] -- The (sub)domain that the cookie is available to. Setting
+ *                  this to a subdomain (such as 'www.example.com') will make
+ *                  the cookie available to that subdomain and all other
+ *                  sub-domains of it (i.e. w2.www.example.com). To make
+ *                  the cookie available to the whole domain (including
+ *                  all subdomains of it), simply set the value to the
+ *                  domain name ('example.com', in this case).
+ *
+ *                  Older browsers still implementing the deprecated RFC 2109
+ *                  may require a leading . to match all subdomains.
+ *    Secure [I] -- Indicates that the cookie should only be transmitted over
+ *                  a secure HTTPS connection from the client. When set to
+ *                  true, the cookie will only be set if a secure connection
+ *                  exists. On the server-side, it's on the programmer to
+ *                  send this kind of cookie only on secure connection.
+ *    HttpOnly [I] -- When true the cookie will be made accessible only
+ *                    through the HTTP protocol. This means that the cookie
+ *                    won't be accessible by scripting languages, such as
+ *                    JavaScript. It has been suggested that this setting
+ *                    can effectively help to reduce identity theft through
+ *                    XSS attacks (although it is not supported by all
+ *                    browsers), but that claim is often disputed.
+ *
+ * FUNCTION:
+ *    This function sets a cookie to be sent to the client.
+ *
+ * RETURNS:
+ *    true -- Things worked out
+ *    false -- There was an error (have you already started sending content?)
+ *
+ * NOTES:
+ *    Most of this header was taken from the PHP doc's.
+ *
+ *    The Expires date is only reformatted when 'Expire' changes, so setting
+ *    a bunch of cookies with the same expire time only formats it once.
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+bool WS_SetCookie(struct WebServer *Web,const char *Name,const char *Value,
+        time_t Expire,const char *Path,const char *Domain,bool Secure,
+        bool HttpOnly)
+{
+    const char *Pos;
+
+    if(Name[0]==0)
+        return false;
+
+    /* Check for bad char's */
+    for(Pos=Name;*Pos!=0;Pos++)
+        if(*Pos==' ' || *Pos==',' || *Pos==';' || *Pos=='\r' || *Pos=='\n')
+            return false;
+
+    for(Pos=Value;*Pos!=0;Pos++)
+        if(*Pos==' ' || *Pos==',' || *Pos==';' || *Pos=='\r' || *Pos=='\n')
+            return false;
+
+    if(Web->WriteStarted)
+        return false;
+
+    if(!Web->ReplyStarted)
+        WS_StartReply(Web);
+
+    WS_Send(Web,"Set-Cookie: ",12);
+    WS_Send(Web,Name,strlen(Name));
+    WS_Send(Web,"=",1);
+    WS_Send(Web,Value,strlen(Value));
+    if(Expire!=0)
+    {
+        WS_Send(Web,"; Expires=",10);
+        WS_Send(Web,WS_GetHTTPDate(&m_ExpiresCache,Expire),
+                WS_HTTP_DATE_LEN);
+    }
+    if(Path!=NULL && Path[0]!=0)
+    {
+        WS_Send(Web,"; Path=",7);
+        WS_Send(Web,Path,strlen(Path));
+    }
+    if(Domain!=NULL && Domain[0]!=0)
+    {
+        WS_Send(Web,"; Domain=",9);
+        WS_Send(Web,Domain,strlen(Domain));
+    }
+    if(Secure)
+    {
+        WS_Send(Web,"; Secure",8);
+    }
+    if(HttpOnly)
+    {
+        WS_Send(Web,"; HttpOnly",10);
+    }
+
+    WS_Send(Web,"\r\n",2);
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_GetOSSocketHandles
+ *
+ * SYNOPSIS:
+ *    int WS_GetOSSocketHandles(t_ConSocketHandle *Handles);
+ *
+ * PARAMETERS:
+ *    Handles [O] -- An array to fill in with the handles being used by the
+ *                   web server.  This must be at least
+ *                   'WS_MAX_LISTENERS+WS_OPT_MAX_CONNECTIONS' in size.
+ *
+ * FUNCTION:
+ *    This function gets all the socket handles being used by the web server.
+ *    You can use these handles to wait on.
+ *
+ *    The returned handles depend on what 't_ConSocketHandle' is defined as.
+ *
+ * RETURNS:
+ *    The number of handles being returned
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+int WS_GetOSSocketHandles(t_ConSocketHandle *Handles)
+{
+    t_ConSocketHandle SocketHandle;
+    int r;
+    int InsertPos;
+
+    /* Fill in the first entries with the listening sockets */
+    InsertPos=0;
+    for(r=0;r<m_ListenerCount;r++)
+        if(SocketsCon_GetSocketHandle(&m_Listeners[r],&SocketHandle))
+            Handles[InsertPos++]=SocketHandle;
+    for(r=0;r<WS_OPT_MAX_CONNECTIONS;r++)
+        if(SocketsCon_GetSocketHandle(&m_WebServers[r].Con,&SocketHandle))
+            Handles[InsertPos++]=SocketHandle;
+
+    return InsertPos;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_ParseArgList
+ *
+ * SYNOPSIS:
+ *    static void WS_ParseArgList(struct WebServer *Web,e_WSArgTypeType Type,
+ *          char *Args);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Type [I] -- What type of args these are (GET or COOKIE)
+ *    Args [I] -- The string with the args in it.  For GETs this is the
+ *                query string (one=1&two=2).  For COOKIEs this is the value
+ *                of the Cookie header (one=1; two=2).  This is broken up
+ *                in place.
+ *
+ * FUNCTION:
+ *    This function breaks up a list of args and stores the ones the page
+ *    accepts.  GET values are URL decoded, COOKIE values are not.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_StoreArg()
+ ******************************************************************************/
+static void WS_ParseArgList(struct WebServer *Web,e_WSArgTypeType Type,
+        char *Args)
+{
+    char *Pos;
+    char *Name;
+    char *Value;
+    char Sep;
+
+    Sep='&';
+    if(Type==e_WSArgType_Cookie)
+        Sep=';';
+
+    Pos=Args;
+    while(*Pos!=0)
+    {
+        /* Skip any spaces at the start of a cookie name */
+        if(Type==e_WSArgType_Cookie)
+        {
+            while(*Pos==' ')
+                Pos++;
+        }
+
+        Name=Pos;
+        Value=NULL;
+        while(*Pos!=Sep && *Pos!=0)
+        {
+            if(*Pos=='=' && Value==NULL)
+            {
+                *Pos=0;
+                Value=Pos+1;
+            }
+            Pos++;
+        }
+        if(*Pos==Sep)
+            *Pos++=0;
+
+        if(Value!=NULL)
+            WS_StoreArg(Web,Type,Name,Value,Type==e_WSArgType_Get);
+    }
+}
+
+#if WS_OPT_LAZY_ARGS
+/*******************************************************************************
+ * NAME:
+ *    WS_SaveLazyArgs
+ *
+ * SYNOPSIS:
+ *    static bool WS_SaveLazyArgs(struct WebServer *Web,e_WSArgTypeType Type,
+ *          const char *Args);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Type [I] -- What type of args these are (GET or COOKIE)
+ *    Args [I] -- The raw query string or Cookie header value
+ *
+ * FUNCTION:
+ *    This function copies a raw list of args to the end of
+ *    'Web->LazyArgsStorage' without parsing them.  They will be parsed by
+ *    WS_ParseLazyArgs() the first time the page asks for an arg of this
+ *    type (which may be never, for example a 304 reply).
+ *
+ *    The raw args are kept out of 'Web->ArgsStorage' so they don't use up
+ *    the room for the values of the args the page accepts (which is all
+ *    that is copied there when they are parsed).
+ *
+ *    If there is already a list of args of this type waiting (more than one
+ *    Cookie header) the new one is joined on to the end of it.
+ *
+ * RETURNS:
+ *    true -- The args where saved
+ *    false -- There was not enough room to save the raw args.  The caller
+ *             should parse them now (only the args the page accepts are
+ *             stored when they are parsed).
+ *
+ * SEE ALSO:
+ *    WS_ParseLazyArgs()
+ ******************************************************************************/
+static bool WS_SaveLazyArgs(struct WebServer *Web,e_WSArgTypeType Type,
+        const char *Args)
+{
+    struct WSArgIndex *Lazy;
+    int Len;
+
+    Lazy=&Web->LazyArgs[Type];
+    Len=strlen(Args);
+
+    if(Lazy->Offset!=WS_ARG_NOT_SET)
+    {
+        if(Lazy->Offset+Lazy->Len+1==Web->LazyArgsUsed &&
+                Web->LazyArgsUsed+Len+1<=WS_OPT_LAZY_ARGS_SIZE)
+        {
+            /* Join it on to the end of the last one (replacing the \0 with
+               a separator) */
+            Web->LazyArgsStorage[Web->LazyArgsUsed-1]=
+                    Type==e_WSArgType_Cookie?';':'&';
+            memcpy(&Web->LazyArgsStorage[Web->LazyArgsUsed],Args,Len+1);
+            Lazy->Len+=Len+1;
+            Web->LazyArgsUsed+=Len+1;
+            return true;
+        }
+
+        /* We can't join them, parse the one we have first (so the first
+           one still wins) */
+        WS_ParseLazyArgs(Web,Type);
+    }
+
+    if(Web->LazyArgsUsed+Len+1>WS_OPT_LAZY_ARGS_SIZE)
+        return false;
+
+    Lazy->Offset=Web->LazyArgsUsed;
+    Lazy->Len=Len;
+    memcpy(&Web->LazyArgsStorage[Web->LazyArgsUsed],Args,Len+1);
+    Web->LazyArgsUsed+=Len+1;
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_ParseLazyArgs
+ *
+ * SYNOPSIS:
+ *    static void WS_ParseLazyArgs(struct WebServer *Web,e_WSArgTypeType Type);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Type [I] -- What type of args to parse (GET or COOKIE)
+ *
+ * FUNCTION:
+ *    This function parses the raw args that where saved with
+ *    WS_SaveLazyArgs() (if there are any).  The args are broken up where
+ *    they are in 'Web->LazyArgsStorage' and the values of the ones the page
+ *    accepts are stored in 'Web->ArgsStorage'.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_SaveLazyArgs()
+ ******************************************************************************/
+static void WS_ParseLazyArgs(struct WebServer *Web,e_WSArgTypeType Type)
+{
+    struct WSArgIndex *Lazy;
+
+    Lazy=&Web->LazyArgs[Type];
+    if(Lazy->Offset==WS_ARG_NOT_SET)
+        return;
+
+    WS_ParseArgList(Web,Type,&Web->LazyArgsStorage[Lazy->Offset]);
+    Lazy->Offset=WS_ARG_NOT_SET;
+}
+#endif
+
+/*******************************************************************************
+ * NAME:
+ *    WS_ProcessGetVars
+ *
+ * SYNOPSIS:
+ *    static void WS_ProcessGetVars(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function goes though the URI line (in 'Web->LineBuff') and pulls
+ *    out the GET args and stores them in 'Web->ArgsStorage'.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * NOTES:
+ *    The values of the args the page accepts are added to the end of
+ *    'ArgsStorage' as \0 terminated strings in the order they arrive.  Args
+ *    the page doesn't accept are not stored.  The 'ArgIndex' array has an
+ *    entry for each arg listed in the page's Gets[], Cookies[], and
+ *    Posts[] arrays (in that order) with the offset and length of the
+ *    value in 'ArgsStorage' (or WS_ARG_NOT_SET if it was not sent).
+ *
+ *    For example:
+ *      struct WSPageProp Props=
+ *      {
+ *          .Gets={"one","two","three",NULL},
+ *          .Cookies={"four","five",NULL},
+ *          .Posts={"six","seven",NULL},
+ *      }
+ *
+ *    Where two and one are passed in (?two=value2&one=value1) with the
+ *    'five' cookie set, 'ArgsStorage' will look like:
+ *      value2\0value1\0cookie\0
+ *
+ *    and 'ArgIndex' will be:
+ *      [0] one   -- Offset=7, Len=6
+ *      [1] two   -- Offset=0, Len=6
+ *      [2] three -- WS_ARG_NOT_SET
+ *      [3] four  -- WS_ARG_NOT_SET
+ *      [4] five  -- Offset=14, Len=6
+ *      [5] six   -- WS_ARG_NOT_SET
+ *      [6] seven -- WS_ARG_NOT_SET
+ *
+ * SEE ALSO:
+ *    WS_InitArgIndex(), WS_StoreArg()
+ ******************************************************************************/
+static void WS_ProcessGetVars(struct WebServer *Web)
+{
+    char *Args;
+
+    if(Web->ArgCount[e_WSArgType_Get]==0)
+        return;
+
+    /* Find the end of the string (it will be the start of the args or the real
+       end of the string) */
+    Args=Web->LineBuff;
+    while(*Args!=0)
+        Args++;
+    Args++;    // Move to the start of args
+
+    if(*Args==0)
+        return;
+
+#if WS_OPT_LAZY_ARGS
+    if(WS_SaveLazyArgs(Web,e_WSArgType_Get,Args))
+        return;
+#endif
+
+    WS_ParseArgList(Web,e_WSArgType_Get,Args);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_ProcessCookieVars
+ *
+ * SYNOPSIS:
+ *    static void WS_ProcessCookieVars(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function processes a "Cookie: " header.  It will set the cookies
+ *    value in 'Web->ArgsStorage' if any of the sent in cookies match the
+ *    list of supported cookies.
+ *
+ *    See WS_ProcessGetVars() for a description of how 'ArgsStorage' works.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+static void WS_ProcessCookieVars(struct WebServer *Web)
+{
+    char *Args;
+
+    if(Web->ArgCount[e_WSArgType_Cookie]==0)
+        return;
+
+    /* Find the end of the Cookie: string */
+    Args=Web->LineBuff;
+    while(*Args!=':' && *Args!=0)
+        Args++;
+
+    /* Skip the : and any spaces */
+    if(*Args==':')
+        Args++;
+    while(*Args==' ')
+        Args++;
+
+    if(*Args==0)
+        return;
+
+#if WS_OPT_LAZY_ARGS
+    if(WS_SaveLazyArgs(Web,e_WSArgType_Cookie,Args))
+        return;
+#endif
+
+    WS_ParseArgList(Web,e_WSArgType_Cookie,Args);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_StartProcessingPOSTVar
+ *
+ * SYNOPSIS:
+ *    static void WS_StartProcessingPOSTVar(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function sets up for processing of a POST var.  It will find the
+ *    var (the name is in 'Web->LineBuff') in the list of POST vars and
+ *    point it's arg index entry at the end of 'Web->ArgsStorage'.  The value
+ *    is then appended there as it comes in (see WS_CopyLineBuffer2POSTVar()).
+ *
+ *    If the page doesn't accept this var (or we already have a value for
+ *    it) then 'Web->PostArg' is set to NULL and the value will be thrown
+ *    away.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_CopyLineBuffer2POSTVar()
+ ******************************************************************************/
+static void WS_StartProcessingPOSTVar(struct WebServer *Web)
+{
+    struct WSArgIndex *Entry;
+    int Index;
+
+    Web->PostArg=NULL;
+
+    Index=WS_FindArgIndex(Web->PageProp.Posts,Web->LineBuff);
+    if(Index<0 || Index>=Web->ArgCount[e_WSArgType_Post])
+        return;
+
+    Entry=WS_GetArgEntry(Web,e_WSArgType_Post,Index,true);
+    if(Entry==NULL)
+    {
+        Web->ReplyStatus=e_ReplyStatus_InsufficientStorage;
+        return;
+    }
+    if(Entry->Offset!=WS_ARG_NOT_SET)
+    {
+        /* We already have this one, the first one wins */
+        return;
+    }
+
+    if(Web->ArgsStorageUsed>=WS_OPT_ARG_MEMORY_SIZE)
+    {
+        /* No room for even the \0 */
+        Web->ReplyStatus=e_ReplyStatus_InsufficientStorage;
+        return;
+    }
+
+    /* Start an empty string at the end of the storage */
+    Entry->Offset=Web->ArgsStorageUsed;
+    Entry->Len=0;
+    Web->ArgsStorage[Web->ArgsStorageUsed]=0;
+    Web->PostArg=Entry;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_CopyLineBuffer2POSTVar
+ *
+ * SYNOPSIS:
+ *    static bool WS_CopyLineBuffer2POSTVar(struct WebServer *Web,
+ *          bool EndOfVar);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    EndOfVar [I] -- Is this the last of the value (we got the '&' or
+ *                    the end of the body).
+ *
+ * FUNCTION:
+ *    This function decodes what is in the line buffer and appends it to the
+ *    POST var that is being stored.  Because the var being stored is always
+ *    the last thing in 'Web->ArgsStorage' this is just a copy to the end of
+ *    the storage.
+ *
+ *    If the line buffer ends part way though a % esc seq (and this isn't
+ *    the end of the var) the esc seq is left in the line buffer to be
+ *    finished by the next block of data.
+ *
+ *    You have to have started this with WS_StartProcessingPOSTVar() to setup
+ *    the needed vars.
+ *
+ * RETURNS:
+ *    true -- All ok
+ *    false -- There wasn't enough room to store this var.
+ *
+ * SEE ALSO:
+ *    WS_StartProcessingPOSTVar()
+ ******************************************************************************/
+static bool WS_CopyLineBuffer2POSTVar(struct WebServer *Web,bool EndOfVar)
+{
+    struct WSArgIndex *Entry;
+    char EscBuff[3];
+    char *Pos;
+    char *EndOfLineBuff;
+    int Len;
+    bool RetValue;
+
+    /* Make the line buffer in to a string */
+    Web->LineBuff[Web->LineBuffPos]=0;
+
+    Entry=Web->PostArg;
+    if(Entry==NULL)
+    {
+        Web->LineBuffPos=0;
+        return true;
+    }
+
+    /* First see we where in the middle of a % esc seq */
+    EscBuff[0]=0;
+    EscBuff[1]=0;
+    EscBuff[2]=0;
+    if(!EndOfVar && Web->LineBuffPos>=2)
+    {
+        /* Ok, move the esc seq to 'EscBuff' and kill it out of the main
+           buffer */
+        Pos=&Web->LineBuff[Web->LineBuffPos-1];
+        if(*Pos=='%')
+        {
+            EscBuff[0]='%';
+            *Pos=0;
+            Web->LineBuffPos--;
+        }
+        else
+        {
+            Pos--;
+            if(*Pos=='%')
+            {
+                EscBuff[0]='%';
+                EscBuff[1]=*(Pos+1);
+                *Pos=0;
+                Web->LineBuffPos-=2;
+            }
+        }
+    }
+
+    /* Decode the line buffer */
+    EndOfLineBuff=WS_URLDecodeInPlaceEx(Web->LineBuff,
+            WS_OPT_POST_PLUS_IS_SPACE);
+
+    Len=EndOfLineBuff-Web->LineBuff-1;  // -1 for the \0
+
+    /* Make sure we can fit this (and the \0) */
+    RetValue=true;
+    if(Web->ArgsStorageUsed+Len+1>WS_OPT_ARG_MEMORY_SIZE)
+    {
+        /* It's not going to fit, clip it and return insufficient storage */
+        Len=WS_OPT_ARG_MEMORY_SIZE-Web->ArgsStorageUsed-1;
+        Web->ReplyStatus=e_ReplyStatus_InsufficientStorage;
+        EndOfVar=true;
+        RetValue=false;
+    }
+
+    /* Append it (this is always the last thing in the storage) */
+    memcpy(&Web->ArgsStorage[Web->ArgsStorageUsed],Web->LineBuff,Len);
+    Web->ArgsStorageUsed+=Len;
+    Web->ArgsStorage[Web->ArgsStorageUsed]=0;
+    Entry->Len+=Len;
+
+    if(EndOfVar)
+    {
+        /* Done with this var, keep the \0 */
+        Web->ArgsStorageUsed++;
+        Web->PostArg=NULL;
+        Web->LineBuffPos=0;
+    }
+    else
+    {
+        /* Ok, if we where in the middle of an esc seq, but it in the buffer */
+        strcpy(Web->LineBuff,EscBuff);
+        Web->LineBuffPos=strlen(EscBuff);
+    }
+
+    return RetValue;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_GetHTTPDate
+ *
+ * SYNOPSIS:
+ *    static const char *WS_GetHTTPDate(struct WSDateCache *Cache,time_t When);
+ *
+ * PARAMETERS:
+ *    Cache [I/O] -- The cache to use.  This has the last date formatted
+ *                   in it.
+ *    When [I] -- The time to format
+ *
+ * FUNCTION:
+ *    This function formats a time as an HTTP date (RFC 7231 IMF-fixdate,
+ *    "Sun, 06 Nov 1994 08:49:37 GMT").  The result is kept in 'Cache' and
+ *    is only reformatted when 'When' is different from the last call, so
+ *    for the Date header this only happens once a second.
+ *
+ *    This doesn't use strftime() because the day and month names have to
+ *    be in English no matter what the locale is.
+ *
+ * RETURNS:
+ *    A pointer to the formatted date in 'Cache'.  It is always
+ *    WS_HTTP_DATE_LEN chars long.
+ *
+ * SEE ALSO:
+ *    WS_StartReply(), WS_SetCookie()
+ ******************************************************************************/
+static const char *WS_GetHTTPDate(struct WSDateCache *Cache,time_t When)
+{
+    struct tm tm;
+    char *Pos;
+    int Year;
+
+    if(When==Cache->When && Cache->Str[0]!=0)
+        return Cache->Str;
+
+    gmtime_r(&When,&tm);
+    Year=tm.tm_year+1900;
+
+    Pos=Cache->Str;
+    memcpy(Pos,m_DayNames[tm.tm_wday],3);
+    Pos+=3;
+    *Pos++=',';
+    *Pos++=' ';
+    *Pos++='0'+tm.tm_mday/10;
+    *Pos++='0'+tm.tm_mday%10;
+    *Pos++=' ';
+    memcpy(Pos,m_MonthNames[tm.tm_mon],3);
+    Pos+=3;
+    *Pos++=' ';
+    *Pos++='0'+Year/1000%10;
+    *Pos++='0'+Year/100%10;
+    *Pos++='0'+Year/10%10;
+    *Pos++='0'+Year%10;
+    *Pos++=' ';
+    *Pos++='0'+tm.tm_hour/10;
+    *Pos++='0'+tm.tm_hour%10;
+    *Pos++=':';
+    *Pos++='0'+tm.tm_min/10;
+    *Pos++='0'+tm.tm_min%10;
+    *Pos++=':';
+    *Pos++='0'+tm.tm_sec/10;
+    *Pos++='0'+tm.tm_sec%10;
+    memcpy(Pos," GMT",4);
+    Pos+=4;
+    *Pos=0;
+
+    Cache->When=When;
+
+    return Cache->Str;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_FormatDecimal
+ *
+ * SYNOPSIS:
+ *    static int WS_FormatDecimal(char *Output,unsigned int Value);
+ *
+ * PARAMETERS:
+ *    Output [O] -- Where to write the number.  This needs to have room for
+ *                  10 chars.  It is NOT \0 terminated.
+ *    Value [I] -- The number to write
+ *
+ * FUNCTION:
+ *    This function writes a number out in decimal.  It is used instead of
+ *    sprintf() for things like Content-Length.
+ *
+ * RETURNS:
+ *    The number of chars written to 'Output'
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+static int WS_FormatDecimal(char *Output,unsigned int Value)
+{
+    char buff[10];
+    char *Pos;
+    int Len;
+
+    /* Build it backwards */
+    Pos=&buff[sizeof(buff)];
+    do
+    {
+        *--Pos='0'+Value%10;
+        Value/=10;
+    } while(Value!=0);
+
+    Len=&buff[sizeof(buff)]-Pos;
+    memcpy(Output,Pos,Len);
+
+    return Len;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_FormatChunkHead
+ *
+ * SYNOPSIS:
+ *    static char *WS_FormatChunkHead(char *End,unsigned int Len);
+ *
+ * PARAMETERS:
+ *    End [O] -- Where the chunk size line should end.  The line is written
+ *               backwards from here, so there must be WS_CHUNK_HEAD_SIZE
+ *               bytes in front of it.
+ *    Len [I] -- The size of the chunk
+ *
+ * FUNCTION:
+ *    This function writes the size line for a chunk ("1F4\r\n") so that it
+ *    ends right before 'End'.  This lets the chunk buffer keep room for the
+ *    size line in front of the data and send it all with one write.
+ *
+ * RETURNS:
+ *    A pointer to the start of the size line.
+ *
+ * SEE ALSO:
+ *    WS_SendChunkBuffer()
+ ******************************************************************************/
+static char *WS_FormatChunkHead(char *End,unsigned int Len)
+{
+    char *Pos;
+
+    Pos=End;
+    *--Pos='\n';
+    *--Pos='\r';
+    do
+    {
+        *--Pos=m_HexDigits[Len&0xF];
+        Len>>=4;
+    } while(Len!=0);
+
+    return Pos;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_SendChunkBuffer
+ *
+ * SYNOPSIS:
+ *    static void WS_SendChunkBuffer(struct WebServer *Web,bool LastChunk);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    LastChunk [I] -- Also send the last (0 size) chunk to end the reply
+ *
+ * FUNCTION:
+ *    This function sends what has been collected in the chunk buffer as
+ *    a chunk (size line, data, and \r\n in one write) and empties the
+ *    buffer.  If 'LastChunk' is true the end of the content is added to the
+ *    same write.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_WriteChunk(), WS_Flush()
+ ******************************************************************************/
+static void WS_SendChunkBuffer(struct WebServer *Web,bool LastChunk)
+{
+    char *Start;
+    char *End;
+
+    Start=&Web->ChunkBuff[WS_CHUNK_HEAD_SIZE];
+    End=Start;
+    if(Web->ChunkBuffUsed>0)
+    {
+        Start=WS_FormatChunkHead(Start,Web->ChunkBuffUsed);
+        End+=Web->ChunkBuffUsed;
+        *End++='\r';
+        *End++='\n';
+    }
+
+    if(LastChunk)
+    {
+        /* 0 size chunk with no extra header fields */
+        memcpy(End,"0\r\n\r\n",5);
+        End+=5;
+    }
+
+    if(End!=Start)
+        WS_Send(Web,Start,End-Start);
+
+    Web->ChunkBuffUsed=0;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_StartChunkedReply
+ *
+ * SYNOPSIS:
+ *    static void WS_StartChunkedReply(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function ends the reply headers saying the content will be sent
+ *    chunked.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_WriteChunk(), WS_StartGenerator()
+ ******************************************************************************/
+static void WS_StartChunkedReply(struct WebServer *Web)
+{
+    if(!Web->ReplyStarted)
+        WS_StartReply(Web);
+
+    /* Also ends the headers */
+    WS_Send(Web,"Transfer-Encoding: chunked\r\n\r\n",30);
+
+    Web->WriteChunked=true;
+    Web->WriteStarted=true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_RunGenerator
+ *
+ * SYNOPSIS:
+ *    static void WS_RunGenerator(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function calls the connection's generator while the connection
+ *    can take more data, up to WS_OPT_GENERATOR_CALLS times a tick so one
+ *    fast client can't hold up the other connections.  When the generator
+ *    says it's done the reply is ended and the connection goes back to
+ *    waiting for the next request.
+ *
+ *    If the client doesn't take any data for
+ *    WS_SECONDS_UNTIL_CONNECTION_RELEASE we hang up.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_StartGenerator()
+ ******************************************************************************/
+static void WS_RunGenerator(struct WebServer *Web)
+{
+    struct WSHandlerMark Mark;
+    bool More;
+    int Calls;
+
+    if(!SocketsCon_CanWrite(&Web->Con))
+    {
+        if(ReadElapsedClock()-Web->LastReadTime>=
+                WS_SECONDS_UNTIL_CONNECTION_RELEASE)
+        {
+            /* The client stopped taking data, hang up */
+            WSMetrics_Count(e_WSMetricCounter_TimeoutStalled,1);
+            WS_StopGenerator(Web);
+            WS_CloseConnection(Web);
+        }
+        return;
+    }
+
+    More=true;
+    for(Calls=0;Calls<WS_OPT_GENERATOR_CALLS;Calls++)
+    {
+        /* We already know it can take the first one */
+        if(Calls>0 && !SocketsCon_CanWrite(&Web->Con))
+            break;
+
+        WS_HandlerStart(Web,&Mark);
+        More=Web->Generator(Web,Web->GeneratorData,WS_OPT_GENERATOR_BUDGET);
+        WS_HandlerDone(Web,&Mark);
+        WS_Flush(Web);
+        if(!More)
+            break;
+    }
+
+    /* Sending counts as activity for the timeout */
+    Web->LastReadTime=ReadElapsedClock();
+
+    if(!More)
+    {
+        Web->Generator=NULL;
+        WS_EndReply(Web);
+        WS_ResetWebServer(Web);
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_StopGenerator
+ *
+ * SYNOPSIS:
+ *    static void WS_StopGenerator(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function stops the connection's generator (if it has one) before
+ *    it is done.  The generator is called with a budget of 0 so it can
+ *    clean up.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_StartGenerator()
+ ******************************************************************************/
+static void WS_StopGenerator(struct WebServer *Web)
+{
+    t_WSGeneratorFn Generator;
+
+    if(Web->Generator==NULL)
+        return;
+
+    Generator=Web->Generator;
+    Web->Generator=NULL;
+    Generator(Web,Web->GeneratorData,0);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_GetDeferred
+ *
+ * SYNOPSIS:
+ *    static struct WebServer *WS_GetDeferred(t_WSDeferHandle Handle);
+ *
+ * PARAMETERS:
+ *    Handle [I] -- The handle from WS_DeferReply()
+ *
+ * FUNCTION:
+ *    This function finds the connection a deferred reply handle is for.
+ *
+ * RETURNS:
+ *    The web server context or NULL if the handle isn't valid any more (the
+ *    connection was closed, timed out, or has moved on).
+ *
+ * SEE ALSO:
+ *    WS_DeferReply()
+ ******************************************************************************/
+static struct WebServer *WS_GetDeferred(t_WSDeferHandle Handle)
+{
+    struct WebServer *Web;
+    unsigned int Index;
+
+    Index=Handle&0xFFFF;
+    if(Index>=WS_OPT_MAX_CONNECTIONS)
+        return NULL;
+
+    Web=&m_WebServers[Index];
+    if(Web->State!=e_WebServerState_Deferred ||
+            Web->DeferGeneration!=(Handle>>16) ||
+            !SocketsCon_IsConnected(&Web->Con))
+    {
+        return NULL;
+    }
+
+    return Web;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_RunDeferredCompletions
+ *
+ * SYNOPSIS:
+ *    static void WS_RunDeferredCompletions(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function runs the completions that have been queued with
+ *    WS_CompleteDeferred().  It runs at most a queue full so a completion
+ *    that queues another one can't keep us here.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_CompleteDeferred()
+ ******************************************************************************/
+static void WS_RunDeferredCompletions(void)
+{
+    struct WSQueueItem Item;
+    struct WebServer *Web;
+    t_WSDeferredFn Callback;
+    struct WSHandlerMark Mark;
+    int Count;
+
+    for(Count=0;Count<WS_OPT_DEFERRED_QUEUE_SIZE;Count++)
+    {
+        if(!WSQueue_Pop(&m_DeferredQueue,&Item))
+            break;
+
+        Callback=(t_WSDeferredFn)Item.Fn;
+        Web=WS_GetDeferred(Item.Value);
+        if(Web==NULL)
+        {
+            /* Too late, let it clean up */
+            Callback(NULL,Item.Ptr);
+            continue;
+        }
+
+        Web->State=e_WebServerState_Response;
+        WS_HandlerStart(Web,&Mark);
+        Callback(Web,Item.Ptr);
+        WS_HandlerDone(Web,&Mark);
+        WS_FinishResponse(Web);
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_DeferredTimedOut
+ *
+ * SYNOPSIS:
+ *    static void WS_DeferredTimedOut(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function is called when a deferred reply wasn't completed in
+ *    time.  It sends a 504 and gets the connection ready for the next
+ *    request.  If the page already started the reply we can't change the
+ *    status so we just hang up.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_DeferReply()
+ ******************************************************************************/
+static void WS_DeferredTimedOut(struct WebServer *Web)
+{
+    WSMetrics_Count(e_WSMetricCounter_TimeoutDeferred,1);
+
+    if(Web->ReplyStarted)
+    {
+        WS_CloseConnection(Web);
+        return;
+    }
+
+    Web->ReplyStatus=e_ReplyStatus_GatewayTimeout;
+    WS_StartReply(Web);
+    WS_EndReply(Web);
+    WS_ResetWebServer(Web);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_Send
+ *
+ * SYNOPSIS:
+ *    static void WS_Send(struct WebServer *Web,const void *Buffer,int Len);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Buffer [I] -- The bytes to send
+ *    Len [I] -- The number of bytes in 'Buffer'
+ *
+ * FUNCTION:
+ *    This function sends part of the reply.  Everything the web server
+ *    sends to the client goes though here.
+ *
+ *    If the page is running on a worker thread the bytes are added to
+ *    'Web->OutputBuff' instead, and sent by WS_Tick() when the page is done
+ *    (only the web server thread touches the socket).  If the page sends
+ *    more than WS_OPT_OFFLOAD_OUTPUT_MAX bytes the rest is dropped and the
+ *    client gets a 500 instead.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_OffloadResponse()
+ ******************************************************************************/
+static void WS_Send(struct WebServer *Web,const void *Buffer,int Len)
+{
+    char *NewBuff;
+    int NewSize;
+    uint64_t Start;
+    uint64_t Dur;
+
+    if(!Web->CaptureOutput)
+    {
+        Start=WS_NOW();
+        SocketsCon_Write(&Web->Con,Buffer,Len);
+        Dur=WS_NOW()-Start;
+        Web->WriteNS+=Dur;
+        WSMetrics_Count(e_WSMetricCounter_BytesOut,Len);
+        WSTrace_Span(e_WSTrace_Write,WS_CON_INDEX(Web),Start,Dur,Len);
+        return;
+    }
+
+    if(Web->OutputFailed)
+        return;
+
+    if(Web->OutputLen+Len>WS_OPT_OFFLOAD_OUTPUT_MAX)
+    {
+        Web->OutputFailed=true;
+        return;
+    }
+
+    if(Web->OutputLen+Len>Web->OutputSize)
+    {
+        NewSize=Web->OutputSize;
+        if(NewSize==0)
+            NewSize=WS_OPT_CHUNK_BUFFER_SIZE;
+        while(NewSize<Web->OutputLen+Len)
+            NewSize*=2;
+        if(NewSize>WS_OPT_OFFLOAD_OUTPUT_MAX)
+            NewSize=WS_OPT_OFFLOAD_OUTPUT_MAX;
+
+        NewBuff=realloc(Web->OutputBuff,NewSize);
+        if(NewBuff==NULL)
+        {
+            Web->OutputFailed=true;
+            return;
+        }
+        Web->OutputBuff=NewBuff;
+        Web->OutputSize=NewSize;
+    }
+
+    memcpy(&Web->OutputBuff[Web->OutputLen],Buffer,Len);
+    Web->OutputLen+=Len;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_SignalCompletion
+ *
+ * SYNOPSIS:
+ *    static void WS_SignalCompletion(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function lets WS_Tick() know there is something in one of the
+ *    completion queues.  It can be called from any thread.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_CheckCompletions()
+ ******************************************************************************/
+static void WS_SignalCompletion(void)
+{
+    uint64_t One;
+
+    if(m_CompletionFD<0)
+        return;
+
+    One=1;
+    if(write(m_CompletionFD,&One,sizeof(One))!=sizeof(One))
+    {
+        /* Can only fail if the count is about to overflow, which means
+           it's already set */
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_CheckCompletions
+ *
+ * SYNOPSIS:
+ *    static bool WS_CheckCompletions(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function checks (and clears) the signal from other threads that
+ *    they have queued something for WS_Tick().
+ *
+ * RETURNS:
+ *    true -- The completion queues need to be checked
+ *    false -- Nothing has been queued
+ *
+ * SEE ALSO:
+ *    WS_SignalCompletion()
+ ******************************************************************************/
+static bool WS_CheckCompletions(void)
+{
+    uint64_t Count;
+
+    if(m_CompletionFD<0)
+        return true;
+
+    return read(m_CompletionFD,&Count,sizeof(Count))==sizeof(Count);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_OffloadResponse
+ *
+ * SYNOPSIS:
+ *    static bool WS_OffloadResponse(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function hands a page marked Offload to the worker threads.  The
+ *    connection is left alone until the worker is done with it.  What the
+ *    page sends is collected (up to WS_OPT_OFFLOAD_OUTPUT_MAX bytes) and
+ *    written out by WS_RunOffloadCompletions().
+ *
+ * RETURNS:
+ *    true -- The page was given to a worker
+ *    false -- There are no workers or they are all backed up.  Run the page
+ *             on this thread.
+ *
+ * NOTES:
+ *    The connection is in e_WebServerState_Offloaded while the page runs,
+ *    so WS_StartGenerator(), WS_DeferReply(), WS_AcceptWebSocket() and
+ *    WS_SubscribeEvents() all fail from an offloaded page.  The page has
+ *    to send its whole reply before it returns.
+ *
+ * SEE ALSO:
+ *    WS_RunOffloadCompletions(), WS_Send()
+ ******************************************************************************/
+static bool WS_OffloadResponse(struct WebServer *Web)
+{
+#if WS_OPT_OFFLOAD_THREADS>0
+    struct WSQueueItem Item;
+
+    if(m_OffloadThreadCount==0)
+        return false;
+
+    Web->CaptureOutput=true;
+    Web->State=e_WebServerState_Offloaded;
+
+    Item.Value=0;
+    Item.Ptr=Web;
+    Item.Fn=NULL;
+    if(!WSQueue_Push(&m_OffloadJobs,&Item))
+    {
+        Web->CaptureOutput=false;
+        Web->State=e_WebServerState_Response;
+        return false;
+    }
+    sem_post(&m_OffloadSem);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_RunOffloadCompletions
+ *
+ * SYNOPSIS:
+ *    static void WS_RunOffloadCompletions(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function takes back the connections the worker threads are done
+ *    with, sends what the page wrote, and ends the reply.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_OffloadResponse()
+ ******************************************************************************/
+static void WS_RunOffloadCompletions(void)
+{
+#if WS_OPT_OFFLOAD_THREADS>0
+    struct WSQueueItem Item;
+    struct WebServer *Web;
+
+    while(WSQueue_Pop(&m_OffloadDone,&Item))
+    {
+        Web=Item.Ptr;
+        Web->CaptureOutput=false;
+        Web->State=e_WebServerState_Response;
+        Web->LastReadTime=ReadElapsedClock();
+
+        if(Web->OutputFailed)
+        {
+            /* We lost part of the reply.  None of it has gone out yet so
+               send a 500 in place of it and hang up (the page's chunk state
+               is no good for the next request) */
+            Web->ReplyStatus=e_ReplyStatus_InternalServerError;
+            Web->UserSetReplyStatus=false;
+            WS_StartReply(Web);
+            WS_CloseConnection(Web);
+        }
+        else
+        {
+            WS_Send(Web,Web->OutputBuff,Web->OutputLen);
+            WS_FinishResponse(Web);
+        }
+
+        /* Don't hang on to the memory between requests */
+        free(Web->OutputBuff);
+        Web->OutputBuff=NULL;
+        Web->OutputSize=0;
+        Web->OutputLen=0;
+    }
+#endif
+}
+
+#if WS_OPT_OFFLOAD_THREADS>0
+/*******************************************************************************
+ * NAME:
+ *    WS_OffloadWorker
+ *
+ * SYNOPSIS:
+ *    static void *WS_OffloadWorker(void *Arg);
+ *
+ * PARAMETERS:
+ *    Arg [I] -- Not used
+ *
+ * FUNCTION:
+ *    This is the worker thread for pages marked Offload.  It waits for a
+ *    connection on the job queue, runs FS_SendFile() for it, and passes it
+ *    back to WS_Tick().
+ *
+ * RETURNS:
+ *    NULL
+ *
+ * SEE ALSO:
+ *    WS_OffloadResponse()
+ ******************************************************************************/
+static void *WS_OffloadWorker(void *Arg)
+{
+    struct WSQueueItem Item;
+    struct WebServer *Web;
+    struct WSHandlerMark Mark;
+
+    for(;;)
+    {
+        if(sem_wait(&m_OffloadSem)!=0)
+            continue;   // Interrupted
+
+        if(atomic_load(&m_OffloadQuit))
+            break;
+
+        if(!WSQueue_Pop(&m_OffloadJobs,&Item))
+            continue;
+
+        Web=Item.Ptr;
+        atomic_fetch_add(&m_OffloadBusy,1);
+        WS_HandlerStart(Web,&Mark);
+        FS_SendFile(Web,Web->PageProp.FileID);
+        WS_HandlerDone(Web,&Mark);
+        atomic_fetch_sub(&m_OffloadBusy,1);
+
+        /* This only waits if WS_Tick() is behind on emptying the queue */
+        while(!WSQueue_Push(&m_OffloadDone,&Item))
+            sched_yield();
+
+        WS_SignalCompletion();
+    }
+
+    return NULL;
+}
+#endif
+
+/*******************************************************************************
+ * NAME:
+ *    WS_GetPageProperties
+ *
+ * SYNOPSIS:
+ *    static bool WS_GetPageProperties(struct WebServer *Web,
+ *          const char *Filename);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Filename [I] -- The filename from the URL that is being requested
+ *
+ * FUNCTION:
+ *    This function fills in 'Web->PageProp' for the page being requested.
+ *    The pages built into the web server (the metrics and trace pages) are
+ *    checked first, then FS_GetFileProperties() is asked.
+ *
+ * RETURNS:
+ *    true -- Page known
+ *    false -- Unknown page (send a 404)
+ *
+ * SEE ALSO:
+ *    FS_GetFileProperties()
+ ******************************************************************************/
+static bool WS_GetPageProperties(struct WebServer *Web,const char *Filename)
+{
+#if WS_OPT_METRICS
+    if(strcmp(Filename,WS_OPT_METRICS_PATH)==0)
+    {
+        Web->PageProp.FileID=0;
+        Web->PageProp.DynamicFile=true;
+        Web->PageProp.Offload=false;
+        Web->PageProp.Route=WS_OPT_METRICS_PATH;
+        Web->PageProp.Upstream=NULL;
+        Web->PageProp.Cookies=NULL;
+        Web->PageProp.Gets=NULL;
+        Web->PageProp.Posts=NULL;
+        Web->BuiltInPage=WS_SendMetrics;
+        return true;
+    }
+#endif
+#if WS_OPT_TRACE
+    if(strcmp(Filename,WS_OPT_TRACE_PATH)==0)
+    {
+        Web->PageProp.FileID=0;
+        Web->PageProp.DynamicFile=true;
+        Web->PageProp.Offload=false;
+        Web->PageProp.Route=WS_OPT_TRACE_PATH;
+        Web->PageProp.Upstream=NULL;
+        Web->PageProp.Cookies=NULL;
+        Web->PageProp.Gets=NULL;
+        Web->PageProp.Posts=NULL;
+        Web->BuiltInPage=WSTrace_WritePage;
+        return true;
+    }
+#endif
+
+    Web->PageProp.Upstream=NULL;
+    return FS_GetFileProperties(Filename,&Web->PageProp);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_CloseConnection
+ *
+ * SYNOPSIS:
+ *    static void WS_CloseConnection(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function hangs up on the client.  Anything that was being sent
+ *    is lost.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+static void WS_CloseConnection(struct WebServer *Web)
+{
+    WS_EndRequestMetrics(Web);
+    WS_StopProxy(Web);
+    WS_StopWebSocket(Web);
+    WS_StopEvents(Web);
+    WSTrace_Event(e_WSTrace_Close,WS_CON_INDEX(Web),0);
+    SocketsCon_Close(&Web->Con);
+    Web->State=e_WebServerState_Closed;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_StartProxy
+ *
+ * SYNOPSIS:
+ *    static void WS_StartProxy(struct WebServer *Web,int MethodLen);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    MethodLen [I] -- The length of the method at the start of
+ *                     'Web->LineBuff' (the path starts after it and a space)
+ *
+ * FUNCTION:
+ *    This function is called when the request line is for a page that is
+ *    passed on to an upstream server (PageProp.Upstream).  It gets a
+ *    connection to the upstream and gives it the request line.  The
+ *    headers are added as they come in and the request is sent once they
+ *    are done (see WS_RunServer()).
+ *
+ *    The body isn't looked at, it's spliced to the upstream as it comes in.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_RunProxy(), WSProxy_Open()
+ ******************************************************************************/
+static void WS_StartProxy(struct WebServer *Web,int MethodLen)
+{
+    const char *Path;
+    const char *Args;
+
+    /* WS_ProcessURI() left "path\0args\0" after the method */
+    Path=&Web->LineBuff[MethodLen+1];
+    Args=Path+strlen(Path)+1;
+
+    Web->Req=e_ReqType_Get;
+    Web->Proxy=WSProxy_Open(Web->PageProp.Upstream);
+    if(Web->Proxy==NULL)
+    {
+        Web->ReplyStatus=e_ReplyStatus_BadGateway;
+        return;
+    }
+    if(!WSProxy_AddRequestLine(Web->Proxy,Web->LineBuff,MethodLen,Path,Args))
+        Web->ReplyStatus=e_ReplyStatus_URITooLong;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_RunProxy
+ *
+ * SYNOPSIS:
+ *    static void WS_RunProxy(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function is called from WS_Tick() for connections that are
+ *    passing a request on to an upstream server.  It keeps the request
+ *    moving and when the response is done gets the connection ready for
+ *    the next request.
+ *
+ *    If the upstream can't be reached (or doesn't answer in time) before
+ *    anything has been sent the client gets a 502 (or 504).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_StartProxy(), WSProxy_Run()
+ ******************************************************************************/
+static void WS_RunProxy(struct WebServer *Web)
+{
+    e_WSProxyResultType Result;
+
+    Result=WSProxy_Run(Web->Proxy,&Web->Con);
+    switch(Result)
+    {
+        case e_WSProxyResult_Busy:
+        break;
+        case e_WSProxyResult_Done:
+        case e_WSProxyResult_DoneClose:
+            /* The response has been sent, this is just so it's counted
+               under the upstream's status */
+            Web->ReplyStatus=WS_StatusFromCode(WSProxy_GetStatus(Web->Proxy));
+            Web->ReplyStarted=true;
+            WS_EndReply(Web);
+            if(Result==e_WSProxyResult_DoneClose)
+                WS_CloseConnection(Web);
+            else
+                WS_ResetWebServer(Web);
+        break;
+        case e_WSProxyResult_BadGateway:
+        case e_WSProxyResult_Timeout:
+            /* Some of the body may still be coming so we hang up after */
+            Web->ReplyStatus=e_ReplyStatus_BadGateway;
+            if(Result==e_WSProxyResult_Timeout)
+                Web->ReplyStatus=e_ReplyStatus_GatewayTimeout;
+            WS_StartReply(Web);
+            WS_EndReply(Web);
+            WS_CloseConnection(Web);
+        break;
+        case e_WSProxyResult_Failed:
+        case e_WSProxyResultMAX:
+        default:
+            WS_CloseConnection(Web);
+        break;
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_StopProxy
+ *
+ * SYNOPSIS:
+ *    static void WS_StopProxy(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function gives back the upstream connection (if this connection
+ *    has one).  It's kept for the next request if the response was all
+ *    passed on, otherwise it's closed.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_StartProxy(), WSProxy_Release()
+ ******************************************************************************/
+static void WS_StopProxy(struct WebServer *Web)
+{
+    if(Web->Proxy==NULL)
+        return;
+
+    WSProxy_Release(Web->Proxy);
+    Web->Proxy=NULL;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_StopWebSocket
+ *
+ * SYNOPSIS:
+ *    static void WS_StopWebSocket(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function frees the WebSocket (if this connection is one).  The
+ *    page's callback gets e_WSWebSocketEvent_Close if it hasn't already.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_AcceptWebSocket(), WSWebSocket_Release()
+ ******************************************************************************/
+static void WS_StopWebSocket(struct WebServer *Web)
+{
+    if(Web->WebSocket==NULL)
+        return;
+
+    WSWebSocket_Release(Web->WebSocket);
+    Web->WebSocket=NULL;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_StopEvents
+ *
+ * SYNOPSIS:
+ *    static void WS_StopEvents(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function unsubscribes the connection from its event channel (if
+ *    it's subscribed to one).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_SubscribeEvents(), WSEvents_Release()
+ ******************************************************************************/
+static void WS_StopEvents(struct WebServer *Web)
+{
+    if(Web->Events==NULL)
+        return;
+
+    WSEvents_Release(Web->Events);
+    Web->Events=NULL;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_StatusFromCode
+ *
+ * SYNOPSIS:
+ *    static e_ReplyStatusType WS_StatusFromCode(int Code);
+ *
+ * PARAMETERS:
+ *    Code [I] -- The HTTP status code (200, 404, ...)
+ *
+ * FUNCTION:
+ *    This function finds the reply status for a status code an upstream
+ *    server answered with.  Codes we don't have are mapped to the first
+ *    status we have in the same class (a 418 is counted as a 400).
+ *
+ * RETURNS:
+ *    The reply status to count the request under.
+ *
+ * SEE ALSO:
+ *    WS_RunProxy()
+ ******************************************************************************/
+static e_ReplyStatusType WS_StatusFromCode(int Code)
+{
+    e_ReplyStatusType Status;
+    e_ReplyStatusType SameClass;
+    int StatusCode;
+
+    SameClass=e_ReplyStatusMAX;
+    for(Status=0;Status<e_ReplyStatusMAX;Status++)
+    {
+        StatusCode=atoi(&m_StatusLines[Status].Head[9]);
+        if(StatusCode==Code)
+            return Status;
+        if(StatusCode/100==Code/100 && SameClass==e_ReplyStatusMAX)
+            SameClass=Status;
+    }
+    return SameClass;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_EndRequestMetrics
+ *
+ * SYNOPSIS:
+ *    static void WS_EndRequestMetrics(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function records the metrics for the request that just finished
+ *    (or was hung up on) and clears them for the next one.  It does nothing
+ *    if no request was started.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSMetrics_CountRequest()
+ ******************************************************************************/
+static void WS_EndRequestMetrics(struct WebServer *Web)
+{
+    if(Web->MetricsStart==0)
+        return;
+
+    WSMetrics_RecordPhase(e_WSMetricPhase_Handler,Web->HandlerNS);
+    WSMetrics_RecordPhase(e_WSMetricPhase_Write,Web->WriteNS);
+    WSMetrics_RecordPhase(e_WSMetricPhase_Total,
+            WS_NOW()-Web->MetricsStart);
+    WSMetrics_CountRequest(Web->PageProp.Route,Web->ReplyStatus);
+
+    Web->MetricsStart=0;
+    Web->HandlerNS=0;
+    Web->WriteNS=0;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_HandlerStart
+ *
+ * SYNOPSIS:
+ *    static void WS_HandlerStart(struct WebServer *Web,
+ *          struct WSHandlerMark *Mark);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Mark [O] -- Filled in with what WS_HandlerDone() needs
+ *
+ * FUNCTION:
+ *    This function is called before calling into the page (FS_SendFile(),
+ *    a generator, or a deferred completion) to time how long the page
+ *    takes.  Call WS_HandlerDone() when the page returns.
+ *
+ *    Time spent writing to the socket is taken out (it's counted as the
+ *    write phase).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_HandlerDone()
+ ******************************************************************************/
+static void WS_HandlerStart(struct WebServer *Web,struct WSHandlerMark *Mark)
+{
+    Mark->Start=WS_NOW();
+    Mark->WriteNS=Web->WriteNS;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_HandlerDone
+ *
+ * SYNOPSIS:
+ *    static void WS_HandlerDone(struct WebServer *Web,
+ *          struct WSHandlerMark *Mark);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Mark [I] -- What WS_HandlerStart() filled in
+ *
+ * FUNCTION:
+ *    This function adds the time since WS_HandlerStart() to the time spent
+ *    in the page for this request, and records it in the trace.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_HandlerStart()
+ ******************************************************************************/
+static void WS_HandlerDone(struct WebServer *Web,struct WSHandlerMark *Mark)
+{
+    uint64_t Now;
+
+    Now=WS_NOW();
+    Web->HandlerNS+=Now-Mark->Start-(Web->WriteNS-Mark->WriteNS);
+    WSTrace_Span(e_WSTrace_Handler,WS_CON_INDEX(Web),Mark->Start,
+            Now-Mark->Start,0);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_ConnectionsInUse
+ *
+ * SYNOPSIS:
+ *    static int WS_ConnectionsInUse(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function counts the connections that are in use (connected or
+ *    still finishing a reply).
+ *
+ * RETURNS:
+ *    The number of connections in use.
+ *
+ * SEE ALSO:
+ *    WS_ShedConnections()
+ ******************************************************************************/
+static int WS_ConnectionsInUse(void)
+{
+    int InUse;
+    int con;
+
+    InUse=0;
+    for(con=0;con<WS_OPT_MAX_CONNECTIONS;con++)
+        if(m_WebServers[con].State!=e_WebServerState_Closed)
+            InUse++;
+
+    return InUse;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_StartPhase
+ *
+ * SYNOPSIS:
+ *    static void WS_StartPhase(struct WebServer *Web,uint32_t Bytes);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *    Bytes [I] -- The number of bytes of this phase we already have
+ *
+ * FUNCTION:
+ *    This function starts the clock on the next part of the request coming
+ *    in (the request line + headers, or the body).  WS_PastDeadline() checks
+ *    how long it's taking.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_PastDeadline()
+ ******************************************************************************/
+static void WS_StartPhase(struct WebServer *Web,uint32_t Bytes)
+{
+    Web->PhaseStarted=true;
+    Web->PhaseStart=ReadElapsedClock();
+    Web->PhaseBytes=Bytes;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    WS_PastDeadline
+ *
+ * SYNOPSIS:
+ *    static bool WS_PastDeadline(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function checks if a client is sending the request too slowly.
+ *    The request line + headers have to be in within WS_OPT_HEADER_TIMEOUT
+ *    seconds of the first byte, the body within WS_OPT_BODY_TIMEOUT seconds
+ *    of the end of the headers, and after the first second both have to
+ *    keep coming in at WS_OPT_MIN_BYTES_PER_SEC.
+ *
+ *    Unlike the idle timeout these don't get pushed back every time a byte
+ *    comes in, so a client can't hold a connection by sending a byte every
+ *    few seconds.
+ *
+ * RETURNS:
+ *    true -- The client is too slow and should be hung up on (it's been
+ *            counted in the metrics)
+ *    false -- The client is ok (or isn't sending a request)
+ *
+ * SEE ALSO:
+ *    WS_StartPhase()
+ ******************************************************************************/
+static bool WS_PastDeadline(struct WebServer *Web)
+{
+    t_ElapsedTime Elapsed;
+
+    if(!Web->PhaseStarted)
+        return false;
 
-    ArgCount=0;
-    Pos=ArgsStart;
-    /* We need to break up the args first */
-    while(*Pos!=0)
+    Elapsed=ReadElapsedClock()-Web->PhaseStart;
+    if(Web->State==e_WebServerState_Body)
     {
-        if(*Pos=='&')
+        if(Elapsed>=WS_OPT_BODY_TIMEOUT)
         {
-            *Pos=0;
-            ArgCount++;
+            WSMetrics_Count(e_WSMetricCounter_TimeoutBody,1);
+            return true;
         }
-        Pos++;
     }
-    if(Pos!=ArgsStart)
-        ArgCount++;
-
-    StorageStart=Web->ArgsStorage;
-    Write=StorageStart;
-    StartOfLastWrite=Write;
-
-    /* See if this arg is in the list of get args */
-    if(Web->PageProp.Gets!=NULL)
+    else if(Elapsed>=WS_OPT_HEADER_TIMEOUT)
     {
-        for(g=0;Web->PageProp.Gets[g]!=0;g++)
-        {
-            /* See if this arg is in the args we had sent in */
-            arg=0;
-            Pos=ArgsStart;
-            Start=Pos;
-            while(arg<ArgCount)
-            {
-                if(*Pos=='=')
-                {
-                    /* At the value */
-                    Len=strlen(Web->PageProp.Gets[g]);
-                    if(Len==Pos-Start &&
-                            strncmp(Start,Web->PageProp.Gets[g],Len)==0)
-                    {
-                        /* Found this arg */
-                        Pos++;  // Move past the '='
-                        break;
-                    }
-                }
-                if(*Pos==0)
-                {
-                    /* End of the arg, check it */
-                    arg++;
-                    Start=Pos+1;
-                }
-                Pos++;
-            }
-            Found=false;
-            if(arg<ArgCount)
-                Found=true;
-
-            /* Store if we found it */
-            if((Write-StorageStart)>=WS_OPT_ARG_MEMORY_SIZE)
-            {
-                Web->ReplyStatus=e_ReplyStatus_InsufficientStorage;
-                return;
-            }
-            *Write++=Found?'Y':'N';
-
-            if(Found)
-            {
-                /* See if we have space for the value */
-                while(*Pos!=0)
-                {
-                    if((Write-StorageStart)>=WS_OPT_ARG_MEMORY_SIZE)
-                    {
-                        Web->ReplyStatus=e_ReplyStatus_InsufficientStorage;
-                        return;
-                    }
-                    *Write++=*Pos++;
-                }
-                if((Write-StorageStart)>=WS_OPT_ARG_MEMORY_SIZE)
-                {
-                    Web->ReplyStatus=e_ReplyStatus_InsufficientStorage;
-                    return;
-                }
-                *Write++=0;
-
-                /* Decode in place, and then use the end of the string as
-                   where to continue writing new args (if the string shrinks
-                   use the new end) */
-                Write=WS_URLDecodeInPlace(StartOfLastWrite);
-            }
-            StartOfLastWrite=Write;
-        }
+        WSMetrics_Count(e_WSMetricCounter_TimeoutHeaders,1);
+        return true;
     }
 
-    /* Fill in the cookies and post vars with all not found (so the
-       cookie/post code doesn't have to handle the unknown state) */
-    if(Web->PageProp.Cookies!=NULL)
+    /* The clock only counts whole seconds so the first one is free */
+    if(Elapsed>1 && Web->PhaseBytes<(Elapsed-1)*WS_OPT_MIN_BYTES_PER_SEC)
     {
-        for(g=0;Web->PageProp.Cookies[g]!=0;g++)
-        {
-            if((Write-StorageStart)>=WS_OPT_ARG_MEMORY_SIZE)
-            {
-                Web->ReplyStatus=e_ReplyStatus_InsufficientStorage;
-                return;
-            }
-            *Write++='N';
-        }
+        WSMetrics_Count(e_WSMetricCounter_TimeoutSlow,1);
+        return true;
     }
 
-    if(Web->PageProp.Posts!=NULL)
-    {
-        for(g=0;Web->PageProp.Posts[g]!=0;g++)
-        {
-            if((Write-StorageStart)>=WS_OPT_ARG_MEMORY_SIZE)
-            {
-                Web->ReplyStatus=e_ReplyStatus_InsufficientStorage;
-                return;
-            }
-            *Write++='N';
-        }
-    }
-//DEBUG_PrintStoredArgs(Web);
+    return false;
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_ProcessCookieVars
+ *    WS_RunHandoff
  *
  * SYNOPSIS:
- *    static void WS_ProcessCookieVars(struct WebServer *Web);
+ *    static void WS_RunHandoff(void);
  *
  * PARAMETERS:
- *    Web [I] -- The web server context to work on
+ *    NONE
  *
  * FUNCTION:
- *    This function processes a "Cookie: " header.  It will set the cookies
- *    value in 'Web->ArgsStorage' if any of the sent in cookies match the
- *    list of supported cookies.
+ *    This function checks if a new copy of the server has connected to the
+ *    handoff socket (WS_StartHandoff()).  If it has it's sent the listening
+ *    sockets and the idle keep-alive connections (WS_OPT_HANDOFF_IDLE) and
+ *    we close our copies of them.
  *
- *    See WS_ProcessGetVars() for a description of how 'ArgsStorage' works.
+ *    WebSockets can't be handed off (we have their state), they are sent a
+ *    close (going away) so the clients reconnect to the new server.  Event
+ *    streams are hung up on for the same reason (browsers reconnect to
+ *    them on their own).
  *
  * RETURNS:
  *    NONE
  *
  * SEE ALSO:
- *    
+ *    WS_StartHandoff(), WS_TakeOver()
  ******************************************************************************/
-static void WS_ProcessCookieVars(struct WebServer *Web)
+static void WS_RunHandoff(void)
 {
-    int g;
-    char *ArgsStart;
-    int ArgCount;
-    char *Pos;
-    char *StorageStart;
-    char *EndOfStorage;
-    char *Write;
-    int arg;
-    char *Start;
-    int Len;
-
-    /* Break the header line up into each cookie */
-    /* Find the end of the Cookie: string */
-    ArgsStart=Web->LineBuff;
-    while(*ArgsStart!=':' && *ArgsStart!=0)
-        ArgsStart++;
-
-    /* Skip the : */
-    if(*ArgsStart==':')
-        ArgsStart++;
-
-    /* Skip the space (There should be a space, but we handle if there isn't) */
-    if(*ArgsStart==' ')
-        ArgsStart++;
+    t_ConSocketHandle Handles[WS_MAX_LISTENERS+WS_OPT_MAX_CONNECTIONS];
+    int Idle[WS_OPT_MAX_CONNECTIONS];
+    struct SocketCon Con;
+    struct WebServer *Web;
+    int Count;
+    int IdleCount;
+    int con;
+    int r;
 
-    /* See if there are any cookies */
-    if(*ArgsStart==0)
+    SocketsCon_InitSockCon(&Con);
+    if(!SocketsCon_Accept(&m_HandoffSocket,&Con))
         return;
 
-    ArgCount=0;
-    Pos=ArgsStart;
-    /* We need to break up the args first */
-    while(*Pos!=0)
+    Count=0;
+    for(r=0;r<m_ListenerCount;r++)
+        if(SocketsCon_GetSocketHandle(&m_Listeners[r],&Handles[Count]))
+            Count++;
+    if(Count==0)
     {
-        if(*Pos==';')
-        {
-            *Pos=0;
-            ArgCount++;
-        }
-        Pos++;
+        SocketsCon_Close(&Con);
+        return;
     }
-    if(Pos!=ArgsStart)
-        ArgCount++;
-
-    /* Find the end of the GET vars (where the cookies start) */
-    StorageStart=Web->ArgsStorage;
-    Write=StorageStart;
 
-    if(Web->PageProp.Gets!=NULL)
+    /* Connections waiting for their next request can go too (they have
+       nothing buffered with us).  TLS connections stay, their session
+       can't be moved. */
+    IdleCount=0;
+#if WS_OPT_HANDOFF_IDLE
+    for(con=0;con<WS_OPT_MAX_CONNECTIONS;con++)
     {
-        /* Skip all the GETS args */
-        Write=WS_SkipStorageArgs(Write,Web->PageProp.Gets);
+        Web=&m_WebServers[con];
+        if(SocketsCon_IsConnected(&Web->Con) &&
+                !SocketsCon_IsTLS(&Web->Con) &&
+                Web->State==e_WebServerState_Request &&
+                !Web->PhaseStarted && Web->LineBuffPos==0 &&
+                SocketsCon_GetSocketHandle(&Web->Con,&Handles[Count+IdleCount]))
+        {
+            Idle[IdleCount++]=con;
+        }
     }
+#endif
 
-    /* Find the end of the 'ArgsStorage' storage */
-    EndOfStorage=Write; // Already skipped the GETS
-    if(Web->PageProp.Cookies!=NULL)
+    if(!SocketsCon_SendHandles(&Con,Handles,Count+IdleCount))
     {
-        /* Skip all the COOKIES args */
-        EndOfStorage=WS_SkipStorageArgs(EndOfStorage,Web->PageProp.Cookies);
+        SocketsCon_Close(&Con);
+        return;
     }
-    if(Web->PageProp.Posts!=NULL)
+    SocketsCon_Close(&Con);
+
+    /* The new server has them now.  Closing our copies doesn't close the
+       sockets. */
+    for(r=0;r<m_ListenerCount;r++)
+        SocketsCon_Close(&m_Listeners[r]);
+    m_ListenerCount=0;
+    for(r=0;r<IdleCount;r++)
     {
-        /* Skip all the POSTS args */
-        EndOfStorage=WS_SkipStorageArgs(EndOfStorage,Web->PageProp.Posts);
+        Web=&m_WebServers[Idle[r]];
+        WSTrace_Event(e_WSTrace_Close,Idle[r],0);
+        SocketsCon_Close(&Web->Con);
+        Web->State=e_WebServerState_Closed;
     }
 
-    /* See if this arg is in the list of cookie args */
-    if(Web->PageProp.Cookies!=NULL)
+    /* WebSocket and event stream clients are told to reconnect (to the
+       new server) */
+    for(con=0;con<WS_OPT_MAX_CONNECTIONS;con++)
     {
-        for(g=0;Web->PageProp.Cookies[g]!=0;g++)
-        {
-            /* See if this arg is in the args we had sent in */
-            arg=0;
-            Pos=ArgsStart;
-            Start=Pos;
-            /* Skip any spaces at the start */
-            while(*Start==' ')
-                Start++;
-            while(arg<ArgCount)
-            {
-                if(*Pos=='=')
-                {
-                    /* At the value */
-                    Len=strlen(Web->PageProp.Cookies[g]);
-                    /* Skip any spaces at the start of the name */
-                    while(*Start==' ')
-                        Start++;
-                    if(Len==Pos-Start &&
-                            strncmp(Start,Web->PageProp.Cookies[g],Len)==0)
-                    {
-                        /* Found this arg */
-                        Pos++;  // Move past the '='
-                        break;
-                    }
-                }
-                if(*Pos==0)
-                {
-                    /* End of the arg */
-                    arg++;
-                    Start=Pos+1;
-                }
-                Pos++;
-            }
-            /* Did we find it? */
-            if(arg<ArgCount)
-            {
-                /* Yep */
-                Len=strlen(Pos);
-
-                /* See if we have already seen this one */
-                if(*Write=='Y')
-                {
-                    /* Yep, skip */
-                    while(*Write++!=0)
-                        ;
-                }
-                else
-                {
-                    /* Make sure we have space */
-                    if((Write-StorageStart)+Len>=WS_OPT_ARG_MEMORY_SIZE)
-                    {
-                        Web->ReplyStatus=e_ReplyStatus_InsufficientStorage;
-                        return;
-                    }
-                    WS_InsertCopy(Write+1,EndOfStorage,Pos,Len+1);  // +1 for the end of the string
-                    *Write++='Y';
-                    Write+=Len+1;   // +1 for the end of the string
-                    EndOfStorage+=Len+1;    // +1 for the end of the string
-                }
-            }
-            else
-            {
-                /* Skip the 'N' we already have */
-                Write++;
-            }
-        }
+        if(m_WebServers[con].State==e_WebServerState_WebSocket)
+            WSWebSocket_Close(&m_WebServers[con],WSWEBSOCKET_CLOSE_GOING_AWAY);
+        if(m_WebServers[con].State==e_WebServerState_Events)
+            WS_CloseConnection(&m_WebServers[con]);
     }
 
-//DEBUG_PrintStoredArgs(Web);
+    /* The new server listens on the handoff socket now */
+    SocketsCon_Close(&m_HandoffSocket);
+
+    m_HandedOff=true;
+    m_HandoffTime=ReadElapsedClock();
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_StartProcessingPOSTVar
+ *    WS_NewListener
  *
  * SYNOPSIS:
- *    static void WS_StartProcessingPOSTVar(struct WebServer *Web);
+ *    static struct SocketCon *WS_NewListener(void);
  *
  * PARAMETERS:
- *    Web [I] -- The web server context to work on
+ *    NONE
  *
  * FUNCTION:
- *    This function sets up for processing of a POST var.  It will find the
- *    var in the list of POST vars and setup Web->PostWritePos to the
- *    pos where the POST value should be written, and Web->PostEndOfStorage
- *    to the end of arg storage.
+ *    This function gets the next free listening socket.  It isn't counted
+ *    as in use until the caller adds 1 to 'm_ListenerCount' (so if
+ *    listening fails it's just left).
  *
  * RETURNS:
- *    NONE
+ *    The listening socket to use or NULL if we are already listening on
+ *    WS_MAX_LISTENERS sockets.
  *
  * SEE ALSO:
- *    
+ *    WS_Start(), WS_StartUnix()
  ******************************************************************************/
-static void WS_StartProcessingPOSTVar(struct WebServer *Web)
+static struct SocketCon *WS_NewListener(void)
 {
-    char *Write;
-    char *StorageStart;
-    int p;
-    unsigned int Len;
-
-    StorageStart=Web->ArgsStorage;
-    Write=StorageStart;
-    Web->PostWritePos=NULL;
-
-    if(Web->PageProp.Gets!=NULL)
-    {
-        /* Skip all the GETS args */
-        Write=WS_SkipStorageArgs(Write,Web->PageProp.Gets);
-    }
-    if(Web->PageProp.Cookies!=NULL)
-    {
-        /* Skip all the COOKIE args */
-        Write=WS_SkipStorageArgs(Write,Web->PageProp.Cookies);
-    }
-
-    /* See if this arg is in the list of get args */
-    if(Web->PageProp.Posts!=NULL)
-    {
-        /* Skip all the POST args (this will be the end of storage) */
-        Web->PostEndOfStorage=WS_SkipStorageArgs(Write,Web->PageProp.Posts);
+    struct SocketCon *Listener;
 
-        for(p=0;Web->PageProp.Posts[p]!=0;p++)
-        {
-            /* See if this arg is in the args we had sent in */
-            Len=strlen(Web->LineBuff);
-            if(strncmp(Web->LineBuff,Web->PageProp.Posts[p],Len)==0 &&
-                    Web->PageProp.Posts[p][Len]==0)
-            {
-                /* Found this arg */
-                *Write++='Y';
+    if(m_ListenerCount>=WS_MAX_LISTENERS)
+        return NULL;
 
-                Web->PostWritePos=Write;
-                break;
-            }
-            else
-            {
-                /* Skip this arg */
-                if(*Write=='Y')
-                {
-                    while(*Write!=0)
-                        Write++;
-                }
-                Write++;    // Skip the N or the \0
-            }
-        }
-    }
+    Listener=&m_Listeners[m_ListenerCount];
+    SocketsCon_InitSockCon(Listener);
+    return Listener;
 }
 
 /*******************************************************************************
  * NAME:
- *    WS_CopyLineBuffer2POSTVar
+ *    WS_AcceptConnection
  *
  * SYNOPSIS:
- *    static bool WS_CopyLineBuffer2POSTVar(struct WebServer *Web);
+ *    static bool WS_AcceptConnection(struct SocketCon *NewCon);
  *
  * PARAMETERS:
- *    Web [I] -- The web server context to work on
+ *    NewCon [O] -- The connection to fill in
  *
  * FUNCTION:
- *    This function copies what is in the line buffer to the POST var storage.
+ *    This function accepts a new connection from any of the sockets we are
+ *    listening on.  TCP and unix domain connections are handled the same
+ *    after this.
  *
- *    You have to have started this with WS_StartProcessingPOSTVar() to setup
- *    the needed vars.
+ *    The listening sockets take turns going first so a busy one can't keep
+ *    the others waiting.
  *
  * RETURNS:
- *    true -- All ok
- *    false -- There wasn't enough room to store this var.
+ *    true -- We got a new connection
+ *    false -- No new connections
  *
  * SEE ALSO:
- *    WS_StartProcessingPOSTVar()
+ *    SocketsCon_Accept()
  ******************************************************************************/
-static bool WS_CopyLineBuffer2POSTVar(struct WebServer *Web)
+static bool WS_AcceptConnection(struct SocketCon *NewCon)
 {
-    char EscBuff[3];
-    char *Pos;
-    char *EndOfLineBuff;
-    int Len;
-    char Zero;
-
-    /* Make the line buffer in to a string */
-    Web->LineBuff[Web->LineBuffPos]=0;
+    static int Next;
+    struct SocketCon *Listener;
+    int r;
 
-//{
-//printf("\33[1;32m");
-//Pos=Web->LineBuff;
-//while(*Pos!=0)
-//    printf("%c",*Pos++);
-//printf("\33[0m\r\n");
-//}
-    if(Web->PostWritePos!=NULL)
+    for(r=0;r<m_ListenerCount;r++)
     {
-        /* First see we where in the middle of a % esc seq */
-        EscBuff[0]=0;
-        EscBuff[1]=0;
-        EscBuff[2]=0;
-        if(Web->LineBuffPos>=2)
+        Listener=&m_Listeners[(Next+r)%m_ListenerCount];
+        if(SocketsCon_Accept(Listener,NewCon))
         {
-            /* Ok, move the esc seq to 'EscBuff' and kill it out of the main
-               buffer */
-            Pos=&Web->LineBuff[Web->LineBuffPos-1];
-            if(*Pos=='%')
-            {
-                EscBuff[0]='%';
-                *Pos=0;
-                Web->LineBuffPos--;
-            }
-            else
-            {
-                Pos--;
-                if(*Pos=='%')
-                {
-                    EscBuff[0]='%';
-                    EscBuff[1]=*(Pos+1);
-                    *Pos=0;
-                    Web->LineBuffPos-=2;
-                }
-            }
+            Next=(Next+r+1)%m_ListenerCount;
+            return true;
         }
 
-        /* Decode the line buffer (we have to handle the + thing before we
-           decode it) */
-        Pos=Web->LineBuff;
-        while(*Pos!=0)
+        if(SocketsCon_GetErrorCode(Listener)!=e_ConnectError_AllOk)
         {
-            if(*Pos=='+')
-                *Pos=' ';
-            Pos++;
+            /* We had an error accepting the connection, the listening
+               socket it now closed */
+            WSMetrics_Count(e_WSMetricCounter_AcceptFailed,1);
         }
-        EndOfLineBuff=WS_URLDecodeInPlace(Web->LineBuff);
+    }
+    return false;
+}
 
-        Len=EndOfLineBuff-Web->LineBuff;
+#if WS_OPT_SHED_LOAD
+/*******************************************************************************
+ * NAME:
+ *    WS_ShedConnections
+ *
+ * SYNOPSIS:
+ *    static void WS_ShedConnections(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function accepts the connections waiting on the listening socket,
+ *    sends each one a 503 with a Retry-After: (m_ShedReply), and hangs up.
+ *    It is called when we are at WS_OPT_ADMIT_LIMIT so clients get a quick
+ *    answer instead of waiting in the backlog for a connection to free up.
+ *
+ *    At most WS_OPT_MAX_CONNECTIONS are shed per tick so a flood of
+ *    connections can't stop us from running the ones we have.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WS_Tick()
+ ******************************************************************************/
+static void WS_ShedConnections(void)
+{
+    struct SocketCon Con;
+    char Junk[1024];
+    int r;
 
-        /* Make sure we can fit this */
-        if(Web->PostEndOfStorage+Len>Web->ArgsStorage+WS_OPT_ARG_MEMORY_SIZE)
-        {
-            /* It's not going to fit, clip it and return insufficient storage */
-            Zero=0;
-            WS_InsertCopy(Web->PostWritePos,Web->PostEndOfStorage,&Zero,1);
-            Web->ReplyStatus=e_ReplyStatus_InsufficientStorage;
-            return false;
-        }
+    for(r=0;r<WS_OPT_MAX_CONNECTIONS;r++)
+    {
+        SocketsCon_InitSockCon(&Con);
+        if(!WS_AcceptConnection(&Con))
+            break;
 
-        WS_InsertCopy(Web->PostWritePos,Web->PostEndOfStorage,Web->LineBuff,
-                Len);
-        Web->PostEndOfStorage+=Len;
+        /* (TLS clients haven't done the handshake yet so they just get
+           hung up on) */
+        SocketsCon_Write(&Con,m_ShedReply,sizeof(m_ShedReply)-1);
 
-        /* Move to the end of what we just inserted */
-        Web->PostWritePos+=Len-1;
+        /* Read what the client has already sent.  Closing with unread data
+           sends a reset, and that can throw away the 503 before the client
+           reads it. */
+        SocketsCon_Read(&Con,Junk,sizeof(Junk));
 
-        /* Ok, if we where in the middle of an esc seq, but it in the buffer */
-        strcpy(Web->LineBuff,EscBuff);
-        Web->LineBuffPos=strlen(EscBuff);
-    }
-    else
-    {
-        Web->LineBuffPos=0;
+        SocketsCon_Close(&Con);
+        WSMetrics_Count(e_WSMetricCounter_Shed,1);
     }
-//DEBUG_PrintStoredArgs(Web);
-    return true;
 }
+#endif
+
+#if WS_OPT_METRICS
+/*******************************************************************************
+ * NAME:
+ *    WS_SendMetrics
+ *
+ * SYNOPSIS:
+ *    static void WS_SendMetrics(struct WebServer *Web);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web server context to work on
+ *
+ * FUNCTION:
+ *    This function sends the metrics page (WS_OPT_METRICS_PATH).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSMetrics_WritePage()
+ ******************************************************************************/
+static void WS_SendMetrics(struct WebServer *Web)
+{
+    struct WSMetricsPool Pool;
+    int r;
+
+    memset(&Pool,0x00,sizeof(Pool));
+    for(r=0;r<WS_OPT_MAX_CONNECTIONS;r++)
+        Pool.States[m_WebServers[r].State]++;
+    Pool.MaxConnections=WS_OPT_MAX_CONNECTIONS;
+#if WS_OPT_OFFLOAD_THREADS>0
+    Pool.Workers=m_OffloadThreadCount;
+    Pool.WorkersBusy=atomic_load(&m_OffloadBusy);
+#endif
+
+    WSMetrics_WritePage(Web,&Pool);
+}
+#endif
 
 //static void DEBUG_PrintStoredArgs(struct WebServer *Web)
 //{
+//    static const char *TypeNames[e_WSArgTypeMAX]={"GET","COOKIE","POST"};
+//    const char **ArgsList;
+//    const char *Value;
 //    char *StorageStart;
 //    int r;
 //    int rr;
 //    char c;
-//    char *Write;
+//    int Type;
 //    int g;
 //
 //    StorageStart=Web->ArgsStorage;
@@ -2451,58 +5818,16 @@ static bool WS_CopyLineBuffer2POSTVar(struct WebServer *Web)
 //        }
 //    }
 //
-//    Write=StorageStart;
-//    if(Web->PageProp.Gets!=NULL)
-//    {
-//        for(g=0;Web->PageProp.Gets[g]!=0;g++)
-//        {
-//            if(*Write=='Y')
-//            {
-//                printf("GET %s=\"%s\"\r\n",Web->PageProp.Gets[g],Write+1);
-//                while(*Write!=0)
-//                    Write++;
-//            }
-//            else
-//            {
-//                printf("GET %s not found\r\n",Web->PageProp.Gets[g]);
-//            }
-//            Write++;
-//        }
-//    }
-//
-//    if(Web->PageProp.Cookies!=NULL)
-//    {
-//        for(g=0;Web->PageProp.Cookies[g]!=0;g++)
-//        {
-//            if(*Write=='Y')
-//            {
-//                printf("COOKIE %s=\"%s\"\r\n",Web->PageProp.Cookies[g],Write+1);
-//                while(*Write!=0)
-//                    Write++;
-//            }
-//            else
-//            {
-//                printf("COOKIE %s not found\r\n",Web->PageProp.Cookies[g]);
-//            }
-//            Write++;
-//        }
-//    }
-//
-//    if(Web->PageProp.Posts!=NULL)
+//    for(Type=0;Type<e_WSArgTypeMAX;Type++)
 //    {
-//        for(g=0;Web->PageProp.Posts[g]!=0;g++)
+//        ArgsList=WS_GetArgsList(Web,Type);
+//        for(g=0;g<Web->ArgCount[Type];g++)
 //        {
-//            if(*Write=='Y')
-//            {
-//                printf("POST %s=\"%s\"\r\n",Web->PageProp.Posts[g],Write+1);
-//                while(*Write!=0)
-//                    Write++;
-//            }
+//            Value=WS_GetArgByIndex(Web,Type,g);
+//            if(Value!=NULL)
+//                printf("%s %s=\"%s\"\r\n",TypeNames[Type],ArgsList[g],Value);
 //            else
-//            {
-//                printf("POST %s not found\r\n",Web->PageProp.Posts[g]);
-//            }
-//            Write++;
+//                printf("%s %s not found\r\n",TypeNames[Type],ArgsList[g]);
 //        }
 //    }
 //}
@@ -41,6 +41,14 @@
 #include <time.h>
 
 /***  DEFINES                          ***/
+#define WS_ARG_NOT_SET                      0xFFFF  // Offset used in the arg index for args that where not sent
+#define WS_CHUNK_HEAD_SIZE                  10      // Room for the chunk size line in front of the chunk buffer ("FFFFFFFF\r\n")
+#define WS_CHUNK_TAIL_SIZE                  7       // Room for the \r\n after the chunk and the last chunk ("0\r\n\r\n")
+#define WS_DEFER_INVALID                    0       // A t_WSDeferHandle that is never valid
+#define WS_MAX_LISTENERS                    4       // The most sockets we can listen on at once (WS_Start(), WS_StartUnix(), WS_StartOnHandle())
+#define WS_WEBSOCKET_KEY_LEN                24      // The length of a Sec-WebSocket-Key (16 bytes in base64)
+#define WS_LAST_EVENT_ID_LEN                23      // The longest Last-Event-ID we keep (longer ones are ignored)
+#define WS_READ_BUFFER_SIZE                 100     // How many bytes WS_Tick() reads from a connection at a time
 
 /***  MACROS                           ***/
 
@@ -62,6 +70,9 @@ typedef enum
     e_ReplyStatus_NotImplemented,               // 501
     e_ReplyStatus_HTTPVersionNotSupported,      // 505
     e_ReplyStatus_InsufficientStorage,          // 507
+    e_ReplyStatus_SwitchingProtocols,           // 101
+    e_ReplyStatus_GatewayTimeout,               // 504
+    e_ReplyStatus_BadGateway,                   // 502
     e_ReplyStatusMAX
 } e_ReplyStatusType;
 
@@ -72,9 +83,23 @@ typedef enum
     e_WebServerState_Headers,
     e_WebServerState_Body,
     e_WebServerState_Response,
+    e_WebServerState_Generating,
+    e_WebServerState_Deferred,
+    e_WebServerState_Offloaded,
+    e_WebServerState_Proxying,      // Passing the request to an upstream server (PageProp.Upstream)
+    e_WebServerState_WebSocket,     // Upgraded to a WebSocket (WS_AcceptWebSocket())
+    e_WebServerState_Events,        // Sending server-sent events (WS_SubscribeEvents())
     e_WebServerStateMAX
 } e_WebServerStateType;
 
+typedef enum
+{
+    e_WSWebSocketEvent_Text,    // A text message came in ('Data' has a \0 after it)
+    e_WSWebSocketEvent_Binary,  // A binary message came in
+    e_WSWebSocketEvent_Close,   // The WebSocket is gone (this is the last event)
+    e_WSWebSocketEventMAX
+} e_WSWebSocketEventType;
+
 typedef enum
 {
     e_ReqType_Get,
@@ -85,6 +110,13 @@ typedef enum
 struct WSPageProp
 {
     bool DynamicFile;
+    /* Run FS_SendFile() on a worker thread.  The page can't call
+       WS_StartGenerator(), WS_DeferReply(), WS_AcceptWebSocket() or
+       WS_SubscribeEvents() (they return false) and its reply is held in
+       memory, up to WS_OPT_OFFLOAD_OUTPUT_MAX bytes, until it returns. */
+    bool Offload;
+    const char *Route;      // The name the page is counted under in the metrics (NULL="other")
+    const char *Upstream;   // Pass the request on to this server ("host:port" or "unix:/path", NULL=handle it here)
     const char **Cookies;
     const char **Gets;
     const char **Posts;
@@ -99,14 +131,41 @@ typedef enum
     e_WSPostStateMAX
 } e_WSPostStateType;
 
+typedef enum
+{
+    e_WSArgType_Get,
+    e_WSArgType_Cookie,
+    e_WSArgType_Post,
+    e_WSArgTypeMAX
+} e_WSArgTypeType;
+
+struct WSArgIndex
+{
+    uint16_t Offset;    // Where the value starts in 'ArgsStorage' (WS_ARG_NOT_SET if not sent)
+    uint16_t Len;       // The length of the value (not including the \0)
+};
+
 typedef uint32_t t_ElapsedTime;   // Time to be used for elapsed time
 
+struct WebServer;
+struct WSProxyCon;
+struct WSWebSocket;
+struct WSEventsSub;
+typedef bool (*t_WSGeneratorFn)(struct WebServer *Web,void *UserData,
+        int Budget);
+typedef void (*t_WSDeferredFn)(struct WebServer *Web,void *UserData);
+typedef void (*t_WSWebSocketFn)(struct WebServer *Web,void *UserData,
+        e_WSWebSocketEventType Event,const char *Data,int Len);
+typedef uint32_t t_WSDeferHandle;
+
 struct WebServer
 {
     e_WebServerStateType State;
     struct SocketCon Con;
     int LineBuffPos;
     char LineBuff[WS_LINE_BUFFER_SIZE];
+    int PipelinedLen;       // The bytes in 'Pipelined' (0=none)
+    char Pipelined[WS_READ_BUFFER_SIZE];    // The start of a pipelined request read in before the last reply was done
     e_ReqTypeType Req;
     e_ReplyStatusType ReplyStatus;
     bool UserSetReplyStatus;
@@ -115,11 +174,47 @@ struct WebServer
     bool ReplyStarted;
     struct WSPageProp PageProp;
     t_ElapsedTime LastReadTime;
+    bool PhaseStarted;      // A request is coming in ('PhaseStart' is set)
+    t_ElapsedTime PhaseStart;   // When the headers (or body) started coming in
+    uint32_t PhaseBytes;    // The bytes we have read since 'PhaseStart'
     uint32_t BodySize;
     e_WSPostStateType PostState;
-    char *PostWritePos;
-    char *PostEndOfStorage;
+    struct WSArgIndex *PostArg;
+    uint16_t ArgsStorageUsed;
+    uint16_t ArgBase[e_WSArgTypeMAX];
+    uint16_t ArgCount[e_WSArgTypeMAX];
+    struct WSArgIndex ArgIndex[WS_OPT_MAX_ARGS];
+    bool ArgIndexLinear;    // The page lists more than WS_OPT_MAX_ARGS args, 'ArgIndex' entries are handed out as they are sent
+    uint8_t ArgSlotsUsed;   // The 'ArgIndex' entries handed out ('ArgIndexLinear')
+    uint16_t ArgSlot[WS_OPT_MAX_ARGS];  // Which arg each 'ArgIndex' entry is for ('ArgIndexLinear', ArgBase[Type]+Index)
     char ArgsStorage[WS_OPT_ARG_MEMORY_SIZE];
+#if WS_OPT_LAZY_ARGS
+    struct WSArgIndex LazyArgs[e_WSArgTypeMAX];     // Raw query string / cookies waiting to be parsed (in 'LazyArgsStorage')
+    uint16_t LazyArgsUsed;
+    char LazyArgsStorage[WS_OPT_LAZY_ARGS_SIZE];
+#endif
+    t_WSGeneratorFn Generator;
+    void *GeneratorData;
+    uint16_t DeferGeneration;
+    bool CaptureOutput;     // Collect what's sent in 'OutputBuff' instead of writing it (page is running on a worker thread)
+    bool OutputFailed;      // We ran out of memory collecting the output
+    int OutputLen;
+    int OutputSize;
+    char *OutputBuff;
+    void (*BuiltInPage)(struct WebServer *Web);     // Sent instead of calling FS_SendFile()
+    struct WSProxyCon *Proxy;   // The upstream connection the request is being passed on to (NULL=none)
+    bool WebSocketUpgrade;      // The request has "Upgrade: websocket"
+    uint8_t WebSocketVersion;   // The Sec-WebSocket-Version: the request sent (0=none)
+    char WebSocketKey[WS_WEBSOCKET_KEY_LEN+1];  // The Sec-WebSocket-Key: the request sent ("" if none)
+    struct WSWebSocket *WebSocket;  // The frames in and out once the connection is a WebSocket (NULL=it's not)
+    char LastEventID[WS_LAST_EVENT_ID_LEN+1];   // The Last-Event-ID: the request sent ("" if none)
+    struct WSEventsSub *Events; // The channel the connection is subscribed to (NULL=it's not)
+    uint64_t MetricsStart;  // When the first byte of this request came in (0=no request)
+    uint64_t HandlerNS;     // Time spent in the page for this request
+    uint64_t WriteNS;       // Time spent writing to the socket for this request
+    int ChunkBuffUsed;
+    char ChunkBuff[WS_CHUNK_HEAD_SIZE+WS_OPT_CHUNK_BUFFER_SIZE+
+            WS_CHUNK_TAIL_SIZE];
 };
 
 /***  CLASS DEFINITIONS                ***/
@@ -130,23 +225,47 @@ struct WebServer
 void WS_Init(void);
 void WS_Shutdown(void);
 bool WS_Start(uint16_t Port);
+bool WS_StartWithOptions(uint16_t Port,
+        const struct SocketConListenOptions *Options);
+bool WS_StartTLS(uint16_t Port,const char *CertFile,const char *KeyFile);
+bool WS_StartUnix(const char *Path);
+bool WS_StartOnHandle(t_ConSocketHandle Handle);
+bool WS_StartHandoff(const char *Path);
+bool WS_TakeOver(const char *Path);
+bool WS_HandoffDone(void);
 void WS_Tick(void);
 void WS_WriteWhole(struct WebServer *Web,const char *Buffer,int Len);
 void WS_WriteWholeStr(struct WebServer *Web,const char *Buffer);
 void WS_WriteChunk(struct WebServer *Web,const char *Buffer,int Len);
 void WS_WriteChunkStr(struct WebServer *Web,const char *Buffer);
+void WS_Flush(struct WebServer *Web);
+bool WS_StartGenerator(struct WebServer *Web,t_WSGeneratorFn Generator,
+        void *UserData);
+t_WSDeferHandle WS_DeferReply(struct WebServer *Web);
+bool WS_CompleteDeferred(t_WSDeferHandle Handle,t_WSDeferredFn Callback,
+        void *UserData);
+bool WS_IsWebSocketRequest(struct WebServer *Web);
+bool WS_AcceptWebSocket(struct WebServer *Web,t_WSWebSocketFn Callback,
+        void *UserData,uintptr_t Group);
+bool WS_SubscribeEvents(struct WebServer *Web,const char *Channel);
 bool WS_Header(struct WebServer *Web,const char *Header);
 bool WS_Location(struct WebServer *Web,const char *NewURL);
 bool WS_SetHTTPStatusCode(struct WebServer *Web,e_ReplyStatusType Code);
 const char *WS_GET(struct WebServer *Web,const char *Arg);
 const char *WS_COOKIE(struct WebServer *Web,const char *Arg);
 const char *WS_POST(struct WebServer *Web,const char *Arg);
+const char *WS_GETByIndex(struct WebServer *Web,int Index);
+const char *WS_COOKIEByIndex(struct WebServer *Web,int Index);
+const char *WS_POSTByIndex(struct WebServer *Web,int Index);
 bool WS_SetCookie(struct WebServer *Web,const char *Name,const char *Value,
         time_t Expire,const char *Path,const char *Domain,bool Secure,
         bool HttpOnly);
 bool WS_URLEncode(const char *Value,char *OutputBuffer,int MaxLen);
 bool WS_URLDecode(const char *Value,char *Decoded,int MaxLen);
+bool WS_URLDecodeEx(const char *Value,char *Decoded,int MaxLen,
+        bool PlusAsSpace);
 char *WS_URLDecodeInPlace(char *Value);
+char *WS_URLDecodeInPlaceEx(char *Value,bool PlusAsSpace);
 int WS_GetOSSocketHandles(t_ConSocketHandle *Handles);
 
 /* Web server calls these */
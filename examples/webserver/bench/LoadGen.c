@@ -0,0 +1,1219 @@
+/*******************************************************************************
+ * FILENAME: LoadGen.c
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This is a small HTTP load generator for benchmarking the web server.
+ *
+ *    It runs a number of connections from one thread (epoll) and sends
+ *    GET requests on them either as fast as the server answers (closed
+ *    loop) or at a fixed rate (open loop, -r).  In open loop the latency
+ *    is measured from when the request was due to be sent, not when it was
+ *    sent, so a server that falls behind shows it in the latency.
+ *
+ *    If the server's pid is given (-S) it also reports the read()/write()
+ *    syscalls the server made per request (from /proc/<pid>/io) and how
+ *    much the server's RSS grew per connection.
+ *
+ *    Usage:
+ *        loadgen [options]
+ *            -h host     Server address (127.0.0.1)
+ *            -p port     Server port (3000)
+ *            -u path     The page to get (/)
+ *            -c conns    Number of connections (1)
+ *            -s list     Sweep the number of connections (ex: 1,2,4,8,16)
+ *            -d secs     How long to run each test (5)
+ *            -w secs     Warm up time before measuring (1)
+ *            -r rate     Open loop, requests per second over all the
+ *                        connections (0=closed loop)
+ *            -l depth    Pipeline this many requests on each connection (1)
+ *            -C          Don't use keep-alive (a new connection for each
+ *                        request)
+ *            -F          Use TCP fast open for new connections (the
+ *                        request goes in the SYN to a server that has
+ *                        seen us before, most useful with -C)
+ *            -S pid      The server's pid for syscall and RSS numbers
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ ******************************************************************************/
+
+/*** HEADER FILES TO INCLUDE  ***/
+#define _GNU_SOURCE     // memmem()
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*** DEFINES                  ***/
+#define LG_MAX_CONNECTIONS          1024
+#define LG_MAX_PIPELINE             64
+#define LG_RX_BUFF_SIZE             16384
+#define LG_TX_BUFF_SIZE             (LG_MAX_PIPELINE*256)
+#define LG_DUE_QUEUE_SIZE           65536   // Open loop requests waiting for a free connection (power of 2)
+#define LG_TIMEOUT_NS               2000000000ULL   // No reply for this long is an error
+#define LG_MAX_SWEEP                32
+
+/*** MACROS                   ***/
+
+/*** TYPE DEFINITIONS         ***/
+typedef enum
+{
+    e_LGResp_Headers,
+    e_LGResp_Body,              // Content-Length body
+    e_LGResp_ChunkSize,
+    e_LGResp_ChunkData,
+    e_LGResp_ChunkEnd,          // The CRLF after the chunk data
+    e_LGResp_LastCRLF,          // The CRLF after the 0 size chunk
+    e_LGResp_UntilClose,        // No length, body ends when the server hangs up
+    e_LGRespMAX
+} e_LGRespType;
+
+struct LGConn
+{
+    int FD;
+    bool Connecting;
+    bool CloseAfter;            // Server said "Connection: close"
+    int InFlight;
+    uint64_t SentAt[LG_MAX_PIPELINE];
+    int SentHead;
+    int SentTail;
+    uint64_t LastActivity;
+    e_LGRespType Resp;
+    uint64_t BodyLeft;
+    int RxLen;
+    char RxBuff[LG_RX_BUFF_SIZE];
+    int TxLen;
+    int TxPos;
+    char TxBuff[LG_TX_BUFF_SIZE];
+};
+
+struct LGOptions
+{
+    const char *Host;
+    int Port;
+    const char *Path;
+    int Conns;
+    int Sweep[LG_MAX_SWEEP];
+    int SweepCount;
+    int Duration;
+    int Warmup;
+    double Rate;
+    int Depth;
+    bool NoKeepAlive;
+    bool FastOpen;
+    int ServerPID;
+};
+
+struct LGResults
+{
+    uint64_t Requests;
+    uint64_t Errors;
+    uint64_t Dropped;           // Open loop requests we couldn't queue
+    double Seconds;
+    uint64_t *Latency;          // ns
+    uint64_t LatencyCount;
+    uint64_t LatencySize;
+    long long ServerSyscalls;   // -1 if not known
+    long RSSBefore;             // kB, -1 if not known
+    long RSSAfter;
+};
+
+/*** FUNCTION PROTOTYPES      ***/
+static uint64_t LG_Now(void);
+static bool LG_Connect(struct LGConn *Conn);
+static void LG_Close(struct LGConn *Conn);
+static void LG_QueueRequest(struct LGConn *Conn,uint64_t When);
+static bool LG_Flush(struct LGConn *Conn);
+static bool LG_ReadReplies(struct LGConn *Conn);
+static int LG_ParseReplies(struct LGConn *Conn);
+static void LG_ReplyDone(struct LGConn *Conn);
+static void LG_RecordLatency(uint64_t NS);
+static void LG_WatchWrite(struct LGConn *Conn,bool Write);
+static void LG_RunTest(int Conns);
+static long long LG_ReadServerSyscalls(void);
+static long LG_ReadServerRSS(void);
+static int LG_CompareU64(const void *a,const void *b);
+static uint64_t LG_Percentile(double p);
+
+/*** VARIABLE DEFINITIONS     ***/
+static struct LGOptions m_Opts;
+static struct LGResults m_Results;
+static struct LGConn *m_Conns;
+static int m_EPollFD;
+static struct sockaddr_in m_ServerAddr;
+static char m_Request[256];
+static int m_RequestLen;
+static bool m_Measuring;
+
+/* Open loop requests that are due but haven't been sent (when they were
+   due, in ns) */
+static uint64_t m_DueQueue[LG_DUE_QUEUE_SIZE];
+static unsigned int m_DueHead;
+static unsigned int m_DueTail;
+
+int main(int argc,char *argv[])
+{
+    int c;
+    int r;
+    char *p;
+
+    m_Opts.Host="127.0.0.1";
+    m_Opts.Port=3000;
+    m_Opts.Path="/";
+    m_Opts.Conns=1;
+    m_Opts.SweepCount=0;
+    m_Opts.Duration=5;
+    m_Opts.Warmup=1;
+    m_Opts.Rate=0;
+    m_Opts.Depth=1;
+    m_Opts.NoKeepAlive=false;
+    m_Opts.FastOpen=false;
+    m_Opts.ServerPID=0;
+
+    while((c=getopt(argc,argv,"h:p:u:c:s:d:w:r:l:CFS:"))!=-1)
+    {
+        switch(c)
+        {
+            case 'h':
+                m_Opts.Host=optarg;
+            break;
+            case 'p':
+                m_Opts.Port=atoi(optarg);
+            break;
+            case 'u':
+                m_Opts.Path=optarg;
+            break;
+            case 'c':
+                m_Opts.Conns=atoi(optarg);
+            break;
+            case 's':
+                for(p=optarg;*p!=0 && m_Opts.SweepCount<LG_MAX_SWEEP;)
+                {
+                    m_Opts.Sweep[m_Opts.SweepCount++]=strtol(p,&p,10);
+                    if(*p==',')
+                        p++;
+                }
+            break;
+            case 'd':
+                m_Opts.Duration=atoi(optarg);
+            break;
+            case 'w':
+                m_Opts.Warmup=atoi(optarg);
+            break;
+            case 'r':
+                m_Opts.Rate=atof(optarg);
+            break;
+            case 'l':
+                m_Opts.Depth=atoi(optarg);
+            break;
+            case 'C':
+                m_Opts.NoKeepAlive=true;
+            break;
+            case 'F':
+                m_Opts.FastOpen=true;
+            break;
+            case 'S':
+                m_Opts.ServerPID=atoi(optarg);
+            break;
+            default:
+                fprintf(stderr,"Usage: %s [-h host] [-p port] [-u path] "
+                        "[-c conns] [-s sweep] [-d secs] [-w secs] [-r rate] "
+                        "[-l depth] [-C] [-F] [-S pid]\n",argv[0]);
+                return 1;
+        }
+    }
+
+    if(m_Opts.Depth<1 || m_Opts.Depth>LG_MAX_PIPELINE)
+    {
+        fprintf(stderr,"Pipeline depth must be 1 to %d\n",LG_MAX_PIPELINE);
+        return 1;
+    }
+    if(m_Opts.NoKeepAlive)
+        m_Opts.Depth=1;
+
+    if(m_Opts.SweepCount==0)
+        m_Opts.Sweep[m_Opts.SweepCount++]=m_Opts.Conns;
+    for(r=0;r<m_Opts.SweepCount;r++)
+    {
+        if(m_Opts.Sweep[r]<1 || m_Opts.Sweep[r]>LG_MAX_CONNECTIONS)
+        {
+            fprintf(stderr,"Connections must be 1 to %d\n",
+                    LG_MAX_CONNECTIONS);
+            return 1;
+        }
+    }
+
+    memset(&m_ServerAddr,0x00,sizeof(m_ServerAddr));
+    m_ServerAddr.sin_family=AF_INET;
+    m_ServerAddr.sin_port=htons(m_Opts.Port);
+    if(inet_pton(AF_INET,m_Opts.Host,&m_ServerAddr.sin_addr)!=1)
+    {
+        fprintf(stderr,"Bad address %s (use a dotted IPv4 address)\n",
+                m_Opts.Host);
+        return 1;
+    }
+
+    m_RequestLen=snprintf(m_Request,sizeof(m_Request),
+            "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",m_Opts.Path,m_Opts.Host,
+            m_Opts.NoKeepAlive?"Connection: close\r\n":"");
+    if(m_RequestLen>=(int)sizeof(m_Request))
+    {
+        fprintf(stderr,"Path too long\n");
+        return 1;
+    }
+
+    m_Conns=calloc(LG_MAX_CONNECTIONS,sizeof(struct LGConn));
+    m_EPollFD=epoll_create1(0);
+    if(m_Conns==NULL || m_EPollFD<0)
+    {
+        fprintf(stderr,"Out of resources\n");
+        return 1;
+    }
+
+    printf("# %s:%d%s %s, %s, pipeline %d, %ds (+%ds warm up)\n",m_Opts.Host,
+            m_Opts.Port,m_Opts.Path,m_Opts.Rate>0?"open loop":"closed loop",
+            m_Opts.NoKeepAlive?"no keep-alive":"keep-alive",m_Opts.Depth,
+            m_Opts.Duration,m_Opts.Warmup);
+    if(m_Opts.Rate>0)
+        printf("# rate %.0f req/s\n",m_Opts.Rate);
+    printf("%6s %10s %8s %10s %9s %9s %9s %9s %12s\n","conns","requests",
+            "errors","rps","p50_us","p99_us","p999_us","sys/req","rss_kB/conn");
+
+    for(r=0;r<m_Opts.SweepCount;r++)
+        LG_RunTest(m_Opts.Sweep[r]);
+
+    return 0;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    LG_RunTest
+ *
+ * SYNOPSIS:
+ *    static void LG_RunTest(int Conns);
+ *
+ * PARAMETERS:
+ *    Conns [I] -- The number of connections to use
+ *
+ * FUNCTION:
+ *    This function runs one test and prints a line of results.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+static void LG_RunTest(int Conns)
+{
+    struct epoll_event Events[64];
+    struct LGConn *Conn;
+    uint64_t Now;
+    uint64_t Start;
+    uint64_t MeasureStart;
+    uint64_t End;
+    uint64_t NextDue;
+    uint64_t Interval;
+    long long SyscallsStart;
+    int Count;
+    int Timeout;
+    int r;
+    int Next;
+    bool Sent;
+
+    free(m_Results.Latency);
+    memset(&m_Results,0x00,sizeof(m_Results));
+    m_Results.ServerSyscalls=-1;
+    m_DueHead=0;
+    m_DueTail=0;
+    m_Measuring=false;
+    SyscallsStart=-1;
+
+    m_Results.RSSBefore=LG_ReadServerRSS();
+
+    for(r=0;r<Conns;r++)
+    {
+        m_Conns[r].FD=-1;
+        if(!LG_Connect(&m_Conns[r]))
+        {
+            fprintf(stderr,"Failed to connect\n");
+            exit(1);
+        }
+    }
+
+    Interval=m_Opts.Rate>0?(uint64_t)(1e9/m_Opts.Rate):0;
+    Start=LG_Now();
+    MeasureStart=Start+(uint64_t)m_Opts.Warmup*1000000000ULL;
+    End=MeasureStart+(uint64_t)m_Opts.Duration*1000000000ULL;
+    NextDue=Start;
+    Next=0;
+
+    for(;;)
+    {
+        Now=LG_Now();
+        if(Now>=End)
+            break;
+
+        if(!m_Measuring && Now>=MeasureStart)
+        {
+            /* Warm up done, start counting (the server has seen all the
+               connections by now) */
+            m_Measuring=true;
+            m_Results.Requests=0;
+            m_Results.Errors=0;
+            m_Results.Dropped=0;
+            m_Results.LatencyCount=0;
+            m_Results.RSSAfter=LG_ReadServerRSS();
+            SyscallsStart=LG_ReadServerSyscalls();
+            MeasureStart=Now;
+        }
+
+        /* Queue the open loop requests that are due */
+        if(Interval!=0)
+        {
+            while(NextDue<=Now)
+            {
+                if(m_DueHead-m_DueTail<LG_DUE_QUEUE_SIZE)
+                    m_DueQueue[m_DueHead++&(LG_DUE_QUEUE_SIZE-1)]=NextDue;
+                else if(m_Measuring)
+                    m_Results.Dropped++;
+                NextDue+=Interval;
+            }
+        }
+
+        /* Give requests to the connections that can take them */
+        for(Count=0;Count<Conns;Count++)
+        {
+            Conn=&m_Conns[Next];
+            Next=(Next+1)%Conns;
+
+            if(Conn->FD<0)
+                LG_Connect(Conn);
+            if(Conn->FD<0 || Conn->Connecting)
+                continue;
+
+            Sent=false;
+            while(Conn->InFlight<m_Opts.Depth)
+            {
+                if(Interval!=0)
+                {
+                    if(m_DueHead==m_DueTail)
+                        break;
+                    LG_QueueRequest(Conn,
+                            m_DueQueue[m_DueTail++&(LG_DUE_QUEUE_SIZE-1)]);
+                }
+                else
+                {
+                    LG_QueueRequest(Conn,Now);
+                }
+                Sent=true;
+            }
+            if(Sent && !LG_Flush(Conn))
+            {
+                if(m_Measuring)
+                    m_Results.Errors+=Conn->InFlight;
+                LG_Close(Conn);
+                continue;
+            }
+
+            if(Conn->InFlight>0 && Now-Conn->LastActivity>LG_TIMEOUT_NS)
+            {
+                /* Server stopped answering */
+                if(m_Measuring)
+                    m_Results.Errors+=Conn->InFlight;
+                LG_Close(Conn);
+            }
+        }
+
+        Timeout=Interval!=0?1:10;
+        Count=epoll_wait(m_EPollFD,Events,sizeof(Events)/sizeof(Events[0]),
+                Timeout);
+        for(r=0;r<Count;r++)
+        {
+            Conn=Events[r].data.ptr;
+            if(Conn->FD<0)
+                continue;
+
+            if(Conn->Connecting)
+            {
+                if(Events[r].events&(EPOLLERR|EPOLLHUP))
+                {
+                    if(m_Measuring)
+                        m_Results.Errors++;
+                    LG_Close(Conn);
+                    continue;
+                }
+                if(Events[r].events&EPOLLOUT)
+                {
+                    Conn->Connecting=false;
+                    Conn->LastActivity=LG_Now();
+                    LG_WatchWrite(Conn,false);
+                }
+                continue;
+            }
+
+            if(Events[r].events&EPOLLOUT)
+            {
+                if(!LG_Flush(Conn))
+                {
+                    if(m_Measuring)
+                        m_Results.Errors+=Conn->InFlight;
+                    LG_Close(Conn);
+                    continue;
+                }
+            }
+            if(Events[r].events&(EPOLLIN|EPOLLERR|EPOLLHUP))
+            {
+                if(!LG_ReadReplies(Conn))
+                {
+                    if(m_Measuring)
+                        m_Results.Errors+=Conn->InFlight;
+                    LG_Close(Conn);
+                }
+            }
+        }
+    }
+
+    m_Results.Seconds=(LG_Now()-MeasureStart)/1e9;
+    if(SyscallsStart>=0)
+        m_Results.ServerSyscalls=LG_ReadServerSyscalls()-SyscallsStart;
+
+    for(r=0;r<Conns;r++)
+        LG_Close(&m_Conns[r]);
+
+    qsort(m_Results.Latency,m_Results.LatencyCount,sizeof(uint64_t),
+            LG_CompareU64);
+
+    printf("%6d %10llu %8llu %10.0f %9.1f %9.1f %9.1f ",Conns,
+            (unsigned long long)m_Results.Requests,
+            (unsigned long long)(m_Results.Errors+m_Results.Dropped),
+            m_Results.Requests/m_Results.Seconds,
+            LG_Percentile(0.50)/1000.0,LG_Percentile(0.99)/1000.0,
+            LG_Percentile(0.999)/1000.0);
+    if(m_Results.ServerSyscalls>=0 && m_Results.Requests>0)
+        printf("%9.2f ",(double)m_Results.ServerSyscalls/m_Results.Requests);
+    else
+        printf("%9s ","-");
+    if(m_Results.RSSBefore>=0 && m_Results.RSSAfter>=0)
+    {
+        printf("%12.1f\n",(double)(m_Results.RSSAfter-m_Results.RSSBefore)/
+                Conns);
+    }
+    else
+    {
+        printf("%12s\n","-");
+    }
+    fflush(stdout);
+
+    /* Give the server a moment to see the connections close */
+    usleep(200000);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    LG_Connect
+ *
+ * SYNOPSIS:
+ *    static bool LG_Connect(struct LGConn *Conn);
+ *
+ * PARAMETERS:
+ *    Conn [I/O] -- The connection to open
+ *
+ * FUNCTION:
+ *    This function starts a non blocking connect to the server.
+ *
+ * RETURNS:
+ *    true -- Connect started
+ *    false -- Couldn't make the socket
+ *
+ * SEE ALSO:
+ *    LG_Close()
+ ******************************************************************************/
+static bool LG_Connect(struct LGConn *Conn)
+{
+    struct epoll_event Event;
+    int One;
+
+    Conn->FD=socket(AF_INET,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+    if(Conn->FD<0)
+        return false;
+
+    One=1;
+    setsockopt(Conn->FD,IPPROTO_TCP,TCP_NODELAY,&One,sizeof(One));
+
+    /* With this connect() returns right away and the first write goes in
+       the SYN (if we have a cookie from the server) */
+    if(m_Opts.FastOpen)
+        setsockopt(Conn->FD,IPPROTO_TCP,TCP_FASTOPEN_CONNECT,&One,sizeof(One));
+
+    Conn->Connecting=true;
+    Conn->CloseAfter=false;
+    Conn->InFlight=0;
+    Conn->SentHead=0;
+    Conn->SentTail=0;
+    Conn->Resp=e_LGResp_Headers;
+    Conn->RxLen=0;
+    Conn->TxLen=0;
+    Conn->TxPos=0;
+    Conn->LastActivity=LG_Now();
+
+    if(connect(Conn->FD,(struct sockaddr *)&m_ServerAddr,
+            sizeof(m_ServerAddr))<0 && errno!=EINPROGRESS)
+    {
+        close(Conn->FD);
+        Conn->FD=-1;
+        return false;
+    }
+
+    Event.events=EPOLLIN|EPOLLOUT;
+    Event.data.ptr=Conn;
+    epoll_ctl(m_EPollFD,EPOLL_CTL_ADD,Conn->FD,&Event);
+
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    LG_Close
+ *
+ * SYNOPSIS:
+ *    static void LG_Close(struct LGConn *Conn);
+ *
+ * PARAMETERS:
+ *    Conn [I/O] -- The connection to close
+ *
+ * FUNCTION:
+ *    This function closes a connection.  Anything in flight is lost (the
+ *    caller counts it).
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    LG_Connect()
+ ******************************************************************************/
+static void LG_Close(struct LGConn *Conn)
+{
+    if(Conn->FD<0)
+        return;
+
+    epoll_ctl(m_EPollFD,EPOLL_CTL_DEL,Conn->FD,NULL);
+    close(Conn->FD);
+    Conn->FD=-1;
+    Conn->InFlight=0;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    LG_WatchWrite
+ *
+ * SYNOPSIS:
+ *    static void LG_WatchWrite(struct LGConn *Conn,bool Write);
+ *
+ * PARAMETERS:
+ *    Conn [I] -- The connection
+ *    Write [I] -- Wake up when the connection can take more data
+ *
+ * FUNCTION:
+ *    This function sets what epoll tells us about for a connection.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+static void LG_WatchWrite(struct LGConn *Conn,bool Write)
+{
+    struct epoll_event Event;
+
+    Event.events=EPOLLIN|(Write?EPOLLOUT:0);
+    Event.data.ptr=Conn;
+    epoll_ctl(m_EPollFD,EPOLL_CTL_MOD,Conn->FD,&Event);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    LG_QueueRequest
+ *
+ * SYNOPSIS:
+ *    static void LG_QueueRequest(struct LGConn *Conn,uint64_t When);
+ *
+ * PARAMETERS:
+ *    Conn [I/O] -- The connection to send on
+ *    When [I] -- The time to measure the latency from
+ *
+ * FUNCTION:
+ *    This function adds a request to the connection's send buffer.  Call
+ *    LG_Flush() to send it.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    LG_Flush()
+ ******************************************************************************/
+static void LG_QueueRequest(struct LGConn *Conn,uint64_t When)
+{
+    if(Conn->TxPos==Conn->TxLen)
+    {
+        Conn->TxPos=0;
+        Conn->TxLen=0;
+    }
+    else if(Conn->TxLen+m_RequestLen>sizeof(Conn->TxBuff))
+    {
+        /* Move what hasn't been sent yet to the start */
+        memmove(Conn->TxBuff,&Conn->TxBuff[Conn->TxPos],
+                Conn->TxLen-Conn->TxPos);
+        Conn->TxLen-=Conn->TxPos;
+        Conn->TxPos=0;
+    }
+    memcpy(&Conn->TxBuff[Conn->TxLen],m_Request,m_RequestLen);
+    Conn->TxLen+=m_RequestLen;
+
+    Conn->SentAt[Conn->SentHead]=When;
+    Conn->SentHead=(Conn->SentHead+1)%LG_MAX_PIPELINE;
+    Conn->InFlight++;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    LG_Flush
+ *
+ * SYNOPSIS:
+ *    static bool LG_Flush(struct LGConn *Conn);
+ *
+ * PARAMETERS:
+ *    Conn [I/O] -- The connection to send on
+ *
+ * FUNCTION:
+ *    This function sends as much of the connection's send buffer as the
+ *    socket will take.  If there's some left we ask epoll to tell us when
+ *    we can send more.
+ *
+ * RETURNS:
+ *    true -- Ok
+ *    false -- The connection failed
+ *
+ * SEE ALSO:
+ *    LG_QueueRequest()
+ ******************************************************************************/
+static bool LG_Flush(struct LGConn *Conn)
+{
+    ssize_t Bytes;
+
+    while(Conn->TxPos<Conn->TxLen)
+    {
+        Bytes=send(Conn->FD,&Conn->TxBuff[Conn->TxPos],
+                Conn->TxLen-Conn->TxPos,MSG_NOSIGNAL);
+        if(Bytes<0)
+        {
+            if(errno==EAGAIN || errno==EWOULDBLOCK)
+            {
+                LG_WatchWrite(Conn,true);
+                return true;
+            }
+            return false;
+        }
+        Conn->TxPos+=Bytes;
+    }
+
+    LG_WatchWrite(Conn,false);
+    return true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    LG_ReadReplies
+ *
+ * SYNOPSIS:
+ *    static bool LG_ReadReplies(struct LGConn *Conn);
+ *
+ * PARAMETERS:
+ *    Conn [I/O] -- The connection to read from
+ *
+ * FUNCTION:
+ *    This function reads what the server sent and handles any replies that
+ *    are complete.
+ *
+ * RETURNS:
+ *    true -- Ok
+ *    false -- The connection is done (error, or the server hung up).  The
+ *             caller closes it.
+ *
+ * SEE ALSO:
+ *    LG_ParseReplies()
+ ******************************************************************************/
+static bool LG_ReadReplies(struct LGConn *Conn)
+{
+    ssize_t Bytes;
+    int Used;
+
+    for(;;)
+    {
+        Bytes=recv(Conn->FD,&Conn->RxBuff[Conn->RxLen],
+                sizeof(Conn->RxBuff)-Conn->RxLen,0);
+        if(Bytes<0)
+        {
+            if(errno==EAGAIN || errno==EWOULDBLOCK)
+                return true;
+            return false;
+        }
+        if(Bytes==0)
+        {
+            /* Server hung up.  That ends a reply with no length. */
+            if(Conn->Resp==e_LGResp_UntilClose)
+                LG_ReplyDone(Conn);
+            return false;
+        }
+
+        Conn->LastActivity=LG_Now();
+        Conn->RxLen+=Bytes;
+
+        Used=LG_ParseReplies(Conn);
+        if(Used<0)
+            return false;
+        memmove(Conn->RxBuff,&Conn->RxBuff[Used],Conn->RxLen-Used);
+        Conn->RxLen-=Used;
+
+        if(Conn->CloseAfter && Conn->InFlight==0)
+            return false;
+
+        if(Conn->RxLen==sizeof(Conn->RxBuff))
+        {
+            /* A header bigger than our buffer */
+            return false;
+        }
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    LG_ParseReplies
+ *
+ * SYNOPSIS:
+ *    static int LG_ParseReplies(struct LGConn *Conn);
+ *
+ * PARAMETERS:
+ *    Conn [I/O] -- The connection to parse the replies for
+ *
+ * FUNCTION:
+ *    This function works through the bytes in 'Conn->RxBuff' finding the
+ *    end of each reply.  Bodies are skipped over as they come in so they
+ *    can be bigger than the buffer.
+ *
+ * RETURNS:
+ *    The number of bytes used up or -1 if the reply couldn't be parsed.
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+static int LG_ParseReplies(struct LGConn *Conn)
+{
+    char *Pos;
+    char *End;
+    char *LineEnd;
+    char *Line;
+    uint64_t Take;
+
+    Pos=Conn->RxBuff;
+    End=&Conn->RxBuff[Conn->RxLen];
+
+    while(Pos<End)
+    {
+        switch(Conn->Resp)
+        {
+            case e_LGResp_Headers:
+                LineEnd=memmem(Pos,End-Pos,"\r\n\r\n",4);
+                if(LineEnd==NULL)
+                    return Pos-Conn->RxBuff;
+
+                if(End-Pos<12 || strncmp(Pos,"HTTP/1.",7)!=0)
+                    return -1;
+                if(m_Measuring && (Pos[9]<'2' || Pos[9]>'3'))
+                    m_Results.Errors++;
+
+                /* Look for how the body is sent */
+                Conn->Resp=e_LGResp_UntilClose;
+                for(Line=Pos;Line<LineEnd;)
+                {
+                    Line=memchr(Line,'\n',LineEnd-Line);
+                    if(Line==NULL)
+                        break;
+                    Line++;
+                    if(strncasecmp(Line,"Content-Length:",15)==0)
+                    {
+                        Conn->BodyLeft=strtoull(Line+15,NULL,10);
+                        Conn->Resp=e_LGResp_Body;
+                    }
+                    else if(strncasecmp(Line,"Transfer-Encoding: chunked",
+                            26)==0)
+                    {
+                        Conn->Resp=e_LGResp_ChunkSize;
+                    }
+                    else if(strncasecmp(Line,"Connection: close",17)==0)
+                    {
+                        Conn->CloseAfter=true;
+                    }
+                }
+
+                /* A 304 never has a body */
+                if(strncmp(Pos+9,"304",3)==0)
+                {
+                    Conn->Resp=e_LGResp_Body;
+                    Conn->BodyLeft=0;
+                }
+
+                Pos=LineEnd+4;
+                if(Conn->Resp==e_LGResp_Body && Conn->BodyLeft==0)
+                    LG_ReplyDone(Conn);
+            break;
+            case e_LGResp_Body:
+                Take=End-Pos;
+                if(Take>Conn->BodyLeft)
+                    Take=Conn->BodyLeft;
+                Pos+=Take;
+                Conn->BodyLeft-=Take;
+                if(Conn->BodyLeft==0)
+                    LG_ReplyDone(Conn);
+            break;
+            case e_LGResp_ChunkSize:
+                LineEnd=memmem(Pos,End-Pos,"\r\n",2);
+                if(LineEnd==NULL)
+                    return Pos-Conn->RxBuff;
+                Conn->BodyLeft=strtoull(Pos,NULL,16);
+                Pos=LineEnd+2;
+                if(Conn->BodyLeft==0)
+                    Conn->Resp=e_LGResp_LastCRLF;
+                else
+                    Conn->Resp=e_LGResp_ChunkData;
+            break;
+            case e_LGResp_ChunkData:
+                Take=End-Pos;
+                if(Take>Conn->BodyLeft)
+                    Take=Conn->BodyLeft;
+                Pos+=Take;
+                Conn->BodyLeft-=Take;
+                if(Conn->BodyLeft==0)
+                    Conn->Resp=e_LGResp_ChunkEnd;
+            break;
+            case e_LGResp_ChunkEnd:
+            case e_LGResp_LastCRLF:
+                if(End-Pos<2)
+                    return Pos-Conn->RxBuff;
+                if(Pos[0]!='\r' || Pos[1]!='\n')
+                    return -1;
+                Pos+=2;
+                if(Conn->Resp==e_LGResp_LastCRLF)
+                    LG_ReplyDone(Conn);
+                else
+                    Conn->Resp=e_LGResp_ChunkSize;
+            break;
+            case e_LGResp_UntilClose:
+                Pos=End;
+            break;
+            case e_LGRespMAX:
+            default:
+                return -1;
+        }
+    }
+    return Pos-Conn->RxBuff;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    LG_ReplyDone
+ *
+ * SYNOPSIS:
+ *    static void LG_ReplyDone(struct LGConn *Conn);
+ *
+ * PARAMETERS:
+ *    Conn [I/O] -- The connection the reply came in on
+ *
+ * FUNCTION:
+ *    This function records a finished reply.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+static void LG_ReplyDone(struct LGConn *Conn)
+{
+    uint64_t Now;
+
+    Conn->Resp=e_LGResp_Headers;
+    if(Conn->InFlight==0)
+        return;     // Reply we didn't ask for
+
+    Now=LG_Now();
+    if(m_Measuring)
+    {
+        m_Results.Requests++;
+        LG_RecordLatency(Now-Conn->SentAt[Conn->SentTail]);
+    }
+    Conn->SentTail=(Conn->SentTail+1)%LG_MAX_PIPELINE;
+    Conn->InFlight--;
+
+    if(m_Opts.NoKeepAlive)
+        Conn->CloseAfter=true;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    LG_RecordLatency
+ *
+ * SYNOPSIS:
+ *    static void LG_RecordLatency(uint64_t NS);
+ *
+ * PARAMETERS:
+ *    NS [I] -- The latency of a request
+ *
+ * FUNCTION:
+ *    This function adds a latency to the list that the percentiles are
+ *    worked out from.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    LG_Percentile()
+ ******************************************************************************/
+static void LG_RecordLatency(uint64_t NS)
+{
+    uint64_t *NewList;
+    uint64_t NewSize;
+
+    if(m_Results.LatencyCount==m_Results.LatencySize)
+    {
+        NewSize=m_Results.LatencySize==0?65536:m_Results.LatencySize*2;
+        NewList=realloc(m_Results.Latency,NewSize*sizeof(uint64_t));
+        if(NewList==NULL)
+            return;
+        m_Results.Latency=NewList;
+        m_Results.LatencySize=NewSize;
+    }
+    m_Results.Latency[m_Results.LatencyCount++]=NS;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    LG_Percentile
+ *
+ * SYNOPSIS:
+ *    static uint64_t LG_Percentile(double p);
+ *
+ * PARAMETERS:
+ *    p [I] -- The percentile (0.99 for p99)
+ *
+ * FUNCTION:
+ *    This function gets a percentile from the sorted latency list.
+ *
+ * RETURNS:
+ *    The latency in ns (0 if there are no samples)
+ *
+ * SEE ALSO:
+ *    LG_RecordLatency()
+ ******************************************************************************/
+static uint64_t LG_Percentile(double p)
+{
+    uint64_t Index;
+
+    if(m_Results.LatencyCount==0)
+        return 0;
+
+    Index=(uint64_t)(p*m_Results.LatencyCount+0.999999);
+    if(Index>0)
+        Index--;
+    if(Index>=m_Results.LatencyCount)
+        Index=m_Results.LatencyCount-1;
+    return m_Results.Latency[Index];
+}
+
+/*******************************************************************************
+ * NAME:
+ *    LG_CompareU64
+ *
+ * SYNOPSIS:
+ *    static int LG_CompareU64(const void *a,const void *b);
+ *
+ * PARAMETERS:
+ *    a [I] -- The first uint64_t
+ *    b [I] -- The second uint64_t
+ *
+ * FUNCTION:
+ *    This is the qsort() compare for the latency list.
+ *
+ * RETURNS:
+ *    <0, 0, >0 like strcmp()
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+static int LG_CompareU64(const void *a,const void *b)
+{
+    uint64_t A=*(const uint64_t *)a;
+    uint64_t B=*(const uint64_t *)b;
+
+    return A<B?-1:A>B;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    LG_ReadServerSyscalls
+ *
+ * SYNOPSIS:
+ *    static long long LG_ReadServerSyscalls(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function reads the number of read and write syscalls the server
+ *    has made (syscr + syscw from /proc/<pid>/io).
+ *
+ *    This only counts the read()/write() family.  select(), accept(),
+ *    close(), and the rest are not counted by the kernel here.
+ *
+ * RETURNS:
+ *    The count or -1 if we don't know the server's pid or can't read it.
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+static long long LG_ReadServerSyscalls(void)
+{
+    char Filename[64];
+    char Line[128];
+    FILE *in;
+    long long Total;
+    long long Value;
+    int Found;
+
+    if(m_Opts.ServerPID<=0)
+        return -1;
+
+    snprintf(Filename,sizeof(Filename),"/proc/%d/io",m_Opts.ServerPID);
+    in=fopen(Filename,"r");
+    if(in==NULL)
+        return -1;
+
+    Total=0;
+    Found=0;
+    while(fgets(Line,sizeof(Line),in)!=NULL)
+    {
+        if(sscanf(Line,"syscr: %lld",&Value)==1 ||
+                sscanf(Line,"syscw: %lld",&Value)==1)
+        {
+            Total+=Value;
+            Found++;
+        }
+    }
+    fclose(in);
+
+    return Found==2?Total:-1;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    LG_ReadServerRSS
+ *
+ * SYNOPSIS:
+ *    static long LG_ReadServerRSS(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function reads the server's resident memory (VmRSS).
+ *
+ * RETURNS:
+ *    The RSS in kB or -1 if we don't know the server's pid or can't read it.
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+static long LG_ReadServerRSS(void)
+{
+    char Filename[64];
+    char Line[128];
+    FILE *in;
+    long Value;
+
+    if(m_Opts.ServerPID<=0)
+        return -1;
+
+    snprintf(Filename,sizeof(Filename),"/proc/%d/status",m_Opts.ServerPID);
+    in=fopen(Filename,"r");
+    if(in==NULL)
+        return -1;
+
+    Value=-1;
+    while(fgets(Line,sizeof(Line),in)!=NULL)
+        if(sscanf(Line,"VmRSS: %ld",&Value)==1)
+            break;
+    fclose(in);
+
+    return Value;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    LG_Now
+ *
+ * SYNOPSIS:
+ *    static uint64_t LG_Now(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function reads the clock used for all the timing.
+ *
+ * RETURNS:
+ *    The time in ns
+ *
+ * SEE ALSO:
+ *    
+ ******************************************************************************/
+static uint64_t LG_Now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
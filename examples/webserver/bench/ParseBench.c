@@ -0,0 +1,705 @@
+/*******************************************************************************
+ * FILENAME: ParseBench.c
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This is a benchmark of the request parser in WebServer.c.  Each stage
+ *    of the parser (WS_GetNextLine(), WS_ProcessURI(), WS_ProcessGetVars(),
+ *    WS_ProcessCookieVars(), the POST body state machine, the URL codec,
+ *    and WS_StartReply()) is timed on its own over a corpus of requests,
+ *    followed by the whole request going through WS_RunServer() the way
+ *    WS_Tick() feeds it.
+ *
+ *    WebServer.c is included into this file (instead of linked) so the
+ *    static parser functions can be called directly.  Replies are captured
+ *    in the connection's output buffer (like an offloaded page) so no
+ *    socket is needed.
+ *
+ *    Run it with no args to use the built in corpus, or pass it files that
+ *    each have one raw request in them (as captured off the wire, for
+ *    example with "nc -l 3000 >req.txt" and pointing a browser at it):
+ *        parsebench [-f MHz] [-v] [request files...]
+ *
+ *    For each stage it prints the number of requests the stage applies to,
+ *    the bytes of input per request, ns per request, cycles per request,
+ *    and bytes per cycle.  Cycles are read from the CPU cycle counter
+ *    (perf_event_open()).  If that isn't allowed they are worked out from
+ *    the clock speed given with -f, or left out.  -v also prints every
+ *    stage for each request on its own.
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ ******************************************************************************/
+
+/*** HEADER FILES TO INCLUDE  ***/
+#include "../WebServer.c"
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*** DEFINES                  ***/
+#define BENCH_MIN_NS                200000000   // How long to run each stage for (ns)
+#define BENCH_READ_SIZE             100         // The size of the reads WS_Tick() does
+#define BENCH_MAX_REQUESTS          64
+#define BENCH_MAX_REQUEST_SIZE      16384
+
+/*** MACROS                   ***/
+
+/*** TYPE DEFINITIONS         ***/
+struct BenchRequest
+{
+    const char *Name;
+    char *Raw;              // The whole request
+    int Len;
+    int HeadLen;            // The request line + headers + the blank line
+    char ReqLine[WS_LINE_BUFFER_SIZE];  // The request line (no \r\n)
+    int ReqLineLen;
+    char URILine[WS_LINE_BUFFER_SIZE];  // LineBuff after WS_ProcessURI()
+    char CookieLine[WS_LINE_BUFFER_SIZE];   // The Cookie: header ("" if none)
+    int CookieLineLen;
+    char *Query;            // The GET args (NULL if none)
+    int QueryLen;
+    bool Post;
+    char *Body;
+    int BodyLen;
+};
+
+/* Runs one stage on one request.  Returns the number of bytes of input the
+   stage worked on (0 if the stage doesn't apply to this request). */
+typedef int (*t_StageFn)(struct WebServer *Web,struct BenchRequest *Req);
+
+struct BenchStage
+{
+    const char *Name;
+    t_StageFn Fn;
+};
+
+/*** FUNCTION PROTOTYPES      ***/
+static int Stage_GetNextLine(struct WebServer *Web,struct BenchRequest *Req);
+static int Stage_ProcessURI(struct WebServer *Web,struct BenchRequest *Req);
+static int Stage_GetVars(struct WebServer *Web,struct BenchRequest *Req);
+static int Stage_CookieVars(struct WebServer *Web,struct BenchRequest *Req);
+static int Stage_PostBody(struct WebServer *Web,struct BenchRequest *Req);
+static int Stage_URLCodec(struct WebServer *Web,struct BenchRequest *Req);
+static int Stage_StartReply(struct WebServer *Web,struct BenchRequest *Req);
+static int Stage_WholeRequest(struct WebServer *Web,struct BenchRequest *Req);
+
+/*** VARIABLE DEFINITIONS     ***/
+static volatile uint32_t m_Sink;
+static int m_CyclesFD=-1;
+static double m_MHz;
+
+/* The args the page asks for (every page in the corpus uses this page) */
+static const char *m_BenchGets[]={"q","page","sort","lang","id","filter",
+        "utm_source",NULL};
+static const char *m_BenchCookies[]={"sid","theme","lang",NULL};
+static const char *m_BenchPosts[]={"user","pass","comment","email",NULL};
+
+/* The built in corpus.  These are made up to look like what a browser, curl,
+   and a script send (header lines are kept under WS_LINE_BUFFER_SIZE).  The
+   comment in comment-post is bigger than the default WS_OPT_ARG_MEMORY_SIZE
+   so it gets a 507 like it would on the board. */
+static const char *m_BuiltInCorpus[][2]=
+{
+    {"curl-root",
+        "GET / HTTP/1.1\r\n"
+        "Host: 192.168.42.1\r\n"
+        "User-Agent: curl/8.5.0\r\n"
+        "Accept: */*\r\n"
+        "\r\n"},
+    {"browser-page",
+        "GET /index.html HTTP/1.1\r\n"
+        "Host: 192.168.42.1\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Connection: keep-alive\r\n"
+        "Cookie: sid=8f14e45fceea167a5a36dedd4bea2543; theme=dark; lang=en\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "Sec-Fetch-Dest: document\r\n"
+        "Sec-Fetch-Mode: navigate\r\n"
+        "Sec-Fetch-Site: none\r\n"
+        "Sec-Fetch-User: ?1\r\n"
+        "Priority: u=0, i\r\n"
+        "\r\n"},
+    {"browser-revalidate",
+        "GET /index.html HTTP/1.1\r\n"
+        "Host: 192.168.42.1\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Connection: keep-alive\r\n"
+        "Cookie: sid=8f14e45fceea167a5a36dedd4bea2543; theme=dark; lang=en\r\n"
+        "If-None-Match: \"" DOCVER "\"\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "\r\n"},
+    {"search-query",
+        "GET /search?q=milk-v+duo+riscv&page=2&sort=date&lang=en HTTP/1.1\r\n"
+        "Host: 192.168.42.1\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Referer: http://192.168.42.1/index.html\r\n"
+        "Cookie: sid=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+        "\r\n"},
+    {"api-escaped",
+        "GET /api/sensors?id=12345&filter=name%3D%22duo%22%20AND%20ram%3E64&utm_source=news%20letter HTTP/1.1\r\n"
+        "Host: 192.168.42.1:3000\r\n"
+        "User-Agent: python-requests/2.31.0\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Accept: application/json\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n"},
+    {"form-post",
+        "POST /login HTTP/1.1\r\n"
+        "Host: 192.168.42.1\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+        "Content-Type: application/x-www-form-urlencoded\r\n"
+        "Content-Length: 41\r\n"
+        "Origin: http://192.168.42.1\r\n"
+        "Cookie: theme=dark\r\n"
+        "\r\n"
+        "user=paul&pass=s3cr3t%21%40pw&remember=on"},
+    {"comment-post",
+        "POST /comment?id=77 HTTP/1.1\r\n"
+        "Host: 192.168.42.1\r\n"
+        "User-Agent: curl/8.5.0\r\n"
+        "Accept: */*\r\n"
+        "Content-Type: application/x-www-form-urlencoded\r\n"
+        "Content-Length: 158\r\n"
+        "\r\n"
+        "comment=This+is+a+longer+comment+with+%22quotes%22%2C+%26ampersands"
+        "+and+%E2%82%AC+signs+in+it+to+give+the+decoder+some+work&email=paul"
+        "%40example.com&user=paul"},
+};
+
+static const struct BenchStage m_Stages[]=
+{
+    {"GetNextLine",Stage_GetNextLine},
+    {"ProcessURI",Stage_ProcessURI},
+    {"ProcessGetVars",Stage_GetVars},
+    {"ProcessCookieVars",Stage_CookieVars},
+    {"POST body+reply",Stage_PostBody},
+    {"URL decode+encode",Stage_URLCodec},
+    {"StartReply",Stage_StartReply},
+    {"whole request",Stage_WholeRequest},
+};
+
+/* The web server needs these.  Every page is the same dynamic page that
+   reads all of its args and sends a short reply. */
+bool FS_GetFileProperties(const char *Filename,struct WSPageProp *PageProp)
+{
+    PageProp->FileID=0;
+    PageProp->DynamicFile=true;
+    PageProp->Cookies=m_BenchCookies;
+    PageProp->Gets=m_BenchGets;
+    PageProp->Posts=m_BenchPosts;
+    PageProp->Route=NULL;
+    return true;
+}
+void FS_SendFile(struct WebServer *Web,uintptr_t FileID)
+{
+    int r;
+
+    for(r=0;m_BenchGets[r]!=NULL;r++)
+        m_Sink+=WS_GET(Web,m_BenchGets[r])!=NULL;
+    for(r=0;m_BenchCookies[r]!=NULL;r++)
+        m_Sink+=WS_COOKIE(Web,m_BenchCookies[r])!=NULL;
+    for(r=0;m_BenchPosts[r]!=NULL;r++)
+        m_Sink+=WS_POST(Web,m_BenchPosts[r])!=NULL;
+    WS_WriteWholeStr(Web,"ok");
+}
+t_ElapsedTime ReadElapsedClock(void)
+{
+    return (t_ElapsedTime)time(NULL);
+}
+
+static uint64_t Bench_NowNS(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+/* Opens the user space CPU cycle counter for this thread (-1 if we can't) */
+static int Bench_OpenCycles(void)
+{
+    struct perf_event_attr pe;
+
+    memset(&pe,0x00,sizeof(pe));
+    pe.type=PERF_TYPE_HARDWARE;
+    pe.size=sizeof(pe);
+    pe.config=PERF_COUNT_HW_CPU_CYCLES;
+    pe.exclude_kernel=1;
+    pe.exclude_hv=1;
+    return syscall(__NR_perf_event_open,&pe,0,-1,-1,0);
+}
+
+static uint64_t Bench_ReadCycles(void)
+{
+    uint64_t Count;
+
+    if(m_CyclesFD<0 || read(m_CyclesFD,&Count,sizeof(Count))!=sizeof(Count))
+        return 0;
+    return Count;
+}
+
+/* Sets up the page the way WS_GetPageProperties() + WS_InitArgIndex() would
+   and forgets any args that were stored */
+static void Bench_ResetArgs(struct WebServer *Web)
+{
+#if WS_OPT_LAZY_ARGS
+    int r;
+#endif
+
+    FS_GetFileProperties("",&Web->PageProp);
+    Web->ArgsStorageUsed=0;
+#if WS_OPT_LAZY_ARGS
+    Web->LazyArgsUsed=0;
+    for(r=0;r<e_WSArgTypeMAX;r++)
+        Web->LazyArgs[r].Offset=WS_ARG_NOT_SET;
+#endif
+    WS_InitArgIndex(Web);
+}
+
+/* Feeds 'Len' bytes to WS_RunServer() in the size reads WS_Tick() does */
+static void Bench_Feed(struct WebServer *Web,char *Data,int Len)
+{
+    int Bytes;
+
+    while(Len>0)
+    {
+        Bytes=Len<BENCH_READ_SIZE?Len:BENCH_READ_SIZE;
+        WS_RunServer(Web,Data,Bytes);
+        Data+=Bytes;
+        Len-=Bytes;
+    }
+}
+
+/* Splits a raw request up into the parts the stages need.  Returns false
+   if it isn't something we can use. */
+static bool Bench_PrepareRequest(struct BenchRequest *Req,const char *Name,
+        const char *Raw,int Len)
+{
+    struct WebServer Tmp;
+    const char *End;
+    const char *Line;
+    const char *Pos;
+    int LineLen;
+
+    memset(Req,0x00,sizeof(*Req));
+    Req->Name=Name;
+    Req->Raw=malloc(Len);
+    memcpy(Req->Raw,Raw,Len);
+    Req->Len=Len;
+
+    /* Find the end of the headers */
+    Req->HeadLen=Len;
+    for(Pos=Raw;Pos<Raw+Len-1;Pos++)
+    {
+        if(Pos[0]=='\n' && (Pos[1]=='\n' ||
+                (Pos[1]=='\r' && Pos+2<Raw+Len && Pos[2]=='\n')))
+        {
+            Req->HeadLen=(Pos[1]=='\n'?Pos+2:Pos+3)-Raw;
+            break;
+        }
+    }
+
+    /* Pull out the request line and Cookie: header */
+    for(Line=Raw;Line<Raw+Req->HeadLen;Line=End+1)
+    {
+        End=memchr(Line,'\n',Raw+Req->HeadLen-Line);
+        if(End==NULL)
+            break;
+        LineLen=End-Line;
+        if(LineLen>0 && Line[LineLen-1]=='\r')
+            LineLen--;
+        if(LineLen>=WS_LINE_BUFFER_SIZE)
+        {
+            fprintf(stderr,"%s: skipped, has a line longer than %d bytes\n",
+                    Name,WS_LINE_BUFFER_SIZE-1);
+            return false;
+        }
+        if(Line==Raw)
+        {
+            memcpy(Req->ReqLine,Line,LineLen);
+            Req->ReqLineLen=LineLen;
+        }
+        else if(strncmp(Line,"Cookie:",7)==0)
+        {
+            memcpy(Req->CookieLine,Line,LineLen);
+            Req->CookieLineLen=LineLen;
+        }
+    }
+
+    if(strncmp(Req->ReqLine,"GET ",4)!=0 && strncmp(Req->ReqLine,"POST ",5)!=0)
+    {
+        fprintf(stderr,"%s: skipped, not a GET or POST\n",Name);
+        return false;
+    }
+
+    /* Run the URI through once to get what the arg parsers start with */
+    memset(&Tmp,0x00,sizeof(Tmp));
+    memcpy(Tmp.LineBuff,Req->ReqLine,Req->ReqLineLen+1);
+    if(!WS_ProcessURI(&Tmp))
+    {
+        fprintf(stderr,"%s: skipped, WS_ProcessURI() didn't like it\n",Name);
+        return false;
+    }
+    memcpy(Req->URILine,Tmp.LineBuff,sizeof(Req->URILine));
+
+    Pos=strchr(Req->ReqLine,'?');
+    if(Pos!=NULL)
+    {
+        Pos++;
+        Req->QueryLen=strcspn(Pos," ");
+        Req->Query=malloc(Req->QueryLen+1);
+        memcpy(Req->Query,Pos,Req->QueryLen);
+        Req->Query[Req->QueryLen]=0;
+    }
+
+    Req->Post=strncmp(Req->ReqLine,"POST ",5)==0;
+    Req->Body=Req->Raw+Req->HeadLen;
+    Req->BodyLen=Len-Req->HeadLen;
+
+    return true;
+}
+
+static bool Bench_LoadRequest(struct BenchRequest *Req,const char *Filename)
+{
+    static char Buff[BENCH_MAX_REQUEST_SIZE];
+    FILE *in;
+    int Len;
+
+    in=fopen(Filename,"rb");
+    if(in==NULL)
+    {
+        fprintf(stderr,"Failed to open %s\n",Filename);
+        return false;
+    }
+    Len=fread(Buff,1,sizeof(Buff),in);
+    fclose(in);
+    if(Len<=0)
+    {
+        fprintf(stderr,"%s: skipped, empty\n",Filename);
+        return false;
+    }
+    return Bench_PrepareRequest(Req,Filename,Buff,Len);
+}
+
+/*******************************************************************************
+ * The stages.  Each one puts back the input it works on (a copy of at most
+ * one line) before calling into the parser, that copy is counted in the
+ * time.
+ ******************************************************************************/
+static int Stage_GetNextLine(struct WebServer *Web,struct BenchRequest *Req)
+{
+    int Pos;
+    int Bytes;
+    int Used;
+
+    Web->LineBuffPos=0;
+    for(Pos=0;Pos<Req->HeadLen;Pos+=Used)
+    {
+        Bytes=Req->HeadLen-Pos;
+        if(Bytes>BENCH_READ_SIZE)
+            Bytes=BENCH_READ_SIZE;
+        Used=WS_GetNextLine(Web,&Req->Raw[Pos],Bytes);
+        if(Used<=0)
+            Used=Bytes;
+        m_Sink+=Web->LineBuff[0];
+    }
+    return Req->HeadLen;
+}
+
+static int Stage_ProcessURI(struct WebServer *Web,struct BenchRequest *Req)
+{
+    memcpy(Web->LineBuff,Req->ReqLine,Req->ReqLineLen+1);
+    m_Sink+=WS_ProcessURI(Web);
+    return Req->ReqLineLen;
+}
+
+static int Stage_GetVars(struct WebServer *Web,struct BenchRequest *Req)
+{
+    int r;
+
+    if(Req->Query==NULL)
+        return 0;
+
+    memcpy(Web->LineBuff,Req->URILine,Req->ReqLineLen+1);
+    Bench_ResetArgs(Web);
+    WS_ProcessGetVars(Web);
+    for(r=0;m_BenchGets[r]!=NULL;r++)
+        m_Sink+=WS_GET(Web,m_BenchGets[r])!=NULL;
+    return Req->QueryLen;
+}
+
+static int Stage_CookieVars(struct WebServer *Web,struct BenchRequest *Req)
+{
+    int r;
+
+    if(Req->CookieLineLen==0)
+        return 0;
+
+    memcpy(Web->LineBuff,Req->CookieLine,Req->CookieLineLen+1);
+    Bench_ResetArgs(Web);
+    WS_ProcessCookieVars(Web);
+    for(r=0;m_BenchCookies[r]!=NULL;r++)
+        m_Sink+=WS_COOKIE(Web,m_BenchCookies[r])!=NULL;
+    return Req->CookieLineLen;
+}
+
+/* The body goes straight on to the page (it's the same WS_RunServer() call)
+   so this includes FS_SendFile() and the reply */
+static int Stage_PostBody(struct WebServer *Web,struct BenchRequest *Req)
+{
+    if(!Req->Post || Req->BodyLen==0)
+        return 0;
+
+    /* Pick up where the headers left off */
+    WS_ResetWebServer(Web);
+    Bench_ResetArgs(Web);
+    Web->Req=e_ReqType_Post;
+    Web->State=e_WebServerState_Body;
+    Web->BodySize=Req->BodyLen;
+    Web->CaptureOutput=true;
+    Bench_Feed(Web,Req->Body,Req->BodyLen);
+    return Req->BodyLen;
+}
+
+static int Stage_URLCodec(struct WebServer *Web,struct BenchRequest *Req)
+{
+    static char Work[BENCH_MAX_REQUEST_SIZE];
+    static char Encoded[BENCH_MAX_REQUEST_SIZE*3];
+    const char *Input;
+    int Len;
+
+    /* The query string, or the form data if there isn't one */
+    if(Req->Query!=NULL)
+    {
+        Input=Req->Query;
+        Len=Req->QueryLen;
+    }
+    else if(Req->Post && Req->BodyLen>0)
+    {
+        Input=Req->Body;
+        Len=Req->BodyLen;
+    }
+    else
+    {
+        return 0;
+    }
+
+    memcpy(Work,Input,Len);
+    Work[Len]=0;
+    WS_URLDecodeInPlace(Work);
+    WS_URLEncode(Work,Encoded,sizeof(Encoded));
+    m_Sink+=Encoded[0];
+    return Len;
+}
+
+static int Stage_StartReply(struct WebServer *Web,struct BenchRequest *Req)
+{
+    Web->CaptureOutput=true;
+    Web->OutputLen=0;
+    Web->ReplyStatus=e_ReplyStatus_Ok;
+    Web->PageProp.DynamicFile=true;
+    WS_StartReply(Web);
+    return Web->OutputLen;
+}
+
+static int Stage_WholeRequest(struct WebServer *Web,struct BenchRequest *Req)
+{
+    WS_ResetWebServer(Web);
+    Web->CaptureOutput=true;
+    Bench_Feed(Web,Req->Raw,Req->Len);
+    if(Web->State!=e_WebServerState_Request)
+    {
+        /* The request didn't finish (bad Content-Length?), clean up */
+        WS_ResetWebServer(Web);
+    }
+    return Req->Len;
+}
+
+/*******************************************************************************
+ * Runs 'Stage' over the requests it applies to for at least BENCH_MIN_NS
+ * and prints the results on one line.
+ ******************************************************************************/
+static void Bench_RunStage(struct WebServer *Web,const struct BenchStage *Stage,
+        struct BenchRequest **Reqs,int Count,const char *Label)
+{
+    struct BenchRequest *Use[BENCH_MAX_REQUESTS];
+    uint64_t Start;
+    uint64_t Elapsed;
+    uint64_t StartCycles;
+    uint64_t Cycles;
+    uint64_t Passes;
+    int UseCount;
+    int Bytes;
+    int Len;
+    int r;
+    double NSPerReq;
+    double CyclesPerReq;
+
+    /* First pass finds the requests this stage applies to (and warms up) */
+    UseCount=0;
+    Bytes=0;
+    for(r=0;r<Count;r++)
+    {
+        Len=Stage->Fn(Web,Reqs[r]);
+        if(Len>0)
+        {
+            Use[UseCount++]=Reqs[r];
+            Bytes+=Len;
+        }
+    }
+    if(UseCount==0)
+    {
+        if(strcmp(Label,"all")==0)
+            printf("%-18s %-20s %5d\n",Stage->Name,Label,0);
+        return;
+    }
+
+    Passes=0;
+    StartCycles=Bench_ReadCycles();
+    Start=Bench_NowNS();
+    do
+    {
+        for(r=0;r<UseCount;r++)
+            Stage->Fn(Web,Use[r]);
+        Passes++;
+        Elapsed=Bench_NowNS()-Start;
+    } while(Elapsed<BENCH_MIN_NS);
+    Cycles=Bench_ReadCycles()-StartCycles;
+
+    NSPerReq=(double)Elapsed/(Passes*UseCount);
+    if(m_CyclesFD>=0)
+        CyclesPerReq=(double)Cycles/(Passes*UseCount);
+    else
+        CyclesPerReq=NSPerReq*m_MHz/1000.0;
+
+    printf("%-18s %-20s %5d %9.1f %10.1f",Stage->Name,Label,UseCount,
+            (double)Bytes/UseCount,NSPerReq);
+    if(CyclesPerReq>0)
+    {
+        printf(" %10.1f %11.3f\n",CyclesPerReq,
+                (double)Bytes/UseCount/CyclesPerReq);
+    }
+    else
+    {
+        printf(" %10s %11s\n","-","-");
+    }
+}
+
+int main(int argc,char *argv[])
+{
+    static struct BenchRequest Corpus[BENCH_MAX_REQUESTS];
+    struct BenchRequest *Reqs[BENCH_MAX_REQUESTS];
+    struct WebServer *Web;
+    bool Verbose;
+    int Count;
+    int Opt;
+    unsigned int s;
+    int r;
+
+    Verbose=false;
+    m_MHz=0;
+    while((Opt=getopt(argc,argv,"f:v"))!=-1)
+    {
+        switch(Opt)
+        {
+            case 'f':
+                m_MHz=atof(optarg);
+            break;
+            case 'v':
+                Verbose=true;
+            break;
+            default:
+                fprintf(stderr,"Usage: %s [-f MHz] [-v] [request files...]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+
+    Count=0;
+    if(optind<argc)
+    {
+        for(r=optind;r<argc && Count<BENCH_MAX_REQUESTS;r++)
+            if(Bench_LoadRequest(&Corpus[Count],argv[r]))
+                Count++;
+    }
+    else
+    {
+        for(s=0;s<sizeof(m_BuiltInCorpus)/sizeof(m_BuiltInCorpus[0]);s++)
+        {
+            if(Bench_PrepareRequest(&Corpus[Count],m_BuiltInCorpus[s][0],
+                    m_BuiltInCorpus[s][1],strlen(m_BuiltInCorpus[s][1])))
+            {
+                Count++;
+            }
+        }
+    }
+    if(Count==0)
+    {
+        fprintf(stderr,"No requests to run\n");
+        return 1;
+    }
+    for(r=0;r<Count;r++)
+        Reqs[r]=&Corpus[r];
+
+    m_CyclesFD=Bench_OpenCycles();
+
+    /* Use the first connection so the trace events have somewhere to go */
+    Web=&m_WebServers[0];
+    memset(Web,0x00,sizeof(*Web));
+    WS_ResetWebServer(Web);
+
+    printf("# %d requests, %d byte reads, WS_OPT_ARG_MEMORY_SIZE=%d, "
+            "WS_OPT_LAZY_ARGS=%d, cycles from %s\n",Count,BENCH_READ_SIZE,
+            WS_OPT_ARG_MEMORY_SIZE,WS_OPT_LAZY_ARGS,m_CyclesFD>=0?"perf":
+            (m_MHz>0?"-f":"nowhere (use -f MHz)"));
+    printf("%-18s %-20s %5s %9s %10s %10s %11s\n","stage","requests","reqs",
+            "bytes/req","ns/req","cycles/req","bytes/cycle");
+    for(s=0;s<sizeof(m_Stages)/sizeof(m_Stages[0]);s++)
+        Bench_RunStage(Web,&m_Stages[s],Reqs,Count,"all");
+
+    if(Verbose)
+    {
+        for(r=0;r<Count;r++)
+        {
+            printf("\n");
+            for(s=0;s<sizeof(m_Stages)/sizeof(m_Stages[0]);s++)
+                Bench_RunStage(Web,&m_Stages[s],&Reqs[r],1,Reqs[r]->Name);
+        }
+    }
+
+    return 0;
+}
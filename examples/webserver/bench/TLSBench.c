@@ -0,0 +1,316 @@
+/*******************************************************************************
+ * FILENAME: TLSBench.c
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This is a benchmark of the TLS handshake in SocketsCon.c, full
+ *    handshakes against resumed ones (session cache / tickets).
+ *
+ *    Each handshake is done over a socketpair() with the server end being a
+ *    SocketCon (SocketsCon_UseHandle() + SocketsCon_EnableTLS(), the way
+ *    SocketsCon_Accept() sets one up) and the client end being plain
+ *    OpenSSL.  The client sends 1 byte once the handshake is done and the
+ *    server sends 1 byte back (so the client picks up the session ticket).
+ *    Only the time spent in the SocketsCon_*() calls is counted as server
+ *    time, so the numbers are the handshake cost on this CPU without the
+ *    network or WS_Tick() in them.
+ *
+ *    It needs SocketsCon.c built with SOCKETSCON_TLS (see the Makefile):
+ *        tlsbench [-2] [-n handshakes] [-c cert.pem] [-k key.pem]
+ *    -2 limits the client to TLS 1.2 (the default lets it pick TLS 1.3).
+ *
+ *    For full and resumed handshakes it prints the number done, how many
+ *    the client saw as resumed, server us per handshake, server handshakes
+ *    per second of CPU, and handshakes per second for client + server.
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ ******************************************************************************/
+
+/*** HEADER FILES TO INCLUDE  ***/
+#include "../SocketsCon.h"
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*** DEFINES                  ***/
+#define BENCH_DEFAULT_HANDSHAKES    500
+#define BENCH_MAX_STEPS             100     // Give up on a handshake after this many back and forths
+
+/*** MACROS                   ***/
+
+/*** TYPE DEFINITIONS         ***/
+struct BenchResult
+{
+    int Handshakes;
+    int Resumed;
+    uint64_t ServerNS;
+    uint64_t WallNS;
+};
+
+/*** FUNCTION PROTOTYPES      ***/
+static uint64_t Bench_NowNS(void);
+static bool Bench_Handshake(SSL_CTX *ClientCtx,SSL_SESSION **Session,
+        struct BenchResult *Result);
+static bool Bench_Run(SSL_CTX *ClientCtx,bool Resume,int Count,
+        struct BenchResult *Result);
+static void Bench_Print(const char *Name,struct BenchResult *Result);
+
+/*** VARIABLE DEFINITIONS     ***/
+
+static uint64_t Bench_NowNS(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+/* Does one handshake + 1 byte each way.  If '*Session' is set the client
+   tries to resume it, and it's replaced with the new session after */
+static bool Bench_Handshake(SSL_CTX *ClientCtx,SSL_SESSION **Session,
+        struct BenchResult *Result)
+{
+    struct SocketCon Server;
+    SSL *Client;
+    int fds[2];
+    uint64_t Start;
+    char c;
+    int Step;
+    int r;
+    bool Sent;
+    bool Done;
+
+    if(socketpair(AF_UNIX,SOCK_STREAM,0,fds)<0)
+        return false;
+    fcntl(fds[1],F_SETFL,fcntl(fds[1],F_GETFL,0)|O_NONBLOCK);
+
+    Client=SSL_new(ClientCtx);
+    SSL_set_fd(Client,fds[1]);
+    SSL_set_connect_state(Client);
+    if(*Session!=NULL)
+        SSL_set_session(Client,*Session);
+
+    Start=Bench_NowNS();
+    SocketsCon_InitSockCon(&Server);
+    if(!SocketsCon_UseHandle(&Server,fds[0]) ||
+            !SocketsCon_EnableTLS(&Server))
+    {
+        SSL_free(Client);
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    Result->ServerNS+=Bench_NowNS()-Start;
+
+    Sent=false;
+    Done=false;
+    for(Step=0;Step<BENCH_MAX_STEPS && !Done;Step++)
+    {
+        /* Client side */
+        if(!SSL_is_init_finished(Client))
+        {
+            SSL_do_handshake(Client);
+        }
+        else if(!Sent)
+        {
+            Sent=SSL_write(Client,"x",1)==1;
+        }
+        else
+        {
+            Done=SSL_read(Client,&c,1)==1;
+            if(Done)
+                break;
+        }
+
+        /* Server side */
+        Start=Bench_NowNS();
+        r=SocketsCon_Read(&Server,&c,1);
+        if(r==1)
+            SocketsCon_Write(&Server,"y",1);
+        Result->ServerNS+=Bench_NowNS()-Start;
+        if(r<0)
+            break;
+    }
+
+    if(Done)
+    {
+        Result->Handshakes++;
+        if(SSL_session_reused(Client))
+            Result->Resumed++;
+        if(*Session!=NULL)
+            SSL_SESSION_free(*Session);
+        *Session=SSL_get1_session(Client);
+    }
+
+    Start=Bench_NowNS();
+    SocketsCon_Close(&Server);
+    Result->ServerNS+=Bench_NowNS()-Start;
+
+    /* A session that wasn't shut down can't be resumed */
+    SSL_shutdown(Client);
+    SSL_free(Client);
+    close(fds[1]);
+    ERR_clear_error();
+
+    return Done;
+}
+
+static bool Bench_Run(SSL_CTX *ClientCtx,bool Resume,int Count,
+        struct BenchResult *Result)
+{
+    SSL_SESSION *Session;
+    uint64_t Start;
+    int r;
+
+    memset(Result,0x00,sizeof(*Result));
+    Session=NULL;
+
+    /* Get a session to resume (not counted) */
+    if(Resume)
+    {
+        if(!Bench_Handshake(ClientCtx,&Session,Result))
+            return false;
+        memset(Result,0x00,sizeof(*Result));
+    }
+
+    Start=Bench_NowNS();
+    for(r=0;r<Count;r++)
+    {
+        if(!Bench_Handshake(ClientCtx,&Session,Result))
+            break;
+        if(!Resume && Session!=NULL)
+        {
+            SSL_SESSION_free(Session);
+            Session=NULL;
+        }
+    }
+    Result->WallNS=Bench_NowNS()-Start;
+
+    if(Session!=NULL)
+        SSL_SESSION_free(Session);
+
+    return r==Count;
+}
+
+static void Bench_Print(const char *Name,struct BenchResult *Result)
+{
+    double ServerUS;
+
+    if(Result->Handshakes==0)
+    {
+        printf("%-8s no handshakes finished\n",Name);
+        return;
+    }
+
+    ServerUS=(double)Result->ServerNS/1000.0/Result->Handshakes;
+    printf("%-8s %8d %8d %10.1f %12.0f %12.0f\n",Name,Result->Handshakes,
+            Result->Resumed,ServerUS,1000000.0/ServerUS,
+            Result->Handshakes*1000000000.0/Result->WallNS);
+}
+
+int main(int argc,char *argv[])
+{
+    struct BenchResult Full;
+    struct BenchResult Resumed;
+    const char *CertFile;
+    const char *KeyFile;
+    SSL_CTX *ClientCtx;
+    bool TLS12;
+    int Count;
+    int opt;
+
+    CertFile="cert.pem";
+    KeyFile="key.pem";
+    Count=BENCH_DEFAULT_HANDSHAKES;
+    TLS12=false;
+    while((opt=getopt(argc,argv,"2n:c:k:"))!=-1)
+    {
+        switch(opt)
+        {
+            case '2':
+                TLS12=true;
+            break;
+            case 'n':
+                Count=atoi(optarg);
+            break;
+            case 'c':
+                CertFile=optarg;
+            break;
+            case 'k':
+                KeyFile=optarg;
+            break;
+            default:
+                fprintf(stderr,"Usage: %s [-2] [-n handshakes] [-c cert.pem] "
+                        "[-k key.pem]\n",argv[0]);
+                return 1;
+        }
+    }
+
+    if(!SocketsCon_InitSocketConSystem())
+    {
+        fprintf(stderr,"Failed to init the socket system\n");
+        return 1;
+    }
+    if(!SocketsCon_InitTLS(CertFile,KeyFile))
+    {
+        fprintf(stderr,"Failed to load %s / %s (or SocketsCon.c was built "
+                "without SOCKETSCON_TLS)\n",CertFile,KeyFile);
+        return 1;
+    }
+
+    ClientCtx=SSL_CTX_new(TLS_client_method());
+    if(ClientCtx==NULL)
+        return 1;
+    SSL_CTX_set_verify(ClientCtx,SSL_VERIFY_NONE,NULL);
+    SSL_CTX_set_session_cache_mode(ClientCtx,SSL_SESS_CACHE_CLIENT);
+    if(TLS12)
+        SSL_CTX_set_max_proto_version(ClientCtx,TLS1_2_VERSION);
+
+    printf("%s, %d handshakes over socketpair()\n",TLS12?"TLS 1.2":"TLS 1.3",
+            Count);
+    printf("%-8s %8s %8s %10s %12s %12s\n","","count","resumed","server us",
+            "server hs/s","total hs/s");
+
+    if(!Bench_Run(ClientCtx,false,Count,&Full))
+        fprintf(stderr,"Full handshakes stopped early\n");
+    Bench_Print("full",&Full);
+
+    if(!Bench_Run(ClientCtx,true,Count,&Resumed))
+        fprintf(stderr,"Resumed handshakes stopped early\n");
+    Bench_Print("resumed",&Resumed);
+
+    SSL_CTX_free(ClientCtx);
+    SocketsCon_ShutdownSocketConSystem();
+
+    return 0;
+}
@@ -0,0 +1,352 @@
+/*******************************************************************************
+ * FILENAME: URLCodecBench.c
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    This is a benchmark of the URL encode/decode functions in WebServer.c
+ *    against the sprintf()/strtol() versions they replaced (kept here as
+ *    the Legacy_ functions).
+ *
+ *    Run it with no args.  Each test prints the ns per call and MB/s (of
+ *    input) for the old and new function.
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ ******************************************************************************/
+
+/*** HEADER FILES TO INCLUDE  ***/
+#include "../WebServer.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*** DEFINES                  ***/
+#define BENCH_MIN_NS                200000000   // How long to run each test for (ns)
+#define BENCH_BUFF_SIZE             8192
+
+/*** MACROS                   ***/
+
+/*** TYPE DEFINITIONS         ***/
+typedef void (*t_BenchFn)(const char *Input,char *Output);
+
+struct BenchInput
+{
+    const char *Name;
+    char *Encoded;  // The URL encoded version
+    char *Plain;    // The decoded version
+};
+
+/*** FUNCTION PROTOTYPES      ***/
+static bool Legacy_WS_URLDecode(const char *Value,char *Decoded,int MaxLen);
+static char *Legacy_WS_URLDecodeInPlace(char *Value);
+static bool Legacy_WS_URLEncode(const char *Value,char *OutputBuffer,
+        int MaxLen);
+
+/*** VARIABLE DEFINITIONS     ***/
+static volatile uint32_t m_Sink;
+
+/* The web server needs these, we never call them */
+bool FS_GetFileProperties(const char *Filename,struct WSPageProp *PageProp)
+{
+    return false;
+}
+void FS_SendFile(struct WebServer *Web,uintptr_t FileID)
+{
+}
+t_ElapsedTime ReadElapsedClock(void)
+{
+    return (t_ElapsedTime)time(NULL);
+}
+
+static uint64_t Bench_NowNS(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+/* Runs 'Fn' for at least BENCH_MIN_NS and returns ns per call */
+static double Bench_Run(t_BenchFn Fn,const char *Input,char *Output)
+{
+    uint64_t Start;
+    uint64_t Elapsed;
+    uint64_t Calls;
+    int r;
+
+    Calls=0;
+    Start=Bench_NowNS();
+    do
+    {
+        for(r=0;r<256;r++)
+            Fn(Input,Output);
+        Calls+=256;
+        Elapsed=Bench_NowNS()-Start;
+    } while(Elapsed<BENCH_MIN_NS);
+
+    return (double)Elapsed/Calls;
+}
+
+static void Bench_LegacyDecode(const char *Input,char *Output)
+{
+    Legacy_WS_URLDecode(Input,Output,BENCH_BUFF_SIZE);
+    m_Sink+=Output[0];
+}
+static void Bench_NewDecode(const char *Input,char *Output)
+{
+    WS_URLDecode(Input,Output,BENCH_BUFF_SIZE);
+    m_Sink+=Output[0];
+}
+static void Bench_LegacyDecodeInPlace(const char *Input,char *Output)
+{
+    strcpy(Output,Input);
+    m_Sink+=*Legacy_WS_URLDecodeInPlace(Output);
+}
+static void Bench_NewDecodeInPlace(const char *Input,char *Output)
+{
+    strcpy(Output,Input);
+    m_Sink+=*WS_URLDecodeInPlace(Output);
+}
+static void Bench_LegacyEncode(const char *Input,char *Output)
+{
+    Legacy_WS_URLEncode(Input,Output,BENCH_BUFF_SIZE);
+    m_Sink+=Output[0];
+}
+static void Bench_NewEncode(const char *Input,char *Output)
+{
+    WS_URLEncode(Input,Output,BENCH_BUFF_SIZE);
+    m_Sink+=Output[0];
+}
+
+static void Bench_Compare(const char *TestName,const char *InputName,
+        const char *Input,t_BenchFn Old,t_BenchFn New)
+{
+    static char Output[BENCH_BUFF_SIZE];
+    double OldNS;
+    double NewNS;
+    size_t Len;
+
+    Len=strlen(Input);
+    OldNS=Bench_Run(Old,Input,Output);
+    NewNS=Bench_Run(New,Input,Output);
+    printf("%-16s %-12s %6zu %10.1f %10.1f %8.1f %8.1f %6.2fx\n",TestName,
+            InputName,Len,OldNS,NewNS,Len/OldNS*1000.0,Len/NewNS*1000.0,
+            OldNS/NewNS);
+}
+
+/* Makes a plain string of 'Len' chars with about 1 in 'EscEvery' needing
+   to be escaped (0 for none) */
+static char *Bench_MakePlain(int Len,int EscEvery)
+{
+    static const char Normal[]="abcdefghijklmnopqrstuvwxyz0123456789-_.~";
+    static const char Escaped[]=" &=+/?#%\xC3\xA9\xE2\x82\xAC";
+    char *Str;
+    int r;
+
+    Str=malloc(Len+1);
+    for(r=0;r<Len;r++)
+    {
+        if(EscEvery>0 && r%EscEvery==EscEvery-1)
+            Str[r]=Escaped[r%(sizeof(Escaped)-1)];
+        else
+            Str[r]=Normal[r%(sizeof(Normal)-1)];
+    }
+    Str[Len]=0;
+    return Str;
+}
+
+int main(void)
+{
+    static char Check1[BENCH_BUFF_SIZE];
+    static char Check2[BENCH_BUFF_SIZE];
+    struct BenchInput Inputs[]=
+    {
+        {"short",NULL,NULL},
+        {"no-escapes",NULL,NULL},
+        {"form",NULL,NULL},
+        {"utf8-heavy",NULL,NULL},
+    };
+    int Sizes[][2]={{24,6},{512,0},{512,12},{512,2}};
+    unsigned int r;
+
+    for(r=0;r<sizeof(Inputs)/sizeof(Inputs[0]);r++)
+    {
+        Inputs[r].Plain=Bench_MakePlain(Sizes[r][0],Sizes[r][1]);
+        Inputs[r].Encoded=malloc(strlen(Inputs[r].Plain)*3+1);
+        WS_URLEncode(Inputs[r].Plain,Inputs[r].Encoded,
+                strlen(Inputs[r].Plain)*3+1);
+
+        /* Make sure the old and new versions agree before timing them */
+        Legacy_WS_URLEncode(Inputs[r].Plain,Check1,sizeof(Check1));
+        if(strcmp(Check1,Inputs[r].Encoded)!=0)
+            printf("WARNING: encode mismatch on %s\n",Inputs[r].Name);
+        Legacy_WS_URLDecode(Inputs[r].Encoded,Check1,sizeof(Check1));
+        WS_URLDecode(Inputs[r].Encoded,Check2,sizeof(Check2));
+        if(strcmp(Check1,Check2)!=0 || strcmp(Check2,Inputs[r].Plain)!=0)
+            printf("WARNING: decode mismatch on %s\n",Inputs[r].Name);
+    }
+
+    printf("%-16s %-12s %6s %10s %10s %8s %8s %7s\n","test","input","bytes",
+            "old ns","new ns","old MB/s","new MB/s","speedup");
+    for(r=0;r<sizeof(Inputs)/sizeof(Inputs[0]);r++)
+    {
+        Bench_Compare("URLDecode",Inputs[r].Name,Inputs[r].Encoded,
+                Bench_LegacyDecode,Bench_NewDecode);
+    }
+    for(r=0;r<sizeof(Inputs)/sizeof(Inputs[0]);r++)
+    {
+        Bench_Compare("URLDecodeInPlace",Inputs[r].Name,Inputs[r].Encoded,
+                Bench_LegacyDecodeInPlace,Bench_NewDecodeInPlace);
+    }
+    for(r=0;r<sizeof(Inputs)/sizeof(Inputs[0]);r++)
+    {
+        Bench_Compare("URLEncode",Inputs[r].Name,Inputs[r].Plain,
+                Bench_LegacyEncode,Bench_NewEncode);
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ * The versions from before the table driven codecs (unsigned char fix in
+ * the encoder so it can be compared on UTF-8 input).
+ ******************************************************************************/
+static bool Legacy_WS_URLDecode(const char *Value,char *Decoded,int MaxLen)
+{
+    char *Write;
+    const char *Read;
+    char buff[100];
+
+    Write=Decoded;
+    Read=Value;
+    while(*Read!=0)
+    {
+        if(*Read=='%')
+        {
+            /* Encoded */
+            Read++; // Move past the %
+
+            /* Copy the next 2 bytes */
+            buff[0]=*Read++;
+            buff[1]=*Read++;
+            buff[2]=0;
+
+            *Write++=strtol(buff,NULL,16);
+            if(Write-Decoded>=MaxLen)
+                return false;
+        }
+        else
+        {
+            *Write++=*Read;
+            if(Write-Decoded>=MaxLen)
+                return false;
+            Read++;
+        }
+    }
+    *Write=0;
+    return true;
+}
+
+static char *Legacy_WS_URLDecodeInPlace(char *Value)
+{
+    char *Write;
+    char *Read;
+    char buff[100];
+
+    Write=Value;
+    Read=Value;
+    while(*Read!=0)
+    {
+        if(*Read=='%')
+        {
+            /* Encoded */
+            buff[0]=0;
+            buff[1]=0;
+            buff[2]=0;
+
+            Read++; // Move past the %
+
+            /* Copy the next 2 bytes */
+            if(*Read!=0)
+                buff[0]=*Read++;
+            if(*Read!=0)
+                buff[1]=*Read++;
+
+            *Write++=strtol(buff,NULL,16);
+        }
+        else
+        {
+            *Write++=*Read;
+            Read++;
+        }
+    }
+    *Write++=0;
+    return Write;
+}
+
+static bool Legacy_WS_URLEncode(const char *Value,char *OutputBuffer,
+        int MaxLen)
+{
+    const char *Pos;
+    char *Write;
+    char *End;
+    unsigned char c;
+
+    Pos=Value;
+    Write=OutputBuffer;
+    End=OutputBuffer+MaxLen-1;
+    while(*Pos!=0)
+    {
+        c=*Pos++;
+        if((c>='A' && c<='Z') ||
+            (c>='a' && c<='z') ||
+            (c>='0' && c<='9') ||
+            c=='-' || c=='_' || c=='.' || c=='~')
+        {
+            /* Normal copy */
+            *Write++=c;
+            if(Write==End)
+            {
+                *Write++=0;
+                return false;
+            }
+        }
+        else
+        {
+            /* % encode */
+            if(Write+3>=End)
+            {
+                *Write++=0;
+                return false;
+            }
+            sprintf(Write,"%%%02X",c);
+            Write+=3;
+        }
+    }
+    *Write=0;
+    return true;
+}
@@ -33,8 +33,13 @@
 /*** HEADER FILES TO INCLUDE  ***/
 #include "main.h"
 #include "WebServer.h"
+#include "WSClient.h"
+#include "WSTrace.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
 
 #include <unistd.h> // usleep()
 
@@ -45,39 +50,141 @@
 /*** TYPE DEFINITIONS         ***/
 
 /*** FUNCTION PROTOTYPES      ***/
+#if WS_OPT_TRACE
+static void DumpTraceSignal(int Sig);
+#endif
 
 /*** VARIABLE DEFINITIONS     ***/
 bool g_Quit;
 
-int main(void)
+int main(int argc,char *argv[])
 {
     t_ElapsedTime Waiting2End;
+    t_ConSocketHandle Inherited;
+    bool HaveInherited;
+    const char *UnixPath;
+    int TLSPort;
+    const char *CertFile;
+    const char *KeyFile;
+    int r;
 
     SocketsCon_InitSocketConSystem();
     WS_Init();
+    WSClient_Init();
+
+    /* We can be handed the listening socket by who ever started us (with
+       "--fd <handle>" or socket activation with LISTEN_FDS), or listen on
+       a unix domain socket for a reverse proxy ("--unix <path>").  HTTPS
+       is added with "--tls <port> --cert <file> --key <file>". */
+    HaveInherited=false;
+    UnixPath=NULL;
+    TLSPort=0;
+    CertFile="cert.pem";
+    KeyFile="key.pem";
+    for(r=1;r+1<argc;r+=2)
+    {
+        if(strcmp(argv[r],"--fd")==0)
+        {
+            Inherited=atoi(argv[r+1]);
+            HaveInherited=true;
+        }
+        else if(strcmp(argv[r],"--unix")==0)
+        {
+            UnixPath=argv[r+1];
+        }
+        else if(strcmp(argv[r],"--tls")==0)
+        {
+            TLSPort=atoi(argv[r+1]);
+        }
+        else if(strcmp(argv[r],"--cert")==0)
+        {
+            CertFile=argv[r+1];
+        }
+        else if(strcmp(argv[r],"--key")==0)
+        {
+            KeyFile=argv[r+1];
+        }
+    }
+    if(!HaveInherited && SocketsCon_InheritedHandles(&Inherited,1)>0)
+        HaveInherited=true;
+
+    /* If we are already running take over from the old copy (so we can
+       upgrade without dropping any connections), otherwise start fresh */
+    if(HaveInherited)
+    {
+        if(!WS_StartOnHandle(Inherited))
+        {
+            printf("Handle %d isn't a listening socket\n",Inherited);
+            return 0;
+        }
+        printf("Started on inherited socket %d\n",Inherited);
+    }
+    else if(WS_TakeOver(WS_OPT_HANDOFF_PATH))
+    {
+        printf("Took over from the running server\n");
+    }
+    else if(UnixPath!=NULL)
+    {
+        if(!WS_StartUnix(UnixPath))
+        {
+            printf("Failed to start web server on %s\n",UnixPath);
+            return 0;
+        }
+        printf("Waiting for connections on %s\n",UnixPath);
+    }
+    else
+    {
+        if(!WS_Start(3000))
+        {
+            printf("Failed to start web server\n");
+            return 0;
+        }
+        printf("Waiting for connections on port 3000\n");
+    }
 
-    if(!WS_Start(3000))
+    if(TLSPort!=0)
     {
-        printf("Failed to start web server\n");
-        return 0;
+        if(WS_StartTLS(TLSPort,CertFile,KeyFile))
+            printf("Waiting for HTTPS connections on port %d\n",TLSPort);
+        else
+            printf("Warning: can't start HTTPS on port %d\n",TLSPort);
     }
 
-    printf("Waiting for connections on port 3000\n");
+    if(!WS_StartHandoff(WS_OPT_HANDOFF_PATH))
+        printf("Warning: can't take handoffs on %s\n",WS_OPT_HANDOFF_PATH);
+
+#if WS_OPT_TRACE
+    /* kill -USR1 writes the trace to WS_OPT_TRACE_FILE */
+    signal(SIGUSR1,DumpTraceSignal);
+#endif
 
     g_Quit=false;
-    while(!g_Quit)
+    while(!g_Quit && !WS_HandoffDone())
     {
         WS_Tick();
+        WSClient_Tick();
         usleep(1000);
     }
 
-    printf("Quiting...\n");
-
-    /* Run the web server for a while so we can send any "finished" page */
-    Waiting2End=ReadElapsedClock();
-    while(ReadElapsedClock()-Waiting2End<3)
-        WS_Tick();
+    if(WS_HandoffDone())
+    {
+        /* The new copy has the listening socket and we finished what we had */
+        printf("Handed off to the new server\n");
+    }
+    else
+    {
+        printf("Quiting...\n");
+
+        /* Run the web server for a while so we can send any "finished" page */
+        Waiting2End=ReadElapsedClock();
+        while(ReadElapsedClock()-Waiting2End<3)
+        {
+            WS_Tick();
+            WSClient_Tick();
+        }
+    }
 
+    WSClient_Shutdown();
     WS_Shutdown();
     SocketsCon_ShutdownSocketConSystem();
 
@@ -117,3 +224,30 @@ t_ElapsedTime ReadElapsedClock(void)
 
     return (uint32_t)Current;
 }
+
+#if WS_OPT_TRACE
+/*******************************************************************************
+ * NAME:
+ *    DumpTraceSignal
+ *
+ * SYNOPSIS:
+ *    static void DumpTraceSignal(int Sig);
+ *
+ * PARAMETERS:
+ *    Sig [I] -- The signal (SIGUSR1)
+ *
+ * FUNCTION:
+ *    This function is the signal handler that asks for the trace to be
+ *    written out.  The writing is done from WS_Tick().
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    WSTrace_RequestDump()
+ ******************************************************************************/
+static void DumpTraceSignal(int Sig)
+{
+    WSTrace_RequestDump();
+}
+#endif
@@ -0,0 +1,934 @@
+/*******************************************************************************
+ * FILENAME: WebServerTest.c
+ *
+ * PROJECT:
+ *    Bitty HTTP
+ *
+ * FILE DESCRIPTION:
+ *    These are tests of the web server run against a real copy of it.  The
+ *    web server runs on the main thread (WS_Tick() in a loop, like main.c)
+ *    with its own small page table (this file is the FileServer.c), and
+ *    each test talks to it over loopback from a client thread.
+ *
+ *    Run it with:
+ *        make -C tests run
+ *    or with HTTPS (makes a throw away self signed cert with openssl):
+ *        make -C tests run TLS=1
+ *
+ *    Each test prints PASS or FAIL.  The exit code is the number of tests
+ *    that failed.  If WS_Tick() stops returning the test is failed by an
+ *    alarm() instead of hanging.
+ *
+ * COPYRIGHT:
+ *    Copyright (c) 2019 Paul Hutchinson
+ *
+ *    Permission is hereby granted, free of charge, to any person obtaining a copy
+ *    of this software and associated documentation files (the "Software"), to deal
+ *    in the Software without restriction, including without limitation the rights
+ *    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *    copies of the Software, and to permit persons to whom the Software is
+ *    furnished to do so, subject to the following conditions:
+ *    
+ *    The above copyright notice and this permission notice shall be included in all
+ *    copies or substantial portions of the Software.
+ *    
+ *    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *    SOFTWARE.
+ *
+ ******************************************************************************/
+
+/*** HEADER FILES TO INCLUDE  ***/
+#include "WebServer.h"
+#include "WSEvents.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#if SOCKETSCON_TLS
+#include <openssl/ssl.h>
+#endif
+
+/*** DEFINES                  ***/
+#define TEST_PORT               3080    // Plain HTTP
+#define TEST_TLS_PORT           3443    // HTTPS (TLS=1 builds)
+#define TEST_TIMEOUT            20      // Seconds a test can take before we say WS_Tick() is stuck
+#define TEST_REPLY_TIMEOUT      2       // Seconds a client waits for a reply
+#define TEST_REPLY_SIZE         4096
+#define TEST_STALL_PROBES       20      // Requests sent while the subscriber isn't reading
+#define TEST_EVENT_SIZE         2000    // The size of each event published to the stalled subscriber
+#define TEST_EVENTS_PER_TICK    4       // Has to fit in WS_OPT_EVENTS_RING_SIZE
+#define TEST_STALL_BYTES        (16*1024*1024) // Published before probing (more than the socket buffers hold)
+
+/*** MACROS                   ***/
+
+/*** TYPE DEFINITIONS         ***/
+struct TestPage
+{
+    const char *Filename;
+    const char **Gets;
+    const char **Posts;
+    void (*WriteFile)(struct WebServer *Web);
+};
+
+struct TestStall
+{
+    bool UseTLS;
+    volatile bool Subscribed;   // The subscriber has its reply head and stopped reading
+    volatile bool Done;         // The client threads are finished
+    volatile int Published;     // Bytes of events published since 'Subscribed'
+    int ProbesAnswered;
+    bool Failed;
+};
+
+/*** FUNCTION PROTOTYPES      ***/
+static void Page_Ping(struct WebServer *Web);
+static void Page_Args(struct WebServer *Web);
+static void Page_ManyArgs(struct WebServer *Web);
+static void Page_PostKey(struct WebServer *Web);
+static void Page_Events(struct WebServer *Web);
+static void Test_Stuck(int Sig);
+static int Test_Connect(int Port,int RcvBuf);
+static int Test_Request(const char *Request,char *Reply,int Size);
+static void Test_RunServer(volatile bool *Done,void (*Tick)(void *Arg),
+        void *Arg);
+static void *Test_RequestThread(void *Arg);
+static bool Test_LazyArgsRoom(void);
+static bool Test_ManyArgs(void);
+static bool Test_PostKeyPlus(void);
+static void *Test_StallSubscriber(void *Arg);
+static void *Test_StallProbe(void *Arg);
+static void Test_StallPublish(void *Arg);
+static bool Test_StalledSubscriber(bool UseTLS);
+
+/*** VARIABLE DEFINITIONS     ***/
+static const char *m_ArgsGets[]={"a",NULL};
+static const char *m_ArgsPosts[]={"x",NULL};
+static const char *m_PostKeyPosts[]={"two words",NULL};
+static const char *m_ManyArgsGets[]=
+{
+    "g0","g1","g2","g3","g4","g5","g6","g7","g8","g9",
+    "g10","g11","g12","g13","g14","g15","g16","g17","g18","g19",
+    NULL
+};
+
+static struct TestPage m_Pages[]=
+{
+    {"/ping",NULL,NULL,Page_Ping},
+    {"/args",m_ArgsGets,m_ArgsPosts,Page_Args},
+    {"/manyargs",m_ManyArgsGets,m_ArgsPosts,Page_ManyArgs},
+    {"/postkey",NULL,m_PostKeyPosts,Page_PostKey},
+    {"/events",NULL,NULL,Page_Events},
+};
+
+static const char *m_CertFile="test-cert.pem";
+static const char *m_KeyFile="test-key.pem";
+static const char *m_TestName;
+
+int main(int argc,char *argv[])
+{
+    int Failed;
+    int opt;
+
+    while((opt=getopt(argc,argv,"c:k:"))!=-1)
+    {
+        switch(opt)
+        {
+            case 'c':
+                m_CertFile=optarg;
+            break;
+            case 'k':
+                m_KeyFile=optarg;
+            break;
+            default:
+                printf("Usage: webservertest [-c cert.pem -k key.pem]\n");
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE,SIG_IGN);
+    signal(SIGALRM,Test_Stuck);
+
+    SocketsCon_InitSocketConSystem();
+    WS_Init();
+    if(!WS_Start(TEST_PORT))
+    {
+        printf("FAIL: can't listen on port %d\n",TEST_PORT);
+        return 1;
+    }
+#if SOCKETSCON_TLS
+    if(!WS_StartTLS(TEST_TLS_PORT,m_CertFile,m_KeyFile))
+    {
+        printf("FAIL: can't start HTTPS on port %d with %s and %s\n",
+                TEST_TLS_PORT,m_CertFile,m_KeyFile);
+        return 1;
+    }
+#endif
+
+    Failed=0;
+    Failed+=!Test_LazyArgsRoom();
+    Failed+=!Test_ManyArgs();
+    Failed+=!Test_PostKeyPlus();
+    Failed+=!Test_StalledSubscriber(false);
+#if SOCKETSCON_TLS
+    Failed+=!Test_StalledSubscriber(true);
+#endif
+
+    WS_Shutdown();
+    SocketsCon_ShutdownSocketConSystem();
+
+    printf("%d failed\n",Failed);
+    return Failed;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    ReadElapsedClock
+ *
+ * SYNOPSIS:
+ *    t_ElapsedTime ReadElapsedClock(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function is the seconds clock for the web server (main.c has the
+ *    one for the real server).
+ *
+ * RETURNS:
+ *    The current clock time in seconds.
+ *
+ * SEE ALSO:
+ *
+ ******************************************************************************/
+t_ElapsedTime ReadElapsedClock(void)
+{
+    return (uint32_t)time(NULL);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    FS_GetFileProperties
+ *
+ * SYNOPSIS:
+ *    bool FS_GetFileProperties(const char *Filename,
+ *          struct WSPageProp *PageProp);
+ *
+ * PARAMETERS:
+ *    Filename [I] -- The file the client asked for
+ *    PageProp [O] -- The properties of the page
+ *
+ * FUNCTION:
+ *    This function looks a page up in the test page table (see FileServer.c
+ *    for the real one).
+ *
+ * RETURNS:
+ *    true -- It's a test page
+ *    false -- It's not (404)
+ *
+ * SEE ALSO:
+ *    FS_SendFile()
+ ******************************************************************************/
+bool FS_GetFileProperties(const char *Filename,struct WSPageProp *PageProp)
+{
+    unsigned int r;
+
+    for(r=0;r<sizeof(m_Pages)/sizeof(m_Pages[0]);r++)
+    {
+        if(strcmp(Filename,m_Pages[r].Filename)==0)
+        {
+            PageProp->FileID=(uintptr_t)&m_Pages[r];
+            PageProp->DynamicFile=true;
+            PageProp->Offload=false;
+            PageProp->Route=m_Pages[r].Filename;
+            PageProp->Cookies=NULL;
+            PageProp->Gets=m_Pages[r].Gets;
+            PageProp->Posts=m_Pages[r].Posts;
+            PageProp->Upstream=NULL;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    FS_SendFile
+ *
+ * SYNOPSIS:
+ *    void FS_SendFile(struct WebServer *Web,uintptr_t FileID);
+ *
+ * PARAMETERS:
+ *    Web [I] -- The web context for this web connection.
+ *    FileID [I] -- The test page from FS_GetFileProperties()
+ *
+ * FUNCTION:
+ *    This function sends a test page.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    FS_GetFileProperties()
+ ******************************************************************************/
+void FS_SendFile(struct WebServer *Web,uintptr_t FileID)
+{
+    struct TestPage *Page=(struct TestPage *)FileID;
+
+    Page->WriteFile(Web);
+}
+
+static void Page_Ping(struct WebServer *Web)
+{
+    WS_WriteWholeStr(Web,"pong");
+}
+
+static void Page_Args(struct WebServer *Web)
+{
+    const char *Value;
+
+    Value=WS_POST(Web,"x");
+    WS_WriteWholeStr(Web,Value!=NULL?Value:"(null)");
+}
+
+static void Page_ManyArgs(struct WebServer *Web)
+{
+    const char *Values[3];
+    char Buff[100];
+    int r;
+
+    Values[0]=WS_GET(Web,"g18");
+    Values[1]=WS_GET(Web,"g3");
+    Values[2]=WS_POST(Web,"x");
+    for(r=0;r<3;r++)
+        if(Values[r]==NULL)
+            Values[r]="(null)";
+    snprintf(Buff,sizeof(Buff),"%s,%s,%s",Values[0],Values[1],Values[2]);
+    WS_WriteWholeStr(Web,Buff);
+}
+
+static void Page_PostKey(struct WebServer *Web)
+{
+    const char *Value;
+
+    Value=WS_POST(Web,"two words");
+    WS_WriteWholeStr(Web,Value!=NULL?Value:"(null)");
+}
+
+static void Page_Events(struct WebServer *Web)
+{
+    if(!WS_SubscribeEvents(Web,"stall"))
+        WS_WriteWholeStr(Web,"no room");
+}
+
+/*******************************************************************************
+ * NAME:
+ *    Test_Stuck
+ *
+ * SYNOPSIS:
+ *    static void Test_Stuck(int Sig);
+ *
+ * PARAMETERS:
+ *    Sig [I] -- SIGALRM
+ *
+ * FUNCTION:
+ *    This function fails the test that is running when it has taken more
+ *    than TEST_TIMEOUT seconds (WS_Tick() got stuck).
+ *
+ * RETURNS:
+ *    Doesn't
+ *
+ * SEE ALSO:
+ *    Test_RunServer()
+ ******************************************************************************/
+static void Test_Stuck(int Sig)
+{
+    static const char Msg[]="FAIL: WS_Tick() stopped returning\n";
+
+    if(m_TestName!=NULL)
+        write(STDOUT_FILENO,m_TestName,strlen(m_TestName));
+    write(STDOUT_FILENO," ",1);
+    write(STDOUT_FILENO,Msg,sizeof(Msg)-1);
+    _exit(100);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    Test_Connect
+ *
+ * SYNOPSIS:
+ *    static int Test_Connect(int Port,int RcvBuf);
+ *
+ * PARAMETERS:
+ *    Port [I] -- The port on 127.0.0.1 to connect to
+ *    RcvBuf [I] -- The receive buffer size to ask for (0=leave it alone)
+ *
+ * FUNCTION:
+ *    This function connects a blocking client socket to the web server.
+ *    Reads time out after TEST_REPLY_TIMEOUT seconds.
+ *
+ * RETURNS:
+ *    The socket or -1 if it couldn't connect.
+ *
+ * SEE ALSO:
+ *    Test_Request()
+ ******************************************************************************/
+static int Test_Connect(int Port,int RcvBuf)
+{
+    struct sockaddr_in Addr;
+    struct timeval Timeout;
+    int Sock;
+
+    Sock=socket(AF_INET,SOCK_STREAM,0);
+    if(Sock<0)
+        return -1;
+
+    /* This has to be set before connect() to shrink the TCP window */
+    if(RcvBuf>0)
+        setsockopt(Sock,SOL_SOCKET,SO_RCVBUF,&RcvBuf,sizeof(RcvBuf));
+    Timeout.tv_sec=TEST_REPLY_TIMEOUT;
+    Timeout.tv_usec=0;
+    setsockopt(Sock,SOL_SOCKET,SO_RCVTIMEO,&Timeout,sizeof(Timeout));
+
+    memset(&Addr,0,sizeof(Addr));
+    Addr.sin_family=AF_INET;
+    Addr.sin_port=htons(Port);
+    Addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    if(connect(Sock,(struct sockaddr *)&Addr,sizeof(Addr))<0)
+    {
+        close(Sock);
+        return -1;
+    }
+    return Sock;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    Test_Request
+ *
+ * SYNOPSIS:
+ *    static int Test_Request(const char *Request,char *Reply,int Size);
+ *
+ * PARAMETERS:
+ *    Request [I] -- The whole request to send (head and body)
+ *    Reply [O] -- The body of the reply (\0 terminated)
+ *    Size [I] -- The size of 'Reply'
+ *
+ * FUNCTION:
+ *    This function sends a request to the plain HTTP port on a new
+ *    connection and reads the reply (it has to have a Content-Length).
+ *
+ * RETURNS:
+ *    The status code of the reply or -1 if there wasn't one in time.
+ *
+ * SEE ALSO:
+ *    Test_Connect()
+ ******************************************************************************/
+static int Test_Request(const char *Request,char *Reply,int Size)
+{
+    char Buff[TEST_REPLY_SIZE];
+    const char *Body;
+    const char *Length;
+    int Sock;
+    int Len;
+    int Got;
+    int BodyLen;
+
+    Sock=Test_Connect(TEST_PORT,0);
+    if(Sock<0)
+        return -1;
+    if(send(Sock,Request,strlen(Request),0)!=(ssize_t)strlen(Request))
+    {
+        close(Sock);
+        return -1;
+    }
+
+    Len=0;
+    Body=NULL;
+    BodyLen=0;
+    for(;;)
+    {
+        Got=recv(Sock,&Buff[Len],sizeof(Buff)-1-Len,0);
+        if(Got<=0)
+            break;
+        Len+=Got;
+        Buff[Len]=0;
+
+        if(Body==NULL)
+        {
+            Body=strstr(Buff,"\r\n\r\n");
+            if(Body==NULL)
+                continue;
+            Body+=4;
+            Length=strstr(Buff,"Content-Length: ");
+            BodyLen=Length!=NULL && Length<Body?atoi(&Length[16]):0;
+        }
+        if(Buff+Len-Body>=BodyLen)
+            break;
+    }
+    close(Sock);
+
+    if(Body==NULL || Buff+Len-Body<BodyLen || BodyLen>=Size ||
+            strncmp(Buff,"HTTP/1.1 ",9)!=0)
+    {
+        return -1;
+    }
+    memcpy(Reply,Body,BodyLen);
+    Reply[BodyLen]=0;
+
+    return atoi(&Buff[9]);
+}
+
+/*******************************************************************************
+ * NAME:
+ *    Test_RunServer
+ *
+ * SYNOPSIS:
+ *    static void Test_RunServer(volatile bool *Done,
+ *          void (*Tick)(void *Arg),void *Arg);
+ *
+ * PARAMETERS:
+ *    Done [I] -- Set by the client thread when the test is over
+ *    Tick [I] -- Called after every WS_Tick() (NULL for none)
+ *    Arg [I] -- Passed to 'Tick'
+ *
+ * FUNCTION:
+ *    This function runs the web server until the client thread is done.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    Test_Stuck()
+ ******************************************************************************/
+static void Test_RunServer(volatile bool *Done,void (*Tick)(void *Arg),
+        void *Arg)
+{
+    alarm(TEST_TIMEOUT);
+    while(!*Done)
+    {
+        WS_Tick();
+        if(Tick!=NULL)
+            Tick(Arg);
+        usleep(1000);
+    }
+    alarm(0);
+}
+
+/* Args for Test_RequestThread() */
+struct TestRequest
+{
+    const char *Request;
+    char Reply[TEST_REPLY_SIZE];
+    int Status;
+    volatile bool Done;
+};
+
+static void *Test_RequestThread(void *Arg)
+{
+    struct TestRequest *Req=Arg;
+
+    Req->Status=Test_Request(Req->Request,Req->Reply,sizeof(Req->Reply));
+    Req->Done=true;
+    return NULL;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    Test_LazyArgsRoom
+ *
+ * SYNOPSIS:
+ *    static bool Test_LazyArgsRoom(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function sends a POST with a long query string the page doesn't
+ *    accept any of and a POST arg that only just fits in
+ *    WS_OPT_ARG_MEMORY_SIZE.  Only the args the page accepts should take
+ *    up arg storage, so the POST arg must still come through.
+ *
+ * RETURNS:
+ *    true -- Passed
+ *    false -- Failed
+ *
+ * SEE ALSO:
+ *    WS_SaveLazyArgs()
+ ******************************************************************************/
+static bool Test_LazyArgsRoom(void)
+{
+    static struct TestRequest Req;
+    static char Request[1024];
+    char Junk[WS_OPT_ARG_MEMORY_SIZE];
+    char Value[WS_OPT_ARG_MEMORY_SIZE];
+    pthread_t Thread;
+    bool Passed;
+
+    m_TestName="LazyArgsRoom";
+
+    /* Each of these nearly fills the arg storage on its own */
+    memset(Junk,'j',sizeof(Junk)-10);
+    Junk[sizeof(Junk)-10]=0;
+    memset(Value,'v',sizeof(Value)-10);
+    Value[sizeof(Value)-10]=0;
+    snprintf(Request,sizeof(Request),"POST /args?junk=%s HTTP/1.1\r\n"
+            "Host: test\r\n"
+            "Cookie: other=%s\r\n"
+            "Content-Type: application/x-www-form-urlencoded\r\n"
+            "Content-Length: %d\r\n"
+            "\r\n"
+            "x=%s",Junk,Junk,(int)strlen(Value)+2,Value);
+
+    Req.Request=Request;
+    Req.Done=false;
+    pthread_create(&Thread,NULL,Test_RequestThread,&Req);
+    Test_RunServer(&Req.Done,NULL,NULL);
+    pthread_join(Thread,NULL);
+
+    Passed=Req.Status==200 && strcmp(Req.Reply,Value)==0;
+    printf("%s %s (status %d)\n",Passed?"PASS":"FAIL",m_TestName,Req.Status);
+    return Passed;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    Test_ManyArgs
+ *
+ * SYNOPSIS:
+ *    static bool Test_ManyArgs(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function sends a few args to a page that lists more GET and POST
+ *    args than WS_OPT_MAX_ARGS.  The ones that are sent must still come
+ *    through.
+ *
+ * RETURNS:
+ *    true -- Passed
+ *    false -- Failed
+ *
+ * SEE ALSO:
+ *    WS_GetArgEntry()
+ ******************************************************************************/
+static bool Test_ManyArgs(void)
+{
+    static struct TestRequest Req;
+    pthread_t Thread;
+    bool Passed;
+
+    m_TestName="ManyArgs";
+
+    Req.Request="POST /manyargs?g18=one&g3=two HTTP/1.1\r\n"
+            "Host: test\r\n"
+            "Content-Type: application/x-www-form-urlencoded\r\n"
+            "Content-Length: 7\r\n"
+            "\r\n"
+            "x=three";
+    Req.Done=false;
+    pthread_create(&Thread,NULL,Test_RequestThread,&Req);
+    Test_RunServer(&Req.Done,NULL,NULL);
+    pthread_join(Thread,NULL);
+
+    Passed=Req.Status==200 && strcmp(Req.Reply,"one,two,three")==0;
+    printf("%s %s (status %d)\n",Passed?"PASS":"FAIL",m_TestName,Req.Status);
+    return Passed;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    Test_PostKeyPlus
+ *
+ * SYNOPSIS:
+ *    static bool Test_PostKeyPlus(void);
+ *
+ * PARAMETERS:
+ *    NONE
+ *
+ * FUNCTION:
+ *    This function POSTs form data with a '+' in the name of an arg.  It
+ *    has to be decoded the same way as the value (a space when
+ *    WS_OPT_POST_PLUS_IS_SPACE is set).
+ *
+ * RETURNS:
+ *    true -- Passed
+ *    false -- Failed
+ *
+ * SEE ALSO:
+ *    WS_StartProcessingPOSTVar()
+ ******************************************************************************/
+static bool Test_PostKeyPlus(void)
+{
+    static struct TestRequest Req;
+    pthread_t Thread;
+    bool Passed;
+
+    m_TestName="PostKeyPlus";
+
+    Req.Request="POST /postkey HTTP/1.1\r\n"
+            "Host: test\r\n"
+            "Content-Type: application/x-www-form-urlencoded\r\n"
+            "Content-Length: 15\r\n"
+            "\r\n"
+            "two+words=a%21b";
+    Req.Done=false;
+    pthread_create(&Thread,NULL,Test_RequestThread,&Req);
+    Test_RunServer(&Req.Done,NULL,NULL);
+    pthread_join(Thread,NULL);
+
+#if WS_OPT_POST_PLUS_IS_SPACE
+    Passed=Req.Status==200 && strcmp(Req.Reply,"a!b")==0;
+#else
+    Passed=Req.Status==200 && strcmp(Req.Reply,"(null)")==0;
+#endif
+    printf("%s %s (status %d)\n",Passed?"PASS":"FAIL",m_TestName,Req.Status);
+    return Passed;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    Test_StallSubscriber
+ *
+ * SYNOPSIS:
+ *    static void *Test_StallSubscriber(void *Arg);
+ *
+ * PARAMETERS:
+ *    Arg [I/O] -- The struct TestStall for the test
+ *
+ * FUNCTION:
+ *    This is the client thread that subscribes to the "stall" event
+ *    channel (over HTTPS if 'UseTLS') and then stops reading.  It holds the
+ *    connection open until the test is done.
+ *
+ * RETURNS:
+ *    NULL
+ *
+ * SEE ALSO:
+ *    Test_StalledSubscriber()
+ ******************************************************************************/
+static void *Test_StallSubscriber(void *Arg)
+{
+    static const char Request[]="GET /events HTTP/1.1\r\nHost: test\r\n\r\n";
+    struct TestStall *Stall=Arg;
+    char Buff[512];
+    int Len;
+    int Got;
+    int Sock;
+#if SOCKETSCON_TLS
+    SSL_CTX *Context=NULL;
+    SSL *TLS=NULL;
+#endif
+
+    Sock=Test_Connect(Stall->UseTLS?TEST_TLS_PORT:TEST_PORT,4096);
+    if(Sock<0)
+    {
+        Stall->Failed=true;
+        Stall->Done=true;
+        return NULL;
+    }
+
+#if SOCKETSCON_TLS
+    if(Stall->UseTLS)
+    {
+        Context=SSL_CTX_new(TLS_client_method());
+        TLS=SSL_new(Context);
+        SSL_set_fd(TLS,Sock);
+        if(SSL_connect(TLS)!=1)
+        {
+            Stall->Failed=true;
+            Stall->Done=true;
+            SSL_free(TLS);
+            SSL_CTX_free(Context);
+            close(Sock);
+            return NULL;
+        }
+    }
+#endif
+
+    /* Send the request and read just the reply head */
+    Len=0;
+    Buff[0]=0;
+#if SOCKETSCON_TLS
+    if(TLS!=NULL)
+        SSL_write(TLS,Request,sizeof(Request)-1);
+    else
+#endif
+        send(Sock,Request,sizeof(Request)-1,0);
+    while(strstr(Buff,"\r\n\r\n")==NULL && Len<(int)sizeof(Buff)-1)
+    {
+#if SOCKETSCON_TLS
+        if(TLS!=NULL)
+            Got=SSL_read(TLS,&Buff[Len],1);
+        else
+#endif
+            Got=recv(Sock,&Buff[Len],1,0);
+        if(Got<=0)
+            break;
+        Len+=Got;
+        Buff[Len]=0;
+    }
+    if(strncmp(Buff,"HTTP/1.1 200",12)!=0)
+        Stall->Failed=true;
+
+    /* Now stop reading and wait for the probes to finish */
+    Stall->Subscribed=true;
+    while(!Stall->Done)
+        usleep(10000);
+
+#if SOCKETSCON_TLS
+    if(TLS!=NULL)
+    {
+        SSL_free(TLS);
+        SSL_CTX_free(Context);
+    }
+#endif
+    close(Sock);
+
+    return NULL;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    Test_StallProbe
+ *
+ * SYNOPSIS:
+ *    static void *Test_StallProbe(void *Arg);
+ *
+ * PARAMETERS:
+ *    Arg [I/O] -- The struct TestStall for the test
+ *
+ * FUNCTION:
+ *    This is the client thread that sends TEST_STALL_PROBES requests on
+ *    other connections once TEST_STALL_BYTES of events have been published
+ *    to the subscriber that isn't reading.  Each has to be answered within
+ *    TEST_REPLY_TIMEOUT.
+ *
+ * RETURNS:
+ *    NULL
+ *
+ * SEE ALSO:
+ *    Test_StalledSubscriber()
+ ******************************************************************************/
+static void *Test_StallProbe(void *Arg)
+{
+    struct TestStall *Stall=Arg;
+    char Reply[64];
+    int r;
+
+    /* Wait for the subscriber's connection to fill up */
+    while(Stall->Published<TEST_STALL_BYTES && !Stall->Done)
+        usleep(1000);
+
+    for(r=0;r<TEST_STALL_PROBES && !Stall->Failed;r++)
+    {
+        usleep(50000);
+        if(Test_Request("GET /ping HTTP/1.1\r\nHost: test\r\n\r\n",Reply,
+                sizeof(Reply))==200 && strcmp(Reply,"pong")==0)
+        {
+            Stall->ProbesAnswered++;
+        }
+    }
+
+    Stall->Done=true;
+    return NULL;
+}
+
+/*******************************************************************************
+ * NAME:
+ *    Test_StallPublish
+ *
+ * SYNOPSIS:
+ *    static void Test_StallPublish(void *Arg);
+ *
+ * PARAMETERS:
+ *    Arg [I] -- The struct TestStall for the test
+ *
+ * FUNCTION:
+ *    This function publishes TEST_EVENTS_PER_TICK events every tick once the
+ *    subscriber has stopped reading, so its connection fills up.
+ *
+ * RETURNS:
+ *    NONE
+ *
+ * SEE ALSO:
+ *    Test_StalledSubscriber()
+ ******************************************************************************/
+static void Test_StallPublish(void *Arg)
+{
+    struct TestStall *Stall=Arg;
+    static char Data[TEST_EVENT_SIZE];
+    int r;
+
+    if(!Stall->Subscribed)
+        return;
+
+    if(Data[0]==0)
+        memset(Data,'e',sizeof(Data)-1);
+    for(r=0;r<TEST_EVENTS_PER_TICK;r++)
+    {
+        WSEvents_Publish("stall",NULL,Data);
+        Stall->Published+=sizeof(Data)-1;
+    }
+}
+
+/*******************************************************************************
+ * NAME:
+ *    Test_StalledSubscriber
+ *
+ * SYNOPSIS:
+ *    static bool Test_StalledSubscriber(bool UseTLS);
+ *
+ * PARAMETERS:
+ *    UseTLS [I] -- Subscribe over HTTPS
+ *
+ * FUNCTION:
+ *    This function checks that an event subscriber that stops reading
+ *    doesn't hold up the other connections.  Events are published until
+ *    its connection is full while another client sends requests.
+ *
+ * RETURNS:
+ *    true -- Passed
+ *    false -- Failed
+ *
+ * SEE ALSO:
+ *    WSEvents_Flush(), SocketsCon_WriteSome()
+ ******************************************************************************/
+static bool Test_StalledSubscriber(bool UseTLS)
+{
+    static struct TestStall Stall;
+    pthread_t Subscriber;
+    pthread_t Probe;
+    bool Passed;
+
+    m_TestName=UseTLS?"StalledSubscriberTLS":"StalledSubscriber";
+
+    memset(&Stall,0,sizeof(Stall));
+    Stall.UseTLS=UseTLS;
+    pthread_create(&Subscriber,NULL,Test_StallSubscriber,&Stall);
+    pthread_create(&Probe,NULL,Test_StallProbe,&Stall);
+    Test_RunServer(&Stall.Done,Test_StallPublish,&Stall);
+    pthread_join(Probe,NULL);
+    pthread_join(Subscriber,NULL);
+
+    /* Let the server see the subscriber hang up */
+    WS_Tick();
+
+    Passed=!Stall.Failed && Stall.ProbesAnswered==TEST_STALL_PROBES;
+    printf("%s %s (%d of %d answered)\n",Passed?"PASS":"FAIL",m_TestName,
+            Stall.ProbesAnswered,TEST_STALL_PROBES);
+    return Passed;
+}